@@ -30,7 +30,8 @@ public:
 USB Usb;
 //USBHub Hub1(&Usb);
 USBTMCHostAsyncOper  AsyncOper;
-USBTMC_HELPER worker(&Usb,&AsyncOper);
+char responseBuffer[64];
+USBTMC_HELPER worker(&Usb,&AsyncOper,responseBuffer,sizeof(responseBuffer));
 
 void setup() {
   // put your setup code here, to run once:
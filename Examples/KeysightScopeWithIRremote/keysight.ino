@@ -6,6 +6,24 @@
 bool isResumed = false;
 unsigned long previousMillis = 0;
 
+void OnConditionReceived(const char *response, uint16_t length)
+{
+  if(length == 0) {
+    return;
+  }
+
+  int value = atoi(response);
+  value = value & (1 << 3); // Bit3 Name:Run Description:Running 
+                            // When Set (1 = High = True), Indicates: The oscilloscope is running (not stopped).
+
+  if(value == 0) {
+    worker.write(F(":RUN"));
+  }
+  else {
+    worker.write(F(":STOP"));
+  }
+}
+
 void Initialize()
 {
   IrReceiver.begin(IR_RECEIVE_PIN, DISABLE_LED_FEEDBACK);
@@ -14,8 +32,6 @@ void Initialize()
 
 void Routine()
 {
-  String command;
-  String response;
   int request = 0;
 
   if (IrReceiver.decode()) {
@@ -39,26 +55,8 @@ void Routine()
       isResumed = true;
       previousMillis = millis();
       
-      command = F(":OPERegister:CONDition?");
-      worker.write(command);
-      response = worker.read(1000);
-      
-      if(response == "") {
-        return;
-      }
-      
-      int value = response.toInt();
-      value = value & (1 << 3); // Bit3 Name:Run Description:Running 
-                                // When Set (1 = High = True), Indicates: The oscilloscope is running (not stopped).
-
-      if(value == 0) {
-        command = F(":RUN");
-      }
-      else {
-        command = F(":STOP");
-      }
-      
-      worker.write(command);
+      // The answer comes back through OnConditionReceived() while the IR receiver keeps running
+      worker.queryAsync(F(":OPERegister:CONDition?"), OnConditionReceived, 1000);
   }
   
   
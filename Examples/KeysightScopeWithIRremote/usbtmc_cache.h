@@ -0,0 +1,103 @@
+/*
+ * Query result cache for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_CACHE_H__)
+#define __USBTMC_CACHE_H__
+
+#include <Arduino.h>
+
+// Which set commands change the answer of a query, stored in PROGMEM.
+// {query, prefixes of the set commands separated by '|'}
+//   {":WAV:PRE?", ":WAV:|:TIM:"}   dropped by any :WAV: or :TIM: command
+//   {"*IDN?", NULL}                 only dropped by *RST, *RCL or the TTL
+// A query without a rule is dropped by any set command.
+// The comparison ignores case but not the SCPI short and long forms, write the form the sketch sends.
+// A relative header after ';' is compared with the path of the previous header, "OFFS 0" of ":TIM:SCAL 1;OFFS 0" as ":TIM:OFFS 0".
+// No entry or no rule, a uint8_t count leaves the indexes below it
+#define USBTMC_CACHE_NONE       0xFF
+
+// Longest header path kept for relative headers, e.g. ":TRIG:EDGE:"
+#define USBTMC_CACHE_PATH_SIZE  24
+
+typedef struct tagUSBTMC_CACHE_RULE {
+    const char *query;
+    const char *invalidatedBy;
+} USBTMCCacheRule;
+
+typedef struct tagUSBTMC_CACHE_KEY {
+    uint32_t hash;              // FNV-1a of the query, 0 is a free entry
+    uint16_t check;             // CRC-16 of the query
+    uint16_t length;            // of the query
+} USBTMCCacheKey;
+
+typedef struct tagUSBTMC_CACHE_ENTRY {
+    USBTMCCacheKey key;         // a hit needs all of it to match, one hash alone may collide
+    uint32_t storedMillis;
+    uint32_t ttl;               // milliseconds, 0 never expires
+    uint8_t ruleIndex;          // USBTMC_CACHE_NONE without a rule
+    uint16_t length;
+} USBTMCCacheEntry;
+
+// Answers of queries kept in memory supplied by the caller, keyed by two hashes and the length of the query.
+// The text of each entry has (textSize - 1) characters at most.
+class USBTMCQueryCache
+{
+    USBTMCCacheEntry *entries;
+    uint8_t entryCount;
+    char *textPool;
+    uint16_t textSize;
+    const USBTMCCacheRule *rulesPtr;
+    uint8_t rulesCount;
+
+    static void MakeKey(const char *command, bool isProgmem, USBTMCCacheKey *key);
+    uint8_t FindEntry(const USBTMCCacheKey &key);
+    uint8_t FindRule(const char *command, bool isProgmem);
+    bool IsInvalidatedBy(uint8_t ruleIndex, const char *path, uint8_t pathLength, const char *command, uint16_t length, bool isProgmem);
+    void InvalidateSegment(const char *path, uint8_t pathLength, const char *command, uint16_t length, bool isProgmem);
+    const char *Find(const char *command, bool isProgmem, uint16_t *length);
+    void Store(const char *command, bool isProgmem, const char *response, uint16_t length, uint32_t ttl);
+    void OnWrite(const char *command, bool isProgmem);
+
+public:
+    USBTMCQueryCache(USBTMCCacheEntry *entries, uint8_t count, char *textPool, uint16_t textSize);
+
+    void SetRules(const USBTMCCacheRule *rules, uint8_t count);
+
+    // The cached answer or NULL, the text is valid until the next Store()
+    const char *Find(const char *command, uint16_t *length);
+    const char *Find(const __FlashStringHelper *command, uint16_t *length);
+    void Store(const char *command, const char *response, uint16_t length, uint32_t ttl = 0);
+    void Store(const __FlashStringHelper *command, const char *response, uint16_t length, uint32_t ttl = 0);
+
+    // Every message sent to the instrument, the set commands in it drop the entries they affect
+    void OnWrite(const char *command);
+    void OnWrite(const __FlashStringHelper *command);
+    void Clear();
+};
+
+// Cache with its own storage
+template <uint8_t Entries, uint16_t TextSize>
+class USBTMCQueryCacheBuffer : public USBTMCQueryCache
+{
+    USBTMCCacheEntry entryBuffer[Entries];
+    char textBuffer[Entries * TextSize];
+
+public:
+    USBTMCQueryCacheBuffer() : USBTMCQueryCache(entryBuffer, Entries, textBuffer, TextSize) {};
+};
+
+#endif // __USBTMC_CACHE_H__
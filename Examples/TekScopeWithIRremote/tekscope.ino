@@ -6,6 +6,20 @@
 bool isResumed = false;
 unsigned long previousMillis = 0;
 
+void OnAcquireStateReceived(const char *response, uint16_t length)
+{
+  if(length == 0) {
+    return;
+  }
+
+  if(strcmp(response, "0") == 0) {
+    worker.write(F("ACQ:STATE RUN"));
+  }
+  else {
+    worker.write(F("ACQ:STATE STOP"));
+  }
+}
+
 void Initialize()
 {
   IrReceiver.begin(IR_RECEIVE_PIN, DISABLE_LED_FEEDBACK);
@@ -14,8 +28,6 @@ void Initialize()
 
 void Routine()
 {
-  String command;
-  String response;
   int request = 0;
 
   if (IrReceiver.decode()) {
@@ -40,22 +52,8 @@ void Routine()
       isResumed = true;
       previousMillis = millis();
       
-      command = F("ACQ:STATE?");
-      worker.write(command);
-      response = worker.read(1000);
-      
-      if(response == "") {
-        return;
-      }
-      
-      if(response == "0") {
-        command = F("ACQ:STATE RUN");
-      }
-      else {
-        command = F("ACQ:STATE STOP");
-      }
-      
-      worker.write(command);
+      // The answer comes back through OnAcquireStateReceived() while the IR receiver keeps running
+      worker.queryAsync(F("ACQ:STATE?"), OnAcquireStateReceived, 1000);
     break;
 
     default:
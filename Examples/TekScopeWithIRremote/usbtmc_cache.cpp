@@ -0,0 +1,358 @@
+/*
+ * Query result cache for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_cache.h"
+
+#define FNV_OFFSET_BASIS    2166136261UL
+#define FNV_PRIME           16777619UL
+
+static char ReadChar(const char *p, bool isProgmem)
+{
+    return isProgmem ? (char)pgm_read_byte(p) : *p;
+}
+
+static char ToUpper(char c)
+{
+    return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+USBTMCQueryCache::USBTMCQueryCache(USBTMCCacheEntry *entries, uint8_t count, char *textPool, uint16_t textSize) :
+    entries(entries), entryCount(count), textPool(textPool), textSize(textSize), rulesPtr(NULL), rulesCount(0)
+{
+    // USBTMCQueryCacheBuffer passes plain arrays, they need no construction before this
+    Clear();
+}
+
+void USBTMCQueryCache::SetRules(const USBTMCCacheRule *rules, uint8_t count)
+{
+    rulesPtr = rules;
+    rulesCount = count;
+    Clear();
+}
+
+void USBTMCQueryCache::Clear()
+{
+    for (uint8_t i = 0; i < entryCount; i++)
+        entries[i].key.hash = 0;
+}
+
+// FNV-1a and CRC-16/CCITT-FALSE on the upper case text, "*idn?" and "*IDN?" are the same query
+void USBTMCQueryCache::MakeKey(const char *command, bool isProgmem, USBTMCCacheKey *key)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    uint16_t crc = 0xFFFF;
+    uint16_t length = 0;
+    char c;
+
+    while ((c = ReadChar(command + length, isProgmem)) != '\0')
+    {
+        uint8_t u = (uint8_t)ToUpper(c);
+
+        hash ^= u;
+        hash *= FNV_PRIME;
+
+        crc ^= (uint16_t)u << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+
+        length++;
+    }
+
+    key->hash = (hash != 0) ? hash : 1;
+    key->check = crc;
+    key->length = length;
+}
+
+uint8_t USBTMCQueryCache::FindEntry(const USBTMCCacheKey &key)
+{
+    for (uint8_t i = 0; i < entryCount; i++)
+    {
+        if (entries[i].key.hash == key.hash && entries[i].key.check == key.check && entries[i].key.length == key.length)
+            return i;
+    }
+
+    return USBTMC_CACHE_NONE;
+}
+
+uint8_t USBTMCQueryCache::FindRule(const char *command, bool isProgmem)
+{
+    for (uint8_t i = 0; i < rulesCount; i++)
+    {
+        const char *query = (const char *)pgm_read_ptr(&rulesPtr[i].query);
+        uint16_t n = 0;
+        char c;
+
+        while ((c = ReadChar(command + n, isProgmem)) != '\0' && ToUpper(c) == ToUpper((char)pgm_read_byte(query + n)))
+            n++;
+
+        if (c == '\0' && pgm_read_byte(query + n) == '\0')
+            return i;
+    }
+
+    return USBTMC_CACHE_NONE;
+}
+
+const char *USBTMCQueryCache::Find(const char *command, bool isProgmem, uint16_t *length)
+{
+    USBTMCCacheKey key;
+
+    MakeKey(command, isProgmem, &key);
+
+    uint8_t index = FindEntry(key);
+
+    if (index == USBTMC_CACHE_NONE)
+        return NULL;
+
+    USBTMCCacheEntry &entry = entries[index];
+
+    if (entry.ttl != 0 && millis() - entry.storedMillis >= entry.ttl)
+    {
+        entry.key.hash = 0;
+        return NULL;
+    }
+
+    if (length != NULL)
+        *length = entry.length;
+
+    return &textPool[index * textSize];
+}
+
+const char *USBTMCQueryCache::Find(const char *command, uint16_t *length)
+{
+    return Find(command, false, length);
+}
+
+const char *USBTMCQueryCache::Find(const __FlashStringHelper *command, uint16_t *length)
+{
+    return Find(reinterpret_cast<const char *>(command), true, length);
+}
+
+void USBTMCQueryCache::Store(const char *command, bool isProgmem, const char *response, uint16_t length, uint32_t ttl)
+{
+    USBTMCCacheKey key;
+
+    MakeKey(command, isProgmem, &key);
+
+    uint8_t index = FindEntry(key);
+
+    if (entryCount == 0 || textSize == 0)
+        return;
+
+    if (index == USBTMC_CACHE_NONE)
+    {
+        // A free entry or else the oldest one
+        index = 0;
+        for (uint8_t i = 0; i < entryCount; i++)
+        {
+            if (entries[i].key.hash == 0)
+            {
+                index = i;
+                break;
+            }
+
+            if ((int32_t)(entries[i].storedMillis - entries[index].storedMillis) < 0)
+                index = i;
+        }
+    }
+
+    if (length >= textSize)
+        length = textSize - 1;
+
+    char *text = &textPool[index * textSize];
+    memcpy(text, response, length);
+    text[length] = '\0';
+
+    entries[index].key = key;
+    entries[index].storedMillis = millis();
+    entries[index].ttl = ttl;
+    entries[index].ruleIndex = FindRule(command, isProgmem);
+    entries[index].length = length;
+}
+
+void USBTMCQueryCache::Store(const char *command, const char *response, uint16_t length, uint32_t ttl)
+{
+    Store(command, false, response, length, ttl);
+}
+
+void USBTMCQueryCache::Store(const __FlashStringHelper *command, const char *response, uint16_t length, uint32_t ttl)
+{
+    Store(reinterpret_cast<const char *>(command), true, response, length, ttl);
+}
+
+// The path goes before a relative header, NULL when it has been lost
+bool USBTMCQueryCache::IsInvalidatedBy(uint8_t ruleIndex, const char *path, uint8_t pathLength, const char *command, uint16_t length, bool isProgmem)
+{
+    if (ruleIndex == USBTMC_CACHE_NONE)
+        return true;
+
+    const char *prefixes = (const char *)pgm_read_ptr(&rulesPtr[ruleIndex].invalidatedBy);
+
+    if (prefixes == NULL)
+        return false;
+
+    if (path == NULL)
+        return true;
+
+    // Each prefix between the '|' separators
+    for (;;)
+    {
+        uint16_t n = 0;
+        char p;
+
+        while ((p = (char)pgm_read_byte(prefixes + n)) != '\0' && p != '|' && n < pathLength + length &&
+               ToUpper(p) == ToUpper((n < pathLength) ? path[n] : ReadChar(command + n - pathLength, isProgmem)))
+            n++;
+
+        if (n > 0 && (p == '\0' || p == '|'))
+            return true;
+
+        // Skip to the next prefix
+        while ((p = (char)pgm_read_byte(prefixes + n)) != '\0' && p != '|')
+            n++;
+
+        if (p == '\0')
+            return false;
+
+        prefixes += n + 1;
+    }
+}
+
+void USBTMCQueryCache::InvalidateSegment(const char *path, uint8_t pathLength, const char *command, uint16_t length, bool isProgmem)
+{
+    // A reset or a recall changes every setting
+    if (length >= 4 && ToUpper(ReadChar(command, isProgmem)) == '*')
+    {
+        char name[4];
+
+        for (uint8_t i = 0; i < 3; i++)
+            name[i] = ToUpper(ReadChar(command + 1 + i, isProgmem));
+        name[3] = '\0';
+
+        if (strcmp(name, "RST") == 0 || strcmp(name, "RCL") == 0)
+        {
+            Clear();
+            return;
+        }
+    }
+
+    for (uint8_t i = 0; i < entryCount; i++)
+    {
+        if (entries[i].key.hash != 0 && IsInvalidatedBy(entries[i].ruleIndex, path, pathLength, command, length, isProgmem))
+            entries[i].key.hash = 0;
+    }
+}
+
+void USBTMCQueryCache::OnWrite(const char *command, bool isProgmem)
+{
+    // Header path of the previous command, a relative header goes on from it. The first one starts at the root.
+    char path[USBTMC_CACHE_PATH_SIZE];
+    uint8_t pathLength = 1;
+    bool isPathLost = false;
+
+    path[0] = ':';
+
+    // The message may hold queries and set commands separated by ';', only set commands change settings
+    for (;;)
+    {
+        uint16_t length = 0;
+        uint16_t headerLength = 0;
+        bool isHeader = true;
+        bool isQuery = false;
+        char quote = '\0';
+        char c;
+
+        while ((c = ReadChar(command, isProgmem)) == ' ')
+            command++;
+
+        // Quoted strings are skipped whole, a doubled quote opens the string again
+        while ((c = ReadChar(command + length, isProgmem)) != '\0')
+        {
+            if (quote != '\0')
+            {
+                if (c == quote)
+                    quote = '\0';
+            }
+            else if (c == '"' || c == '\'')
+            {
+                quote = c;
+            }
+            else if (c == ';' || c == '\n')
+            {
+                break;
+            }
+            else if (c == ' ' || c == '\t')
+            {
+                isHeader = false;
+            }
+            else if (c == '?' && isHeader)
+            {
+                isQuery = true;
+            }
+
+            if (isHeader)
+                headerLength++;
+            length++;
+        }
+
+        char first = ReadChar(command, isProgmem);
+        bool isRelative = (first != ':' && first != '*');
+        uint8_t prefixLength = isRelative ? pathLength : 0;
+
+        if (length > 0 && !isQuery)
+            InvalidateSegment((isRelative && isPathLost) ? NULL : path, prefixLength, command, length, isProgmem);
+
+        // Common commands leave the path alone, the others set it up to their last ':'
+        if (length > 0 && first != '*')
+        {
+            uint16_t colon = headerLength;
+
+            while (colon > 0 && ReadChar(command + colon - 1, isProgmem) != ':')
+                colon--;
+
+            if (!isRelative)
+            {
+                pathLength = 0;
+                isPathLost = false;
+            }
+
+            if (pathLength + colon > USBTMC_CACHE_PATH_SIZE)
+            {
+                isPathLost = true;
+            }
+            else
+            {
+                for (uint16_t i = 0; i < colon; i++)
+                    path[pathLength++] = ReadChar(command + i, isProgmem);
+            }
+        }
+
+        if (c != ';')
+            return;
+
+        command += length + 1;
+    }
+}
+
+void USBTMCQueryCache::OnWrite(const char *command)
+{
+    OnWrite(command, false);
+}
+
+void USBTMCQueryCache::OnWrite(const __FlashStringHelper *command)
+{
+    OnWrite(reinterpret_cast<const char *>(command), true);
+}
@@ -0,0 +1,149 @@
+/*
+ * Ring buffer for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_FIFO_H__)
+#define __USBTMC_FIFO_H__
+
+#include <stdint.h>
+#include <string.h>
+
+// 8-bit indexes are enough up to 256 bytes, which keeps AVR arithmetic single-byte.
+template <bool isSmall>
+struct USBTMCFifoIndex {
+    typedef uint16_t Type;
+};
+
+template <>
+struct USBTMCFifoIndex<true> {
+    typedef uint8_t Type;
+};
+
+// Capacity must be a power of two so that wrapping is a mask instead of a division.
+// One byte is kept free to tell a full buffer from an empty one.
+template <uint16_t Capacity>
+class USBTMCFifo
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "USBTMCFifo capacity must be a power of two");
+
+    typedef typename USBTMCFifoIndex<(Capacity <= 256)>::Type Index;
+    static const uint16_t Mask = Capacity - 1;
+
+    Index head;
+    Index tail;
+    uint8_t buffer[Capacity];
+
+public:
+    USBTMCFifo() : head(0), tail(0) {};
+
+    static uint16_t capacity() {
+        return Capacity - 1;
+    };
+
+    uint16_t available() const {
+        return (uint16_t)(head - tail) & Mask;
+    };
+
+    uint16_t space() const {
+        return Mask - available();
+    };
+
+    bool write(uint8_t c) {
+        Index next = (Index)((head + 1) & Mask);
+
+        if (next == tail)
+            return false;
+
+        buffer[head] = c;
+        head = next;
+        return true;
+    };
+
+    uint8_t read() {
+        if (head == tail)
+            return 0;
+
+        uint8_t c = buffer[tail];
+        tail = (Index)((tail + 1) & Mask);
+        return c;
+    };
+
+    // Copies as many bytes as fit and returns the number of bytes accepted.
+    uint16_t write(const uint8_t *dataptr, uint16_t length) {
+        uint16_t room = space();
+
+        if (length > room)
+            length = room;
+
+        uint16_t first = Capacity - head;
+        if (first > length)
+            first = length;
+
+        memcpy(&buffer[head], dataptr, first);
+        memcpy(&buffer[0], dataptr + first, length - first);
+        head = (Index)((head + length) & Mask);
+
+        return length;
+    };
+
+    // Copies up to length bytes without consuming them.
+    uint16_t peek(uint8_t *dataptr, uint16_t length) const {
+        uint16_t count = available();
+
+        if (length > count)
+            length = count;
+
+        uint16_t first = Capacity - tail;
+        if (first > length)
+            first = length;
+
+        memcpy(dataptr, &buffer[tail], first);
+        memcpy(dataptr + first, &buffer[0], length - first);
+
+        return length;
+    };
+
+    // The bytes from the read position up to the end of the buffer, they are consumed with skip().
+    const uint8_t *peekContiguous(uint16_t &length) const {
+        uint16_t count = available();
+        uint16_t first = Capacity - tail;
+
+        length = (count < first) ? count : first;
+        return &buffer[tail];
+    };
+
+    uint16_t skip(uint16_t length) {
+        uint16_t count = available();
+
+        if (length > count)
+            length = count;
+
+        tail = (Index)((tail + length) & Mask);
+
+        return length;
+    };
+
+    uint16_t read(uint8_t *dataptr, uint16_t length) {
+        return skip(peek(dataptr, length));
+    };
+
+    void flush() {
+        head = 0;
+        tail = 0;
+    };
+};
+
+#endif // __USBTMC_FIFO_H__
@@ -17,37 +17,78 @@
  */
 #include "usbtmc_helper.h"
 
-USBTMC_HELPER::USBTMC_HELPER(USB *pusb, USBTMCAsyncOper * pasync, uint16_t vid, uint16_t pid) : USBTMC(pusb, this, vid, pid)
+// Follow-up requests ask for one packet payload at least
+#define USBTMC_HELPER_MIN_REQUEST 52
+// The rest of an overflowing response is thrown away with the largest Request() an int allows
+#define USBTMC_HELPER_DRAIN_REQUEST 0x7FFF
+
+USBTMC_HELPER::USBTMC_HELPER(USB *pusb, USBTMCAsyncOper * pasync, char *buffer, uint16_t size, uint16_t vid, uint16_t pid) : USBTMC(pusb, this, vid, pid)
 {
   pUsb = pusb;
   pAsync = pasync;
   isRecieved = false;
-  receivedText = "";
+  responseBuffer = buffer;
+  responseSize = size;
+  responseLength = 0;
+  isQueryActive = false;
+  isQueryRequested = false;
+  isQueryFailed = false;
+  isEndOfMessage = false;
+  queryCallback = NULL;
+  maxResponseLength = 0;
+  receivedBytes = 0;
+  queryTimeout = 0;
+  queryBeginMillis = 0;
+  pCache = NULL;
+  isCachedResponse = false;
+  queryCommand = NULL;
+  isQueryCommandProgmem = false;
+  queryTtl = 0;
+
+  if (responseSize > 0)
+  {
+    responseBuffer[0] = '\0';
+  }
 }
 
 void USBTMC_HELPER::OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr, uint8_t serialNumLen)
 {
+  // It may be another instrument
+  if (pCache != NULL)
+  {
+    pCache->Clear();
+  }
+
   pAsync->OnRcvdDescr(pdescr, serialNumPtr, serialNumLen);
 }
 
 void USBTMC_HELPER::OnReceived(uint8_t data)
+{
+  // The responses come through OnLine()
+}
+
+void USBTMC_HELPER::OnLine(const char *line, uint16_t length)
 {
   if (isRecieved)
   {
     return;
   }
 
-  char rc = (char)data;
-  if ((rc == 0x00) || (!isAscii(data))) {
-    return;
-  }
-  
-  if (rc == '\n') {
-    isRecieved = true;
-  }
-  else {
-    receivedText += rc;
+  // A line spanning packets is already assembled in the response buffer
+  if (line != responseBuffer)
+  {
+    if (length >= responseSize)
+      length = responseSize - 1;
+
+    memcpy(responseBuffer, line, length);
+    responseBuffer[length] = '\0';
   }
+
+  responseLength = length;
+  isRecieved = true;
+
+  // Keep the following lines off the response
+  SetLineMode('\n', NULL, 0);
 }
 
 void USBTMC_HELPER::OnReadStatusByte(uint8_t status)
@@ -56,61 +97,568 @@ void USBTMC_HELPER::OnReadStatusByte(uint8_t status)
 
 void USBTMC_HELPER::OnFailed(USBTMCInformation info, uint8_t code)
 {
+  if (!isQueryActive)
+  {
+    return;
+  }
+
+  switch (info)
+  {
+    case USBTMCInformation::RequestError:
+    case USBTMCInformation::ReceiveheaderNakAndTimeouted:
+    case USBTMCInformation::ReceiveheaderError:
+    case USBTMCInformation::ReceivepayloadNakAndTimeouted:
+    case USBTMCInformation::ReceivepayloadError:
+      isQueryFailed = true;
+      break;
+
+    default:
+      break;
+  }
 }
 
-void USBTMC_HELPER::write(String command)
+void USBTMC_HELPER::OnTransferHeader(uint32_t transferSize, bool isEndOfMessage)
+{
+  // The device never sends more than requested
+  receivedBytes += transferSize;
+  this->isEndOfMessage = isEndOfMessage;
+}
+
+bool USBTMC_HELPER::BeginWrite(uint16_t length)
 {
   if (pUsb->getUsbTaskState() != USB_STATE_RUNNING)
   {
-    return;
+    return false;
   }
-  command += '\n';
-  Transmit(command.length(), (uint8_t *)command.c_str());
+
+  if (!IsIdle())
+  {
+    return false;
+  }
+
+  // The command and the terminator go out as one message
+  BeginTransmit(length + 1);
+  return true;
 }
 
-String USBTMC_HELPER::read(unsigned long timeout)
+bool USBTMC_HELPER::write(const char *command)
 {
-  String response = "";
+  uint16_t length = strlen(command);
 
-  if (pUsb->getUsbTaskState() != USB_STATE_RUNNING)
+  if (!BeginWrite(length))
   {
-    return response;
+    return false;
   }
 
-  unsigned long waitBeginMillis = millis();
+  if (pCache != NULL)
+  {
+    pCache->OnWrite(command);
+  }
 
-  Request(1024);
+  for (uint16_t i = 0; i < length; i++)
+  {
+    TransmitData((uint8_t)command[i]);
+    if (TransmitDone())
+      return false;
+  }
 
-  // sub loop function
-  while (true)
+  TransmitData('\n');
+  return true;
+}
+
+bool USBTMC_HELPER::write(const __FlashStringHelper *command)
+{
+  PGM_P p = reinterpret_cast<PGM_P>(command);
+  uint16_t length = strlen_P(p);
+
+  if (!BeginWrite(length))
+  {
+    return false;
+  }
+
+  if (pCache != NULL)
+  {
+    pCache->OnWrite(command);
+  }
+
+  for (uint16_t i = 0; i < length; i++)
+  {
+    TransmitData(pgm_read_byte(p + i));
+    if (TransmitDone())
+      return false;
+  }
+
+  TransmitData('\n');
+  return true;
+}
+
+void USBTMC_HELPER::BeginResponse()
+{
+  isRecieved = false;
+  responseLength = 0;
+  if (responseSize > 0)
+  {
+    responseBuffer[0] = '\0';
+  }
+}
+
+void USBTMC_HELPER::BeginQuery(unsigned long timeout, uint32_t maxLength)
+{
+  BeginResponse();
+  isQueryActive = true;
+  isQueryRequested = false;
+  isQueryFailed = false;
+  isEndOfMessage = false;
+  maxResponseLength = maxLength;
+  receivedBytes = 0;
+  queryTimeout = timeout;
+  queryBeginMillis = millis();
+  queryCommand = NULL;
+
+  // The driver assembles the response line in the response buffer
+  SetLineMode('\n', responseBuffer, responseSize);
+}
+
+void USBTMC_HELPER::RequestNext()
+{
+  uint32_t size;
+
+  if (maxResponseLength > 0)
   {
-    if (pUsb->getUsbTaskState() != USB_STATE_RUNNING)
+    // The caller knows the size of the response
+    size = maxResponseLength - receivedBytes;
+  }
+  else
+  {
+    // The buffer holds the line and its terminator, once the line is in only the rest is drained
+    if (isRecieved)
     {
-      break;
+      size = USBTMC_HELPER_DRAIN_REQUEST;
     }
+    else
+    {
+      size = responseSize;
+      if (size < USBTMC_HELPER_MIN_REQUEST)
+        size = USBTMC_HELPER_MIN_REQUEST;
+    }
+  }
+
+  isEndOfMessage = false;
+  isQueryRequested = true;
+  Request((int)size);
+}
+
+bool USBTMC_HELPER::PollQuery()
+{
+  bool isSucceeded = false;
+
+  if (isCachedResponse)
+  {
+    isCachedResponse = false;
+    isQueryActive = false;
+    return true;
+  }
+
+  if (pUsb->getUsbTaskState() != USB_STATE_RUNNING || isQueryFailed)
+  {
+    goto Fail;
+  }
+
+  if (!isQueryRequested)
+  {
+    // The command may still be waiting in the transmit FIFO
+    if (IsIdle())
+      RequestNext();
+  }
+  else if (IsIdle())
+  {
+    // A transfer has finished
+    isQueryRequested = false;
+
+    if (isEndOfMessage)
+    {
+      isSucceeded = true;
+    }
+    else if (maxResponseLength > 0 && receivedBytes >= maxResponseLength)
+    {
+      // Throw away the rest of the response to keep the instrument in sync
+      Clear();
+      isSucceeded = true;
+    }
+    else
+    {
+      RequestNext();
+    }
+  }
+
+  if (isSucceeded)
+  {
+    isQueryActive = false;
+    StoreCached();
+    return true;
+  }
+
+  if (millis() - queryBeginMillis < queryTimeout)
+  {
+    return false;
+  }
+
+  if (!IsIdle())
+  {
+    AbortReceive();
+  }
+  else if (!isEndOfMessage)
+  {
+    // Between two requests, the rest of the response would answer the next query
+    Clear();
+  }
+
+Fail:
+  // A partial response is not a response, and the next query starts on a line of its own
+  BeginResponse();
+  SetLineMode('\n', NULL, 0);
+  isQueryActive = false;
+  return true;
+}
 
+const char *USBTMC_HELPER::read(unsigned long timeout, uint32_t maxLength)
+{
+  static const char empty[] = "";
+
+  if (responseSize == 0 || isQueryActive)
+  {
+    return empty;
+  }
+
+  if (pUsb->getUsbTaskState() != USB_STATE_RUNNING)
+  {
+    BeginResponse();
+    return responseBuffer;
+  }
+
+  BeginQuery(timeout, maxLength);
+  queryCallback = NULL;
+
+  // sub loop function
+  while (isQueryActive)
+  {
     task();
+  }
+
+  return responseBuffer;
+}
+
+uint16_t USBTMC_HELPER::length()
+{
+  return responseLength;
+}
+
+bool USBTMC_HELPER::queryAsync(const char *command, USBTMCQueryCallback onDone, unsigned long timeout, uint32_t maxLength, uint32_t ttl)
+{
+  uint16_t cachedLength;
+  const char *cached;
+
+  if (isQueryActive || responseSize == 0 || onDone == NULL)
+  {
+    return false;
+  }
+
+  cached = (pCache != NULL) ? pCache->Find(command, &cachedLength) : NULL;
+  if (LoadCached(cached, cachedLength))
+  {
+    // Delivered from task() as a response from the instrument would be
+    isQueryActive = true;
+    isCachedResponse = true;
+    queryCallback = onDone;
+    return true;
+  }
+
+  if (!write(command))
+  {
+    return false;
+  }
+
+  BeginQuery(timeout, maxLength);
+  queryCallback = onDone;
+  queryCommand = reinterpret_cast<const char *>(command);
+  isQueryCommandProgmem = false;
+  queryTtl = ttl;
+  return true;
+}
+
+bool USBTMC_HELPER::queryAsync(const __FlashStringHelper *command, USBTMCQueryCallback onDone, unsigned long timeout, uint32_t maxLength, uint32_t ttl)
+{
+  uint16_t cachedLength;
+  const char *cached;
+
+  if (isQueryActive || responseSize == 0 || onDone == NULL)
+  {
+    return false;
+  }
+
+  cached = (pCache != NULL) ? pCache->Find(command, &cachedLength) : NULL;
+  if (LoadCached(cached, cachedLength))
+  {
+    // Delivered from task() as a response from the instrument would be
+    isQueryActive = true;
+    isCachedResponse = true;
+    queryCallback = onDone;
+    return true;
+  }
+
+  if (!write(command))
+  {
+    return false;
+  }
+
+  BeginQuery(timeout, maxLength);
+  queryCallback = onDone;
+  queryCommand = reinterpret_cast<const char *>(command);
+  isQueryCommandProgmem = true;
+  queryTtl = ttl;
+  return true;
+}
+
+uint8_t USBTMC_HELPER::queryBatch(const char *const *commands, uint8_t count, const char **results, unsigned long timeout)
+{
+  uint16_t length;
 
-    unsigned long currentMillis = millis();
-    if (currentMillis - waitBeginMillis >= timeout)
+  if (count == 0 || isQueryActive || responseSize == 0)
+  {
+    return 0;
+  }
+
+  // The separators between the queries
+  length = count - 1;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    length += strlen(commands[i]);
+  }
+
+  if (!BeginWrite(length))
+  {
+    return 0;
+  }
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (i > 0)
     {
-      break;
+      TransmitData(';');
     }
 
-    if (isRecieved)
+    if (pCache != NULL)
+    {
+      pCache->OnWrite(commands[i]);
+    }
+
+    for (const char *p = commands[i]; *p != '\0'; p++)
+    {
+      TransmitData((uint8_t)*p);
+    }
+
+    if (TransmitDone())
+      return 0;
+  }
+
+  TransmitData('\n');
+
+  return splitResponse((char *)read(timeout), results, count);
+}
+
+uint8_t USBTMC_HELPER::queryBatch(const __FlashStringHelper *commands, const char **results, uint8_t maxCount, unsigned long timeout)
+{
+  if (maxCount == 0 || isQueryActive || responseSize == 0)
+  {
+    return 0;
+  }
+
+  if (!write(commands))
+  {
+    return 0;
+  }
+
+  return splitResponse((char *)read(timeout), results, maxCount);
+}
+
+uint8_t USBTMC_HELPER::splitResponse(char *response, const char **results, uint8_t maxCount)
+{
+  uint8_t count = 0;
+  char quote = '\0';
+  char *begin = response;
+  char *p = response;
+
+  if (response == NULL || *response == '\0' || maxCount == 0)
+  {
+    return 0;
+  }
+
+  for (;; p++)
+  {
+    char c = *p;
+
+    if (quote != '\0' && c != '\0')
+    {
+      // A doubled quote closes the string and opens it again
+      if (c == quote)
+        quote = '\0';
+      continue;
+    }
+
+    if (c == '"' || c == '\'')
+    {
+      quote = c;
+      continue;
+    }
+
+    if (c != ';' && c != '\0')
+    {
+      continue;
+    }
+
+    // Trim the spaces around the result
+    char *end = p;
+    while (begin < end && *begin == ' ')
+      begin++;
+    while (end > begin && end[-1] == ' ')
+      end--;
+    *end = '\0';
+
+    results[count++] = begin;
+
+    if (c == '\0' || count >= maxCount)
     {
-      isRecieved = false;
-      response = receivedText;
-      receivedText = "";
       break;
     }
+
+    begin = p + 1;
+  }
+
+  return count;
+}
+
+const char *USBTMC_HELPER::query(const char *command, unsigned long timeout, uint32_t ttl)
+{
+  uint16_t cachedLength;
+  const char *cached = (pCache != NULL) ? pCache->Find(command, &cachedLength) : NULL;
+
+  if (isQueryActive || responseSize == 0)
+  {
+    return "";
+  }
+
+  if (LoadCached(cached, cachedLength))
+  {
+    return responseBuffer;
+  }
+
+  if (!write(command))
+  {
+    BeginResponse();
+    return responseBuffer;
+  }
+
+  read(timeout);
+
+  queryCommand = command;
+  isQueryCommandProgmem = false;
+  queryTtl = ttl;
+  StoreCached();
+
+  return responseBuffer;
+}
+
+const char *USBTMC_HELPER::query(const __FlashStringHelper *command, unsigned long timeout, uint32_t ttl)
+{
+  uint16_t cachedLength;
+  const char *cached = (pCache != NULL) ? pCache->Find(command, &cachedLength) : NULL;
+
+  if (isQueryActive || responseSize == 0)
+  {
+    return "";
+  }
+
+  if (LoadCached(cached, cachedLength))
+  {
+    return responseBuffer;
+  }
+
+  if (!write(command))
+  {
+    BeginResponse();
+    return responseBuffer;
   }
 
-  return response;
+  read(timeout);
+
+  queryCommand = reinterpret_cast<const char *>(command);
+  isQueryCommandProgmem = true;
+  queryTtl = ttl;
+  StoreCached();
+
+  return responseBuffer;
+}
+
+void USBTMC_HELPER::setQueryCache(USBTMCQueryCache *cache)
+{
+  pCache = cache;
+}
+
+bool USBTMC_HELPER::LoadCached(const char *cached, uint16_t length)
+{
+  if (cached == NULL)
+  {
+    return false;
+  }
+
+  if (length >= responseSize)
+    length = responseSize - 1;
+
+  memcpy(responseBuffer, cached, length);
+  responseBuffer[length] = '\0';
+  responseLength = length;
+  return true;
+}
+
+void USBTMC_HELPER::StoreCached()
+{
+  const char *command = queryCommand;
+
+  queryCommand = NULL;
+
+  // An empty response is a timeout
+  if (pCache == NULL || command == NULL || responseLength == 0)
+  {
+    return;
+  }
+
+  if (isQueryCommandProgmem)
+    pCache->Store(reinterpret_cast<const __FlashStringHelper *>(command), responseBuffer, responseLength, queryTtl);
+  else
+    pCache->Store(command, responseBuffer, responseLength, queryTtl);
+}
+
+bool USBTMC_HELPER::isQueryPending()
+{
+  return isQueryActive;
 }
 
 void USBTMC_HELPER::task()
 {
   pUsb->Task();
   Run();
+
+  if (!isQueryActive)
+  {
+    return;
+  }
+
+  if (PollQuery() && queryCallback != NULL)
+  {
+    USBTMCQueryCallback onDone = queryCallback;
+
+    // The callback may start the next query
+    queryCallback = NULL;
+    onDone(responseBuffer, responseLength);
+  }
 }
@@ -20,26 +20,89 @@
 
 #include <usbhub.h>
 #include "usbtmc.h"
+#include "usbtmc_cache.h"
 
 class USBTMC_HELPER;
 
+// Completion of queryAsync(), length is 0 when the query timed out.
+typedef void (*USBTMCQueryCallback)(const char *response, uint16_t length);
+
 class USBTMC_HELPER : public USBTMC, public USBTMCAsyncOper
 {
     USB *pUsb;
     USBTMCAsyncOper *pAsync;
     bool isRecieved;
-    String receivedText;
+    char *responseBuffer;       // Supplied by the sketch, no heap is used
+    uint16_t responseSize;
+    uint16_t responseLength;
+
+    // Response being collected by read() or queryAsync()
+    bool isQueryActive;
+    bool isQueryRequested;
+    bool isQueryFailed;
+    bool isEndOfMessage;
+    USBTMCQueryCallback queryCallback;
+    uint32_t maxResponseLength;
+    uint32_t receivedBytes;
+    unsigned long queryTimeout;
+    unsigned long queryBeginMillis;
+
+    // Answers are kept for the next identical query
+    USBTMCQueryCache *pCache;
+    bool isCachedResponse;
+    const char *queryCommand;   // stored in the cache when the query completes
+    bool isQueryCommandProgmem;
+    uint32_t queryTtl;
 
     void OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr, uint8_t serialNumLen);
     void OnReceived(uint8_t data);
     void OnReadStatusByte(uint8_t status);
     void OnFailed(USBTMCInformation info, uint8_t code);
+    void OnTransferHeader(uint32_t transferSize, bool isEndOfMessage);
+    void OnLine(const char *line, uint16_t length);
+
+    bool BeginWrite(uint16_t length);
+    void BeginResponse();
+    void BeginQuery(unsigned long timeout, uint32_t maxLength);
+    void RequestNext();
+    bool PollQuery();
+    bool LoadCached(const char *cached, uint16_t length);
+    void StoreCached();
 
 public:
-    USBTMC_HELPER(USB *pusb, USBTMCAsyncOper *pasync,uint16_t vid = 0, uint16_t pid = 0);
+    USBTMC_HELPER(USB *pusb, USBTMCAsyncOper *pasync, char *buffer, uint16_t size, uint16_t vid = 0, uint16_t pid = 0);
+
+    bool write(const char *command);
+    bool write(const __FlashStringHelper *command);
+    // The returned text lives in the response buffer until the next read.
+    // The text is truncated to (size - 1) characters, an empty text means timeout.
+    // maxLength limits the bytes read from the instrument, 0 reads up to the end of message.
+    const char *read(unsigned long timeout, uint32_t maxLength = 0);
+    uint16_t length();
+
+    // write() and read() in one call, the answer comes from the cache when it has one.
+    // ttl is the lifetime of the cached answer in milliseconds, 0 keeps it until a set command drops it.
+    const char *query(const char *command, unsigned long timeout = 1000, uint32_t ttl = 0);
+    const char *query(const __FlashStringHelper *command, unsigned long timeout = 1000, uint32_t ttl = 0);
+    // Every message written goes through the cache, see USBTMCCacheRule
+    void setQueryCache(USBTMCQueryCache *cache);
+
+    // Returns immediately, onDone is called from task() with the response.
+    // Only one query is in flight, false means the helper is busy.
+    // A cached answer is also delivered from task(), the command must stay valid until then.
+    bool queryAsync(const char *command, USBTMCQueryCallback onDone, unsigned long timeout = 1000, uint32_t maxLength = 0, uint32_t ttl = 0);
+    bool queryAsync(const __FlashStringHelper *command, USBTMCQueryCallback onDone, unsigned long timeout = 1000, uint32_t maxLength = 0, uint32_t ttl = 0);
+    bool isQueryPending();
+
+    // The queries go out as one message "Q1;Q2;Q3" and come back as one response, one round trip for all.
+    // Give each query its full path (":MEAS:VPP? CHAN1") as the parser resumes from the previous one otherwise.
+    // results[i] points into the response buffer, the number of results is returned.
+    uint8_t queryBatch(const char *const *commands, uint8_t count, const char **results, unsigned long timeout = 1000);
+    // The queries already joined with ';', e.g. F(":MEAS:VPP? CHAN1;:MEAS:FREQ? CHAN1")
+    uint8_t queryBatch(const __FlashStringHelper *commands, const char **results, uint8_t maxCount, unsigned long timeout = 1000);
+    // Splits a response at the ';' which are not in a quoted string, for queryAsync() callbacks
+    static uint8_t splitResponse(char *response, const char **results, uint8_t maxCount);
 
-    void write(String command);
-    String read(unsigned long timeout);
     void task();
 };
 
@@ -4,8 +4,11 @@
 
 #include <usbhub.h>
 
-// Please copy usbtmc.cpp and usbtmc.h to "USBTMCHostDS1054ZDemo" folder.
+// Please copy usbtmc.cpp, usbtmc.h, usbtmc_config.h, usbtmc_fifo.h, usbtmc_script.cpp, usbtmc_script.h,
+// usbtmc_snapshot.cpp and usbtmc_snapshot.h to "USBTMCHostDS1054ZDemo" folder.
 #include "usbtmc.h"
+#include "usbtmc_script.h"
+#include "usbtmc_snapshot.h"
 
 // Satisfy the IDE, which needs to see the include statement in the ino too.
 #ifdef dobogusinclude
@@ -17,92 +20,91 @@
 #define PIN_LED     3
 #define PIN_BUTTON  2
 
-const uint8_t USB488Terminator = 0x0A;
-const char SerialTerminator = '\n';
+#define SCRIPT_REGISTER_COUNT   1
+#define SCRIPT_REGISTER_SIZE    16
 
-String ReceivedText;
-bool isReceived = false;
+const char USB488Terminator = '\n';
+const char SerialTerminator = '\n';
 
 bool isFired = false;
 unsigned long beginMillis;
 
 class USBTMCAsync : public USBTMCAsyncOper
 {
-  public:
-    bool OnReceived(uint8_t data);
-    void OnError(String info, bool newline);
+public:
+    void OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr, uint8_t serialNumLen);
+    void OnReceived(uint8_t data);
+    void OnReceivedData(const uint8_t *dataptr, uint16_t length);
+    void OnReadStatusByte(uint8_t status);
+    void OnFailed(USBTMCInformation info, uint8_t code);
+    void OnTransferHeader(uint32_t transferSize, bool isEndOfMessage);
 };
 
-bool USBTMCAsync::OnReceived(uint8_t data)
+USB Usb;
+//USBHub         Hub(&Usb);
+USBTMCAsync UsbtmcAsync;
+USBTMC Usbtmc(&Usb, &UsbtmcAsync);
+
+char ScriptRegisters[SCRIPT_REGISTER_COUNT][SCRIPT_REGISTER_SIZE];
+USBTMCScript Script(&Usbtmc, ScriptRegisters[0], SCRIPT_REGISTER_COUNT, SCRIPT_REGISTER_SIZE);
+
+// The answers of the query set, see RunScript()
+uint8_t SnapshotBuffer[96];
+USBTMCSnapshot Snapshot(&Usbtmc, SnapshotBuffer, sizeof(SnapshotBuffer));
+
+void USBTMCAsync::OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr __attribute__((unused)), uint8_t serialNumLen __attribute__((unused)))
 {
-    if (data == USB488Terminator)
-    {
-        Serial.write((uint8_t)SerialTerminator);
-        isReceived = true;
-        return true;
-    }
-    else
-    {
-        Serial.write(data);
-        ReceivedText += (char)data;
-        return false;
-    }
+    Serial.print(F("ProductID:"));
+    Serial.println(pdescr->idProduct, HEX);
+
+    Serial.print(F("VendorID:"));
+    Serial.println(pdescr->idVendor, HEX);
 }
 
-void USBTMCAsync::OnError(String info, bool newline)
+void USBTMCAsync::OnReceived(uint8_t data)
 {
-    Serial.print(info);
-    if(newline)
-        Serial.write((uint8_t)SerialTerminator);
+    Serial.write(data);
 }
 
-USB Usb;
-//USBHub         Hub(&Usb);
-USBTMCAsync UsbtmcAsync;
-USBTMC Usbtmc(&Usb, &UsbtmcAsync);
-
-void sendCommand(String command)
+void USBTMCAsync::OnReceivedData(const uint8_t *dataptr, uint16_t length)
 {
-    Serial.println(command);
-    command += (char)USB488Terminator;
-    Usbtmc.Send((uint8_t)command.length(), (uint8_t *)command.c_str());
+    if (Snapshot.IsBusy())
+        Snapshot.OnReceivedData(dataptr, length);
+    else if (Script.IsRunning())
+        Script.OnReceivedData(dataptr, length);
+    else
+        Serial.write(dataptr, length);
 }
 
-String waitUntilReceived(unsigned long timeout)
+void USBTMCAsync::OnReadStatusByte(uint8_t status)
 {
-    ReceivedText = "";
-    isReceived = false;
-    unsigned long waitBeginMillis = millis();
-  
-    // sub loop function
-    while(true)
+    if (Script.IsRunning())
     {
-        unsigned long currentMillis = millis();
-        if (currentMillis - waitBeginMillis >= timeout)
-        {
-            ReceivedText = "";
-            break;
-        }
-        
-        Usb.Task();
-
-        if (Usb.getUsbTaskState() != USB_STATE_RUNNING)
-        {
-            ReceivedText = "";
-            break;
-        }
-        else
-        {
-            Usbtmc.Run();
+        Script.OnReadStatusByte(status);
+        return;
+    }
 
-            if(isReceived)
-                break;
+    Serial.print(F("STB:"));
+    Serial.println(status, HEX);
+}
 
-        }
+void USBTMCAsync::OnFailed(USBTMCInformation info, uint8_t code)
+{
+    Script.OnFailed(info, code);
+    Snapshot.OnFailed(info, code);
 
-    }
+    Serial.print(F("Failed:"));
+    Serial.print(static_cast<int>(info));
+    Serial.print(F(","));
+    Serial.println(code, HEX);
+}
 
-    return ReceivedText;
+void USBTMCAsync::OnTransferHeader(uint32_t transferSize, bool isEndOfMessage)
+{
+    if (Snapshot.IsBusy())
+        Snapshot.OnTransferHeader(transferSize, isEndOfMessage);
+    else if (Script.IsRunning())
+        Script.OnTransferHeader(transferSize, isEndOfMessage);
 }
 
 void setup()
@@ -121,28 +123,57 @@ void setup()
         Serial.println(F("OSC did not start."));
 
     delay(200);
+
+    // Request size and polling cadence the DS1000Z copes with
+    Usbtmc.SetProfiles(USBTMCDefaultProfiles, USBTMCDefaultProfilesCount);
     
     beginMillis = millis();
 }
 
 void loop()
 {
+    static bool isRequestPending = false;
+
     Usb.Task();
 
     if (Usb.getUsbTaskState() != USB_STATE_RUNNING)
     {
+        if (Script.IsRunning())
+            Script.Stop();
+
+        isRequestPending = false;
         RunInitialize();
     }
     else
     {
         Usbtmc.Run();
+        Script.Task();
+        Snapshot.Task();
+
+        if (Script.IsRunning() || Snapshot.IsBusy())
+            return;
+
+        ScriptFinished();
 
         if (Usbtmc.IsIdle())
         {
-            String receivedText = serialReceive();
-            if(receivedText != "")
-                Usbtmc.Send((uint8_t)receivedText.length(), (uint8_t *)receivedText.c_str());
-
+            if (isRequestPending)
+            {
+                // The response of a query
+                isRequestPending = false;
+                Usbtmc.Request(1024);
+            }
+            else
+            {
+                uint8_t length;
+                char *receivedText = serialReceive(length);
+
+                if (receivedText != NULL)
+                {
+                    isRequestPending = (memchr(receivedText, '?', length) != NULL);
+                    Usbtmc.Transmit(length, (uint8_t *)receivedText);
+                }
+            }
         }
 
         int inPin = digitalRead(PIN_BUTTON);
@@ -167,7 +198,7 @@ void loop()
           isFired = false;
         }
 
-        if (inPin == LOW) {
+        if (inPin == LOW && Usbtmc.IsIdle() && !isRequestPending) {
             RunScript();
         }
 
@@ -175,10 +206,11 @@ void loop()
     }
 }
 
-String serialReceive()
+// A line from the serial port with the USB488 terminator, NULL until it is complete
+char *serialReceive(uint8_t &length)
 {
-    static String tmpText = "";
-    String receivedText = "";
+    static char tmpText[64];
+    static uint8_t tmpLength = 0;
     char rc;
 
     while (Serial.available() > 0)
@@ -192,17 +224,17 @@ String serialReceive()
 
         if (rc == SerialTerminator)
         {
-            tmpText += (char)USB488Terminator;
-            receivedText = tmpText;
-            tmpText = "";
-            break;
+            tmpText[tmpLength++] = USB488Terminator;
+            length = tmpLength;
+            tmpLength = 0;
+            return tmpText;
         }
-        else
+        else if (tmpLength < sizeof(tmpText) - 1)
         {
-            tmpText += rc;
+            tmpText[tmpLength++] = rc;
         }
         
     }
 
-    return receivedText;
+    return NULL;
 }
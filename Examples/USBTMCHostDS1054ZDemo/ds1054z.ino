@@ -3,207 +3,124 @@
 //#define CHANNEL
 //#define MEASURE
 
+#include "scripts.h"
+
+#define STAGE_NONE      0
+#define STAGE_CAPTURE   1
+#define STAGE_SCRIPT    2
+#define STAGE_RESTORE   3
+
 bool isStop = false;
 int channelNum = 1;
+uint8_t stage = STAGE_NONE;
 
 void RunInitialize()
 {
     isStop = false;
     channelNum = 1;
+    stage = STAGE_NONE;
     digitalWrite(PIN_LED, HIGH);
     
 }
 
+void sendCommand(const __FlashStringHelper *command)
+{
+    char text[32];
+
+    strncpy_P(text, (const char *)command, sizeof(text) - 2);
+    text[sizeof(text) - 2] = '\0';
+    Serial.println(text);
+
+    strcat(text, "\n");
+    Usbtmc.Transmit((uint8_t)strlen(text), (uint8_t *)text);
+}
+
 void RunScript()
 {
 #if defined RUNSTOP
-    String command;
     if(isStop)
     {
-        command = F(":RUN");
         isStop = false;
         digitalWrite(PIN_LED, HIGH);
+        sendCommand(F(":RUN"));
     }
     else
     {
-        command = F(":STOP");
         isStop = true;
         digitalWrite(PIN_LED, LOW);
+        sendCommand(F(":STOP"));
     }
 
-    sendCommand(command);
-
 #elif defined CHANNEL
-    String command;
-    String range1;
-    String range2;
-    String range3;
-    String range4;
-    String edgeLevel;
-
+    // The scale and the trigger level are captured in one query and put back in one message
+    // when ChannelScript has run
     digitalWrite(PIN_LED, LOW);
-    
-    command = F(":CHAN1:DISP ON");
-    sendCommand(command);
-
-    command = F(":CHAN2:DISP ON");
-    sendCommand(command);
-
-    command = F(":CHAN3:DISP ON");
-    sendCommand(command);
+    Snapshot.SetQuerySet(F(":CHAN1:SCAL?;:CHAN2:SCAL?;:CHAN3:SCAL?;:CHAN4:SCAL?;:TRIG:EDG:LEV?"));
+    if (Snapshot.Capture())
+        stage = STAGE_CAPTURE;
 
-    command = F(":CHAN4:DISP ON");
-    sendCommand(command);
-
-    //:CHAN1:SCAL? -> 5.000000e+00
-    command = F(":CHAN1:SCAL?");
-    sendCommand(command);
-    range1 = waitUntilReceived(5000);
-
-    if(range1 == "")
-        return;
-
-    command = F(":CHAN2:SCAL?");
-    sendCommand(command);
-    range2 = waitUntilReceived(5000);
-
-    if(range2 == "")
-        return;
+#elif defined MEASURE
+    char source[] = "CHAN1";
 
-    command = F(":CHAN3:SCAL?");
-    sendCommand(command);
-    range3 = waitUntilReceived(5000);
+    digitalWrite(PIN_LED, LOW);
 
-    if(range3 == "")
-        return;
+    source[4] = '0' + channelNum;
+    Script.SetRegister(0, source);
+    Serial.println(source);
 
-    command = F(":CHAN4:SCAL?");
-    sendCommand(command);
-    range4 = waitUntilReceived(5000);
+    channelNum = (channelNum < 4) ? (channelNum + 1) : 1;
 
-    if(range4 == "")
-        return;
+    Script.Start(MeasureScript);
+    stage = STAGE_SCRIPT;
 
-    command = F(":TRIG:EDG:LEV? ");
-    sendCommand(command);
-    edgeLevel = waitUntilReceived(5000);
+#endif
+    
+}
 
-    if(edgeLevel == "")
+// Called from loop() when neither the script nor the snapshot is busy
+void ScriptFinished()
+{
+    // The last message of the script may still be going out
+    if (stage != STAGE_NONE && !Usbtmc.IsIdle())
         return;
 
-    command = F(":CHAN1:SCAL 10");
-    sendCommand(command);
-
-    command = F(":CHAN2:SCAL 10");
-    sendCommand(command);
-
-    command = F(":CHAN3:SCAL 10");
-    sendCommand(command);
-
-    command = F(":CHAN4:SCAL 10");
-    sendCommand(command);
-
-    command = F(":CHAN1:OFFS 20");
-    sendCommand(command);
-
-    command = F(":CHAN2:OFFS 0");
-    sendCommand(command);
-
-    command = F(":CHAN3:OFFS -20");
-    sendCommand(command);
-
-    command = F(":CHAN4:OFFS -40");
-    sendCommand(command);
-
-    command = F(":CHAN1:SCAL");
-    command = command + " " + range1;
-    sendCommand(command);
-
-    command = F(":CHAN2:SCAL");
-    command = command + " " + range2;
-    sendCommand(command);
-
-    command = F(":CHAN3:SCAL");
-    command = command + " " + range3;
-    sendCommand(command);
-
-    command = F(":CHAN4:SCAL");
-    command = command + " " + range4;
-    sendCommand(command);
-
-    command = F(":TRIG:EDG:LEV");
-    command = command + " " + edgeLevel;
-    sendCommand(command);
-
-    digitalWrite(PIN_LED, HIGH);
-
-#elif defined MEASURE
-    String command;
-
-    digitalWrite(PIN_LED, LOW);
-    
-    switch(channelNum)
+    switch (stage)
     {
-        case 1:
-            command = F(":MEAS:SOUR CHAN1");
-            channelNum = 2;
-        break;
-        
-        case 2:
-            command = F(":MEAS:SOUR CHAN2");
-            channelNum = 3;
-        break;
-        
-        case 3:
-            command = F(":MEAS:SOUR CHAN3");
-            channelNum = 4;
-        break;
-        
-        case 4:
-            command = F(":MEAS:SOUR CHAN4");
-            channelNum = 1;
-        break;
-
-        defaule:
-            command = F(":MEAS:SOUR CHAN1");
-            channelNum = 1;
-        break;
+        case STAGE_CAPTURE:
+            if (Snapshot.IsValid())
+            {
+                Script.Start(ChannelScript);
+                stage = STAGE_SCRIPT;
+                return;
+            }
+
+            Serial.println(F("Snapshot failed"));
+            break;
+
+        case STAGE_SCRIPT:
+            if (Script.IsFailed())
+            {
+                Serial.print(F("Script failed at "));
+                Serial.println(Script.GetErrorOffset());
+            }
+
+            // The snapshot is valid only in CHANNEL
+            if (Snapshot.IsValid() && Snapshot.Restore())
+            {
+                stage = STAGE_RESTORE;
+                return;
+            }
+            break;
+
+        case STAGE_RESTORE:
+            if (Snapshot.IsFailed())
+                Serial.println(F("Restore failed"));
+            break;
+
+        default:
+            return;
     }
-    
-    sendCommand(command);
-
-    // Upload dummy settings -- begin
-    command = F(":MEAS:ITEM VMAX");
-    sendCommand(command);
-
-    command = F(":MEAS:ITEM VMIN");
-    sendCommand(command);
-
-    command = F(":MEAS:ITEM VTOP");
-    sendCommand(command);
-
-    command = F(":MEAS:ITEM VAMP");
-    sendCommand(command);
-    // Upload dummy settings -- end
-
-    // Upload actual settings
-    command = F(":MEAS:ITEM VRMS");
-    sendCommand(command);
-
-    command = F(":MEAS:ITEM VAVG");
-    sendCommand(command);
-
-    command = F(":MEAS:ITEM VPP");
-    sendCommand(command);
-
-    command = F(":MEAS:ITEM FREQ");
-    sendCommand(command);
-
-    command = F(":MEAS:ITEM PER");
-    sendCommand(command);
 
+    stage = STAGE_NONE;
     digitalWrite(PIN_LED, HIGH);
-
-#endif
-    
 }
@@ -0,0 +1,76 @@
+// Scripts for USBTMCScript, compiled on the PC with USBTMCHostLinux/usbtmc_scriptc:
+//   usbtmc_scriptc -j -n ChannelScript channel.txt
+//   usbtmc_scriptc -j -n MeasureScript measure.txt
+
+// Compiled by usbtmc_scriptc from channel.txt
+//
+//   # Shows every channel with the scale of 10 V and the offsets
+//   send :CHAN1:DISP ON
+//   send :CHAN2:DISP ON
+//   send :CHAN3:DISP ON
+//   send :CHAN4:DISP ON
+//   send :CHAN1:SCAL 10
+//   send :CHAN2:SCAL 10
+//   send :CHAN3:SCAL 10
+//   send :CHAN4:SCAL 10
+//   send :CHAN1:OFFS 20
+//   send :CHAN2:OFFS 0
+//   send :CHAN3:OFFS -20
+//   send :CHAN4:OFFS -40
+
+const uint8_t ChannelScript[] PROGMEM = {
+    0x01, 0x0E, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x31, 0x3A, 0x44, 0x49, 0x53,
+    0x50, 0x20, 0x4F, 0x4E, 0x01, 0x01, 0x3B, 0x01, 0x0E, 0x3A, 0x43, 0x48,
+    0x41, 0x4E, 0x32, 0x3A, 0x44, 0x49, 0x53, 0x50, 0x20, 0x4F, 0x4E, 0x01,
+    0x01, 0x3B, 0x01, 0x0E, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x33, 0x3A, 0x44,
+    0x49, 0x53, 0x50, 0x20, 0x4F, 0x4E, 0x01, 0x01, 0x3B, 0x01, 0x0E, 0x3A,
+    0x43, 0x48, 0x41, 0x4E, 0x34, 0x3A, 0x44, 0x49, 0x53, 0x50, 0x20, 0x4F,
+    0x4E, 0x03, 0x01, 0x0E, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x31, 0x3A, 0x53,
+    0x43, 0x41, 0x4C, 0x20, 0x31, 0x30, 0x01, 0x01, 0x3B, 0x01, 0x0E, 0x3A,
+    0x43, 0x48, 0x41, 0x4E, 0x32, 0x3A, 0x53, 0x43, 0x41, 0x4C, 0x20, 0x31,
+    0x30, 0x01, 0x01, 0x3B, 0x01, 0x0E, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x33,
+    0x3A, 0x53, 0x43, 0x41, 0x4C, 0x20, 0x31, 0x30, 0x01, 0x01, 0x3B, 0x01,
+    0x0E, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x34, 0x3A, 0x53, 0x43, 0x41, 0x4C,
+    0x20, 0x31, 0x30, 0x03, 0x01, 0x0E, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x31,
+    0x3A, 0x4F, 0x46, 0x46, 0x53, 0x20, 0x32, 0x30, 0x01, 0x01, 0x3B, 0x01,
+    0x0D, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x32, 0x3A, 0x4F, 0x46, 0x46, 0x53,
+    0x20, 0x30, 0x01, 0x01, 0x3B, 0x01, 0x0F, 0x3A, 0x43, 0x48, 0x41, 0x4E,
+    0x33, 0x3A, 0x4F, 0x46, 0x46, 0x53, 0x20, 0x2D, 0x32, 0x30, 0x01, 0x01,
+    0x3B, 0x01, 0x0F, 0x3A, 0x43, 0x48, 0x41, 0x4E, 0x34, 0x3A, 0x4F, 0x46,
+    0x46, 0x53, 0x20, 0x2D, 0x34, 0x30, 0x03, 0x00
+};
+
+// Compiled by usbtmc_scriptc from measure.txt
+//
+//   # r0 is the source, e.g. CHAN1
+//   send :MEAS:SOUR {r0}
+//   # Dummy items
+//   send :MEAS:ITEM VMAX
+//   send :MEAS:ITEM VMIN
+//   send :MEAS:ITEM VTOP
+//   send :MEAS:ITEM VAMP
+//   # Actual items
+//   send :MEAS:ITEM VRMS
+//   send :MEAS:ITEM VAVG
+//   send :MEAS:ITEM VPP
+//   send :MEAS:ITEM FREQ
+//   send :MEAS:ITEM PER
+
+const uint8_t MeasureScript[] PROGMEM = {
+    0x01, 0x0B, 0x3A, 0x4D, 0x45, 0x41, 0x53, 0x3A, 0x53, 0x4F, 0x55, 0x52,
+    0x20, 0x02, 0x00, 0x01, 0x01, 0x3B, 0x01, 0x0F, 0x3A, 0x4D, 0x45, 0x41,
+    0x53, 0x3A, 0x49, 0x54, 0x45, 0x4D, 0x20, 0x56, 0x4D, 0x41, 0x58, 0x01,
+    0x01, 0x3B, 0x01, 0x0F, 0x3A, 0x4D, 0x45, 0x41, 0x53, 0x3A, 0x49, 0x54,
+    0x45, 0x4D, 0x20, 0x56, 0x4D, 0x49, 0x4E, 0x03, 0x01, 0x0F, 0x3A, 0x4D,
+    0x45, 0x41, 0x53, 0x3A, 0x49, 0x54, 0x45, 0x4D, 0x20, 0x56, 0x54, 0x4F,
+    0x50, 0x01, 0x01, 0x3B, 0x01, 0x0F, 0x3A, 0x4D, 0x45, 0x41, 0x53, 0x3A,
+    0x49, 0x54, 0x45, 0x4D, 0x20, 0x56, 0x41, 0x4D, 0x50, 0x01, 0x01, 0x3B,
+    0x01, 0x0F, 0x3A, 0x4D, 0x45, 0x41, 0x53, 0x3A, 0x49, 0x54, 0x45, 0x4D,
+    0x20, 0x56, 0x52, 0x4D, 0x53, 0x01, 0x01, 0x3B, 0x01, 0x0F, 0x3A, 0x4D,
+    0x45, 0x41, 0x53, 0x3A, 0x49, 0x54, 0x45, 0x4D, 0x20, 0x56, 0x41, 0x56,
+    0x47, 0x03, 0x01, 0x0E, 0x3A, 0x4D, 0x45, 0x41, 0x53, 0x3A, 0x49, 0x54,
+    0x45, 0x4D, 0x20, 0x56, 0x50, 0x50, 0x01, 0x01, 0x3B, 0x01, 0x0F, 0x3A,
+    0x4D, 0x45, 0x41, 0x53, 0x3A, 0x49, 0x54, 0x45, 0x4D, 0x20, 0x46, 0x52,
+    0x45, 0x51, 0x01, 0x01, 0x3B, 0x01, 0x0E, 0x3A, 0x4D, 0x45, 0x41, 0x53,
+    0x3A, 0x49, 0x54, 0x45, 0x4D, 0x20, 0x50, 0x45, 0x52, 0x03, 0x00
+};
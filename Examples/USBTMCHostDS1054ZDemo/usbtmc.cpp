@@ -1,6 +1,6 @@
 /*
  * USBTMC class driver for USB Host Shield 2.0 Library
- * Copyright (c) 2019 Naoya Imai
+ * Copyright (c) 2022 Naoya Imai
  * 
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -17,12 +17,87 @@
  */
 #include "usbtmc.h"
 
+#define USBTMC_RCV_HEADER_SIZE 12
+#define USBTMC_DEFAULT_TIMEOUT 5000
+#define USBTMC_STRING_DESCRIPTOR_SIZE USBTMC_MESSAGE_SIZE
+
+#if USBTMC_USE_SERIAL_NUMBER
+// bLength tells more than the buffer took, e.g. a serial number of more than 31 characters.
+// Such a string is only a prefix and never identifies the device.
+static bool IsStringTruncated(const uint8_t *dataptr, uint8_t length)
+{
+    return (length > 0 && dataptr[0] > length);
+}
+#endif
+
+#if USBTMC_USE_PROFILES
+// Known instruments, only used when the sketch passes them to SetProfiles().
+// {VID, PID, timestep, max request size, quirks}
+// PID 0x0000 matches any product of the vendor, the first match wins.
+const USBTMCProfile USBTMCDefaultProfiles[] PROGMEM = {
+    {0x1AB1, 0x04CE, 10, 1024, USBTMC_QUIRK_TERMCHAR_IGNORED},                               // Rigol DS1000Z series
+    {0x1AB1, 0x0000, 10, 0, USBTMC_QUIRK_TERMCHAR_IGNORED},                                  // Rigol Technologies
+};
+const uint8_t USBTMCDefaultProfilesCount = sizeof(USBTMCDefaultProfiles) / sizeof(USBTMCDefaultProfiles[0]);
+#endif
+
+#if USBTMC_SHARED_PACKET_BUFFER
+// One packet buffer shared by every instance, Run() and Init() never overlap
+uint8_t USBTMC::packetBuffer[USBTMC_MESSAGE_SIZE];
+bool USBTMC::isPacketBufferBusy = false;
+#endif
+
 const uint8_t USBTMC::epDataInIndex = 1;
 const uint8_t USBTMC::epDataOutIndex = 2;
 const uint8_t USBTMC::epInterruptInIndex = 3;
 
-USBTMC::USBTMC(USB* p, USBTMCAsyncOper * pasync) : pAsync(pasync), pUsb(p), bAddress(0), bNumEP(1), bTag(1), CommandState(USBTMC_Idle)
+USBTMC::USBTMC(USB* p, USBTMCAsyncOper * pasync, uint16_t vid, uint16_t pid) : 
+    pAsync(pasync), pUsb(p), bAddress(0), bNumEP(1), isConnected(false), targetVID(vid), targetPID(pid), isRemoteEnabled(true), quirkFlags(0), isClearPending(false), bTag(1), rtb_bTag(2), commandState(USBTMCState::Idle), previousMillis(0), bin_current_size(0)
 {
+    baseConfig.timestepMillis = 0;
+    baseConfig.timeoutMillis = USBTMC_DEFAULT_TIMEOUT;
+    baseConfig.packetBudget = 1;
+    baseConfig.maxRequestSize = 0;
+    baseConfig.termChar = 0;
+    config = baseConfig;
+
+#if !USBTMC_SHARED_PACKET_BUFFER
+    isPacketBufferBusy = false;
+#endif
+#if USBTMC_USE_SERIAL_NUMBER
+    serialNumberDataPtr = NULL;
+    langID = 0;
+    langIDVID = 0;
+    langIDPID = 0;
+#endif
+#if USBTMC_USE_DEVICE_RULES
+    deviceRulesPtr = NULL;
+    deviceRulesCount = 0;
+    deviceRuleIndex = -1;
+#endif
+#if USBTMC_USE_SESSION
+    sessionPreamblePtr = NULL;
+    sessionOffset = 0;
+    sessionLineRemaining = 0;
+    isSessionPending = false;
+#endif
+#if USBTMC_USE_DEVICE_STORE
+    pStore = NULL;
+    isCachedConnection = false;
+    isDeviceKeyUnique = false;
+#endif
+#if USBTMC_USE_PROFILES
+    profilesPtr = NULL;
+    profilesCount = 0;
+#endif
+#if USBTMC_USE_LINE_MODE
+    lineTerminator = 0;
+    lineBuffer = NULL;
+    lineBufferSize = 0;
+    lineLength = 0;
+    isEndOfMessage = false;
+#endif
+
     for (uint8_t i = 0; i < USBTMC_MAX_ENDPOINTS; i++)
     {
         epInfo[i].epAddr = 0;
@@ -31,6 +106,7 @@ USBTMC::USBTMC(USB* p, USBTMCAsyncOper * pasync) : pAsync(pasync), pUsb(p), bAdd
         epInfo[i].bmRcvToggle = 0;
         epInfo[i].bmNakPower = (i == epDataInIndex) ? USB_NAK_NOWAIT : USB_NAK_MAX_POWER;
     }
+
     if (pUsb)
         pUsb->RegisterDeviceClass(this);
 }
@@ -46,6 +122,9 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
     EpInfo* oldep_ptr = NULL;
 
     uint8_t num_of_conf; // number of configurations
+    uint8_t* serialNumData;
+    uint8_t serialNumLength;
+    bool isCached;
 
     AddressPool & addrPool = pUsb->GetAddressPool();
 
@@ -77,6 +156,81 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
 
     if (rcode)
         goto FailGetDevDescr;
+    
+    if (targetVID != 0 || targetPID != 0)
+    {
+        if (udd->idVendor != targetVID || udd->idProduct != targetPID)
+        {
+            rcode = USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+            goto FailOnInit;
+        }
+    }
+
+    ApplyProfile(udd);
+
+    // Reject the device by VID/PID before spending any control transfer on the serial number
+    if (!IsDeviceRuleCandidate(udd))
+    {
+        rcode = USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+        goto FailOnInit;
+    }
+
+    serialNumData = NULL;
+    serialNumLength = 0;
+
+#if USBTMC_USE_SERIAL_NUMBER
+    // The descriptor is only needed until OnRcvdDescr() returns
+    serialNumData = packetBuffer;
+
+    // The language table is read again only for another kind of device
+    if (udd->idVendor != langIDVID || udd->idProduct != langIDPID)
+    {
+        langID = 0;
+        langIDVID = udd->idVendor;
+        langIDPID = udd->idProduct;
+    }
+
+    GetStringDescriptor(0, udd->iSerialNumber, serialNumData, &serialNumLength);
+
+    if (serialNumberDataPtr != NULL)
+    {
+        bool isValid = !IsStringTruncated(serialNumData, serialNumLength);
+        for (int i=0; i < serialNumLength; i++)
+        {
+            if (serialNumData[i] != pgm_read_byte(serialNumberDataPtr + i))
+            {
+                isValid = false;
+                break;
+            }
+        }
+
+        if (!isValid)
+        {
+            rcode = USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+            goto FailOnInit;
+        }
+    }
+#endif
+
+    rcode = MatchDeviceRule(udd, serialNumData, serialNumLength);
+
+    if (rcode)
+        goto FailOnInit;
+
+#if USBTMC_USE_DEVICE_STORE
+    deviceKey.vid = udd->idVendor;
+    deviceKey.pid = udd->idProduct;
+    deviceKey.serialHash = GetSerialNumberHash(serialNumData, serialNumLength);
+#if USBTMC_USE_SERIAL_NUMBER
+    // Devices which share the prefix of a long serial number would share the slot
+    isDeviceKeyUnique = !IsStringTruncated(serialNumData, serialNumLength);
+#else
+    isDeviceKeyUnique = true;
+#endif
+#endif
+
+    pAsync->OnRcvdDescr(udd, serialNumData, serialNumLength);
+
 
     // Allocate new address according to device class
     bAddress = addrPool.AllocAddress(parent, false, port);
@@ -115,7 +269,14 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
     if (rcode)
         goto FailSetDevTblEntry;
 
-    for (uint8_t i = 0; i < num_of_conf; i++)
+    // A known device skips the configuration descriptor and GET_CAPABILITIES round trips
+    isCached = LoadDeviceRecord();
+#if USBTMC_USE_DEVICE_STORE
+    isCachedConnection = isCached;
+#endif
+
+ReadConfiguration:
+    for (uint8_t i = 0; i < num_of_conf && !isCached; i++)
     {
         //USB Test and Measurement Device conforming to the USBTMC USB488 Subclass Specification found on www.usb.org.
         ConfigDescParser < USB_CLASS_APP_SPECIFIC, 0x03, 0x01, CP_MASK_COMPARE_ALL > confDescrParser(this);
@@ -138,37 +299,54 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
     // Set Configuration Value
     rcode = pUsb->setConf(bAddress, 0, bConfNum);
 
-    if (rcode)
-        goto FailSetConfDescr;
-
-    // USBTMC Get Capabilities
-    // bRequest = 0x07(7) GET_CAPABILITIES
-    // wValLo = 0x00
-    // wValHi = 0x00
-    // total, nbytes = 0x0018
-    rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0x07, 0x00, 0x00, 0x0000, 0x0018, 0x0018, (uint8_t*)&Capabilities, NULL);
+    if (rcode && isCached)
+    {
+        // The device has changed since it was stored, e.g. by a firmware update
+        DropDeviceRecord();
+        isCached = false;
+        bNumEP = 1;
+        goto ReadConfiguration;
+    }
 
     if (rcode)
-        goto FailOnInit;
+        goto FailSetConfDescr;
 
-    // Does the interface accept REN_CONTROL request?
-    if(Capabilities.USB488Interface & 0x02)
+    if (!isCached)
     {
-        // USBTMC REN_CONTROL
-        // bRequest = 0xA0(160) REN_CONTROL
-        // wValLo = 0x01 Assert REN.
-        // wValHi = 0x00 Reserved. Must be 0x00.
-        // total, nbytes = 0x0001
-        uint8_t usbtmc_status;
-        rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0xA0, 0x01, 0x00, 0x0000, 0x0001, 0x0001, &usbtmc_status, NULL);
+        rcode = GetCapabilities(&Capabilities);
 
         if (rcode)
             goto FailOnInit;
 
-        if (usbtmc_status != 0x01)
+        SaveDeviceRecord();
+    }
+
+    if (isRemoteEnabled)
+    {
+        rcode = RenControl(true);
+
+        if (rcode && isCached)
+        {
+            DropDeviceRecord();
+            isCached = false;
+            bNumEP = 1;
+            goto ReadConfiguration;
+        }
+
+        if (rcode)
             goto FailOnInit;
     }
 
+    isConnected = true;
+
+    // The quirky device is cleared and the session preamble is replayed from Run() once the device becomes idle
+    isClearPending = (quirkFlags & USBTMC_QUIRK_CLEAR_ON_INIT) ? true : false;
+#if USBTMC_USE_SESSION
+    isSessionPending = (sessionPreamblePtr != NULL);
+    sessionOffset = 0;
+    sessionLineRemaining = 0;
+#endif
+
     return 0;
 
 FailGetDevDescr:
@@ -205,269 +383,1259 @@ Fail:
     return rcode;
 }
 
-uint8_t USBTMC::Send(uint8_t nbytes, uint8_t* dataptr)
+#if USBTMC_USE_SERIAL_NUMBER
+uint8_t USBTMC::GetStringDescriptor(uint8_t addr, uint8_t idx, uint8_t* dataptr, uint8_t* datalen)
 {
-    uint8_t rcode = 0;
-    uint8_t* tmpptr = dataptr;
+    uint8_t rcode;
+
+    *datalen = 0;
 
-    CommandState = USBTMC_Idle;
-    for (uint8_t i = 0; i < nbytes; i++)
+    if (idx == 0)
+        return 0;   // the device has no such string
+
+    if (langID == 0)
     {
-        if (*tmpptr++ == '?')
+        // bLength, bDescriptorType and the first LANGID of the language table are enough
+        rcode = pUsb->getStrDescr(addr, 0, 4, 0, 0, dataptr);
+        if (rcode)
         {
-            CommandState = USBTMC_Request;
+            return rcode;
+        }
+
+        if (dataptr[0] < 4)
+        {
+            return USBTMC_ERR_UNEXPECTEDSIZE;
         }
-    }
 
-    rcode = BulkOut_Data(nbytes, dataptr);
+        langID = (dataptr[3] << 8) | dataptr[2];
+    }
 
+    // The device returns bLength bytes at most, so a single max-length read is enough
+    rcode = pUsb->getStrDescr(addr, 0, USBTMC_STRING_DESCRIPTOR_SIZE, idx, langID, dataptr);
     if (rcode)
     {
-        pAsync->OnError(F("USBTMC Error on Send: rcode="), false);
-        pAsync->OnError(String(rcode, HEX) + "h", true);
-        CommandState = USBTMC_Idle;
+        // The cached LANGID may not suit this device, read the table next time
+        langID = 0;
+        return rcode;
     }
 
+    *datalen = dataptr[ 0 ];
+    if (*datalen > USBTMC_STRING_DESCRIPTOR_SIZE)
+        *datalen = USBTMC_STRING_DESCRIPTOR_SIZE;
+
     return rcode;
 }
+#endif
 
-void USBTMC::Run()
+void USBTMC::ApplyProfile(USB_DEVICE_DESCRIPTOR* pdescr)
 {
-    uint8_t rcode = 0;
-    uint8_t status = 0;;
-    bool isFull = false;
-    uint8_t bmAbortBulkIn = 0;
-
-    switch (CommandState)
-    {
-        case USBTMC_Request:
-            rcode = BulkOut_Request(USBTMC_REQUEST_SIZE);
+    // Every connection starts from the configuration of the sketch
+    config = baseConfig;
+    quirkFlags = 0;
 
-            if (rcode)
-            {
-                CommandState = USBTMC_Idle;
-            }
-            else
-            {
-                WaitBeginMillis = millis();
-                CommandState = USBTMC_Receive;
-            }
-            break;
+#if USBTMC_USE_PROFILES
+    const USBTMCProfile* profiles = profilesPtr;
+    uint8_t count = profilesCount;
 
-        case USBTMC_Receive:
-            uint8_t buf[USBTMC_REQUEST_SIZE];
-            uint16_t rcvd;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        USBTMCProfile profile;
+        memcpy_P(&profile, &profiles[i], sizeof(USBTMCProfile));
 
-            for (int i = 0; i < USBTMC_REQUEST_SIZE; i++)
-                buf[i] = 0;
-            rcvd = USBTMC_REQUEST_SIZE;
+        if (profile.vid != pdescr->idVendor)
+            continue;
 
-            rcode = BulkIn(&rcvd, buf);
+        if (profile.pid != 0 && profile.pid != pdescr->idProduct)
+            continue;
 
-            if (rcode == hrNAK)
-            {
-                //Try again
-                unsigned long currentMillis;
-                currentMillis = millis();
-                if ((currentMillis - WaitBeginMillis) >= 5000)
-                {
-                    pAsync->OnError(F("USBTMC Timeout on Receive"), true);
-                    CommandState = USBTMC_InitiateAbortBulkIn;
-                }
-                
-            }
-            else if (rcode)
-            {
-                CommandState = USBTMC_Idle;
-            }
-            else
-            {
-                CommandState = USBTMC_Request;
-                for (uint16_t i = 0; i < rcvd; i++)
-                {
-                    if (pAsync->OnReceived(buf[i]))
-                    {
-                        CommandState = USBTMC_Idle;
-                        break;
-                    }
-                }
-            }
+        if (profile.timestepMillis > config.timestepMillis)
+            config.timestepMillis = profile.timestepMillis;
 
-            break;
+        if (profile.maxRequestSize != 0 && (config.maxRequestSize == 0 || profile.maxRequestSize < config.maxRequestSize))
+            config.maxRequestSize = profile.maxRequestSize;
 
-        case USBTMC_InitiateAbortBulkIn:
-            rcode = InitiateAbortBulkIn(&status);
+        quirkFlags = profile.quirks;
+        return;
+    }
+#else
+    (void)pdescr;
+#endif
+}
 
-            if (rcode)
-            {
-                CommandState = USBTMC_Idle;
-            }
-            else
-            {
-                if(status == 0x01)  // STATUS_SUCCESS
-                    CommandState = USBTMC_PurgingOnAbortBulkIn;
-                else if(status == 0x81)  // STATUS_TRANSFER_NOT_IN_PROGRESS
-                    CommandState = USBTMC_InitiateAbortBulkIn;
-                else
-                {
-                    pAsync->OnError(F("USBTMC Error on USBTMC_InitiateAbortBulkIn: status="), false);
-                    pAsync->OnError(String(status, HEX) + "h", true);
-                    CommandState = USBTMC_Idle;
-                }
-            }
+bool USBTMC::IsDeviceRuleCandidate(USB_DEVICE_DESCRIPTOR* pdescr)
+{
+#if USBTMC_USE_DEVICE_RULES
+    if (deviceRulesPtr == NULL)
+        return true;
 
-            break;
+    for (uint8_t i = 0; i < deviceRulesCount; i++)
+    {
+        uint16_t vid = pgm_read_word(&deviceRulesPtr[i].vid);
+        uint16_t pid = pgm_read_word(&deviceRulesPtr[i].pid);
 
-        case USBTMC_PurgingOnAbortBulkIn:
-            rcode = PurgeBulkIn(isFull);
+        if ((vid == 0 || vid == pdescr->idVendor) && (pid == 0 || pid == pdescr->idProduct))
+            return true;
+    }
 
-            if (rcode)
-            {
-                CommandState = USBTMC_Idle;
-            }
-            else
-            {
-                if(isFull)
-                    CommandState = USBTMC_PurgingOnAbortBulkIn;
-                else
-                    CommandState = USBTMC_CheckAbortBulkInStatus;
-            }
+    return false;
+#else
+    (void)pdescr;
+    return true;
+#endif
+}
 
-            break;
+#if USBTMC_USE_SERIAL_NUMBER
+bool USBTMC::IsSerialNumberMatched(const char* serialNumber, uint8_t* serialNumPtr, uint8_t serialNumLen)
+{
+    // string is UTF-16LE encoded, the first two bytes are bLength and bDescriptorType
+    uint8_t i = 2;
 
-        case USBTMC_CheckAbortBulkInStatus:
-            rcode = CheckAbortBulkInStatus(&status, &bmAbortBulkIn);
+    while (true)
+    {
+        char c = (char)pgm_read_byte(serialNumber++);
 
-            if (rcode)
-            {
-                CommandState = USBTMC_Idle;
-            }
-            else
-            {
-                if(status != 0x02)
-                    CommandState = USBTMC_Idle;
-                else
-                {
-                    // USBTMC_STATUS_PENDING
-                    if(bmAbortBulkIn & 0x01 == 0x01)
-                        CommandState = USBTMC_PurgingOnAbortBulkIn;
-                    else
-                        CommandState = USBTMC_CheckAbortBulkInStatus;
+        if (c == 0)
+            return (i >= serialNumLen && !IsStringTruncated(serialNumPtr, serialNumLen));
 
-                }
-            }
+        if ((i + 1) >= serialNumLen)
+            return false;
 
-            break;
+        if (serialNumPtr[i] != (uint8_t)c || serialNumPtr[i + 1] != 0x00)
+            return false;
 
-        default:
-            break;
+        i += 2;
     }
 }
+#endif
 
-bool USBTMC::IsIdle()
+uint8_t USBTMC::MatchDeviceRule(USB_DEVICE_DESCRIPTOR* pdescr, uint8_t* serialNumPtr, uint8_t serialNumLen)
 {
-    if (CommandState == USBTMC_Idle)
+#if USBTMC_USE_DEVICE_RULES
+    deviceRuleIndex = -1;
+
+    if (deviceRulesPtr == NULL)
+        return 0;
+
+    for (uint8_t i = 0; i < deviceRulesCount; i++)
     {
-        return true;
+        USBTMCDeviceRule rule;
+        memcpy_P(&rule, &deviceRulesPtr[i], sizeof(USBTMCDeviceRule));
+
+        if (rule.vid != 0 && rule.vid != pdescr->idVendor)
+            continue;
+
+        if (rule.pid != 0 && rule.pid != pdescr->idProduct)
+            continue;
+
+#if USBTMC_USE_SERIAL_NUMBER
+        if (rule.serialNumber != NULL && !IsSerialNumberMatched(rule.serialNumber, serialNumPtr, serialNumLen))
+            continue;
+#else
+        // The serial number is not read, such a rule never matches
+        if (rule.serialNumber != NULL)
+            continue;
+#endif
+
+        deviceRuleIndex = i;
+        UseConfig(rule.config);
+        return 0;
     }
-    else
+
+    return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+#else
+    (void)pdescr;
+    (void)serialNumPtr;
+    (void)serialNumLen;
+    return 0;
+#endif
+}
+
+#if USBTMC_USE_DEVICE_STORE
+uint16_t USBTMC::GetSerialNumberHash(uint8_t* serialNumPtr, uint8_t serialNumLen)
+{
+    // CRC-16/CCITT-FALSE
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t i = 0; i < serialNumLen; i++)
     {
-        return false;
+        crc ^= (uint16_t)serialNumPtr[i] << 8;
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
     }
+
+    return crc;
 }
+#endif
 
-void USBTMC::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto __attribute__((unused)), const USB_ENDPOINT_DESCRIPTOR* pep) {
-    ErrorMessage<uint8_t>(PSTR("Conf.Val"), conf);
-    ErrorMessage<uint8_t>(PSTR("Iface Num"), iface);
-    ErrorMessage<uint8_t>(PSTR("Alt.Set"), alt);
+bool USBTMC::LoadDeviceRecord()
+{
+#if USBTMC_USE_DEVICE_STORE
+    USBTMCDeviceRecord record;
 
-    bConfNum = conf;
+    if (pStore == NULL || !isDeviceKeyUnique)
+        return false;
 
-    uint8_t index;
+    if (!pStore->Load(deviceKey, &record))
+        return false;
 
-    if ((pep->bmAttributes & bmUSB_TRANSFER_TYPE) == USB_TRANSFER_TYPE_INTERRUPT && (pep->bEndpointAddress & 0x80) == 0x80)
-            index = epInterruptInIndex;
-    else if ((pep->bmAttributes & bmUSB_TRANSFER_TYPE) == USB_TRANSFER_TYPE_BULK)
-            index = ((pep->bEndpointAddress & 0x80) == 0x80) ? epDataInIndex : epDataOutIndex;
-    else
-            return;
+    if (record.bNumEP < 2 || record.bNumEP > USBTMC_MAX_ENDPOINTS)
+        return false;
 
-    // Fill in the endpoint info structure
-    epInfo[index].epAddr = (pep->bEndpointAddress & 0x0F);
-    epInfo[index].maxPktSize = (uint8_t)pep->wMaxPacketSize;
-    epInfo[index].bmSndToggle = 0;
-    epInfo[index].bmRcvToggle = 0;
+    Capabilities = record.capabilities;
+    bConfNum = record.bConfNum;
+    bNumEP = record.bNumEP;
 
-    bNumEP++;
+    for (uint8_t i = 1; i < USBTMC_MAX_ENDPOINTS; i++)
+    {
+        epInfo[i].epAddr = record.epAddr[i];
+        epInfo[i].maxPktSize = record.maxPktSize[i];
+        epInfo[i].bmSndToggle = 0;
+        epInfo[i].bmRcvToggle = 0;
+    }
 
-    PrintEndpointDescriptor(pep);
+    return true;
+#else
+    return false;
+#endif
 }
 
-uint8_t USBTMC::Release()
+void USBTMC::SaveDeviceRecord()
 {
-    uint8_t rcode = 0;
-
-    pUsb->GetAddressPool().FreeAddress(bAddress);
+#if USBTMC_USE_DEVICE_STORE
+    USBTMCDeviceRecord record;
 
-    bAddress = 0;
-    bNumEP = 1;
-    return rcode;
-}
+    if (pStore == NULL || !isDeviceKeyUnique)
+        return;
 
-uint8_t USBTMC::BulkOut_Data(uint8_t nbytes, uint8_t* dataptr)
-{
-#define RESERVED_SIZE 12
-#define DEV_MESSAGE_BEGIN RESERVED_SIZE
-    uint8_t message[USBTMC_COMMAND_SIZE + RESERVED_SIZE];
-    uint16_t messageSize = RESERVED_SIZE;
-    uint8_t rcode = 0;
+    record.capabilities = Capabilities;
+    record.bConfNum = bConfNum;
+    record.bNumEP = bNumEP;
 
-    if (nbytes > USBTMC_COMMAND_SIZE)
+    for (uint8_t i = 0; i < USBTMC_MAX_ENDPOINTS; i++)
     {
-        pAsync->OnError(F("USBTMC Error on BulkOut_Data: Message size must be less than USBTMC_COMMAND_SIZE"), true);
-        rcode = hrUNDEF;
-        return rcode;
+        record.epAddr[i] = epInfo[i].epAddr;
+        record.maxPktSize[i] = (uint8_t)epInfo[i].maxPktSize;
     }
 
-    messageSize += nbytes;
+    pStore->Save(deviceKey, &record);
+#endif
+}
 
-    //0:MsgID
-    message[0] = 0x01; //DEV_DEP_MSG_OUT
-    //1:bTag
-    message[1] = bTag;
-    //2:bTagInverse
-    message[2] = ~bTag;
-    //3:Reserved(0x00)
-    message[3] = 0x00;
-    //4,5,6,7:TransferSize
-    message[4] = nbytes;
-    message[5] = 0x00;
-    message[6] = 0x00;
-    message[7] = 0x00;
-    //8:bmTransfer Attributes
-    message[8] = 0x01; //(EOM is set)
-    //9,10,11:Reserved(0x00)
-    message[9] = 0x00;
-    message[10] = 0x00;
-    message[11] = 0x00;
+// A stored record which does not work any more is removed, the device is read again instead
+void USBTMC::DropDeviceRecord()
+{
+#if USBTMC_USE_DEVICE_STORE
+    if (pStore != NULL && isCachedConnection)
+        pStore->Remove(deviceKey);
 
-    //Device dependent message data bytes
-    for (uint16_t i = DEV_MESSAGE_BEGIN; i < messageSize; i++)
-        message[i] = *dataptr++;
+    isCachedConnection = false;
+#endif
+}
 
-    uint16_t quotient = messageSize / 4;
+#if USBTMC_USE_DEVICE_STORE
+void USBTMC::SetDeviceStore(USBTMCDeviceStore* store)
+{
+    pStore = store;
+}
 
-    if (messageSize > (quotient * 4))
-        quotient++;
+bool USBTMC::IsCachedConnection()
+{
+    return isCachedConnection;
+}
 
-    rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, (quotient * 4), &message[0]);
-    if (rcode)
+uint8_t USBTMC::ReadIdentity(char* dataptr, uint8_t size)
+{
+    if (pStore == NULL || !isConnected || !isDeviceKeyUnique)
+        return 0;
+
+    return pStore->LoadIdentity(deviceKey, dataptr, size);
+}
+
+void USBTMC::SaveIdentity(const char* identity)
+{
+    if (pStore == NULL || !isConnected || !isDeviceKeyUnique)
+        return;
+
+    // The slot may have been evicted since the device connected
+    SaveDeviceRecord();
+    pStore->SaveIdentity(deviceKey, identity);
+}
+#endif
+
+bool USBTMC::IsConnected()
+{
+    return isConnected;
+}
+
+void USBTMC::Clear()
+{
+    commandState = USBTMCState::InitiateClear;
+}
+
+#if USBTMC_USE_SERIAL_NUMBER
+void USBTMC::SetTargetSerialNumber(const uint8_t* serialNumPtr)
+{
+    serialNumberDataPtr = serialNumPtr;
+}
+#endif
+
+#if USBTMC_USE_SESSION
+void USBTMC::SetSessionPreamble(const char* script)
+{
+    sessionPreamblePtr = script;
+}
+#endif
+
+#if USBTMC_USE_LINE_MODE
+void USBTMC::SetLineMode(char terminator, char* buffer, uint16_t size)
+{
+    lineTerminator = terminator;
+    lineBuffer = (size > 0) ? buffer : NULL;
+    lineBufferSize = (lineBuffer != NULL) ? size : 0;
+    lineLength = 0;
+}
+#endif
+
+void USBTMC::SetRemoteEnable(bool enable)
+{
+    uint8_t rcode = 0;
+
+    isRemoteEnabled = enable;
+
+    if (!isConnected)
+        return;
+
+    rcode = RenControl(enable);
+
+    if (rcode)
+        pAsync->OnFailed(USBTMCInformation::RencontrolError, rcode);
+}
+
+#if USBTMC_USE_PROFILES
+void USBTMC::SetProfiles(const USBTMCProfile* profiles, uint8_t count)
+{
+    profilesPtr = profiles;
+    profilesCount = count;
+}
+#endif
+
+#if USBTMC_USE_DEVICE_RULES
+void USBTMC::SetDeviceRules(const USBTMCDeviceRule* rules, uint8_t count)
+{
+    deviceRulesPtr = rules;
+    deviceRulesCount = count;
+}
+
+int8_t USBTMC::GetDeviceRuleIndex()
+{
+    return deviceRuleIndex;
+}
+#endif
+
+void USBTMC::Request(int length)
+{
+    uint8_t rcode = 0;
+
+    if (!IsIdle())
+    {
+        pAsync->OnFailed(USBTMCInformation::RequestError, USBTMC_ERR_BUSY);
+        return;
+    }
+
+    if (config.maxRequestSize != 0 && (uint32_t)length > config.maxRequestSize)
+        length = (int)config.maxRequestSize;
+
+    rcode = BulkOutRequest((uint32_t)length);
+
+    if (rcode)
+    {
+        requestLength = 0;
+        pAsync->OnFailed(USBTMCInformation::RequestError, rcode);
+        return;
+    }
+
+    waitBeginMillis = millis();
+
+    requestLength = (uint32_t)length;
+    commandState = USBTMCState::ReceiveHeader;
+}
+
+void USBTMC::ReadStatusByte()
+{
+    uint8_t rcode = 0;
+
+    // USB488 READ_STATUS_BYTE
+    // bRequest = 0x80(128) READ_STATUS_BYTE
+    // wValLo = bTag.
+    // wValHi = 0x00 Reserved. Must be 0x00.
+    // total, nbytes = 0x0003
+    uint8_t response[3];
+    uint16_t wInd = 0x0000;
+    rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0x80, rtb_bTag, 0x0000, wInd, 0x0003, 0x0003, response, NULL);
+    last_rtb_bTag = rtb_bTag;
+    if (rcode)
+    {
+        pAsync->OnFailed(USBTMCInformation::ReadstatusbyteError, rcode);
+        return;
+    }
+
+    if (response[0] != 0x01)
+    {
+        pAsync->OnFailed(USBTMCInformation::ReadstatusbyteError, USBTMC_ERR_FAILED);
+        return;
+    }
+
+    rtb_bTag++;
+    if (rtb_bTag > 127)
+        rtb_bTag = 2;
+
+#if USBTMC_USE_INTERRUPT_EP
+    if(Capabilities.USB488Interface & 0x02)
+    {
+        uint8_t status;
+
+        rcode = ReadStatusByteFromInterruptEP(status, last_rtb_bTag);
+
+        if (rcode)
+        {
+            pAsync->OnFailed(USBTMCInformation::ReadstatusbyteError, rcode);
+        }
+        else
+        {
+            pAsync->OnReadStatusByte(status);
+        }
+
+    }
+    else
+#endif
+    {
+        pAsync->OnReadStatusByte(response[2]);
+    }
+
+}
+
+void USBTMC::Transmit(uint8_t nbytes, uint8_t* dataptr)
+{
+    if(!IsIdle())
+    {
+        pAsync->OnFailed(USBTMCInformation::TransmitError, USBTMC_ERR_BUSY);
+        return;
+    }
+
+    BeginTransmit(nbytes);
+
+    for(int i=0; i<nbytes; i++)
+    {
+        TransmitData(*dataptr++);
+        if(TransmitDone())
+            break;
+
+    }
+
+}
+
+void USBTMC::BeginTransmit(uint32_t total_size)
+{
+    bin_total_size = total_size;
+    bin_current_size = bin_total_size;
+    isSentHeader = false;
+}
+
+void USBTMC::TransmitData(uint8_t data)
+{
+    USBTMCState state = commandState;
+
+    // A failed send has already been reported and aborted
+    if(!TryTransmitData(data) && commandState == state)
+    {
+        bin_fifo.flush();
+        bin_current_size = 0;
+        if(isSentHeader)
+            commandState = USBTMCState::InitiateAbortBulkOut;
+        isSentHeader = false;
+        pAsync->OnFailed(USBTMCInformation::TransmitError, USBTMC_ERR_OVERFLOWED);
+    }
+}
+
+bool USBTMC::TryTransmitData(uint8_t data)
+{
+    USBTMCState state = commandState;
+    uint8_t rcode;
+
+    // Nothing beyond the size announced by BeginTransmit(), e.g. after an aborted transfer
+    if(bin_current_size <= 0)
+        return false;
+
+    if(bin_fifo.space() == 0)
+    {
+        // Make room by sending the pending packets
+        rcode = SendTransmitPackets();
+        if(rcode && rcode != hrNAK)
+            return false; // the transfer has been aborted
+
+        if(bin_fifo.space() == 0)
+            return false;
+    }
+
+    // The byte must not start a new message while an abort is pending
+    if(commandState != state)
+        return false;
+
+    bin_fifo.write(data);
+    bin_current_size--;
+
+    rcode = SendTransmitPackets();
+
+    return (rcode == 0 || rcode == hrNAK);
+}
+
+uint16_t USBTMC::TransmitData(const uint8_t *dataptr, uint16_t length)
+{
+    uint8_t rcode;
+    uint16_t accepted = 0;
+    uint16_t n;
+
+    // Nothing beyond the size announced by BeginTransmit()
+    if(bin_current_size < length)
+        length = (uint16_t)bin_current_size;
+
+    while(accepted < length)
+    {
+        n = bin_fifo.write(dataptr + accepted, length - accepted);
+
+        accepted += n;
+        bin_current_size -= n;
+
+        // Packets only go out when they are full or the message is complete
+        rcode = SendTransmitPackets();
+        if(rcode && rcode != hrNAK)
+            break; // the transfer has been aborted
+
+        // The device is busy and the FIFO is still full
+        if(n == 0)
+            break;
+    }
+
+    return accepted;
+}
+
+uint16_t USBTMC::TransmitSpaceAvailable()
+{
+    uint16_t space = bin_fifo.space();
+
+    if(bin_current_size < space)
+        space = (uint16_t)bin_current_size;
+
+    return space;
+}
+
+uint8_t USBTMC::SendTransmitPackets()
+{
+    // Sending from an OnReceived() handler, the packet buffer still holds the received data
+    if(isPacketBufferBusy)
+        return SendTransmitPacketsOnStack();
+
+    return SendTransmitPackets(packetBuffer);
+}
+
+// Kept out of line so that only the sends from a handler pay for the stack buffer
+__attribute__((noinline)) uint8_t USBTMC::SendTransmitPacketsOnStack()
+{
+    uint8_t buffer[USBTMC_MESSAGE_SIZE];
+
+    return SendTransmitPackets(buffer);
+}
+
+uint8_t USBTMC::SendTransmitPackets(uint8_t *buffer)
+{
+    uint8_t rcode = 0;
+    uint16_t max_packet_size;
+    uint16_t remain;
+
+    while(bin_fifo.available() > 0)
+    {
+        max_packet_size = epInfo[epDataOutIndex].maxPktSize;
+        if(max_packet_size > USBTMC_MESSAGE_SIZE)
+            max_packet_size = USBTMC_MESSAGE_SIZE;
+
+        if(!isSentHeader)
+            max_packet_size -= USBTMC_RCV_HEADER_SIZE;
+
+        remain = bin_fifo.available();
+        if(remain < max_packet_size)
+        {
+            if(bin_current_size <= 0)
+                max_packet_size = remain;
+            else
+                return rcode;
+        }
+
+        // The data stays in the FIFO until the device accepts the packet
+        if(isSentHeader)
+        {
+            bin_fifo.peek(buffer, max_packet_size);
+            rcode = BulkOutData(buffer, max_packet_size);
+        }
+        else
+        {
+            bin_fifo.peek(&buffer[USBTMC_RCV_HEADER_SIZE], max_packet_size);
+            rcode = BulkOutData(buffer, max_packet_size, bin_total_size);
+            if (!rcode)
+                isSentHeader = true;
+        }
+
+        if (rcode == hrNAK)
+        {
+            // The device is busy, try again on the next call
+            return rcode;
+        }
+        else if (rcode)
+        {
+            bin_fifo.flush();
+            bin_current_size = 0;
+            commandState = USBTMCState::InitiateAbortBulkOut;
+            isSentHeader = false;
+            DropDeviceRecord();
+            pAsync->OnFailed(USBTMCInformation::TransmitError, rcode);
+            return rcode;
+        }
+
+        bin_fifo.skip(max_packet_size);
+    }
+
+    if(bin_current_size <= 0)
+        isSentHeader = false;
+
+    return rcode;
+}
+
+bool USBTMC::TransmitDone()
+{
+    if(bin_current_size <= 0 && bin_fifo.available() == 0)
+        return true;
+    else
+        return false;
+}
+
+void USBTMC::AbortReceive()
+{
+    commandState = USBTMCState::InitiateAbortBulkIn;
+}
+
+void USBTMC::AbortTransmit()
+{
+    bin_fifo.flush();
+    bin_current_size = 0;
+    isSentHeader = false;
+    commandState = USBTMCState::InitiateAbortBulkOut;
+}
+
+void USBTMC::Run()
+{
+#define BUFFER_LENGTH USBTMC_MESSAGE_SIZE
+    uint8_t rcode = 0;
+    uint8_t status = 0;;
+#if USBTMC_USE_ABORT_CLEAR
+    uint8_t bmAbortBulkIn = 0;
+    bool isFull = false;
+#endif
+    uint16_t rcvd = BUFFER_LENGTH;
+    uint8_t* buf = packetBuffer;
+    uint32_t currentMillis;
+
+    USBTMCState state;
+
+    if (pUsb->getUsbTaskState() != USB_STATE_RUNNING) {
+        commandState = USBTMCState::Idle;
+        return;
+    }
+
+    currentMillis = millis();
+    if ((currentMillis - previousMillis) < config.timestepMillis)
+        return;
+
+    previousMillis = currentMillis;
+
+    switch (commandState)
+    {
+        case USBTMCState::Pause:
+            if(isResume == false)
+                commandState = resumedCommandState;
+
+            break;
+
+        case USBTMCState::ReceiveHeader:
+            uint32_t totalLength;
+            bool isEndOfMessage;
+            totalLength = requestLength;
+
+            rcode = BulkIn(&rcvd, buf, totalLength, isEndOfMessage);
+
+            if (rcode == hrNAK)
+            {
+                //Try again
+                currentMillis = millis();
+                if ((currentMillis - waitBeginMillis) >= config.timeoutMillis)
+                {
+                    pAsync->OnFailed(USBTMCInformation::ReceiveheaderNakAndTimeouted, 0);
+                    commandState = USBTMCState::InitiateAbortBulkIn;
+                }
+
+            }
+            else if (rcode)
+            {
+                DropDeviceRecord();
+                pAsync->OnFailed(USBTMCInformation::ReceiveheaderError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                waitBeginMillis = millis();
+
+                pAsync->OnTransferHeader(totalLength, isEndOfMessage);
+#if USBTMC_USE_LINE_MODE
+                this->isEndOfMessage = isEndOfMessage;
+#endif
+
+                if(requestLength > totalLength)
+                    requestLength = totalLength;
+
+                if(rcvd > requestLength)
+                    rcvd = requestLength;
+
+                DeliverPayload(&buf[USBTMC_RCV_HEADER_SIZE], rcvd);
+
+                requestLength -= rcvd;
+
+                if(requestLength > 0)
+                    commandState = USBTMCState::ReceivePayload;
+                else
+                {
+                    commandState = USBTMCState::Idle;
+                    EndTransfer();
+                }
+
+            }
+
+            break;
+
+        case USBTMCState::ReceivePayload:
+
+            for (uint8_t packet = 0; packet < config.packetBudget; packet++)
+            {
+                rcvd = BUFFER_LENGTH;
+                rcode = BulkIn(&rcvd, buf);
+
+                if (rcode == hrNAK)
+                {
+                    //Try again
+                    currentMillis = millis();
+                    if ((currentMillis - waitBeginMillis) >= config.timeoutMillis)
+                    {
+                        pAsync->OnFailed(USBTMCInformation::ReceivepayloadNakAndTimeouted, 0);
+                        commandState = USBTMCState::InitiateAbortBulkIn;
+                    }
+
+                }
+                else if (rcode)
+                {
+                    DropDeviceRecord();
+                    pAsync->OnFailed(USBTMCInformation::ReceivepayloadError, rcode);
+                    commandState = USBTMCState::Idle;
+                }
+                else
+                {
+                    waitBeginMillis = millis();
+
+                    if(rcvd > requestLength)
+                        rcvd = requestLength;
+
+                    DeliverPayload(buf, rcvd);
+
+                    requestLength -= rcvd;
+
+                    if(requestLength > 0)
+                        commandState = USBTMCState::ReceivePayload;
+                    else
+                    {
+                        commandState = USBTMCState::Idle;
+                        EndTransfer();
+                    }
+
+                }
+
+                if (rcode || commandState != USBTMCState::ReceivePayload)
+                    break;
+            }
+
+            break;
+
+#if USBTMC_USE_ABORT_CLEAR
+        case USBTMCState::InitiateAbortBulkOut:
+            rcode = InitiateAbortBulkOut(status);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::InitiateabortbulkoutError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(status == 0x01)  // STATUS_SUCCESS
+                    commandState = USBTMCState::CheckAbortBulkOutStatus;
+                else
+                {
+                    pAsync->OnFailed(USBTMCInformation::InitiateabortbulkoutFailed, status);
+                    commandState = USBTMCState::Idle;
+                }
+            }
+
+            break;
+
+        case USBTMCState::CheckAbortBulkOutStatus:
+            rcode = CheckAbortBulkOutStatus(status);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::CheckabortbulkoutstatusError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(status != 0x02)  // Not STATUS_PENDING
+                    commandState = USBTMCState::ClearFeature;
+            }
+
+            break;
+
+        case USBTMCState::InitiateAbortBulkIn:
+            rcode = InitiateAbortBulkIn(status);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::InitiateabortbulkinError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(status == 0x01)  // STATUS_SUCCESS
+                    commandState = USBTMCState::ReadingByAbortBulkIn;
+                else
+                {
+                    pAsync->OnFailed(USBTMCInformation::InitiateabortbulkinFailed, status);
+                    commandState = USBTMCState::Idle;
+                }
+            }
+
+            break;
+
+        case USBTMCState::ReadingByAbortBulkIn:
+            rcode = PurgeBulkIn(isFull);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::ReadingbyabortbulkinError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(isFull)
+                    commandState = USBTMCState::ReadingByAbortBulkIn;
+                else
+                    commandState = USBTMCState::CheckAbortBulkInStatus;
+            }
+
+            break;
+
+        case USBTMCState::CheckAbortBulkInStatus:
+            rcode = CheckAbortBulkInStatus(status, bmAbortBulkIn);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::CheckabortbulkinstatusError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(status != 0x02)  // Not STATUS_PENDING
+                {
+                    pAsync->OnFailed(USBTMCInformation::AbortbulkinSucceed, 0);
+                    commandState = USBTMCState::Idle;
+                 }
+                else
+                {
+                    if(bmAbortBulkIn & 0x01 == 0x01)
+                        commandState = USBTMCState::ReadingByAbortBulkIn;
+                    else
+                        commandState = USBTMCState::CheckAbortBulkInStatus;
+
+                }
+            }
+
+            break;
+
+        case USBTMCState::InitiateClear:
+            rcode = InitiateClear(status);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::InitiateclearError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(status == 0x01)  // STATUS_SUCCESS
+                    commandState = USBTMCState::CheckClearStatus;
+                else
+                {
+                    pAsync->OnFailed(USBTMCInformation::InitiateclearFailed, status);
+                    commandState = USBTMCState::Idle;
+                }
+            }
+
+            break;
+
+        case USBTMCState::CheckClearStatus:
+            rcode = CheckClearStatus(status, bmAbortBulkIn);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::CheckclearstatusError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(status != 0x02)  // Not STATUS_PENDING
+                    commandState = USBTMCState::ClearFeature;
+                else
+                {
+                    if(bmAbortBulkIn & 0x01 == 0x01)
+                        commandState = USBTMCState::ReadingByInitiateClear;
+                    else
+                        commandState = USBTMCState::CheckClearStatus;
+
+                }
+            }
+
+            break;
+
+        case USBTMCState::ReadingByInitiateClear:
+            rcode = PurgeBulkIn(isFull);
+
+            if (rcode)
+            {
+                pAsync->OnFailed(USBTMCInformation::ReadingbyinitiateclearError, rcode);
+                commandState = USBTMCState::Idle;
+            }
+            else
+            {
+                if(isFull)
+                    commandState = USBTMCState::ReadingByInitiateClear;
+                else
+                    commandState = USBTMCState::CheckClearStatus;
+            }
+
+            break;
+
+        case USBTMCState::ClearFeature:
+            // The Host must send a CLEAR_FEATURE request to clear the Bulk-OUT Halt.
+            ClearFeature(epDataOutIndex);
+
+            if (rcode)
+                pAsync->OnFailed(USBTMCInformation::ClearfeatureError, rcode);
+            else
+                pAsync->OnFailed(USBTMCInformation::ClaerSucceed, 0);
+
+            commandState = USBTMCState::Idle;
+
+            break;
+#else
+        case USBTMCState::InitiateAbortBulkOut:
+        case USBTMCState::CheckAbortBulkOutStatus:
+        case USBTMCState::InitiateAbortBulkIn:
+        case USBTMCState::ReadingByAbortBulkIn:
+        case USBTMCState::CheckAbortBulkInStatus:
+        case USBTMCState::InitiateClear:
+        case USBTMCState::CheckClearStatus:
+        case USBTMCState::ReadingByInitiateClear:
+        case USBTMCState::ClearFeature:
+            // Without the abort and clear sequences the host just gives up the transfer
+            commandState = USBTMCState::Idle;
+
+            break;
+#endif
+
+        case USBTMCState::Idle:
+            if (bin_fifo.available() > 0)
+            {
+                // Retry the packets which the device refused
+                SendTransmitPackets();
+            }
+            else if (isClearPending)
+            {
+                isClearPending = false;
+                commandState = USBTMCState::InitiateClear;
+            }
+#if USBTMC_USE_SESSION
+            else if (isSessionPending)
+                commandState = USBTMCState::RestoreSession;
+#endif
+
+            break;
+
+#if USBTMC_USE_SESSION
+        case USBTMCState::RestoreSession:
+            if (!RestoreSessionLine())
+            {
+                isSessionPending = false;
+                commandState = USBTMCState::Idle;
+                pAsync->OnSessionRestored();
+            }
+            else if (commandState != USBTMCState::RestoreSession)
+            {
+                // The transmit failed and the abort sequence took over
+                isSessionPending = false;
+            }
+
+            break;
+#endif
+
+        default:
+            break;
+    }
+
+    if(isResume == true)
+    {
+        if(commandState != USBTMCState::Idle && commandState != USBTMCState::Pause )
+        {
+            resumedCommandState = commandState;
+            commandState = USBTMCState::Pause;
+        }
+        else
+        {
+            isResume = false;
+        }
+    }
+
+#undef BUFFER_LENGTH
+}
+
+bool USBTMC::IsIdle()
+{
+    // Packets refused by the device are still waiting in the FIFO
+    if (commandState == USBTMCState::Idle && bin_fifo.available() == 0)
+        return true;
+    else
+        return false;
+}
+
+bool USBTMC::IsPause()
+{
+    if (commandState == USBTMCState::Pause)
+        return true;
+    else
+        return false;
+}
+
+void USBTMC::Pause()
+{
+    isResume = true;
+}
+
+void USBTMC::Unpause()
+{
+    isResume = false;
+}
+
+void USBTMC::TimeStep(uint32_t value)
+{
+    baseConfig.timestepMillis = value;
+    config.timestepMillis = value;
+}
+
+void USBTMC::SetConfig(const USBTMCConfig &value)
+{
+    UseConfig(value);
+    baseConfig = config;
+}
+
+// Configuration of the current connection only
+void USBTMC::UseConfig(const USBTMCConfig &value)
+{
+    config = value;
+
+    if (config.packetBudget == 0)
+        config.packetBudget = 1;
+
+    if (config.timeoutMillis == 0)
+        config.timeoutMillis = USBTMC_DEFAULT_TIMEOUT;
+}
+
+const USBTMCConfig &USBTMC::GetConfig()
+{
+    return config;
+}
+
+void USBTMC::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto __attribute__((unused)), const USB_ENDPOINT_DESCRIPTOR* pep) {
+    bConfNum = conf;
+
+    uint8_t index;
+
+#if USBTMC_USE_INTERRUPT_EP
+    if ((pep->bmAttributes & bmUSB_TRANSFER_TYPE) == USB_TRANSFER_TYPE_INTERRUPT && (pep->bEndpointAddress & 0x80) == 0x80)
+            index = epInterruptInIndex;
+    else
+#endif
+    if ((pep->bmAttributes & bmUSB_TRANSFER_TYPE) == USB_TRANSFER_TYPE_BULK)
+            index = ((pep->bEndpointAddress & 0x80) == 0x80) ? epDataInIndex : epDataOutIndex;
+    else
+            return;
+
+    // Fill in the endpoint info structure
+    epInfo[index].epAddr = (pep->bEndpointAddress & 0x0F);
+    epInfo[index].maxPktSize = (uint8_t)pep->wMaxPacketSize;
+    epInfo[index].bmSndToggle = 0;
+    epInfo[index].bmRcvToggle = 0;
+
+    bNumEP++;
+}
+
+uint8_t USBTMC::Release()
+{
+    uint8_t rcode = 0;
+
+    pUsb->GetAddressPool().FreeAddress(bAddress);
+
+    isConnected = false;
+    bAddress = 0;
+    bNumEP = 1;
+    isClearPending = false;
+    quirkFlags = 0;
+    config = baseConfig;
+#if USBTMC_USE_DEVICE_RULES
+    deviceRuleIndex = -1;
+#endif
+#if USBTMC_USE_SESSION
+    isSessionPending = false;
+    sessionLineRemaining = 0;
+#endif
+#if USBTMC_USE_DEVICE_STORE
+    isCachedConnection = false;
+    isDeviceKeyUnique = false;
+#endif
+    return rcode;
+}
+
+#if USBTMC_USE_SESSION
+bool USBTMC::RestoreSessionLine()
+{
+    char c;
+
+    commandState = USBTMCState::RestoreSession;
+
+    if (sessionLineRemaining == 0)
+    {
+        // A line starts only after the device has taken the whole previous one
+        if (bin_fifo.available() > 0)
+        {
+            SendTransmitPackets();
+            return true;
+        }
+
+        const char* line = sessionPreamblePtr + sessionOffset;
+
+        // Skip empty lines
+        while ((c = (char)pgm_read_byte(line)) == '\n' || c == '\r')
+        {
+            line++;
+            sessionOffset++;
+        }
+
+        if (c == 0)
+            return false;
+
+        uint16_t length = 0;
+        while ((c = (char)pgm_read_byte(line + length)) != 0 && c != '\n' && c != '\r')
+            length++;
+
+        sessionLineRemaining = length + 1;
+        BeginTransmit(sessionLineRemaining);
+    }
+
+    // What the busy device can not take yet goes on the next call
+    while (sessionLineRemaining > 0)
+    {
+        c = (sessionLineRemaining > 1) ? (char)pgm_read_byte(sessionPreamblePtr + sessionOffset) : '\n';
+
+        bool isWritten = TryTransmitData((uint8_t)c);
+
+        if (commandState != USBTMCState::RestoreSession)
+        {
+            // The transmit failed and the abort sequence took over
+            sessionLineRemaining = 0;
+            return true;
+        }
+
+        if (!isWritten)
+            return true;
+
+        if (sessionLineRemaining > 1)
+            sessionOffset++;
+        sessionLineRemaining--;
+    }
+
+    return true;
+}
+#endif
+
+uint8_t USBTMC::BulkOutData(uint8_t* message, uint8_t nbytes, uint32_t totalbytes)
+{
+#define RESERVED_SIZE USBTMC_RCV_HEADER_SIZE
+    // The caller has put nbytes of data behind the header in message
+    uint16_t messageSize = RESERVED_SIZE;
+    uint8_t rcode = 0;
+
+    if (nbytes > (USBTMC_MESSAGE_SIZE - RESERVED_SIZE))
+    {
+        rcode = USBTMC_ERR_OVERFLOWED;
+        return rcode;
+    }
+
+    messageSize += nbytes;
+
+    if (messageSize > epInfo[epDataOutIndex].maxPktSize)
     {
-        pAsync->OnError(F("USBTMC Error on BulkOut_Data: rcode="), false);
-        pAsync->OnError(String(rcode, HEX) + "h", true);
+        rcode = USBTMC_ERR_OVERFLOWED;
         return rcode;
     }
 
+    //0:MsgID
+    message[0] = 0x01; //DEV_DEP_MSG_OUT
+    //1:bTag
+    message[1] = bTag;
+    //2:bTagInverse
+    message[2] = ~bTag;
+    //3:Reserved(0x00)
+    message[3] = 0x00;
+    //4,5,6,7:TransferSize
+    message[4] = (uint8_t)(totalbytes       & 0x000000FF);
+    message[5] = (uint8_t)(totalbytes >>  8 & 0x000000FF);
+    message[6] = (uint8_t)(totalbytes >> 16 & 0x000000FF);
+    message[7] = (uint8_t)(totalbytes >> 24 & 0x000000FF);
+    //8:bmTransfer Attributes
+    message[8] = 0x01; //(EOM is set)
+    //9,10,11:Reserved(0x00)
+    message[9] = 0x00;
+    message[10] = 0x00;
+    message[11] = 0x00;
+
+    messageSize = PadMessage(message, messageSize);
+
+    rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, messageSize, &message[0]);
+    if (rcode)
+        return rcode;
+
     last_bTag = bTag;
     bTag++;
     if(bTag == 0)
@@ -475,16 +1643,63 @@ uint8_t USBTMC::BulkOut_Data(uint8_t nbytes, uint8_t* dataptr)
         //The Host must set bTag such that 1<=bTag<=255.
         bTag = 1;
     }
-    
+
     return rcode;
 
-#undef DEV_MESSAGE_BEGIN
 #undef RESERVED_SIZE
 }
 
-uint8_t USBTMC::BulkOut_Request(uint8_t nbytes)
+uint8_t USBTMC::BulkOutData(uint8_t* message, uint8_t nbytes)
+{
+    // The caller has put nbytes of data at the head of message
+    uint16_t messageSize = 0;
+    uint8_t rcode = 0;
+
+    if (nbytes > USBTMC_MESSAGE_SIZE)
+    {
+        rcode = USBTMC_ERR_OVERFLOWED;
+        return rcode;
+    }
+
+    messageSize += nbytes;
+
+    if (messageSize > epInfo[epDataOutIndex].maxPktSize)
+    {
+        rcode = USBTMC_ERR_OVERFLOWED;
+        return rcode;
+    }
+
+    messageSize = PadMessage(message, messageSize);
+
+    rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, messageSize, &message[0]);
+
+    return rcode;
+
+}
+
+uint16_t USBTMC::PadMessage(uint8_t* message, uint16_t messageSize)
+{
+    if (quirkFlags & USBTMC_QUIRK_NO_PADDING)
+        return messageSize;
+
+    // The total number of bytes in a Bulk-OUT transfer must be a multiple of 4
+    while ((messageSize & 0x03) != 0 && messageSize < USBTMC_MESSAGE_SIZE)
+        message[messageSize++] = 0x00;
+
+    return messageSize;
+}
+
+bool USBTMC::IsTermCharSupported()
+{
+    if (quirkFlags & USBTMC_QUIRK_TERMCHAR_IGNORED)
+        return false;
+
+    return (Capabilities.USBTMCDevice & 0x01);
+}
+
+uint8_t USBTMC::BulkOutRequest(uint32_t nbytes)
 {
-#define MESSAGE_SIZE 12
+#define MESSAGE_SIZE USBTMC_RCV_HEADER_SIZE
     uint8_t message[MESSAGE_SIZE];
     uint16_t messageSize = MESSAGE_SIZE;
     uint8_t rcode = 0;
@@ -498,26 +1713,32 @@ uint8_t USBTMC::BulkOut_Request(uint8_t nbytes)
     //3:Reserved(0x00)
     message[3] = 0x00;
     //4,5,6,7:TransferSize
-    message[4] = nbytes;
-    message[5] = 0x00;
-    message[6] = 0x00;
-    message[7] = 0x00;
-    //8:bmTransfer Attributes
-    message[8] = 0x00; //D1 = 0 The device must ignore TermChar.
-    //9:TermChar
-    message[9] = 0x00; //If bmTransferAttributes.D1 = 0, the device must ignore this field.
+    message[4] = nbytes & 0xFF;
+    message[5] = ( nbytes >>  8 )& 0xFF;
+    message[6] = ( nbytes >> 16 )& 0xFF;
+    message[7] = ( nbytes >> 24 )& 0xFF;
+    if (config.termChar != 0 && IsTermCharSupported())
+    {
+        //8:bmTransfer Attributes
+        message[8] = 0x02; //D1 = 1 The device must end the transfer when TermChar is sent.
+        //9:TermChar
+        message[9] = (uint8_t)config.termChar;
+    }
+    else
+    {
+        //8:bmTransfer Attributes
+        message[8] = 0x00; //D1 = 0 The device must ignore TermChar.
+        //9:TermChar
+        message[9] = 0x00; //If bmTransferAttributes.D1 = 0, the device must ignore this field.
+    }
     //10,11:Reserved(0x00)
     message[10] = 0x00;
     message[11] = 0x00;
 
     rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, messageSize, &message[0]);
     if (rcode)
-    {
-        pAsync->OnError(F("USBTMC Error on BulkOut_Request: rcode="), false);
-        pAsync->OnError(String(rcode, HEX) + "h", true);
         return rcode;
-    }
-    
+
     last_bTag = bTag;
     bTag++;
     if(bTag == 0)
@@ -525,101 +1746,260 @@ uint8_t USBTMC::BulkOut_Request(uint8_t nbytes)
         //The Host must set bTag such that 1<=bTag<=255.
         bTag = 1;
     }
-    
+
     return rcode;
 
 #undef MESSAGE_SIZE
 }
 
-uint8_t USBTMC::BulkIn(uint16_t* bytes_rcvd, uint8_t* dataptr)
+
+void USBTMC::DeliverPayload(uint8_t* dataptr, uint16_t length)
 {
-#define EXPECTED_SIZE 12
+    // Keep the transmit path off the packet buffer while the handlers read it
+    isPacketBufferBusy = true;
 
-    uint8_t packet_size = epInfo[epDataInIndex].maxPktSize;
-    uint8_t message[packet_size];
-    uint16_t rcvd = packet_size;
-    uint8_t rcode = 0;
+#if USBTMC_USE_LINE_MODE
+    if (lineTerminator != 0)
+        DeliverLines(dataptr, length);
+    else
+#endif
+        pAsync->OnReceivedData(dataptr, length);
+
+    isPacketBufferBusy = false;
+}
 
-    rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &rcvd, message);
-    if (rcode == hrNAK)
+#if USBTMC_USE_LINE_MODE
+void USBTMC::DeliverLines(uint8_t* dataptr, uint16_t length)
+{
+    while (length > 0)
     {
-        *bytes_rcvd = 0;
-        return rcode;      
+        uint8_t* end = (uint8_t*)memchr(dataptr, lineTerminator, length);
+
+        if (end == NULL)
+        {
+            // The line continues in the next packet
+            AppendLine(dataptr, length);
+            return;
+        }
+
+        uint16_t chunk = (uint16_t)(end - dataptr);
+
+        if (lineLength == 0)
+        {
+            // The whole line is in this packet, hand it over in place
+            *end = '\0';
+            pAsync->OnLine((const char*)dataptr, chunk);
+        }
+        else if (lineBuffer == NULL)
+        {
+            // Without a line buffer a line spanning packets is dropped
+            lineLength = 0;
+        }
+        else
+        {
+            AppendLine(dataptr, chunk);
+            uint16_t lineSize = lineLength;
+            lineLength = 0;
+            pAsync->OnLine(lineBuffer, lineSize);
+        }
+
+        dataptr += chunk + 1;
+        length -= chunk + 1;
+    }
+}
+
+void USBTMC::AppendLine(const uint8_t* dataptr, uint16_t length)
+{
+    if (lineBuffer == NULL)
+    {
+        // Only remember that a line is in progress
+        lineLength = 1;
+        return;
+    }
+
+    // The line is truncated to fit the buffer
+    if (length > (lineBufferSize - 1) - lineLength)
+        length = (lineBufferSize - 1) - lineLength;
+
+    memcpy(&lineBuffer[lineLength], dataptr, length);
+    lineLength += length;
+    lineBuffer[lineLength] = '\0';
+}
+#endif
+
+void USBTMC::EndTransfer()
+{
+#if USBTMC_USE_LINE_MODE
+    // The last line of a message may come without the terminator
+    if (lineTerminator != 0 && isEndOfMessage && lineLength > 0)
+    {
+        uint16_t lineSize = lineLength;
+        lineLength = 0;
+
+        if (lineBuffer != NULL)
+            pAsync->OnLine(lineBuffer, lineSize);
     }
+#endif
+}
+
+uint8_t USBTMC::BulkIn(uint16_t* bytes_rcvd, uint8_t* dataptr, uint32_t &length, bool &isEndOfMessage)
+{
+    uint16_t rcvd = *bytes_rcvd;
+    uint8_t rcode = 0;
+
+    isEndOfMessage = false;
+
+    rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &rcvd, dataptr);
     if (rcode)
     {
-        pAsync->OnError(F("USBTMC Error on BulkIn: rcode="), false);
-        pAsync->OnError(String(rcode, HEX) + "h", true);
         *bytes_rcvd = 0;
         return rcode;
     }
 
-    if (rcvd < EXPECTED_SIZE)
+    if (rcvd < USBTMC_RCV_HEADER_SIZE)
     {
-        pAsync->OnError(F("USBTMC Error on BulkIn: Received unexpected size"), true);
         *bytes_rcvd = 0;
-        rcode = hrUNDEF;
+        rcode = USBTMC_ERR_UNEXPECTEDSIZE;
         return rcode;
     }
 
     uint32_t data_size;
 
     //4,5,6,7:TransferSize
-    data_size = message[7];
+    data_size = dataptr[7];
     data_size = data_size << 8;
-    data_size += message[6];
+    data_size += dataptr[6];
     data_size = data_size << 8;
-    data_size += message[5];
+    data_size += dataptr[5];
     data_size = data_size << 8;
-    data_size += message[4];
+    data_size += dataptr[4];
 
-    if (data_size > *bytes_rcvd)
-    {
-        pAsync->OnError(F("USBTMC Error on BulkIn: Received transferSize is overflow in packet"), true);
-        *bytes_rcvd = 0;
-        rcode = hrUNDEF;
-        return rcode;
-    }
+    length = data_size;
+
+    //8:bmTransferAttributes D0:EOM
+    isEndOfMessage = (dataptr[8] & 0x01) ? true : false;
+
+    *bytes_rcvd = rcvd - USBTMC_RCV_HEADER_SIZE;
+
+    return rcode;
+}
 
-    for (uint32_t i = 0; i < data_size; i++)
-        *dataptr++ = message[i + EXPECTED_SIZE];
+uint8_t USBTMC::BulkIn(uint16_t* bytes_rcvd, uint8_t* dataptr)
+{
+    uint8_t rcode = 0;
 
-    *bytes_rcvd = (uint8_t)data_size;
+    rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, bytes_rcvd, dataptr);
 
     return rcode;
 
-#undef EXPECTED_SIZE
 }
 
+#if USBTMC_USE_ABORT_CLEAR
 uint8_t USBTMC::PurgeBulkIn(bool &isFull)
 {
     uint8_t packet_size = epInfo[epDataInIndex].maxPktSize;
-    uint8_t message[packet_size];
-    uint16_t rcvd = packet_size;
+    uint16_t rcvd;
     uint8_t rcode = 0;
 
-    rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &rcvd, message);
+    if (packet_size > USBTMC_MESSAGE_SIZE)
+        packet_size = USBTMC_MESSAGE_SIZE;
+
+    rcvd = packet_size;
+
+    // The purged data is thrown away, so it can go to the packet buffer
+    rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &rcvd, packetBuffer);
     if (rcode)
-    {
-        pAsync->OnError(F("USBTMC Error on PurgeBulkIn: rcode=" ), false);
-        pAsync->OnError(String(rcode, HEX) + "h", true);
         return rcode;
-    }
 
     if (rcvd >= packet_size)
-    {
         isFull = true;
+    else
+        isFull = false;
+
+    return rcode;
+
+}
+#endif
+
+#if USBTMC_USE_INTERRUPT_EP
+uint8_t USBTMC::ReadStatusByteFromInterruptEP(uint8_t &status, uint8_t previous_btag)
+{
+    uint8_t rcode = 0;
+
+    status = 0;
+
+    uint8_t notify[2];
+    uint16_t rcvd;
+    rcvd = 2;
+
+    rcode = pUsb->inTransfer(bAddress, epInfo[epInterruptInIndex].epAddr, &rcvd, notify);
+    if (rcode)
+        return rcode;
+
+    if (rcvd != 2)
+    {
+        rcode = USBTMC_ERR_UNEXPECTEDSIZE;
+        return rcode;
     }
     else
     {
-        isFull = false;
+        uint8_t number = notify[0];
+        uint8_t res_btag = number & 0x7F;
+
+        if ((number & 0x80) == 0x80 &&
+            res_btag == previous_btag)           // The bTag value must be the same as the bTag value in the READ_STATUS_BYTE request.
+        {
+            status = notify[1];
+        }
+
     }
 
     return rcode;
+}
+#endif
+
+#if USBTMC_USE_ABORT_CLEAR
+uint8_t USBTMC::InitiateAbortBulkOut(uint8_t &status)
+{
+    uint8_t rcode = 0;
+
+    // USBTMC INITIATE ABORT BULKIN
+    // bRequest = 0x01(1) Initiate Abort BulkOut
+    // wValLo = bTag.
+    // wValHi = 0x00 Reserved. Must be 0x00.
+    // total, nbytes = 0x0002
+    uint8_t response[2];
+    uint16_t wInd = 0x80 + epInfo[epDataInIndex].epAddr;
+    rcode = pUsb->ctrlReq(bAddress, 0, (USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_ENDPOINT), 0x01, last_bTag, 0x00, wInd, 0x0002, 0x0002, response, NULL);
+    if (rcode)
+        return rcode;
+
+    status = response[0];
+
+    return rcode;
+}
+
+uint8_t USBTMC::CheckAbortBulkOutStatus(uint8_t &status)
+{
+    uint8_t rcode = 0;
+
+    // USBTMC INITIATE ABORT BULKIN
+    // bRequest = 0x02(2) CHECK ABORT BULKOUT STATUS
+    // wValLo = 0x00 Reserved. Must be 0x00.
+    // wValHi = 0x00 Reserved. Must be 0x00.
+    // total, nbytes = 0x0008
+    uint8_t response[8];
+    uint16_t wInd = 0x80 + epInfo[epDataInIndex].epAddr;
+    rcode = pUsb->ctrlReq(bAddress, 0, (USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_ENDPOINT), 0x02, 0x00, 0x00, wInd, 0x0008, 0x0008, response, NULL);
+    if (rcode)
+        return rcode;
+
+    status = response[0];
 
+    return rcode;
 }
 
-uint8_t USBTMC::InitiateAbortBulkIn(uint8_t* status)
+uint8_t USBTMC::InitiateAbortBulkIn(uint8_t &status)
 {
     uint8_t rcode = 0;
 
@@ -630,58 +2010,135 @@ uint8_t USBTMC::InitiateAbortBulkIn(uint8_t* status)
     // total, nbytes = 0x0002
     uint8_t response[2];
     uint16_t wInd = 0x80 + epInfo[epDataInIndex].epAddr;
-    rcode = pUsb->ctrlReq(bAddress, 0, (USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_INTERFACE), 0x03, last_bTag, 0x00, wInd, 0x0002, 0x0002, response, NULL);
+    rcode = pUsb->ctrlReq(bAddress, 0, (USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_ENDPOINT), 0x03, last_bTag, 0x00, wInd, 0x0002, 0x0002, response, NULL);
     if (rcode)
-    {
-        pAsync->OnError(F("USBTMC Error on InitiateAbortBulkIn: rcode="), false);
-        pAsync->OnError(String(rcode, HEX) + "h", true);
         return rcode;
-    }
 
-    *status = response[0];
+    status = response[0];
 
     return rcode;
 }
 
-uint8_t USBTMC::CheckAbortBulkInStatus(uint8_t* status, uint8_t* bmAbortBulkIn)
+uint8_t USBTMC::CheckAbortBulkInStatus(uint8_t &status, uint8_t &bmAbortBulkIn)
 {
     uint8_t rcode = 0;
 
     // USBTMC INITIATE ABORT BULKIN
     // bRequest = 0x04(4) CHECK ABORT BULKIN STATUS
-    // wValLo = bTag.
+    // wValLo = 0x00 Reserved. Must be 0x00.
     // wValHi = 0x00 Reserved. Must be 0x00.
     // total, nbytes = 0x0008
     uint8_t response[8];
     uint16_t wInd = 0x80 + epInfo[epDataInIndex].epAddr;
     rcode = pUsb->ctrlReq(bAddress, 0, (USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_ENDPOINT), 0x04, 0x00, 0x00, wInd, 0x0008, 0x0008, response, NULL);
     if (rcode)
-    {
-        pAsync->OnError(F("USBTMC Error on CheckAbortBulkInStatus: rcode="), false);
-        pAsync->OnError(String(rcode, HEX) + "h", true);
         return rcode;
-    }
 
-    *status = response[0];
-    *bmAbortBulkIn = response[1];
+    status = response[0];
+    bmAbortBulkIn = response[1];
+
+    return rcode;
+}
+
+uint8_t USBTMC::InitiateClear(uint8_t &status)
+{
+    uint8_t rcode = 0;
+
+    // USBTMC INITIATE CLEAR
+    // bRequest = 0x05(5) Initiate Clear
+    // wValLo = 0x00 Reserved. Must be 0x00.
+    // wValHi = 0x00 Reserved. Must be 0x00.
+    // total, nbytes = 0x0001
+    uint8_t response[1];
+    uint16_t wInd = 0x0000;
+    rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0x05, 0x00, 0x00, wInd, 0x0001, 0x0001, response, NULL);
+    if (rcode)
+        return rcode;
+
+    status = response[0];
+
+    return rcode;
+}
+
+uint8_t USBTMC::CheckClearStatus(uint8_t &status, uint8_t &bmAbortBulkIn)
+{
+    uint8_t rcode = 0;
+
+    // USBTMC CHECK_CLEAR_STATUS
+    // bRequest = 0x06(6) CHECK_CLEAR_STATUS
+    // wValLo = 0x00 Reserved. Must be 0x00.
+    // wValHi = 0x00 Reserved. Must be 0x00.
+    // total, nbytes = 0x0002
+    uint8_t response[2];
+    uint16_t wInd = 0x0000;
+    rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0x06, 0x00, 0x00, wInd, 0x0002, 0x0002, response, NULL);
+    if (rcode)
+        return rcode;
+
+    status = response[0];
+    bmAbortBulkIn = response[1];
+
+    return rcode;
+}
+#endif
+
+uint8_t USBTMC::RenControl(bool enable)
+{
+    uint8_t rcode = 0;
+
+    // Does the interface accept REN_CONTROL request?
+    if ((Capabilities.USB488Interface & 0x02) == 0)
+        return rcode;
+
+    // USB488 REN_CONTROL
+    // bRequest = 0xA0(160) REN_CONTROL
+    // wValLo = 0x01 Assert REN, 0x00 Deassert REN.
+    // wValHi = 0x00 Reserved. Must be 0x00.
+    // total, nbytes = 0x0001
+    uint8_t usbtmc_status;
+    rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0xA0, (enable ? 0x01 : 0x00), 0x00, 0x0000, 0x0001, 0x0001, &usbtmc_status, NULL);
+    if (rcode)
+        return rcode;
+
+    if (usbtmc_status != 0x01)
+        return USBTMC_ERR_FAILED;
 
     return rcode;
 }
 
-void USBTMC::PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR* ep_ptr)
+uint8_t USBTMC::GetCapabilities(USBTMCCapabilities* pCapabilities)
+{
+    uint8_t rcode = 0;
+
+    // USBTMC Get Capabilities
+    // bRequest = 0x07(7) GET_CAPABILITIES
+    // wValLo = 0x00
+    // wValHi = 0x00
+    // total, nbytes = 0x0018
+    uint16_t wInd = 0x0000;
+    return pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0x07, 0x00, 0x00, wInd, 0x0018, 0x0018, (uint8_t*)pCapabilities, NULL);
+}
+
+#if USBTMC_USE_ABORT_CLEAR
+uint8_t USBTMC::ClearFeature(uint8_t index)
 {
-    Notify(PSTR("Endpoint descriptor:"), 0x80);
-    Notify(PSTR("\r\nLength:\t\t"), 0x80);
-    D_PrintHex<uint8_t>(ep_ptr->bLength, 0x80);
-    Notify(PSTR("\r\nType:\t\t"), 0x80);
-    D_PrintHex<uint8_t>(ep_ptr->bDescriptorType, 0x80);
-    Notify(PSTR("\r\nAddress:\t"), 0x80);
-    D_PrintHex<uint8_t>(ep_ptr->bEndpointAddress, 0x80);
-    Notify(PSTR("\r\nAttributes:\t"), 0x80);
-    D_PrintHex<uint8_t>(ep_ptr->bmAttributes, 0x80);
-    Notify(PSTR("\r\nMaxPktSize:\t"), 0x80);
-    D_PrintHex<uint16_t>(ep_ptr->wMaxPacketSize, 0x80);
-    Notify(PSTR("\r\nPoll Intrv:\t"), 0x80);
-    D_PrintHex<uint8_t>(ep_ptr->bInterval, 0x80);
-    Notify(PSTR("\r\n"), 0x80);
+    uint8_t rcode = 0;
+
+    // CLEAR FEATURE
+    // bRequest = Clear Feature
+    // wVal as "Feature selector"
+    // wValLo = 0x00(0) USB_FEATURE_ENDPOINT_HALT
+    // wValHi = 0x00
+    // total, nbytes = 0x0000
+    uint16_t wInd = ((index == epDataInIndex) ? (0x80 | epInfo[index].epAddr) : epInfo[index].epAddr);
+    rcode = pUsb->ctrlReq(bAddress, 0, (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT), USB_REQUEST_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, 0, wInd, 0, 0, NULL, NULL);
+
+    if(rcode)
+        return rcode;
+    
+    epInfo[index].bmSndToggle = 0;
+    epInfo[index].bmRcvToggle = 0;
+
+    return 0;
 }
+#endif
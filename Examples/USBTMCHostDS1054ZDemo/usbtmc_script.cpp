@@ -0,0 +1,394 @@
+/*
+ * SCPI script interpreter for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_script.h"
+
+#define SCRIPT_STATE_IDLE       0
+#define SCRIPT_STATE_EXECUTE    1
+#define SCRIPT_STATE_TRANSMIT   2
+#define SCRIPT_STATE_REQUEST    3   // the query is out, the response is not requested yet
+#define SCRIPT_STATE_RECEIVE    4
+#define SCRIPT_STATE_STATUS     5
+#define SCRIPT_STATE_DELAY      6
+#define SCRIPT_STATE_DONE       7
+#define SCRIPT_STATE_FAILED     8
+
+#define SCRIPT_DEFAULT_TIMEOUT  5000
+#define SCRIPT_STATUS_INTERVAL  10
+// Operations per Task() without waiting, so that Run() is not held up by a long script
+#define SCRIPT_STEPS_PER_TASK   16
+
+USBTMCScript::USBTMCScript(USBTMC *pusbtmc, char *registers, uint8_t count, uint8_t size) :
+    pUsbtmc(pusbtmc), registers(registers), registerCount(count), registerSize(size)
+{
+    scriptPtr = NULL;
+    state = SCRIPT_STATE_IDLE;
+    timeout = SCRIPT_DEFAULT_TIMEOUT;
+    pc = 0;
+    opOffset = 0;
+
+    for (uint8_t i = 0; i < registerCount; i++)
+        Register(i)[0] = '\0';
+}
+
+char *USBTMCScript::Register(uint8_t index)
+{
+    return &registers[(uint16_t)index * registerSize];
+}
+
+void USBTMCScript::Start(const uint8_t *script)
+{
+    scriptPtr = script;
+    pc = 0;
+    opOffset = 0;
+    messageLength = 0;
+    isOverflowed = false;
+    isFailureReported = false;
+    state = SCRIPT_STATE_EXECUTE;
+}
+
+void USBTMCScript::Stop()
+{
+    if (state == SCRIPT_STATE_RECEIVE && !pUsbtmc->IsIdle())
+        pUsbtmc->AbortReceive();
+
+    state = SCRIPT_STATE_IDLE;
+}
+
+bool USBTMCScript::IsRunning()
+{
+    return (state != SCRIPT_STATE_IDLE && state != SCRIPT_STATE_DONE && state != SCRIPT_STATE_FAILED);
+}
+
+bool USBTMCScript::IsFailed()
+{
+    return (state == SCRIPT_STATE_FAILED);
+}
+
+uint16_t USBTMCScript::GetErrorOffset()
+{
+    return opOffset;
+}
+
+const char *USBTMCScript::GetRegister(uint8_t index)
+{
+    return (index < registerCount) ? Register(index) : "";
+}
+
+void USBTMCScript::SetRegister(uint8_t index, const char *text)
+{
+    if (index >= registerCount || registerSize == 0)
+        return;
+
+    strncpy(Register(index), text, registerSize - 1);
+    Register(index)[registerSize - 1] = '\0';
+}
+
+void USBTMCScript::SetTimeout(uint16_t value)
+{
+    timeout = value;
+}
+
+uint8_t USBTMCScript::ReadByte()
+{
+    return pgm_read_byte(scriptPtr + pc++);
+}
+
+uint16_t USBTMCScript::ReadWord()
+{
+    uint16_t value = ReadByte();
+
+    return value | ((uint16_t)ReadByte() << 8);
+}
+
+void USBTMCScript::Append(const char *text, uint8_t length, bool isProgmem)
+{
+    for (uint8_t i = 0; i < length; i++)
+    {
+        if (messageLength >= sizeof(message))
+        {
+            isOverflowed = true;
+            return;
+        }
+
+        message[messageLength++] = isProgmem ? (char)pgm_read_byte(text + i) : text[i];
+    }
+}
+
+// Compares the text which follows in the script, pc moves past it
+bool USBTMCScript::IsRegisterEqual(uint8_t index, uint8_t length)
+{
+    const char *text = (index < registerCount) ? Register(index) : "";
+    bool isEqual = true;
+
+    for (uint8_t i = 0; i < length; i++)
+    {
+        char c = (char)ReadByte();
+
+        if (isEqual && text[i] != c)
+            isEqual = false;
+    }
+
+    return isEqual && text[length] == '\0';
+}
+
+void USBTMCScript::Fail()
+{
+    if (state == SCRIPT_STATE_RECEIVE && !pUsbtmc->IsIdle())
+        pUsbtmc->AbortReceive();
+
+    state = SCRIPT_STATE_FAILED;
+}
+
+void USBTMCScript::BeginSend(int8_t reg)
+{
+    queryRegister = reg;
+    transmitOffset = 0;
+    waitBeginMillis = millis();
+
+    if (isOverflowed || messageLength + 1 > (int)sizeof(message))
+    {
+        Fail();
+        return;
+    }
+
+    message[messageLength++] = '\n';
+    state = SCRIPT_STATE_TRANSMIT;
+}
+
+// Returns false when the operation waits for the driver
+bool USBTMCScript::Step()
+{
+    uint8_t op;
+    uint8_t index;
+    uint8_t length;
+    uint16_t offset;
+    bool isEqual;
+
+    opOffset = pc;
+    op = ReadByte();
+
+    switch (op)
+    {
+        case USBTMC_SCRIPT_END:
+            state = SCRIPT_STATE_DONE;
+            return false;
+
+        case USBTMC_SCRIPT_TEXT:
+            length = ReadByte();
+            Append((const char *)scriptPtr + pc, length, true);
+            pc += length;
+            return true;
+
+        case USBTMC_SCRIPT_REGISTER:
+            index = ReadByte();
+            if (index < registerCount)
+                Append(Register(index), strlen(Register(index)), false);
+            return true;
+
+        case USBTMC_SCRIPT_SEND:
+            BeginSend(-1);
+            return false;
+
+        case USBTMC_SCRIPT_QUERY:
+            index = ReadByte();
+            BeginSend((index < registerCount) ? (int8_t)index : -1);
+            return false;
+
+        case USBTMC_SCRIPT_WAIT_STATUS:
+            statusMask = ReadByte();
+            waitMillis = ReadWord();
+            waitBeginMillis = millis();
+            isStatusReceived = false;
+            state = SCRIPT_STATE_STATUS;
+            return false;
+
+        case USBTMC_SCRIPT_DELAY:
+            waitMillis = ReadWord();
+            waitBeginMillis = millis();
+            state = SCRIPT_STATE_DELAY;
+            return false;
+
+        case USBTMC_SCRIPT_JUMP:
+            pc = ReadWord();
+            return true;
+
+        case USBTMC_SCRIPT_JUMP_IF_EQUAL:
+        case USBTMC_SCRIPT_JUMP_IF_NOT_EQUAL:
+            index = ReadByte();
+            length = ReadByte();
+            isEqual = IsRegisterEqual(index, length);
+            offset = ReadWord();
+
+            if (isEqual == (op == USBTMC_SCRIPT_JUMP_IF_EQUAL))
+                pc = offset;
+            return true;
+
+        default:
+            // Not a script or a newer one
+            Fail();
+            return false;
+    }
+}
+
+void USBTMCScript::Task()
+{
+    if (!IsRunning())
+        return;
+
+    if (isFailureReported)
+    {
+        Fail();
+        return;
+    }
+
+    for (uint8_t steps = 0; steps < SCRIPT_STEPS_PER_TASK; steps++)
+    {
+        switch (state)
+        {
+            case SCRIPT_STATE_EXECUTE:
+                if (!Step())
+                    break;
+                continue;
+
+            case SCRIPT_STATE_TRANSMIT:
+                if (transmitOffset == 0)
+                {
+                    if (!pUsbtmc->IsIdle())
+                        break;
+
+                    pUsbtmc->BeginTransmit(messageLength);
+                }
+
+                transmitOffset += pUsbtmc->TransmitData((const uint8_t *)message + transmitOffset, messageLength - transmitOffset);
+                if (transmitOffset < messageLength)
+                    break;
+
+                messageLength = 0;
+                state = (queryRegister >= 0) ? SCRIPT_STATE_REQUEST : SCRIPT_STATE_EXECUTE;
+                continue;
+
+            case SCRIPT_STATE_REQUEST:
+                if (!pUsbtmc->IsIdle() || !pUsbtmc->TransmitDone())
+                    break;
+
+                queryLength = 0;
+                Register(queryRegister)[0] = '\0';
+                isEndOfMessage = false;
+                state = SCRIPT_STATE_RECEIVE;
+                pUsbtmc->Request(USBTMC_SCRIPT_MESSAGE_SIZE);
+                break;
+
+            case SCRIPT_STATE_RECEIVE:
+                if (!pUsbtmc->IsIdle())
+                    break;
+
+                if (!isEndOfMessage)
+                {
+                    // The rest of a long response is drained, the register keeps its beginning
+                    pUsbtmc->Request(USBTMC_SCRIPT_MESSAGE_SIZE);
+                    break;
+                }
+
+                // Without the terminator
+                while (queryLength > 0 && (Register(queryRegister)[queryLength - 1] == '\n' || Register(queryRegister)[queryLength - 1] == '\r'))
+                    queryLength--;
+                Register(queryRegister)[queryLength] = '\0';
+
+                state = SCRIPT_STATE_EXECUTE;
+                continue;
+
+            case SCRIPT_STATE_STATUS:
+                if (isStatusReceived && (statusByte & statusMask))
+                {
+                    state = SCRIPT_STATE_EXECUTE;
+                    continue;
+                }
+
+                if (millis() - waitBeginMillis >= waitMillis)
+                {
+                    Fail();
+                    return;
+                }
+
+                // Polled at an interval, READ_STATUS_BYTE is a control transfer each time
+                if (!pUsbtmc->IsIdle() || (isStatusReceived && millis() - pollMillis < SCRIPT_STATUS_INTERVAL))
+                    break;
+
+                isStatusReceived = false;
+                pollMillis = millis();
+                pUsbtmc->ReadStatusByte();
+                break;
+
+            case SCRIPT_STATE_DELAY:
+                if (millis() - waitBeginMillis < waitMillis)
+                    break;
+
+                state = SCRIPT_STATE_EXECUTE;
+                continue;
+
+            default:
+                return;
+        }
+
+        break;
+    }
+
+    // A transfer which does not finish
+    if ((state == SCRIPT_STATE_TRANSMIT || state == SCRIPT_STATE_REQUEST || state == SCRIPT_STATE_RECEIVE) &&
+        millis() - waitBeginMillis >= timeout)
+    {
+        Fail();
+    }
+}
+
+void USBTMCScript::OnReceivedData(const uint8_t *dataptr, uint16_t length)
+{
+    if (state != SCRIPT_STATE_RECEIVE || queryRegister < 0)
+        return;
+
+    char *text = Register(queryRegister);
+
+    while (length > 0 && queryLength + 1 < registerSize)
+    {
+        text[queryLength++] = (char)*dataptr++;
+        length--;
+    }
+
+    text[queryLength] = '\0';
+}
+
+void USBTMCScript::OnTransferHeader(uint32_t transferSize __attribute__((unused)), bool isEndOfMessage)
+{
+    this->isEndOfMessage = isEndOfMessage;
+}
+
+void USBTMCScript::OnReadStatusByte(uint8_t status)
+{
+    statusByte = status;
+    isStatusReceived = true;
+}
+
+void USBTMCScript::OnFailed(USBTMCInformation info, uint8_t code __attribute__((unused)))
+{
+    if (!IsRunning())
+        return;
+
+    // The notices of a finished abort or clear are not failures
+    if (static_cast<int16_t>(info) < 0)
+        isFailureReported = true;
+}
@@ -0,0 +1,118 @@
+/*
+ * SCPI script interpreter for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_SCRIPT_H__)
+#define __USBTMC_SCRIPT_H__
+
+#include <stdint.h>
+
+// Bytecode of a script, all numbers are little endian.
+// Scripts are written as text and compiled on the PC (USBTMCHostLinux/usbtmc_scriptc).
+#define USBTMC_SCRIPT_END               0x00    //
+#define USBTMC_SCRIPT_TEXT              0x01    // length, text: appended to the message
+#define USBTMC_SCRIPT_REGISTER          0x02    // register: its text is appended to the message
+#define USBTMC_SCRIPT_SEND              0x03    // the message goes out with the terminator
+#define USBTMC_SCRIPT_QUERY             0x04    // register: as SEND, the response goes to the register
+#define USBTMC_SCRIPT_WAIT_STATUS       0x05    // mask, timeout(16): until the status byte has a bit of mask
+#define USBTMC_SCRIPT_DELAY             0x06    // milliseconds(16)
+#define USBTMC_SCRIPT_JUMP              0x07    // offset(16)
+#define USBTMC_SCRIPT_JUMP_IF_EQUAL     0x08    // register, length, text, offset(16)
+#define USBTMC_SCRIPT_JUMP_IF_NOT_EQUAL 0x09    // register, length, text, offset(16)
+
+#if !defined(__USBTMC_SCRIPT_OPCODES_ONLY__)
+
+#include "usbtmc.h"
+
+// Longest message, the text and the registers substituted in it
+#if !defined(USBTMC_SCRIPT_MESSAGE_SIZE)
+#define USBTMC_SCRIPT_MESSAGE_SIZE      64
+#endif
+
+// Runs a PROGMEM script on a USBTMC instance, one command right after the other.
+// Call Task() after Run() and forward the callbacks below from the USBTMCAsyncOper while it runs.
+//
+//   char registers[4][16];
+//   USBTMCScript script(&Usbtmc, registers[0], 4, 16);
+//   script.Start(ChannelScript);
+//   loop: Usb.Task(); Usbtmc.Run(); script.Task();
+class USBTMCScript
+{
+    USBTMC *pUsbtmc;
+    char *registers;
+    uint8_t registerCount;
+    uint8_t registerSize;
+
+    const uint8_t *scriptPtr;
+    uint16_t pc;
+    uint16_t opOffset;          // of the operation in progress, for the error report
+    uint8_t state;
+    uint16_t timeout;
+
+    char message[USBTMC_SCRIPT_MESSAGE_SIZE];
+    uint8_t messageLength;
+    uint8_t transmitOffset;
+    bool isOverflowed;
+
+    // Query and status in progress
+    int8_t queryRegister;
+    uint8_t queryLength;
+    bool isEndOfMessage;
+    bool isFailureReported;
+    uint8_t statusMask;
+    uint8_t statusByte;
+    bool isStatusReceived;
+    uint32_t waitBeginMillis;
+    uint32_t pollMillis;
+    uint16_t waitMillis;
+
+    uint8_t ReadByte();
+    uint16_t ReadWord();
+    char *Register(uint8_t index);
+    void Append(const char *text, uint8_t length, bool isProgmem);
+    bool IsRegisterEqual(uint8_t index, uint8_t length);
+    bool Step();
+    void BeginSend(int8_t reg);
+    void Fail();
+
+public:
+    USBTMCScript(USBTMC *pusbtmc, char *registers, uint8_t count, uint8_t size);
+
+    // The script is in PROGMEM
+    void Start(const uint8_t *script);
+    void Stop();
+    void Task();
+
+    bool IsRunning();
+    bool IsFailed();
+    // Offset of the operation which failed
+    uint16_t GetErrorOffset();
+
+    const char *GetRegister(uint8_t index);
+    void SetRegister(uint8_t index, const char *text);
+    // For each query and status wait, milliseconds
+    void SetTimeout(uint16_t value);
+
+    // Forward these from the USBTMCAsyncOper while the script runs
+    void OnReceivedData(const uint8_t *dataptr, uint16_t length);
+    void OnTransferHeader(uint32_t transferSize, bool isEndOfMessage);
+    void OnReadStatusByte(uint8_t status);
+    void OnFailed(USBTMCInformation info, uint8_t code);
+};
+
+#endif // __USBTMC_SCRIPT_OPCODES_ONLY__
+
+#endif // __USBTMC_SCRIPT_H__
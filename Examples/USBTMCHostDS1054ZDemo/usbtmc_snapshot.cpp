@@ -0,0 +1,432 @@
+/*
+ * Instrument state snapshot for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_snapshot.h"
+
+#define SNAPSHOT_STATE_IDLE         0
+#define SNAPSHOT_STATE_QUERY        1
+#define SNAPSHOT_STATE_REQUEST      2   // the query is out, the answer is not requested yet
+#define SNAPSHOT_STATE_RECEIVE      3
+#define SNAPSHOT_STATE_RESTORE      4
+#define SNAPSHOT_STATE_FLUSH        5   // the restore message is in the FIFO
+#define SNAPSHOT_STATE_FAILED       6
+
+// Parts of the message going out
+#define SNAPSHOT_PART_QUERY         0
+#define SNAPSHOT_PART_HEADER        1
+#define SNAPSHOT_PART_SPACE         2
+#define SNAPSHOT_PART_ANSWER        3
+#define SNAPSHOT_PART_SEPARATOR     4
+#define SNAPSHOT_PART_TERMINATOR    5
+#define SNAPSHOT_PART_END           6
+
+#define SNAPSHOT_DEFAULT_TIMEOUT    5000
+
+static const char LearnQuery[] PROGMEM = "*LRN?";
+static const uint8_t Space = ' ';
+static const uint8_t Separator = ';';
+static const uint8_t Terminator = '\n';
+
+USBTMCSnapshot::USBTMCSnapshot(USBTMC *pusbtmc, uint8_t *buffer, uint16_t size) :
+    pUsbtmc(pusbtmc), buffer(buffer), bufferSize(size)
+{
+    length = 0;
+    querySet = NULL;
+    state = SNAPSHOT_STATE_IDLE;
+    isValid = false;
+    timeout = SNAPSHOT_DEFAULT_TIMEOUT;
+}
+
+void USBTMCSnapshot::SetQuerySet(const __FlashStringHelper *queries)
+{
+    querySet = (const char *)queries;
+    length = 0;
+    isValid = false;
+}
+
+void USBTMCSnapshot::SetTimeout(uint16_t value)
+{
+    timeout = value;
+}
+
+bool USBTMCSnapshot::IsBusy()
+{
+    return (state != SNAPSHOT_STATE_IDLE && state != SNAPSHOT_STATE_FAILED);
+}
+
+bool USBTMCSnapshot::IsFailed()
+{
+    return (state == SNAPSHOT_STATE_FAILED);
+}
+
+bool USBTMCSnapshot::IsValid()
+{
+    return isValid;
+}
+
+const uint8_t *USBTMCSnapshot::GetData()
+{
+    return buffer;
+}
+
+uint16_t USBTMCSnapshot::GetLength()
+{
+    return length;
+}
+
+// Length of the answer at offset, up to the ';' which ends it
+uint16_t USBTMCSnapshot::AnswerLength(uint16_t offset)
+{
+    uint16_t i = offset;
+
+    while (i < length && buffer[i] != ';')
+    {
+        uint8_t c = buffer[i];
+
+        if (c == '"' || c == '\'')
+        {
+            // A doubled quote is two strings in a row
+            for (i++; i < length && buffer[i] != c; i++)
+                ;
+            i++;
+        }
+        else if (c == '#' && i + 1 < length && buffer[i + 1] >= '0' && buffer[i + 1] <= '9')
+        {
+            uint8_t digits = buffer[i + 1] - '0';
+            uint32_t size = 0;
+
+            // Indefinite length block, it runs to the end
+            if (digits == 0)
+                return length - offset;
+
+            for (uint8_t n = 0; n < digits && i + 2 + n < length; n++)
+                size = size * 10 + (buffer[i + 2 + n] - '0');
+
+            i = (uint32_t)i + 2 + digits + size < length ? i + 2 + digits + size : length;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    return ((i < length) ? i : length) - offset;
+}
+
+bool USBTMCSnapshot::Load(const uint8_t *dataptr, uint16_t length)
+{
+    if (IsBusy() || length > bufferSize)
+        return false;
+
+    if (dataptr != buffer)
+        memcpy(buffer, dataptr, length);
+    this->length = length;
+
+    // The answers must match the query set as after Capture()
+    uint16_t answers = 0;
+    uint16_t queries = 1;
+
+    for (uint16_t offset = 0; offset <= length; offset += AnswerLength(offset) + 1)
+        answers++;
+
+    if (querySet != NULL)
+    {
+        for (const char *p = querySet; pgm_read_byte(p) != '\0'; p++)
+        {
+            if (pgm_read_byte(p) == ';')
+                queries++;
+        }
+    }
+
+    isValid = (querySet == NULL || answers == queries);
+    state = SNAPSHOT_STATE_IDLE;
+    return isValid;
+}
+
+void USBTMCSnapshot::Rewind()
+{
+    segmentLength = 0;
+    queryOffset = 0;
+    answerOffset = 0;
+
+    if (state == SNAPSHOT_STATE_QUERY)
+        part = SNAPSHOT_PART_QUERY;
+    else
+        part = (querySet != NULL) ? SNAPSHOT_PART_HEADER : SNAPSHOT_PART_ANSWER;
+}
+
+// Moves to the next part of the message, false at the end
+bool USBTMCSnapshot::NextSegment()
+{
+    uint16_t begin;
+
+    isSegmentProgmem = false;
+
+    switch (part)
+    {
+        case SNAPSHOT_PART_QUERY:
+            segmentPtr = (const uint8_t *)((querySet != NULL) ? querySet : LearnQuery);
+            segmentLength = strlen_P((const char *)segmentPtr);
+            isSegmentProgmem = true;
+            part = SNAPSHOT_PART_TERMINATOR;
+            return true;
+
+        case SNAPSHOT_PART_HEADER:
+            while (pgm_read_byte(querySet + queryOffset) == ' ')
+                queryOffset++;
+
+            begin = queryOffset;
+            while (pgm_read_byte(querySet + queryOffset) != '?' && pgm_read_byte(querySet + queryOffset) != ';' &&
+                   pgm_read_byte(querySet + queryOffset) != '\0')
+                queryOffset++;
+
+            segmentPtr = (const uint8_t *)querySet + begin;
+            segmentLength = queryOffset - begin;
+            isSegmentProgmem = true;
+
+            // Past the ';' of this query
+            while (pgm_read_byte(querySet + queryOffset) != ';' && pgm_read_byte(querySet + queryOffset) != '\0')
+                queryOffset++;
+            if (pgm_read_byte(querySet + queryOffset) == ';')
+                queryOffset++;
+
+            part = SNAPSHOT_PART_SPACE;
+            return true;
+
+        case SNAPSHOT_PART_SPACE:
+            segmentPtr = &Space;
+            segmentLength = 1;
+            part = SNAPSHOT_PART_ANSWER;
+            return true;
+
+        case SNAPSHOT_PART_ANSWER:
+            if (querySet == NULL)
+            {
+                // *LRN? answers with the commands themselves
+                segmentPtr = buffer;
+                segmentLength = length;
+                part = SNAPSHOT_PART_TERMINATOR;
+                return true;
+            }
+
+            segmentPtr = buffer + answerOffset;
+            segmentLength = AnswerLength(answerOffset);
+            answerOffset += segmentLength + 1;
+
+            part = (pgm_read_byte(querySet + queryOffset) == '\0') ? SNAPSHOT_PART_TERMINATOR : SNAPSHOT_PART_SEPARATOR;
+            return true;
+
+        case SNAPSHOT_PART_SEPARATOR:
+            segmentPtr = &Separator;
+            segmentLength = 1;
+            part = SNAPSHOT_PART_HEADER;
+            return true;
+
+        case SNAPSHOT_PART_TERMINATOR:
+            segmentPtr = &Terminator;
+            segmentLength = 1;
+            part = SNAPSHOT_PART_END;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+uint32_t USBTMCSnapshot::MessageLength()
+{
+    uint32_t total = 0;
+
+    Rewind();
+    while (NextSegment())
+        total += segmentLength;
+
+    Rewind();
+    return total;
+}
+
+// Fills the FIFO of the driver, true when the whole message is in
+bool USBTMCSnapshot::Transmit()
+{
+    while (true)
+    {
+        if (segmentLength == 0)
+        {
+            if (!NextSegment())
+                return true;
+            continue;
+        }
+
+        if (isSegmentProgmem)
+        {
+            if (!pUsbtmc->TryTransmitData(pgm_read_byte(segmentPtr)))
+                return false;
+
+            segmentPtr++;
+            segmentLength--;
+        }
+        else
+        {
+            uint16_t accepted = pUsbtmc->TransmitData(segmentPtr, segmentLength);
+
+            segmentPtr += accepted;
+            segmentLength -= accepted;
+
+            if (segmentLength > 0)
+                return false;
+        }
+    }
+}
+
+bool USBTMCSnapshot::Capture()
+{
+    if (IsBusy() || !pUsbtmc->IsIdle())
+        return false;
+
+    length = 0;
+    isValid = false;
+    isOverflowed = false;
+    isFailureReported = false;
+
+    state = SNAPSHOT_STATE_QUERY;
+    pUsbtmc->BeginTransmit(MessageLength());
+    waitBeginMillis = millis();
+    return true;
+}
+
+bool USBTMCSnapshot::Restore()
+{
+    if (IsBusy() || !isValid || !pUsbtmc->IsIdle())
+        return false;
+
+    isFailureReported = false;
+
+    // One message with every setting
+    state = SNAPSHOT_STATE_RESTORE;
+    pUsbtmc->BeginTransmit(MessageLength());
+    waitBeginMillis = millis();
+    return true;
+}
+
+void USBTMCSnapshot::Fail()
+{
+    if (state == SNAPSHOT_STATE_RECEIVE && !pUsbtmc->IsIdle())
+        pUsbtmc->AbortReceive();
+
+    state = SNAPSHOT_STATE_FAILED;
+}
+
+void USBTMCSnapshot::Task()
+{
+    if (!IsBusy())
+        return;
+
+    if (isFailureReported || millis() - waitBeginMillis >= timeout)
+    {
+        Fail();
+        return;
+    }
+
+    switch (state)
+    {
+        case SNAPSHOT_STATE_QUERY:
+            if (Transmit())
+                state = SNAPSHOT_STATE_REQUEST;
+            break;
+
+        case SNAPSHOT_STATE_REQUEST:
+            if (!pUsbtmc->IsIdle() || !pUsbtmc->TransmitDone())
+                break;
+
+            isEndOfMessage = false;
+            state = SNAPSHOT_STATE_RECEIVE;
+            waitBeginMillis = millis();
+            pUsbtmc->Request(USBTMC_SNAPSHOT_REQUEST_SIZE);
+            break;
+
+        case SNAPSHOT_STATE_RECEIVE:
+            if (!pUsbtmc->IsIdle())
+                break;
+
+            if (!isEndOfMessage)
+            {
+                waitBeginMillis = millis();
+                pUsbtmc->Request(USBTMC_SNAPSHOT_REQUEST_SIZE);
+                break;
+            }
+
+            // A snapshot which does not fit is of no use
+            if (isOverflowed)
+            {
+                length = 0;
+                Fail();
+                break;
+            }
+
+            while (length > 0 && (buffer[length - 1] == '\n' || buffer[length - 1] == '\r'))
+                length--;
+
+            state = SNAPSHOT_STATE_IDLE;
+            if (!Load(buffer, length))
+                state = SNAPSHOT_STATE_FAILED;
+            break;
+
+        case SNAPSHOT_STATE_RESTORE:
+            if (Transmit())
+                state = SNAPSHOT_STATE_FLUSH;
+            break;
+
+        case SNAPSHOT_STATE_FLUSH:
+            if (pUsbtmc->IsIdle() && pUsbtmc->TransmitDone())
+                state = SNAPSHOT_STATE_IDLE;
+            break;
+
+        default:
+            break;
+    }
+}
+
+void USBTMCSnapshot::OnReceivedData(const uint8_t *dataptr, uint16_t length)
+{
+    if (state != SNAPSHOT_STATE_RECEIVE)
+        return;
+
+    if (this->length + length > bufferSize)
+    {
+        // The rest is drained
+        isOverflowed = true;
+        length = bufferSize - this->length;
+    }
+
+    memcpy(buffer + this->length, dataptr, length);
+    this->length += length;
+}
+
+void USBTMCSnapshot::OnTransferHeader(uint32_t transferSize __attribute__((unused)), bool isEndOfMessage)
+{
+    this->isEndOfMessage = isEndOfMessage;
+}
+
+void USBTMCSnapshot::OnFailed(USBTMCInformation info, uint8_t code __attribute__((unused)))
+{
+    if (!IsBusy())
+        return;
+
+    // The notices of a finished abort or clear are not failures
+    if (static_cast<int16_t>(info) < 0)
+        isFailureReported = true;
+}
@@ -0,0 +1,51 @@
+/*
+ * Arduino core subset for the Linux build of USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_LINUX_ARDUINO_H__)
+#define __USBTMC_LINUX_ARDUINO_H__
+
+// Just enough of the Arduino core to build the driver on Linux.
+// Flash memory is ordinary memory here, so the PROGMEM helpers are plain reads.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(PSTR(s)))
+
+inline bool isAscii(int c)
+{
+    return (c & ~0x7F) == 0;
+}
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+#endif // __USBTMC_LINUX_ARDUINO_H__
@@ -0,0 +1,300 @@
+/*
+ * USB Host Shield API subset for the Linux build of USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "Usb.h"
+#include "../usbfs_backend.h"
+
+#define USB_CONTROL_BUFFER_SIZE     1024
+#define USB_ATTACH_INTERVAL         500     // rescan cadence while nothing is attached
+#define USB_ERROR_RETRY_INTERVAL    2000    // an unsupported device is retried after this
+#define USB_TRANSFER_TIMEOUT        1000    // NAK power other than USB_NAK_NOWAIT
+
+static USBFSBackend defaultBackend;
+
+AddressPool::AddressPool()
+{
+    dev0ep.epAddr = 0;
+    dev0ep.maxPktSize = 8;
+    dev0ep.epAttribs = 0;
+    dev0ep.bmNakPower = USB_NAK_MAX_POWER;
+
+    for (uint8_t i = 0; i < USB_NUMDEVICES; i++)
+    {
+        devices[i].epinfo = (i == 0) ? &dev0ep : NULL;
+        devices[i].address = 0;
+        devices[i].epcount = (i == 0) ? 1 : 0;
+        devices[i].lowspeed = false;
+    }
+}
+
+UsbDevice *AddressPool::GetUsbDevicePtr(uint8_t addr)
+{
+    if (addr >= USB_NUMDEVICES)
+        return NULL;
+
+    if (addr != 0 && devices[addr].address == 0)
+        return NULL;
+
+    return &devices[addr];
+}
+
+uint8_t AddressPool::AllocAddress(uint8_t parent __attribute__((unused)), bool is_hub __attribute__((unused)), uint8_t port __attribute__((unused)))
+{
+    // The kernel has addressed the device already, there is only one device per USB instance
+    if (devices[1].address != 0)
+        return 0;
+
+    devices[1].address = 1;
+    devices[1].epinfo = &dev0ep;
+    devices[1].epcount = 1;
+    return 1;
+}
+
+void AddressPool::FreeAddress(uint8_t addr)
+{
+    if (addr == 0 || addr >= USB_NUMDEVICES)
+        return;
+
+    devices[addr].address = 0;
+    devices[addr].epinfo = NULL;
+    devices[addr].epcount = 0;
+}
+
+USB::USB() : pBackend(NULL), usbTaskState(USB_STATE_DETACHED), nextAttachMillis(0)
+{
+    for (uint8_t i = 0; i < USB_NUMDEVICECLASSES; i++)
+        devConfig[i] = NULL;
+}
+
+void USB::SetBackend(USBBackend *backend)
+{
+    pBackend = backend;
+}
+
+USBBackend *USB::GetBackend()
+{
+    return pBackend;
+}
+
+int USB::Init()
+{
+    if (pBackend == NULL)
+        pBackend = &defaultBackend;
+
+    usbTaskState = USB_STATE_DETACHED;
+    nextAttachMillis = millis();
+    return 0;
+}
+
+uint8_t USB::RegisterDeviceClass(USBDeviceConfig *pdev)
+{
+    for (uint8_t i = 0; i < USB_NUMDEVICECLASSES; i++)
+    {
+        if (devConfig[i] == NULL)
+        {
+            devConfig[i] = pdev;
+            return 0;
+        }
+    }
+
+    return USB_ERROR_UNABLE_TO_REGISTER_DEVICE_CLASS;
+}
+
+void USB::Task()
+{
+    if (pBackend == NULL)
+        return;
+
+    switch (usbTaskState)
+    {
+        case USB_STATE_DETACHED:
+            if ((int32_t)(millis() - nextAttachMillis) < 0)
+                return;
+
+            nextAttachMillis = millis() + USB_ATTACH_INTERVAL;
+
+            if (!pBackend->Attach())
+                return;
+
+            usbTaskState = USB_STATE_CONFIGURING;
+            // fall through
+
+        case USB_STATE_CONFIGURING:
+            for (uint8_t i = 0; i < USB_NUMDEVICECLASSES; i++)
+            {
+                if (devConfig[i] == NULL)
+                    continue;
+
+                if (devConfig[i]->Init(0, 0, false) == 0)
+                {
+                    usbTaskState = USB_STATE_RUNNING;
+                    return;
+                }
+            }
+
+            // Nobody wants the device
+            pBackend->Detach();
+            nextAttachMillis = millis() + USB_ERROR_RETRY_INTERVAL;
+            usbTaskState = USB_STATE_ERROR;
+            break;
+
+        case USB_STATE_RUNNING:
+            if (pBackend->IsAttached())
+            {
+                for (uint8_t i = 0; i < USB_NUMDEVICECLASSES; i++)
+                {
+                    if (devConfig[i])
+                        devConfig[i]->Poll();
+                }
+                break;
+            }
+
+            for (uint8_t i = 0; i < USB_NUMDEVICECLASSES; i++)
+            {
+                if (devConfig[i])
+                    devConfig[i]->Release();
+            }
+
+            pBackend->Detach();
+            nextAttachMillis = millis() + USB_ATTACH_INTERVAL;
+            usbTaskState = USB_STATE_DETACHED;
+            break;
+
+        case USB_STATE_ERROR:
+        default:
+            if ((int32_t)(millis() - nextAttachMillis) >= 0)
+                usbTaskState = USB_STATE_DETACHED;
+            break;
+    }
+}
+
+uint8_t USB::setEpInfoEntry(uint8_t addr, uint8_t epcount, EpInfo *eprecord_ptr)
+{
+    if (!eprecord_ptr)
+        return USB_ERROR_INVALID_ARGUMENT;
+
+    UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+
+    if (!p)
+        return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+
+    p->address = addr;
+    p->epinfo = eprecord_ptr;
+    p->epcount = epcount;
+
+    return 0;
+}
+
+uint8_t USB::ctrlReq(uint8_t addr __attribute__((unused)), uint8_t ep __attribute__((unused)), uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
+        uint16_t wInd, uint16_t total, uint16_t nbytes __attribute__((unused)), uint8_t *dataptr, USBReadParser *p)
+{
+    uint16_t transferred = 0;
+    uint8_t rcode;
+
+    if (pBackend == NULL)
+        return USB_ERROR_INVALID_ARGUMENT;
+
+    rcode = pBackend->ControlTransfer(bmReqType, bRequest, ((uint16_t)wValHi << 8) | wValLo, wInd, total, dataptr, &transferred);
+
+    if (!rcode && p && (bmReqType & USB_SETUP_DEVICE_TO_HOST))
+        p->Parse(transferred, dataptr, 0);
+
+    return rcode;
+}
+
+uint8_t USB::getDevDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *dataptr)
+{
+    return ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, 0x00, USB_DESCRIPTOR_DEVICE, 0x0000, nbytes, nbytes, dataptr, NULL);
+}
+
+uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t conf, uint8_t *dataptr)
+{
+    return ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, nbytes, nbytes, dataptr, NULL);
+}
+
+uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint8_t conf, USBReadParser *p)
+{
+    uint8_t buf[USB_CONTROL_BUFFER_SIZE];
+    USB_CONFIGURATION_DESCRIPTOR *ucd = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR *>(buf);
+    uint16_t total;
+    uint8_t rcode;
+
+    rcode = getConfDescr(addr, ep, sizeof(USB_CONFIGURATION_DESCRIPTOR), conf, buf);
+
+    if (rcode)
+        return rcode;
+
+    total = ucd->wTotalLength;
+    if (total > sizeof(buf))
+        total = sizeof(buf);
+
+    return ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, total, total, buf, p);
+}
+
+uint8_t USB::getStrDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t index, uint16_t langid, uint8_t *dataptr)
+{
+    return ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, index, USB_DESCRIPTOR_STRING, langid, nbytes, nbytes, dataptr, NULL);
+}
+
+uint8_t USB::setAddr(uint8_t oldaddr __attribute__((unused)), uint8_t ep __attribute__((unused)), uint8_t newaddr __attribute__((unused)))
+{
+    // The kernel has done it
+    return 0;
+}
+
+uint8_t USB::setConf(uint8_t addr __attribute__((unused)), uint8_t ep __attribute__((unused)), uint8_t conf_value)
+{
+    if (pBackend == NULL)
+        return USB_ERROR_INVALID_ARGUMENT;
+
+    return pBackend->SetConfiguration(conf_value);
+}
+
+uint8_t USB::Transfer(uint8_t addr, uint8_t ep, uint8_t *dataptr, uint16_t *nbytes, bool isIn)
+{
+    UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+    uint32_t timeout = USB_TRANSFER_TIMEOUT;
+
+    if (pBackend == NULL)
+        return USB_ERROR_INVALID_ARGUMENT;
+
+    if (!p || !p->epinfo)
+        return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+
+    for (uint8_t i = 0; i < p->epcount; i++)
+    {
+        if (p->epinfo[i].epAddr == ep)
+        {
+            // NOWAIT polls the endpoint, the data is not lost when it is not there yet
+            if (p->epinfo[i].bmNakPower == USB_NAK_NOWAIT)
+                timeout = 0;
+            break;
+        }
+    }
+
+    return pBackend->BulkTransfer(isIn ? (0x80 | ep) : ep, dataptr, nbytes, timeout);
+}
+
+uint8_t USB::inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t *data, uint8_t bInterval __attribute__((unused)))
+{
+    return Transfer(addr, ep, data, nbytesptr, true);
+}
+
+uint8_t USB::outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *data)
+{
+    return Transfer(addr, ep, data, &nbytes, false);
+}
@@ -0,0 +1,339 @@
+/*
+ * USB Host Shield API subset for the Linux build of USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_LINUX_USB_H__)
+#define __USBTMC_LINUX_USB_H__
+
+// The part of the USB Host Shield 2.0 API which USBTMC uses, with the same names and values,
+// running on a USBBackend instead of the MAX3421E.
+
+#include "Arduino.h"
+#include "../usb_backend.h"
+
+/* Host result codes */
+#define hrSUCCESS   0x00
+#define hrBUSY      0x01
+#define hrBADREQ    0x02
+#define hrUNDEF     0x03
+#define hrNAK       0x04
+#define hrSTALL     0x05
+#define hrTOGERR    0x06
+#define hrWRONGPID  0x07
+#define hrBADBC     0x08
+#define hrPIDERR    0x09
+#define hrPKTERR    0x0A
+#define hrCRCERR    0x0B
+#define hrKERR      0x0C
+#define hrJERR      0x0D
+#define hrTIMEOUT   0x0E
+#define hrBABBLE    0x0F
+
+/* USB task states */
+#define USB_STATE_DETACHED                      0x10
+#define USB_STATE_CONFIGURING                   0x80
+#define USB_STATE_RUNNING                       0x90
+#define USB_STATE_ERROR                         0xA0
+
+/* Common error codes */
+#define USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED       0xD1
+#define USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE     0xD2
+#define USB_ERROR_UNABLE_TO_REGISTER_DEVICE_CLASS       0xD3
+#define USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL          0xD4
+#define USB_ERROR_HUB_ADDRESS_OVERFLOW                  0xD5
+#define USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL             0xD6
+#define USB_ERROR_EPINFO_IS_NULL                        0xD7
+#define USB_ERROR_INVALID_ARGUMENT                      0xD8
+#define USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE         0xD9
+#define USB_ERROR_INVALID_MAX_PKT_SIZE                  0xDA
+#define USB_ERROR_EP_NOT_FOUND_IN_TBL                   0xDB
+#define USB_ERROR_TRANSFER_TIMEOUT                      0xFF
+
+/* NAK powers */
+#define USB_NAK_MAX_POWER       15
+#define USB_NAK_DEFAULT         14
+#define USB_NAK_NOWAIT          1
+#define USB_NAK_NONAK           0
+
+/* Setup packet */
+#define USB_SETUP_HOST_TO_DEVICE        0x00
+#define USB_SETUP_DEVICE_TO_HOST        0x80
+#define USB_SETUP_TYPE_STANDARD         0x00
+#define USB_SETUP_TYPE_CLASS            0x20
+#define USB_SETUP_TYPE_VENDOR           0x40
+#define USB_SETUP_RECIPIENT_DEVICE      0x00
+#define USB_SETUP_RECIPIENT_INTERFACE   0x01
+#define USB_SETUP_RECIPIENT_ENDPOINT    0x02
+#define USB_SETUP_RECIPIENT_OTHER       0x03
+
+#define bmREQ_GET_DESCR     (USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE)
+#define bmREQ_SET           (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE)
+#define bmREQ_CL_GET_INTF   (USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_INTERFACE)
+
+/* Standard requests */
+#define USB_REQUEST_GET_STATUS          0
+#define USB_REQUEST_CLEAR_FEATURE       1
+#define USB_REQUEST_SET_FEATURE         3
+#define USB_REQUEST_SET_ADDRESS         5
+#define USB_REQUEST_GET_DESCRIPTOR      6
+#define USB_REQUEST_SET_DESCRIPTOR      7
+#define USB_REQUEST_GET_CONFIGURATION   8
+#define USB_REQUEST_SET_CONFIGURATION   9
+
+#define USB_FEATURE_ENDPOINT_HALT       0
+
+/* Descriptor types */
+#define USB_DESCRIPTOR_DEVICE           0x01
+#define USB_DESCRIPTOR_CONFIGURATION    0x02
+#define USB_DESCRIPTOR_STRING           0x03
+#define USB_DESCRIPTOR_INTERFACE        0x04
+#define USB_DESCRIPTOR_ENDPOINT         0x05
+
+#define USB_CLASS_APP_SPECIFIC          0xFE
+
+#define bmUSB_TRANSFER_TYPE             0x03
+#define USB_TRANSFER_TYPE_CONTROL       0x00
+#define USB_TRANSFER_TYPE_ISOCHRONOUS   0x01
+#define USB_TRANSFER_TYPE_BULK          0x02
+#define USB_TRANSFER_TYPE_INTERRUPT     0x03
+
+#define CP_MASK_COMPARE_CLASS           1
+#define CP_MASK_COMPARE_SUBCLASS        2
+#define CP_MASK_COMPARE_PROTOCOL        4
+#define CP_MASK_COMPARE_ALL             7
+
+#define USB_NUMDEVICES  2   // the pseudo device at address 0 and the attached device
+#define USB_MAX_PACKET_SIZE 64  // packet size seen by the class drivers, as on the MAX3421E
+
+typedef struct {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} __attribute__((packed)) USB_DEVICE_DESCRIPTOR;
+
+typedef struct {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wTotalLength;
+    uint8_t bNumInterfaces;
+    uint8_t bConfigurationValue;
+    uint8_t iConfiguration;
+    uint8_t bmAttributes;
+    uint8_t bMaxPower;
+} __attribute__((packed)) USB_CONFIGURATION_DESCRIPTOR;
+
+typedef struct {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} __attribute__((packed)) USB_INTERFACE_DESCRIPTOR;
+
+typedef struct {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} __attribute__((packed)) USB_ENDPOINT_DESCRIPTOR;
+
+struct EpInfo {
+    uint8_t epAddr;
+    uint8_t maxPktSize;
+
+    union {
+        uint8_t epAttribs;
+
+        struct {
+            uint8_t bmSndToggle : 1;
+            uint8_t bmRcvToggle : 1;
+            uint8_t bmNakPower : 6;
+        } __attribute__((packed));
+    } __attribute__((packed));
+} __attribute__((packed));
+
+struct UsbDevice {
+    EpInfo *epinfo;
+    uint8_t address;
+    uint8_t epcount;
+    bool lowspeed;
+};
+
+class AddressPool {
+    EpInfo dev0ep;
+    UsbDevice devices[USB_NUMDEVICES];
+
+public:
+    AddressPool();
+
+    UsbDevice *GetUsbDevicePtr(uint8_t addr);
+    uint8_t AllocAddress(uint8_t parent, bool is_hub = false, uint8_t port = 0);
+    void FreeAddress(uint8_t addr);
+};
+
+class USBDeviceConfig {
+public:
+    virtual ~USBDeviceConfig() {};
+
+    virtual uint8_t Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+        return 0;
+    }
+
+    virtual uint8_t Release() {
+        return 0;
+    }
+
+    virtual uint8_t Poll() {
+        return 0;
+    }
+
+    virtual uint8_t GetAddress() {
+        return 0;
+    }
+};
+
+class UsbConfigXtracter {
+public:
+    virtual ~UsbConfigXtracter() {};
+
+    virtual void EndpointXtract(uint8_t conf __attribute__((unused)), uint8_t iface __attribute__((unused)), uint8_t alt __attribute__((unused)), uint8_t proto __attribute__((unused)), const USB_ENDPOINT_DESCRIPTOR *ep __attribute__((unused))) {
+    };
+};
+
+class USBReadParser {
+public:
+    virtual ~USBReadParser() {};
+
+    // The whole configuration descriptor in one piece
+    virtual void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset) = 0;
+};
+
+// Walks a configuration descriptor and hands the endpoints of the matching interfaces to the extractor
+template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
+class ConfigDescParser : public USBReadParser {
+    UsbConfigXtracter *theXtractor;
+
+public:
+    ConfigDescParser(UsbConfigXtracter *xtractor) : theXtractor(xtractor) {
+    };
+
+    void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset __attribute__((unused))) {
+        uint8_t confValue = 0;
+        bool isMatched = false;
+        const USB_INTERFACE_DESCRIPTOR *iface = NULL;
+
+        for (uint16_t i = 0; i + 2 <= len && pbuf[i] >= 2 && i + pbuf[i] <= len; i += pbuf[i]) {
+            switch (pbuf[i + 1]) {
+                case USB_DESCRIPTOR_CONFIGURATION:
+                    confValue = reinterpret_cast<const USB_CONFIGURATION_DESCRIPTOR *>(&pbuf[i])->bConfigurationValue;
+                    break;
+
+                case USB_DESCRIPTOR_INTERFACE:
+                    iface = reinterpret_cast<const USB_INTERFACE_DESCRIPTOR *>(&pbuf[i]);
+                    isMatched = true;
+                    if ((MASK & CP_MASK_COMPARE_CLASS) && iface->bInterfaceClass != CLASS_ID)
+                        isMatched = false;
+                    if ((MASK & CP_MASK_COMPARE_SUBCLASS) && iface->bInterfaceSubClass != SUBCLASS_ID)
+                        isMatched = false;
+                    if ((MASK & CP_MASK_COMPARE_PROTOCOL) && iface->bInterfaceProtocol != PROTOCOL_ID)
+                        isMatched = false;
+                    break;
+
+                case USB_DESCRIPTOR_ENDPOINT:
+                    if (isMatched && theXtractor) {
+                        USB_ENDPOINT_DESCRIPTOR ep;
+                        memcpy(&ep, &pbuf[i], sizeof(ep));
+
+                        // EpInfo holds 8-bit packet sizes, the backend splits high speed packets
+                        if (ep.wMaxPacketSize > USB_MAX_PACKET_SIZE)
+                            ep.wMaxPacketSize = USB_MAX_PACKET_SIZE;
+
+                        theXtractor->EndpointXtract(confValue, iface->bInterfaceNumber, iface->bAlternateSetting, iface->bInterfaceProtocol, &ep);
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    };
+};
+
+#define USB_NUMDEVICECLASSES 4
+
+class USB {
+    AddressPool addrPool;
+    USBDeviceConfig *devConfig[USB_NUMDEVICECLASSES];
+    USBBackend *pBackend;
+    uint8_t usbTaskState;
+    uint32_t nextAttachMillis;
+
+    uint8_t Transfer(uint8_t addr, uint8_t ep, uint8_t *dataptr, uint16_t *nbytes, bool isIn);
+
+public:
+    USB();
+
+    // The usbfs backend is used unless another one is set before Init()
+    void SetBackend(USBBackend *backend);
+    USBBackend *GetBackend();
+
+    int Init();
+    void Task();
+
+    uint8_t getUsbTaskState() {
+        return usbTaskState;
+    };
+
+    AddressPool &GetAddressPool() {
+        return addrPool;
+    };
+
+    uint8_t RegisterDeviceClass(USBDeviceConfig *pdev);
+
+    uint8_t setEpInfoEntry(uint8_t addr, uint8_t epcount, EpInfo *eprecord_ptr);
+
+    uint8_t getDevDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *dataptr);
+    uint8_t getConfDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t conf, uint8_t *dataptr);
+    uint8_t getConfDescr(uint8_t addr, uint8_t ep, uint8_t conf, USBReadParser *p);
+    uint8_t getStrDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t index, uint16_t langid, uint8_t *dataptr);
+    uint8_t setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr);
+    uint8_t setConf(uint8_t addr, uint8_t ep, uint8_t conf_value);
+
+    uint8_t ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
+            uint16_t wInd, uint16_t total, uint16_t nbytes, uint8_t *dataptr, USBReadParser *p);
+
+    uint8_t inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t *data, uint8_t bInterval = 0);
+    uint8_t outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *data);
+};
+
+#endif // __USBTMC_LINUX_USB_H__
@@ -0,0 +1,24 @@
+/*
+ * USB Host Shield API subset for the Linux build of USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_LINUX_USBHUB_H__)
+#define __USBTMC_LINUX_USBHUB_H__
+
+// Hubs are handled by the kernel
+#include "Usb.h"
+
+#endif // __USBTMC_LINUX_USBHUB_H__
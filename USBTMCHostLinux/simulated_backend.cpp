@@ -0,0 +1,601 @@
+/*
+ * Simulated USBTMC device for the Linux build of USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "simulated_backend.h"
+#include "shim/Usb.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+#define SIMULATED_VID               0x1209  // pid.codes test VID
+#define SIMULATED_PID               0x0001
+#define SIMULATED_PACKET_SIZE       64
+#define SIMULATED_EP_OUT            0x01
+#define SIMULATED_EP_IN             0x82
+#define SIMULATED_DEFAULT_POINTS    1200
+#define SIMULATED_MAX_POINTS        1000000
+
+#define STB_MAV                     0x10
+#define STB_ESB                     0x20
+
+static const uint8_t DeviceDescriptor[] = {
+    18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0x00, 0x00, 0x00, SIMULATED_PACKET_SIZE,
+    SIMULATED_VID & 0xFF, SIMULATED_VID >> 8, SIMULATED_PID & 0xFF, SIMULATED_PID >> 8,
+    0x00, 0x01, 1, 2, 3, 1
+};
+
+static const uint8_t ConfigurationDescriptor[] = {
+    9, USB_DESCRIPTOR_CONFIGURATION, 32, 0, 1, 1, 0, 0x80, 50,
+    9, USB_DESCRIPTOR_INTERFACE, 0, 0, 2, USB_CLASS_APP_SPECIFIC, 0x03, 0x01, 0,
+    7, USB_DESCRIPTOR_ENDPOINT, SIMULATED_EP_OUT, USB_TRANSFER_TYPE_BULK, SIMULATED_PACKET_SIZE, 0, 0,
+    7, USB_DESCRIPTOR_ENDPOINT, SIMULATED_EP_IN, USB_TRANSFER_TYPE_BULK, SIMULATED_PACKET_SIZE, 0, 0
+};
+
+static uint32_t ReadLE32(const uint8_t *dataptr)
+{
+    return dataptr[0] | ((uint32_t)dataptr[1] << 8) | ((uint32_t)dataptr[2] << 16) | ((uint32_t)dataptr[3] << 24);
+}
+
+// Upper case without the leading ':', so ":chan1:scal" and "CHAN1:SCAL" are the same setting
+static std::string Normalize(const std::string &header)
+{
+    std::string key;
+
+    for (size_t i = (header.size() > 0 && header[0] == ':') ? 1 : 0; i < header.size(); i++)
+        key += (char)toupper((unsigned char)header[i]);
+
+    return key;
+}
+
+static std::string Trim(const std::string &text)
+{
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    size_t end = text.find_last_not_of(" \t\r\n");
+
+    return (begin == std::string::npos) ? "" : text.substr(begin, end - begin + 1);
+}
+
+SimulatedBackend::SimulatedBackend(uint8_t unit) : unit(unit), isAttached(false)
+{
+    Reset();
+    settings.clear();
+    readingCount = 0;
+}
+
+void SimulatedBackend::Reset()
+{
+    command.clear();
+    outRemaining = 0;
+    isOutEndOfMessage = false;
+    output.clear();
+    isRequestPending = false;
+    inTransfer.clear();
+    inOffset = 0;
+    errors.clear();
+    eventStatus = 0;
+}
+
+bool SimulatedBackend::Attach()
+{
+    if (!isAttached)
+        Reset();
+
+    isAttached = true;
+    return true;
+}
+
+void SimulatedBackend::Detach()
+{
+    isAttached = false;
+}
+
+bool SimulatedBackend::IsAttached()
+{
+    return isAttached;
+}
+
+uint8_t SimulatedBackend::SetConfiguration(uint8_t conf __attribute__((unused)))
+{
+    return hrSUCCESS;
+}
+
+uint16_t SimulatedBackend::Descriptor(uint8_t type, uint8_t index, uint8_t *dataptr, uint16_t length)
+{
+    const uint8_t *source = NULL;
+    uint16_t size = 0;
+    uint8_t text[128];
+
+    if (type == USB_DESCRIPTOR_DEVICE)
+    {
+        source = DeviceDescriptor;
+        size = sizeof(DeviceDescriptor);
+    }
+    else if (type == USB_DESCRIPTOR_CONFIGURATION)
+    {
+        source = ConfigurationDescriptor;
+        size = sizeof(ConfigurationDescriptor);
+    }
+    else if (type == USB_DESCRIPTOR_STRING)
+    {
+        char ascii[32];
+
+        if (index == 0)
+        {
+            // English (United States)
+            text[2] = 0x09;
+            text[3] = 0x04;
+            size = 4;
+        }
+        else
+        {
+            if (index == 1)
+                snprintf(ascii, sizeof(ascii), "USBTMC-Host-Driver");
+            else if (index == 2)
+                snprintf(ascii, sizeof(ascii), "Simulated instrument");
+            else
+                snprintf(ascii, sizeof(ascii), "SIM%04u", unit);
+
+            // UTF-16LE
+            size = 2;
+            for (size_t i = 0; ascii[i] != '\0'; i++)
+            {
+                text[size++] = (uint8_t)ascii[i];
+                text[size++] = 0;
+            }
+        }
+
+        text[0] = (uint8_t)size;
+        text[1] = USB_DESCRIPTOR_STRING;
+        source = text;
+    }
+
+    if (source == NULL)
+        return 0;
+
+    if (size > length)
+        size = length;
+
+    memcpy(dataptr, source, size);
+    return size;
+}
+
+uint8_t SimulatedBackend::ControlTransfer(uint8_t bmReqType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex __attribute__((unused)), uint16_t wLength, uint8_t *dataptr, uint16_t *transferred)
+{
+    uint8_t response[24];
+    uint16_t size = 0;
+
+    *transferred = 0;
+
+    if (!isAttached)
+        return hrTIMEOUT;
+
+    memset(response, 0, sizeof(response));
+
+    switch (bmReqType & 0x7F)
+    {
+        case USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE:
+            if (bRequest == USB_REQUEST_GET_DESCRIPTOR)
+            {
+                *transferred = Descriptor(wValue >> 8, wValue & 0xFF, dataptr, wLength);
+                return (*transferred > 0) ? hrSUCCESS : hrSTALL;
+            }
+            return (bRequest == USB_REQUEST_SET_CONFIGURATION) ? hrSUCCESS : hrSTALL;
+
+        case USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT:
+            // CLEAR_FEATURE(ENDPOINT_HALT), nothing halts here
+            return (bRequest == USB_REQUEST_CLEAR_FEATURE) ? hrSUCCESS : hrSTALL;
+
+        case USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_INTERFACE:
+            response[0] = 0x01;     // STATUS_SUCCESS
+
+            switch (bRequest)
+            {
+                case 0x05:          // INITIATE_CLEAR
+                    Reset();
+                    size = 1;
+                    break;
+
+                case 0x06:          // CHECK_CLEAR_STATUS
+                    size = 2;
+                    break;
+
+                case 0x07:          // GET_CAPABILITIES
+                    response[2] = 0x00;     // bcdUSBTMC 1.00
+                    response[3] = 0x01;
+                    response[12] = 0x00;    // bcdUSB488 1.00
+                    response[13] = 0x01;
+                    response[14] = 0x04;    // USB488.2
+                    response[15] = 0x08;    // SCPI
+                    size = 24;
+                    break;
+
+                case 0x80:          // READ_STATUS_BYTE
+                    response[1] = wValue & 0xFF;
+                    response[2] = (output.empty() && inTransfer.empty() ? 0 : STB_MAV) | (eventStatus ? STB_ESB : 0);
+                    size = 3;
+                    break;
+
+                case 0xA0:          // REN_CONTROL
+                    size = 1;
+                    break;
+
+                default:
+                    return hrSTALL;
+            }
+            break;
+
+        case USB_SETUP_TYPE_CLASS | USB_SETUP_RECIPIENT_ENDPOINT:
+            response[0] = 0x01;
+
+            switch (bRequest)
+            {
+                case 0x01:          // INITIATE_ABORT_BULK_OUT
+                    command.clear();
+                    outRemaining = 0;
+                    response[1] = wValue & 0xFF;
+                    size = 2;
+                    break;
+
+                case 0x03:          // INITIATE_ABORT_BULK_IN
+                    output.clear();
+                    inTransfer.clear();
+                    isRequestPending = false;
+                    response[1] = wValue & 0xFF;
+                    size = 2;
+                    break;
+
+                case 0x02:          // CHECK_ABORT_BULK_OUT_STATUS
+                case 0x04:          // CHECK_ABORT_BULK_IN_STATUS
+                    size = 8;
+                    break;
+
+                default:
+                    return hrSTALL;
+            }
+            break;
+
+        default:
+            return hrSTALL;
+    }
+
+    if (size > wLength)
+        size = wLength;
+
+    memcpy(dataptr, response, size);
+    *transferred = size;
+    return hrSUCCESS;
+}
+
+uint8_t SimulatedBackend::BulkTransfer(uint8_t endpoint, uint8_t *dataptr, uint16_t *length, uint32_t timeoutMillis __attribute__((unused)))
+{
+    if (!isAttached)
+        return hrTIMEOUT;
+
+    if (endpoint == SIMULATED_EP_OUT)
+    {
+        uint16_t offset = 0;
+        uint32_t taken;
+
+        if (outRemaining == 0)
+        {
+            if (*length < 12)
+                return hrSTALL;
+
+            switch (dataptr[0])
+            {
+                case 0x01:          // DEV_DEP_MSG_OUT
+                    outRemaining = ReadLE32(dataptr + 4);
+                    isOutEndOfMessage = (dataptr[8] & 0x01) != 0;
+                    offset = 12;
+                    break;
+
+                case 0x02:          // REQUEST_DEV_DEP_MSG_IN
+                    isRequestPending = true;
+                    requestSize = ReadLE32(dataptr + 4);
+                    requestTag = dataptr[1];
+                    return hrSUCCESS;
+
+                default:
+                    return hrSTALL;
+            }
+        }
+
+        // The padding after the message is dropped
+        taken = *length - offset;
+        if (taken > outRemaining)
+            taken = outRemaining;
+
+        command.append((const char *)dataptr + offset, taken);
+        outRemaining -= taken;
+
+        if (outRemaining == 0 && isOutEndOfMessage)
+        {
+            Execute(command);
+            command.clear();
+        }
+
+        return hrSUCCESS;
+    }
+
+    if (endpoint != SIMULATED_EP_IN)
+        return hrSTALL;
+
+    if (inOffset >= inTransfer.size())
+    {
+        uint32_t size;
+        uint8_t header[12];
+
+        // Nothing to say yet
+        if (!isRequestPending || output.empty())
+        {
+            *length = 0;
+            return hrNAK;
+        }
+
+        size = (output.size() < requestSize) ? (uint32_t)output.size() : requestSize;
+
+        header[0] = 0x02;   // DEV_DEP_MSG_IN
+        header[1] = requestTag;
+        header[2] = ~requestTag;
+        header[3] = 0;
+        header[4] = size & 0xFF;
+        header[5] = (size >> 8) & 0xFF;
+        header[6] = (size >> 16) & 0xFF;
+        header[7] = (size >> 24) & 0xFF;
+        header[8] = (size == output.size()) ? 0x01 : 0x00;
+        header[9] = header[10] = header[11] = 0;
+
+        inTransfer.assign((const char *)header, sizeof(header));
+        inTransfer.append(output, 0, size);
+        inTransfer.append((4 - (inTransfer.size() & 3)) & 3, '\0');
+        output.erase(0, size);
+        inOffset = 0;
+        isRequestPending = false;
+    }
+
+    // A packet at a time, as on the wire
+    size_t size = inTransfer.size() - inOffset;
+    if (size > *length)
+        size = *length;
+    if (size > SIMULATED_PACKET_SIZE)
+        size = SIMULATED_PACKET_SIZE;
+
+    memcpy(dataptr, inTransfer.data() + inOffset, size);
+    inOffset += size;
+    *length = (uint16_t)size;
+
+    if (inOffset >= inTransfer.size())
+    {
+        inTransfer.clear();
+        inOffset = 0;
+    }
+
+    return hrSUCCESS;
+}
+
+unsigned long SimulatedBackend::WaveformPoints()
+{
+    std::map<std::string, std::string>::iterator it = settings.find("WAV:POIN");
+    unsigned long points = (it != settings.end()) ? strtoul(it->second.c_str(), NULL, 10) : SIMULATED_DEFAULT_POINTS;
+
+    return (points > SIMULATED_MAX_POINTS) ? SIMULATED_MAX_POINTS : points;
+}
+
+void SimulatedBackend::PushError(const char *error)
+{
+    errors += error;
+    errors += '\n';
+    eventStatus |= 0x20;    // Command Error
+}
+
+// The program message units are separated by ';', the answers of the queries are joined the same way
+void SimulatedBackend::Execute(const std::string &message)
+{
+    std::string response;
+    std::string unitText;
+    char quote = '\0';
+    size_t i = 0;
+
+    while (i <= message.size())
+    {
+        char c = (i < message.size()) ? message[i] : '\0';
+
+        if (quote != '\0' && c != '\0')
+        {
+            if (c == quote)
+                quote = '\0';
+            unitText += c;
+            i++;
+            continue;
+        }
+
+        // Definite length block, taken as it is
+        if (c == '#' && i + 1 < message.size() && message[i + 1] > '0' && message[i + 1] <= '9')
+        {
+            size_t digits = message[i + 1] - '0';
+            size_t size = strtoul(message.substr(i + 2, digits).c_str(), NULL, 10);
+            size_t end = i + 2 + digits + size;
+
+            if (end > message.size())
+                end = message.size();
+
+            unitText.append(message, i, end - i);
+            i = end;
+            continue;
+        }
+
+        if (c == ';' || c == '\0')
+        {
+            std::string answer;
+
+            if (Respond(Trim(unitText), answer))
+            {
+                if (!response.empty())
+                    response += ';';
+                response += answer;
+            }
+
+            unitText.clear();
+            i++;
+            continue;
+        }
+
+        if (c == '"' || c == '\'')
+            quote = c;
+
+        unitText += c;
+        i++;
+    }
+
+    if (!response.empty())
+        output += response + "\n";
+}
+
+// Runs one message unit, true when it has an answer
+bool SimulatedBackend::Respond(const std::string &unitText, std::string &response)
+{
+    size_t space = unitText.find_first_of(" \t");
+    std::string header = Normalize(unitText.substr(0, space));
+    std::string value = (space == std::string::npos) ? "" : Trim(unitText.substr(space));
+    bool isQuery = (!header.empty() && header[header.size() - 1] == '?');
+    char text[96];
+
+    if (header.empty())
+        return false;
+
+    if (isQuery)
+        header.erase(header.size() - 1);
+
+    if (header == "*IDN" && isQuery)
+    {
+        snprintf(text, sizeof(text), "USBTMC-Host-Driver,Simulator,SIM%04u,1.0", unit);
+        response = text;
+        return true;
+    }
+
+    if (header == "*RST")
+    {
+        settings.clear();
+        return false;
+    }
+
+    if (header == "*CLS")
+    {
+        errors.clear();
+        eventStatus = 0;
+        return false;
+    }
+
+    if (header == "*OPC")
+    {
+        if (!isQuery)
+        {
+            eventStatus |= 0x01;
+            return false;
+        }
+
+        response = "1";
+        return true;
+    }
+
+    if ((header == "*ESR" || header == "*STB") && isQuery)
+    {
+        uint8_t status = (header == "*ESR") ? eventStatus : ((eventStatus ? STB_ESB : 0) | (output.empty() ? 0 : STB_MAV));
+
+        if (header == "*ESR")
+            eventStatus = 0;
+
+        snprintf(text, sizeof(text), "%u", status);
+        response = text;
+        return true;
+    }
+
+    if (header == "*LRN" && isQuery)
+    {
+        response = "*RST";
+        for (std::map<std::string, std::string>::iterator it = settings.begin(); it != settings.end(); ++it)
+            response += ";:" + it->first + " " + it->second;
+        return true;
+    }
+
+    if ((header == "SYST:ERR" || header == "SYSTEM:ERROR") && isQuery)
+    {
+        size_t end = errors.find('\n');
+
+        if (end == std::string::npos)
+        {
+            response = "0,\"No error\"";
+            return true;
+        }
+
+        response = errors.substr(0, end);
+        errors.erase(0, end + 1);
+        return true;
+    }
+
+    if ((header == "READ" || header == "MEAS") && isQuery)
+    {
+        // A slow ramp, enough to see the readings move
+        snprintf(text, sizeof(text), "%+.6E", 1.0 + (readingCount++ % 1000) * 1e-3);
+        response = text;
+        return true;
+    }
+
+    if ((header == "WAV:PRE" || header == "WAVEFORM:PREAMBLE") && isQuery)
+    {
+        // BYTE, NORMal, 1 us a point, 8 bits over 10.24 V around 0 V
+        snprintf(text, sizeof(text), "0,0,%lu,1,1.000000e-06,0,0,4.000000e-02,0,128", WaveformPoints());
+        response = text;
+        return true;
+    }
+
+    if ((header == "WAV:DATA" || header == "WAVEFORM:DATA") && isQuery)
+    {
+        unsigned long points = WaveformPoints();
+
+        snprintf(text, sizeof(text), "#9%09lu", points);
+        response = text;
+
+        for (unsigned long n = 0; n < points; n++)
+            response += (char)((n & 0x100) ? (0xFF - (n & 0xFF)) : (n & 0xFF));
+        return true;
+    }
+
+    if (isQuery)
+    {
+        std::map<std::string, std::string>::iterator it = settings.find(header);
+
+        if (it == settings.end())
+        {
+            // A query with an error has no answer
+            PushError("-113,\"Undefined header\"");
+            return false;
+        }
+
+        response = it->second;
+        return true;
+    }
+
+    if (value.empty())
+    {
+        PushError("-109,\"Missing parameter\"");
+        return false;
+    }
+
+    settings[header] = value;
+    return false;
+}
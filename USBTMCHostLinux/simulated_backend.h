@@ -0,0 +1,77 @@
+/*
+ * Simulated USBTMC device for the Linux build of USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__SIMULATED_BACKEND_H__)
+#define __SIMULATED_BACKEND_H__
+
+#include <map>
+#include <string>
+
+#include "usb_backend.h"
+
+// An in-process USB488 instrument behind the backend interface, for trying the tools without hardware.
+// It answers the standard and USBTMC control requests and runs a small SCPI model on the bulk endpoints:
+//   *IDN? *RST *CLS *OPC *OPC? *ESR? *STB? *LRN? :SYST:ERR?
+//   READ? / :MEAS?              a reading which changes each time
+//   :WAV:POIN <n>, :WAV:PRE?,   a triangle of n BYTE samples in a definite length block
+//   :WAV:DATA?
+//   <header> <value>            any other setting is stored, <header>? reads it back
+class SimulatedBackend : public USBBackend
+{
+    uint8_t unit;
+    bool isAttached;
+
+    // Bulk-OUT transfer in progress
+    std::string command;
+    uint32_t outRemaining;
+    bool isOutEndOfMessage;
+
+    // Bulk-IN
+    std::string output;
+    bool isRequestPending;
+    uint32_t requestSize;
+    uint8_t requestTag;
+    std::string inTransfer;
+    size_t inOffset;
+
+    // SCPI model
+    std::map<std::string, std::string> settings;
+    std::string errors;
+    uint8_t eventStatus;
+    uint32_t readingCount;
+
+    void Reset();
+    uint16_t Descriptor(uint8_t type, uint8_t index, uint8_t *dataptr, uint16_t length);
+    void Execute(const std::string &message);
+    bool Respond(const std::string &unit, std::string &response);
+    void PushError(const char *error);
+    unsigned long WaveformPoints();
+
+public:
+    // The unit number goes to the serial number and *IDN?
+    SimulatedBackend(uint8_t unit = 0);
+
+    bool Attach();
+    void Detach();
+    bool IsAttached();
+
+    uint8_t SetConfiguration(uint8_t conf);
+    uint8_t ControlTransfer(uint8_t bmReqType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *dataptr, uint16_t *transferred);
+    uint8_t BulkTransfer(uint8_t endpoint, uint8_t *dataptr, uint16_t *length, uint32_t timeoutMillis);
+};
+
+#endif // __SIMULATED_BACKEND_H__
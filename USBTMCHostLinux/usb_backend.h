@@ -0,0 +1,46 @@
+/*
+ * USB backend interface for the Linux build of USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USB_BACKEND_H__)
+#define __USB_BACKEND_H__
+
+#include <stdint.h>
+
+// The shim USB class forwards every transfer to a backend.
+// Return codes are the host result codes of the USB Host Shield (hrSUCCESS, hrNAK, hrSTALL...),
+// so the driver sees the same errors as on the MAX3421E.
+class USBBackend
+{
+public:
+    virtual ~USBBackend() {};
+
+    // Look for a USBTMC device and get it ready for transfers, true when one is attached
+    virtual bool Attach() = 0;
+    virtual void Detach() = 0;
+    // False once the device has gone
+    virtual bool IsAttached() = 0;
+
+    // SET_CONFIGURATION goes through the backend, the operating system owns the configuration
+    virtual uint8_t SetConfiguration(uint8_t conf) = 0;
+
+    virtual uint8_t ControlTransfer(uint8_t bmReqType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *dataptr, uint16_t *transferred) = 0;
+    // The direction is bit 7 of the endpoint address, length is updated with the transferred bytes.
+    // A transfer which does not complete within timeoutMillis reports hrNAK.
+    virtual uint8_t BulkTransfer(uint8_t endpoint, uint8_t *dataptr, uint16_t *length, uint32_t timeoutMillis) = 0;
+};
+
+#endif // __USB_BACKEND_H__
@@ -0,0 +1,468 @@
+/*
+ * Linux usbfs backend for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbfs_backend.h"
+#include "shim/Usb.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <mutex>
+
+#define USBFS_SYSFS_PATH        "/sys/bus/usb/devices"
+#define USBFS_CONTROL_TIMEOUT   5000
+#define USBFS_MAX_CLAIMS        16
+
+// Interfaces held by the backends of this process. USBDEVFS_DISCONNECT would take an interface
+// from another backend as well as from the kernel driver, so a held one is skipped.
+struct USBFSClaim {
+    unsigned int busnum;
+    unsigned int devnum;
+    int ifno;
+    const USBFSBackend *owner;
+};
+
+static USBFSClaim claims[USBFS_MAX_CLAIMS];
+static std::mutex claimsMutex;
+
+static bool Claim(unsigned int busnum, unsigned int devnum, int ifno, const USBFSBackend *owner)
+{
+    std::lock_guard<std::mutex> lock(claimsMutex);
+    USBFSClaim *freeClaim = NULL;
+
+    for (int i = 0; i < USBFS_MAX_CLAIMS; i++)
+    {
+        if (claims[i].owner == NULL)
+        {
+            if (freeClaim == NULL)
+                freeClaim = &claims[i];
+        }
+        else if (claims[i].busnum == busnum && claims[i].devnum == devnum && claims[i].ifno == ifno)
+        {
+            return false;
+        }
+    }
+
+    if (freeClaim == NULL)
+        return false;
+
+    freeClaim->busnum = busnum;
+    freeClaim->devnum = devnum;
+    freeClaim->ifno = ifno;
+    freeClaim->owner = owner;
+    return true;
+}
+
+static void Unclaim(const USBFSBackend *owner)
+{
+    std::lock_guard<std::mutex> lock(claimsMutex);
+
+    for (int i = 0; i < USBFS_MAX_CLAIMS; i++)
+    {
+        if (claims[i].owner == owner)
+            claims[i].owner = NULL;
+    }
+}
+
+static bool ReadSysfsHex(const char *dir, const char *name, unsigned int *value)
+{
+    char path[512];
+    FILE *fp;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", USBFS_SYSFS_PATH, dir, name);
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+
+    n = fscanf(fp, "%x", value);
+    fclose(fp);
+
+    return (n == 1);
+}
+
+static bool ReadSysfsDec(const char *dir, const char *name, unsigned int *value)
+{
+    char path[512];
+    FILE *fp;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", USBFS_SYSFS_PATH, dir, name);
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+
+    n = fscanf(fp, "%u", value);
+    fclose(fp);
+
+    return (n == 1);
+}
+
+USBFSBackend::USBFSBackend() : fd(-1), interfaceNumber(-1), configurationValue(0), isAttached(false), isKernelDriverDetached(false), targetVID(0), targetPID(0), isInPending(false), inEndpoint(0), inHead(0), inTail(0)
+{
+    memset(&inUrb, 0, sizeof(inUrb));
+}
+
+USBFSBackend::~USBFSBackend()
+{
+    Detach();
+}
+
+void USBFSBackend::SetTarget(uint16_t vid, uint16_t pid)
+{
+    targetVID = vid;
+    targetPID = pid;
+}
+
+bool USBFSBackend::Attach()
+{
+    DIR *dir;
+    struct dirent *entry;
+
+    if (fd >= 0)
+        return isAttached;
+
+    dir = opendir(USBFS_SYSFS_PATH);
+    if (dir == NULL)
+        return false;
+
+    // Interfaces are named like "1-1.2:1.0", the device is the part before the colon
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char device[256];
+        const char *colon = strchr(entry->d_name, ':');
+        unsigned int ifClass, ifSubClass, ifNumber;
+
+        if (colon == NULL || (size_t)(colon - entry->d_name) >= sizeof(device))
+            continue;
+
+        if (!ReadSysfsHex(entry->d_name, "bInterfaceClass", &ifClass) ||
+            !ReadSysfsHex(entry->d_name, "bInterfaceSubClass", &ifSubClass) ||
+            !ReadSysfsHex(entry->d_name, "bInterfaceNumber", &ifNumber))
+            continue;
+
+        if (ifClass != USB_CLASS_APP_SPECIFIC || ifSubClass != 0x03)
+            continue;
+
+        memcpy(device, entry->d_name, colon - entry->d_name);
+        device[colon - entry->d_name] = '\0';
+
+        if (OpenDevice(device, (int)ifNumber))
+            break;
+    }
+
+    closedir(dir);
+
+    return isAttached;
+}
+
+bool USBFSBackend::OpenDevice(const char *sysName, int ifno)
+{
+    unsigned int vid, pid, busnum, devnum, conf;
+    char path[64];
+
+    if (!ReadSysfsHex(sysName, "idVendor", &vid) || !ReadSysfsHex(sysName, "idProduct", &pid))
+        return false;
+
+    if ((targetVID != 0 && vid != targetVID) || (targetPID != 0 && pid != targetPID))
+        return false;
+
+    if (!ReadSysfsDec(sysName, "busnum", &busnum) || !ReadSysfsDec(sysName, "devnum", &devnum))
+        return false;
+
+    if (!ReadSysfsDec(sysName, "bConfigurationValue", &conf))
+        conf = 0;
+
+    if (!Claim(busnum, devnum, ifno, this))
+        return false;
+
+    snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u", busnum, devnum);
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "usbfs: %s: %s\n", path, strerror(errno));
+        Unclaim(this);
+        return false;
+    }
+
+    // Take the interface over from the kernel usbtmc driver
+    struct usbdevfs_ioctl command;
+    command.ifno = ifno;
+    command.ioctl_code = USBDEVFS_DISCONNECT;
+    command.data = NULL;
+    isKernelDriverDetached = (ioctl(fd, USBDEVFS_IOCTL, &command) == 0);
+
+    if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &ifno) != 0)
+    {
+        fprintf(stderr, "usbfs: claim interface %d: %s\n", ifno, strerror(errno));
+        close(fd);
+        fd = -1;
+        Unclaim(this);
+        return false;
+    }
+
+    interfaceNumber = ifno;
+    configurationValue = (uint8_t)conf;
+    isInPending = false;
+    inHead = inTail = 0;
+    isAttached = true;
+
+    return true;
+}
+
+void USBFSBackend::CancelInUrb()
+{
+    struct usbdevfs_urb *done;
+
+    if (!isInPending)
+        return;
+
+    ioctl(fd, USBDEVFS_DISCARDURB, &inUrb);
+
+    // Wait for the kernel to give the URB back before its buffer is reused
+    while (ioctl(fd, USBDEVFS_REAPURB, &done) == 0 && done != &inUrb)
+        ;
+
+    isInPending = false;
+}
+
+void USBFSBackend::Detach()
+{
+    if (fd < 0)
+        return;
+
+    if (isAttached)
+        CancelInUrb();
+
+    ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interfaceNumber);
+
+    if (isKernelDriverDetached)
+    {
+        // Give the interface back to the kernel driver
+        struct usbdevfs_ioctl command;
+        command.ifno = interfaceNumber;
+        command.ioctl_code = USBDEVFS_CONNECT;
+        command.data = NULL;
+        ioctl(fd, USBDEVFS_IOCTL, &command);
+    }
+
+    close(fd);
+    Unclaim(this);
+
+    fd = -1;
+    interfaceNumber = -1;
+    isAttached = false;
+    isKernelDriverDetached = false;
+    isInPending = false;
+    inHead = inTail = 0;
+}
+
+bool USBFSBackend::IsAttached()
+{
+    struct usbdevfs_connectinfo info;
+
+    if (fd < 0 || !isAttached)
+        return false;
+
+    if (ioctl(fd, USBDEVFS_CONNECTINFO, &info) != 0 && errno == ENODEV)
+        isAttached = false;
+
+    return isAttached;
+}
+
+uint8_t USBFSBackend::TranslateError(int error)
+{
+    switch (error)
+    {
+        case ETIMEDOUT:
+        case EAGAIN:
+            return hrNAK;
+
+        case EPIPE:
+            return hrSTALL;
+
+        case EOVERFLOW:
+            return hrBABBLE;
+
+        case EPROTO:
+        case EILSEQ:
+            return hrCRCERR;
+
+        case ENODEV:
+        case ESHUTDOWN:
+            isAttached = false;
+            return hrJERR;
+
+        default:
+            return hrTIMEOUT;
+    }
+}
+
+uint8_t USBFSBackend::SetConfiguration(uint8_t conf)
+{
+    unsigned int value = conf;
+
+    if (fd < 0)
+        return hrJERR;
+
+    // The kernel has configured the device already in most cases
+    if (conf == configurationValue)
+        return hrSUCCESS;
+
+    if (ioctl(fd, USBDEVFS_SETCONFIGURATION, &value) != 0)
+        return TranslateError(errno);
+
+    configurationValue = conf;
+    return hrSUCCESS;
+}
+
+uint8_t USBFSBackend::ControlTransfer(uint8_t bmReqType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *dataptr, uint16_t *transferred)
+{
+    struct usbdevfs_ctrltransfer transfer;
+    int rc;
+
+    *transferred = 0;
+
+    if (fd < 0)
+        return hrJERR;
+
+    // CLEAR_FEATURE(ENDPOINT_HALT) must reset the data toggle on the host side too
+    if (bmReqType == (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT) &&
+        bRequest == USB_REQUEST_CLEAR_FEATURE && wValue == USB_FEATURE_ENDPOINT_HALT)
+    {
+        unsigned int ep = wIndex;
+
+        if ((ep & 0x80) && isInPending && inEndpoint == ep)
+            CancelInUrb();
+
+        if (ioctl(fd, USBDEVFS_CLEAR_HALT, &ep) != 0)
+            return TranslateError(errno);
+
+        return hrSUCCESS;
+    }
+
+    transfer.bRequestType = bmReqType;
+    transfer.bRequest = bRequest;
+    transfer.wValue = wValue;
+    transfer.wIndex = wIndex;
+    transfer.wLength = wLength;
+    transfer.timeout = USBFS_CONTROL_TIMEOUT;
+    transfer.data = dataptr;
+
+    rc = ioctl(fd, USBDEVFS_CONTROL, &transfer);
+    if (rc < 0)
+        return TranslateError(errno);
+
+    *transferred = (uint16_t)rc;
+    return hrSUCCESS;
+}
+
+uint8_t USBFSBackend::BulkTransfer(uint8_t endpoint, uint8_t *dataptr, uint16_t *length, uint32_t timeoutMillis)
+{
+    if (fd < 0 || !isAttached)
+    {
+        *length = 0;
+        return hrJERR;
+    }
+
+    if ((endpoint & 0x80) && timeoutMillis == 0)
+    {
+        // Polled Bulk-IN, hand out what the read-ahead URB has brought in
+        if (inHead == inTail)
+        {
+            struct usbdevfs_urb *done;
+
+            if (!isInPending)
+            {
+                memset(&inUrb, 0, sizeof(inUrb));
+                inUrb.type = USBDEVFS_URB_TYPE_BULK;
+                inUrb.endpoint = endpoint;
+                inUrb.buffer = inBuffer;
+                inUrb.buffer_length = sizeof(inBuffer);
+
+                if (ioctl(fd, USBDEVFS_SUBMITURB, &inUrb) != 0)
+                {
+                    *length = 0;
+                    return TranslateError(errno);
+                }
+
+                isInPending = true;
+                inEndpoint = endpoint;
+            }
+
+            if (ioctl(fd, USBDEVFS_REAPURBNDELAY, &done) != 0)
+            {
+                *length = 0;
+                return TranslateError(errno);
+            }
+
+            isInPending = false;
+
+            if (done->status != 0)
+            {
+                *length = 0;
+                return TranslateError(-done->status);
+            }
+
+            inHead = 0;
+            inTail = (uint16_t)done->actual_length;
+
+            if (inTail == 0)
+            {
+                // Zero length packet
+                *length = 0;
+                return hrSUCCESS;
+            }
+        }
+
+        uint16_t n = inTail - inHead;
+        if (n > *length)
+            n = *length;
+
+        memcpy(dataptr, &inBuffer[inHead], n);
+        inHead += n;
+        *length = n;
+
+        return hrSUCCESS;
+    }
+
+    struct usbdevfs_bulktransfer transfer;
+    int rc;
+
+    transfer.ep = endpoint;
+    transfer.len = *length;
+    transfer.timeout = (timeoutMillis == 0) ? 1 : timeoutMillis;
+    transfer.data = dataptr;
+
+    rc = ioctl(fd, USBDEVFS_BULK, &transfer);
+    if (rc < 0)
+    {
+        *length = 0;
+        return TranslateError(errno);
+    }
+
+    *length = (uint16_t)rc;
+    return hrSUCCESS;
+}
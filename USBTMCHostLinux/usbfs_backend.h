@@ -0,0 +1,69 @@
+/*
+ * Linux usbfs backend for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBFS_BACKEND_H__)
+#define __USBFS_BACKEND_H__
+
+#include <linux/usbdevice_fs.h>
+
+#include "usb_backend.h"
+
+#define USBFS_IN_BUFFER_SIZE    4096    // multiple of the high speed packet size
+
+// Talks to the instrument through /dev/bus/usb, the kernel usbtmc driver is unbound while attached.
+// The user needs write access to the device node (udev rule or root).
+class USBFSBackend : public USBBackend
+{
+    int fd;
+    int interfaceNumber;
+    uint8_t configurationValue;
+    bool isAttached;
+    bool isKernelDriverDetached;
+
+    uint16_t targetVID;
+    uint16_t targetPID;
+
+    // Bulk-IN is read ahead by an asynchronous URB, the data is handed out in the requested sizes
+    bool isInPending;
+    uint8_t inEndpoint;
+    uint8_t inBuffer[USBFS_IN_BUFFER_SIZE];
+    uint16_t inHead;
+    uint16_t inTail;
+    // Last member, usbdevfs_urb ends with a flexible array
+    struct usbdevfs_urb inUrb;
+
+    bool OpenDevice(const char *sysName, int ifno);
+    void CancelInUrb();
+    uint8_t TranslateError(int error);
+
+public:
+    USBFSBackend();
+    ~USBFSBackend();
+
+    // 0 matches any, the first USBTMC interface found is used
+    void SetTarget(uint16_t vid, uint16_t pid);
+
+    bool Attach();
+    void Detach();
+    bool IsAttached();
+
+    uint8_t SetConfiguration(uint8_t conf);
+    uint8_t ControlTransfer(uint8_t bmReqType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *dataptr, uint16_t *transferred);
+    uint8_t BulkTransfer(uint8_t endpoint, uint8_t *dataptr, uint16_t *length, uint32_t timeoutMillis);
+};
+
+#endif // __USBFS_BACKEND_H__
@@ -0,0 +1,499 @@
+/*
+ * Command line tool for USBTMC class driver on Linux
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Arduino.h>
+#include <Usb.h>
+
+#include "usbtmc.h"
+#include "usbtmc_envelope.h"
+#include "usbfs_backend.h"
+#include "simulated_backend.h"
+#include "usbtmc_waveform.h"
+
+#define CONNECT_TIMEOUT         5000
+#define QUERY_TIMEOUT           5000
+#define RESPONSE_SIZE           4096
+#define REQUEST_SIZE            65536   // per Bulk-IN transfer of a long response
+#define BENCH_POINTS            1000000
+#define BENCH_ROUNDS            20
+
+class CliOper : public USBTMCAsyncOper
+{
+public:
+    char response[RESPONSE_SIZE];
+    size_t responseLength;
+    USBTMCWaveformConverter *pConverter;
+    USBTMCEnvelope *pEnvelope;
+    bool isEndOfMessage;
+    bool isFailed;
+
+    CliOper() : responseLength(0), pConverter(NULL), pEnvelope(NULL), isEndOfMessage(false), isFailed(false) {};
+
+    void OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr __attribute__((unused)), uint8_t serialNumLen __attribute__((unused)))
+    {
+        fprintf(stderr, "Connected %04X:%04X\n", pdescr->idVendor, pdescr->idProduct);
+    };
+
+    void OnReceived(uint8_t data __attribute__((unused))) {};
+
+    void OnReceivedData(const uint8_t *dataptr, uint16_t length)
+    {
+        if (pConverter != NULL)
+        {
+            pConverter->Feed(dataptr, length);
+            return;
+        }
+
+        if (pEnvelope != NULL)
+        {
+            pEnvelope->Feed(dataptr, length);
+            return;
+        }
+
+        if (length > sizeof(response) - 1 - responseLength)
+            length = sizeof(response) - 1 - responseLength;
+
+        memcpy(&response[responseLength], dataptr, length);
+        responseLength += length;
+        response[responseLength] = '\0';
+    };
+
+    void OnReadStatusByte(uint8_t status)
+    {
+        printf("STB %02X\n", status);
+    };
+
+    void OnFailed(USBTMCInformation info, uint8_t code)
+    {
+        fprintf(stderr, "Failed %d (0x%02X)\n", (int)info, code);
+        isFailed = true;
+    };
+
+    void OnTransferHeader(uint32_t transferSize __attribute__((unused)), bool isEndOfMessage)
+    {
+        this->isEndOfMessage = isEndOfMessage;
+    };
+};
+
+static USB Usb;
+static USBFSBackend Backend;
+static SimulatedBackend Simulator;
+static CliOper AsyncOper;
+static USBTMC Usbtmc(&Usb, &AsyncOper);
+
+static void Pump()
+{
+    Usb.Task();
+    Usbtmc.Run();
+}
+
+static bool Connect(uint32_t timeout)
+{
+    uint32_t beginMillis = millis();
+
+    while (Usb.getUsbTaskState() != USB_STATE_RUNNING || !Usbtmc.IsConnected())
+    {
+        if (millis() - beginMillis > timeout)
+        {
+            fprintf(stderr, "No USBTMC device\n");
+            return false;
+        }
+
+        Pump();
+        delay(1);
+    }
+
+    return true;
+}
+
+static bool WaitIdle(uint32_t timeout)
+{
+    uint32_t beginMillis = millis();
+
+    while (!Usbtmc.IsIdle())
+    {
+        if (AsyncOper.isFailed || Usb.getUsbTaskState() != USB_STATE_RUNNING)
+            return false;
+
+        if (millis() - beginMillis > timeout)
+        {
+            Usbtmc.AbortReceive();
+            return false;
+        }
+
+        Pump();
+    }
+
+    return !AsyncOper.isFailed;
+}
+
+static bool Write(const char *command)
+{
+    size_t length = strlen(command);
+
+    if (!WaitIdle(QUERY_TIMEOUT))
+        return false;
+
+    Usbtmc.BeginTransmit(length + 1);
+
+    for (size_t i = 0; i <= length; i++)
+    {
+        uint8_t c = (i < length) ? (uint8_t)command[i] : '\n';
+
+        while (!Usbtmc.TryTransmitData(c))
+        {
+            if (AsyncOper.isFailed)
+                return false;
+            Pump();
+        }
+    }
+
+    while (!Usbtmc.TransmitDone())
+    {
+        if (AsyncOper.isFailed)
+            return false;
+        Pump();
+    }
+
+    return WaitIdle(QUERY_TIMEOUT);
+}
+
+// The response goes to AsyncOper.response, or to the converter or the envelope when one is set
+static bool Query(const char *command, USBTMCWaveformConverter *converter = NULL, USBTMCEnvelope *envelope = NULL)
+{
+    AsyncOper.responseLength = 0;
+    AsyncOper.response[0] = '\0';
+    AsyncOper.pConverter = converter;
+    AsyncOper.pEnvelope = envelope;
+
+    if (!Write(command))
+        return false;
+
+    do
+    {
+        AsyncOper.isEndOfMessage = false;
+        Usbtmc.Request(REQUEST_SIZE);
+
+        if (!WaitIdle(QUERY_TIMEOUT))
+            return false;
+    } while (!AsyncOper.isEndOfMessage);
+
+    AsyncOper.pConverter = NULL;
+    AsyncOper.pEnvelope = NULL;
+
+    // Drop the terminator
+    while (AsyncOper.responseLength > 0 && (AsyncOper.response[AsyncOper.responseLength - 1] == '\n' || AsyncOper.response[AsyncOper.responseLength - 1] == '\r'))
+        AsyncOper.response[--AsyncOper.responseLength] = '\0';
+
+    return true;
+}
+
+static int RunQuery(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        bool isQuery = (strchr(argv[i], '?') != NULL);
+
+        if (isQuery ? !Query(argv[i]) : !Write(argv[i]))
+            return 1;
+
+        if (isQuery)
+            printf("%s\n", AsyncOper.response);
+    }
+
+    return 0;
+}
+
+static bool SetupWaveform(USBTMCWaveformConverter &converter, bool isWord)
+{
+    if (!Write(isWord ? ":WAV:FORM WORD" : ":WAV:FORM BYTE"))
+        return false;
+    if (isWord && !Write(":WAV:BYT LSBF"))
+        return false;
+    if (!Query(":WAV:PRE?") || !converter.SetPreamble(AsyncOper.response))
+    {
+        fprintf(stderr, "No preamble\n");
+        return false;
+    }
+
+    converter.SetFormat(isWord ? USBTMCSampleFormat::UInt16LE : USBTMCSampleFormat::UInt8);
+    return true;
+}
+
+static int RunWaveform(bool isWord, bool isDouble)
+{
+    USBTMCWaveformConverter converter;
+    size_t capacity;
+    void *values;
+
+    if (!SetupWaveform(converter, isWord))
+        return 1;
+
+    capacity = converter.GetPreamble().points;
+    values = malloc(capacity * (isDouble ? sizeof(double) : sizeof(float)) + 1);
+
+    if (isDouble)
+        converter.BeginBlock(static_cast<double *>(values), capacity);
+    else
+        converter.BeginBlock(static_cast<float *>(values), capacity);
+
+    if (!Query(":WAV:DATA?", &converter) || !converter.IsBlockComplete())
+    {
+        fprintf(stderr, "No waveform data\n");
+        free(values);
+        return 1;
+    }
+
+    for (size_t i = 0; i < converter.SampleCount(); i++)
+    {
+        if (isDouble)
+            printf("%.9g\n", static_cast<double *>(values)[i]);
+        else
+            printf("%.6g\n", static_cast<float *>(values)[i]);
+    }
+
+    fprintf(stderr, "%zu points (%s)\n", converter.SampleCount(), USBTMCWaveformConverter::GetKernelName());
+    free(values);
+    return 0;
+}
+
+// Min, max and mean in volts per bucket, only the buckets are kept in memory
+static int RunEnvelope(uint16_t buckets, bool isWord)
+{
+    USBTMCWaveformConverter converter;
+    int16_t *minimums = (int16_t *)malloc(buckets * sizeof(int16_t));
+    int16_t *maximums = (int16_t *)malloc(buckets * sizeof(int16_t));
+    int16_t *means = (int16_t *)malloc(buckets * sizeof(int16_t));
+    USBTMCEnvelope envelope(minimums, maximums, buckets, means);
+    int result = 1;
+
+    if (SetupWaveform(converter, isWord))
+    {
+        envelope.SetFormat(converter.GetFormat());
+        envelope.Begin(converter.GetPreamble().points);
+
+        if (Query(":WAV:DATA?", NULL, &envelope))
+        {
+            envelope.Finish();
+
+            for (uint16_t i = 0; i < envelope.Count(); i++)
+            {
+                printf("%.6g,%.6g,%.6g\n", converter.Scale(envelope.Minimum(i)),
+                       converter.Scale(envelope.Maximum(i)), converter.Scale(envelope.Mean(i)));
+            }
+
+            fprintf(stderr, "%u samples in %u buckets\n", envelope.SampleCount(), envelope.Count());
+            result = 0;
+        }
+    }
+
+    free(minimums);
+    free(maximums);
+    free(means);
+    return result;
+}
+
+static double BenchFloat(USBTMCWaveformConverter &converter, const uint8_t *raw, size_t bytes, float *out)
+{
+    uint32_t beginMicros = micros();
+
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+        converter.Convert(raw, bytes, out);
+
+    return (double)(uint32_t)(micros() - beginMicros) / BENCH_ROUNDS;
+}
+
+// Every kernel against the scalar one on random samples
+static int RunBench()
+{
+    static const struct {
+        USBTMCSampleFormat format;
+        const char *name;
+    } formats[] = {
+        { USBTMCSampleFormat::Int8, "int8" },
+        { USBTMCSampleFormat::UInt8, "uint8" },
+        { USBTMCSampleFormat::Int16LE, "int16le" },
+        { USBTMCSampleFormat::Int16BE, "int16be" },
+        { USBTMCSampleFormat::UInt16LE, "uint16le" },
+        { USBTMCSampleFormat::UInt16BE, "uint16be" },
+    };
+    USBTMCWaveformConverter converter;
+    const size_t bytes = BENCH_POINTS * 2 + 1;  // odd, the tail goes through the scalar code
+    uint8_t *raw = (uint8_t *)malloc(bytes);
+    float *fast = (float *)malloc(BENCH_POINTS * sizeof(float));
+    float *reference = (float *)malloc(BENCH_POINTS * sizeof(float));
+    double *fastDouble = (double *)malloc(BENCH_POINTS * sizeof(double));
+    double *referenceDouble = (double *)malloc(BENCH_POINTS * sizeof(double));
+    uint8_t *inPlace = (uint8_t *)malloc(BENCH_POINTS * sizeof(double));
+    int result = 0;
+
+    srand(1);
+    for (size_t i = 0; i < bytes; i++)
+        raw[i] = (uint8_t)rand();
+
+    converter.SetPreamble("0,2,1200,1,2.000000e-06,-1.200000e-03,0,4.000000e-02,-1.500000e+00,127");
+    printf("kernel %s\n", USBTMCWaveformConverter::GetKernelName());
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        size_t size, samples, mismatches = 0;
+        double fastMicros, scalarMicros;
+
+        converter.SetFormat(formats[f].format);
+        size = converter.BytesPerSample();
+        samples = (BENCH_POINTS * size + 1) / size;
+        if (samples > BENCH_POINTS)
+            samples = BENCH_POINTS;
+
+        USBTMCWaveformConverter::UseScalarKernels(true);
+        scalarMicros = BenchFloat(converter, raw, samples * size, reference);
+        converter.Convert(raw, samples * size, referenceDouble);
+
+        USBTMCWaveformConverter::UseScalarKernels(false);
+        fastMicros = BenchFloat(converter, raw, samples * size, fast);
+        converter.Convert(raw, samples * size, fastDouble);
+
+        memcpy(inPlace, raw, samples * size);
+        float *inPlaceFloat = converter.ConvertInPlace(inPlace, samples * size);
+
+        for (size_t i = 0; i < samples; i++)
+        {
+            if (fast[i] != reference[i] || fastDouble[i] != referenceDouble[i] || inPlaceFloat[i] != reference[i])
+                mismatches++;
+        }
+
+        memcpy(inPlace, raw, samples * size);
+        double *inPlaceDouble = converter.ConvertInPlaceDouble(inPlace, samples * size);
+
+        for (size_t i = 0; i < samples; i++)
+        {
+            if (inPlaceDouble[i] != referenceDouble[i])
+                mismatches++;
+        }
+
+        printf("%-9s scalar %8.0f us  %-6s %8.0f us  %5.1fx  %s\n", formats[f].name, scalarMicros,
+               USBTMCWaveformConverter::GetKernelName(), fastMicros, scalarMicros / fastMicros,
+               mismatches ? "MISMATCH" : "ok");
+
+        if (mismatches)
+            result = 1;
+    }
+
+    free(raw);
+    free(fast);
+    free(reference);
+    free(fastDouble);
+    free(referenceDouble);
+    free(inPlace);
+    return result;
+}
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: usbtmc_cli [-d vid:pid | -s] query <command>...\n"
+        "       usbtmc_cli [-d vid:pid | -s] waveform [-w] [-f64]\n"
+        "       usbtmc_cli [-d vid:pid | -s] envelope <buckets> [-w]\n"
+        "       usbtmc_cli bench\n"
+        "       -s talks to the simulated instrument\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t vid = 0;
+    uint16_t pid = 0;
+    int index = 1;
+    int result;
+    bool isSimulated = false;
+
+    if (index + 1 < argc && strcmp(argv[index], "-d") == 0)
+    {
+        unsigned int v, p;
+
+        if (sscanf(argv[index + 1], "%x:%x", &v, &p) != 2)
+        {
+            Usage();
+            return 2;
+        }
+
+        vid = (uint16_t)v;
+        pid = (uint16_t)p;
+        index += 2;
+    }
+    else if (index < argc && strcmp(argv[index], "-s") == 0)
+    {
+        isSimulated = true;
+        index++;
+    }
+
+    if (index >= argc)
+    {
+        Usage();
+        return 2;
+    }
+
+    if (strcmp(argv[index], "bench") == 0)
+        return RunBench();
+
+    Backend.SetTarget(vid, pid);
+    if (isSimulated)
+        Usb.SetBackend(&Simulator);
+    else
+        Usb.SetBackend(&Backend);
+
+    if (Usb.Init() == -1 || !Connect(CONNECT_TIMEOUT))
+        return 1;
+
+    if (strcmp(argv[index], "query") == 0 && index + 1 < argc)
+    {
+        result = RunQuery(argc - index - 1, &argv[index + 1]);
+    }
+    else if (strcmp(argv[index], "waveform") == 0)
+    {
+        bool isWord = false;
+        bool isDouble = false;
+
+        for (int i = index + 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-w") == 0)
+                isWord = true;
+            else if (strcmp(argv[i], "-f64") == 0)
+                isDouble = true;
+        }
+
+        result = RunWaveform(isWord, isDouble);
+    }
+    else if (strcmp(argv[index], "envelope") == 0 && index + 1 < argc && atoi(argv[index + 1]) > 0)
+    {
+        bool isWord = (index + 2 < argc && strcmp(argv[index + 2], "-w") == 0);
+
+        result = RunEnvelope((uint16_t)atoi(argv[index + 1]), isWord);
+    }
+    else
+    {
+        Usage();
+        result = 2;
+    }
+
+    Usbtmc.Release();
+    Usb.GetBackend()->Detach();
+    return result;
+}
@@ -0,0 +1,651 @@
+/*
+ * SCPI over TCP gateway for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// Serves each USBTMC instrument as a raw SCPI socket, the first on port 5025 and the next ones above it.
+// Every instrument has a thread with its own driver and backend, so a slow instrument does not hold up the others.
+// The thread waits for the sockets in epoll_wait() and polls the instrument on its timeout, every GATEWAY_BUSY_WAIT
+// while a transfer is going on and GATEWAY_IDLE_WAIT otherwise, as the synchronous usbfs transfers give no event
+// to wait for. The driver copies a message through its FIFO into bulk-OUT packets. The response is written to the
+// socket straight from the bulk-IN packet and only staged while the socket is full.
+//
+// A message ends with '\n' outside quoted strings and definite length blocks. One with '?' is a query,
+// its response is read until EOM. One client at a time per instrument, the next one waits in the backlog.
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Arduino.h>
+#include <Usb.h>
+
+#include "usbtmc.h"
+#include "usbfs_backend.h"
+#include "simulated_backend.h"
+
+#define GATEWAY_DEFAULT_PORT    5025
+#define GATEWAY_MESSAGE_SIZE    (1 << 20)   // longest message from a client
+#define GATEWAY_READ_SIZE       65536
+#define GATEWAY_REQUEST_SIZE    65536       // per Bulk-IN transfer of a long response
+#define GATEWAY_OUTPUT_LIMIT    (1 << 20)   // the next transfer waits while the client is this far behind
+#define GATEWAY_IDLE_WAIT       20          // ms, the USB side is polled at least this often
+#define GATEWAY_BUSY_WAIT       1           // ms, while a transfer is in progress
+
+#define GATEWAY_STATE_IDLE      0
+#define GATEWAY_STATE_TRANSMIT  1
+#define GATEWAY_STATE_RECEIVE   2
+
+class GatewayInstrument : public USBTMCAsyncOper
+{
+    USB usb;
+    USBTMC usbtmc;
+    USBBackend *pBackend;
+    int port;
+
+    int epollFd;
+    int listenFd;
+    int clientFd;
+    uint32_t clientEvents;
+    bool isListening;
+
+    // Bytes from the client, [inHead, inTail) is not sent yet
+    std::vector<uint8_t> input;
+    size_t inHead;
+    size_t inTail;
+    size_t scanOffset;
+
+    // Bytes for the client which the socket did not take
+    std::string output;
+
+    uint8_t state;
+    size_t messageLength;
+    size_t transmitOffset;
+    bool isQuery;
+    bool isEndOfMessage;
+    bool isFailed;
+
+    // Message scanner, kept between reads
+    char quote;
+    size_t blockRemaining;
+
+    bool Listen(const char *address);
+    void SetListening(bool enable);
+    void Accept();
+    void CloseClient();
+    void UpdateEvents();
+    void ReadClient();
+    void WriteClient(const uint8_t *dataptr, size_t length);
+    void FlushClient();
+    bool FindMessage();
+    void Step();
+
+public:
+    GatewayInstrument(USBBackend *backend, int port);
+    ~GatewayInstrument();
+
+    bool Open(const char *address);
+    void Loop();
+
+    void OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr, uint8_t serialNumLen);
+    void OnReceived(uint8_t data);
+    void OnReceivedData(const uint8_t *dataptr, uint16_t length);
+    void OnReadStatusByte(uint8_t status);
+    void OnFailed(USBTMCInformation info, uint8_t code);
+    void OnTransferHeader(uint32_t transferSize, bool isEndOfMessage);
+};
+
+GatewayInstrument::GatewayInstrument(USBBackend *backend, int port) :
+    usbtmc(&usb, this), pBackend(backend), port(port), epollFd(-1), listenFd(-1), clientFd(-1), clientEvents(0), isListening(false),
+    input(GATEWAY_MESSAGE_SIZE), inHead(0), inTail(0), scanOffset(0), state(GATEWAY_STATE_IDLE),
+    messageLength(0), transmitOffset(0), isQuery(false), isEndOfMessage(false), isFailed(false), quote('\0'), blockRemaining(0)
+{
+    usb.SetBackend(pBackend);
+}
+
+GatewayInstrument::~GatewayInstrument()
+{
+    CloseClient();
+
+    if (listenFd >= 0)
+        close(listenFd);
+    if (epollFd >= 0)
+        close(epollFd);
+}
+
+bool GatewayInstrument::Open(const char *address)
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+    {
+        perror("epoll_create1");
+        return false;
+    }
+
+    if (!Listen(address))
+        return false;
+
+    // Bulk-IN is polled without blocking, take what has come in at every step
+    USBTMCConfig config = usbtmc.GetConfig();
+    config.timestepMillis = 0;
+    config.packetBudget = 255;
+    usbtmc.SetConfig(config);
+
+    return (usb.Init() != -1);
+}
+
+bool GatewayInstrument::Listen(const char *address)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", address);
+        return false;
+    }
+
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+    {
+        perror("socket");
+        return false;
+    }
+
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 4) != 0)
+    {
+        fprintf(stderr, "port %d: %s\n", port, strerror(errno));
+        return false;
+    }
+
+    SetListening(true);
+
+    fprintf(stderr, "Listening on %s:%d\n", address, port);
+    return true;
+}
+
+void GatewayInstrument::SetListening(bool enable)
+{
+    struct epoll_event event;
+
+    if (enable == isListening)
+        return;
+
+    event.events = EPOLLIN;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listenFd, &event);
+    isListening = enable;
+}
+
+void GatewayInstrument::Accept()
+{
+    struct epoll_event event;
+    int one = 1;
+
+    clientFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientFd < 0)
+        return;
+
+    // Short queries go out at once
+    setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // The next client waits in the backlog
+    SetListening(false);
+
+    event.events = EPOLLIN;
+    event.data.fd = clientFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+    clientEvents = EPOLLIN;
+
+    inHead = inTail = scanOffset = 0;
+    quote = '\0';
+    blockRemaining = 0;
+    output.clear();
+}
+
+void GatewayInstrument::CloseClient()
+{
+    if (clientFd < 0)
+        return;
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, clientFd, NULL);
+    close(clientFd);
+    clientFd = -1;
+    output.clear();
+
+    // A message on its way to the instrument is finished and its response is read to nowhere,
+    // the rest of the input is dropped. The next client is taken once the instrument is idle.
+    if (state != GATEWAY_STATE_TRANSMIT)
+        inHead = inTail = scanOffset = 0;
+}
+
+// Reads while there is room, writes while something is staged
+void GatewayInstrument::UpdateEvents()
+{
+    struct epoll_event event;
+    uint32_t events = 0;
+
+    if (clientFd < 0)
+        return;
+
+    if (inTail < input.size() || inHead > 0)
+        events |= EPOLLIN;
+    if (!output.empty())
+        events |= EPOLLOUT;
+
+    if (events == clientEvents)
+        return;
+
+    event.events = events;
+    event.data.fd = clientFd;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, clientFd, &event);
+    clientEvents = events;
+}
+
+void GatewayInstrument::ReadClient()
+{
+    ssize_t n;
+
+    // The message in progress moves to the front to make room
+    if (inTail == input.size() && inHead > 0 && state != GATEWAY_STATE_TRANSMIT)
+    {
+        memmove(&input[0], &input[inHead], inTail - inHead);
+        inTail -= inHead;
+        scanOffset -= inHead;
+        inHead = 0;
+    }
+
+    if (inTail == input.size())
+    {
+        if (inHead == 0 && state == GATEWAY_STATE_IDLE)
+        {
+            fprintf(stderr, "port %d: message longer than %d bytes\n", port, GATEWAY_MESSAGE_SIZE);
+            CloseClient();
+        }
+        return;
+    }
+
+    n = read(clientFd, &input[inTail], (input.size() - inTail < GATEWAY_READ_SIZE) ? input.size() - inTail : GATEWAY_READ_SIZE);
+
+    if (n > 0)
+        inTail += n;
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        CloseClient();
+}
+
+void GatewayInstrument::WriteClient(const uint8_t *dataptr, size_t length)
+{
+    ssize_t n = 0;
+
+    if (clientFd < 0)
+        return;
+
+    // Straight from the packet when nothing is staged
+    if (output.empty())
+    {
+        n = send(clientFd, dataptr, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                CloseClient();
+                return;
+            }
+            n = 0;
+        }
+    }
+
+    if ((size_t)n < length)
+        output.append((const char *)dataptr + n, length - n);
+}
+
+void GatewayInstrument::FlushClient()
+{
+    ssize_t n;
+
+    if (clientFd < 0 || output.empty())
+        return;
+
+    n = send(clientFd, output.data(), output.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (n > 0)
+        output.erase(0, n);
+    else if (n < 0 && errno != EAGAIN && errno != EINTR)
+        CloseClient();
+}
+
+// Looks for the end of the next message, a '\n' outside strings and blocks
+bool GatewayInstrument::FindMessage()
+{
+    while (scanOffset < inTail)
+    {
+        uint8_t c = input[scanOffset];
+
+        if (blockRemaining > 0)
+        {
+            size_t skip = inTail - scanOffset;
+
+            if (skip > blockRemaining)
+                skip = blockRemaining;
+
+            scanOffset += skip;
+            blockRemaining -= skip;
+            continue;
+        }
+
+        if (quote != '\0')
+        {
+            if (c == quote)
+                quote = '\0';
+            scanOffset++;
+            continue;
+        }
+
+        if (c == '#')
+        {
+            // #<digits><length>, wait until the header is in
+            if (scanOffset + 1 >= inTail)
+                return false;
+
+            uint8_t digits = input[scanOffset + 1] - '0';
+
+            if (digits >= 1 && digits <= 9)
+            {
+                size_t size = 0;
+
+                if (scanOffset + 2 + digits > inTail)
+                    return false;
+
+                for (uint8_t i = 0; i < digits; i++)
+                    size = size * 10 + (input[scanOffset + 2 + i] - '0');
+
+                scanOffset += 2 + digits;
+                blockRemaining = size;
+                continue;
+            }
+        }
+
+        if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '?')
+            isQuery = true;
+
+        scanOffset++;
+
+        if (c == '\n')
+        {
+            messageLength = scanOffset - inHead;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void GatewayInstrument::Step()
+{
+    switch (state)
+    {
+        case GATEWAY_STATE_IDLE:
+            if (!usbtmc.IsIdle() || output.size() >= GATEWAY_OUTPUT_LIMIT || !FindMessage())
+                break;
+
+            isFailed = false;
+            transmitOffset = 0;
+            usbtmc.BeginTransmit(messageLength);
+            state = GATEWAY_STATE_TRANSMIT;
+            // fall through
+
+        case GATEWAY_STATE_TRANSMIT:
+            // Straight from the socket buffer
+            transmitOffset += usbtmc.TransmitData(&input[inHead + transmitOffset], messageLength - transmitOffset);
+
+            if (isFailed)
+            {
+                // Dropped, the instrument stays with the client for the next one
+                inHead += messageLength;
+                isQuery = false;
+                state = GATEWAY_STATE_IDLE;
+                break;
+            }
+
+            if (transmitOffset < messageLength || !usbtmc.TransmitDone() || !usbtmc.IsIdle())
+                break;
+
+            inHead += messageLength;
+            if (inHead == inTail)
+                inHead = inTail = scanOffset = 0;
+
+            if (!isQuery)
+            {
+                state = GATEWAY_STATE_IDLE;
+                break;
+            }
+
+            isQuery = false;
+            isEndOfMessage = false;
+            state = GATEWAY_STATE_RECEIVE;
+            usbtmc.Request(GATEWAY_REQUEST_SIZE);
+            break;
+
+        case GATEWAY_STATE_RECEIVE:
+            if (!usbtmc.IsIdle())
+                break;
+
+            if (isEndOfMessage || isFailed)
+            {
+                state = GATEWAY_STATE_IDLE;
+                break;
+            }
+
+            // The client takes the response at its own pace
+            if (output.size() < GATEWAY_OUTPUT_LIMIT)
+                usbtmc.Request(GATEWAY_REQUEST_SIZE);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void GatewayInstrument::Loop()
+{
+    struct epoll_event events[4];
+
+    while (true)
+    {
+        int wait = (state != GATEWAY_STATE_IDLE || !usbtmc.IsIdle()) ? GATEWAY_BUSY_WAIT : GATEWAY_IDLE_WAIT;
+        int n = epoll_wait(epollFd, events, 4, wait);
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == listenFd)
+            {
+                Accept();
+                continue;
+            }
+
+            if (events[i].data.fd != clientFd)
+                continue;
+
+            if (events[i].events & EPOLLOUT)
+                FlushClient();
+            if (clientFd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                ReadClient();
+        }
+
+        usb.Task();
+
+        if (usb.getUsbTaskState() == USB_STATE_RUNNING)
+        {
+            usbtmc.Run();
+
+            // Several messages from one read go out back to back
+            uint8_t previous;
+            do
+            {
+                previous = state;
+                Step();
+            } while (state != previous && state == GATEWAY_STATE_IDLE);
+        }
+        else if (state != GATEWAY_STATE_IDLE)
+        {
+            // The instrument has gone with the transfer
+            if (state == GATEWAY_STATE_TRANSMIT)
+                inHead += messageLength;
+            isQuery = false;
+            state = GATEWAY_STATE_IDLE;
+        }
+
+        if (clientFd < 0 && state == GATEWAY_STATE_IDLE && usbtmc.IsIdle())
+        {
+            inHead = inTail = scanOffset = 0;
+            SetListening(true);
+        }
+
+        UpdateEvents();
+    }
+}
+
+void GatewayInstrument::OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr __attribute__((unused)), uint8_t serialNumLen __attribute__((unused)))
+{
+    fprintf(stderr, "port %d: connected %04X:%04X\n", port, pdescr->idVendor, pdescr->idProduct);
+}
+
+void GatewayInstrument::OnReceived(uint8_t data)
+{
+    WriteClient(&data, 1);
+}
+
+void GatewayInstrument::OnReceivedData(const uint8_t *dataptr, uint16_t length)
+{
+    WriteClient(dataptr, length);
+}
+
+void GatewayInstrument::OnReadStatusByte(uint8_t status __attribute__((unused)))
+{
+}
+
+void GatewayInstrument::OnFailed(USBTMCInformation info, uint8_t code)
+{
+    // The notices of a finished abort or clear are not failures
+    if (static_cast<int16_t>(info) < 0)
+    {
+        fprintf(stderr, "port %d: failed %d (0x%02X)\n", port, (int)info, code);
+        isFailed = true;
+    }
+}
+
+void GatewayInstrument::OnTransferHeader(uint32_t transferSize __attribute__((unused)), bool isEndOfMessage)
+{
+    this->isEndOfMessage = isEndOfMessage;
+}
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: usbtmc_gateway [-a address] [-p port] [-n instruments] [-d vid:pid | -s]\n"
+        "       serves the instruments on port, port + 1, ... (127.0.0.1:5025 by default)\n"
+        "       -s serves simulated instruments\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *address = "127.0.0.1";
+    int port = GATEWAY_DEFAULT_PORT;
+    int count = 1;
+    unsigned int vid = 0, pid = 0;
+    bool isSimulated = false;
+    std::vector<GatewayInstrument *> instruments;
+    std::vector<std::thread> threads;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+            address = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%x:%x", &vid, &pid) == 2)
+            i++;
+        else if (strcmp(argv[i], "-s") == 0)
+            isSimulated = true;
+        else
+        {
+            Usage();
+            return 2;
+        }
+    }
+
+    if (port <= 0 || count <= 0 || port + count > 65536)
+    {
+        Usage();
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < count; i++)
+    {
+        USBBackend *backend;
+
+        if (isSimulated)
+        {
+            backend = new SimulatedBackend((uint8_t)i);
+        }
+        else
+        {
+            USBFSBackend *usbfs = new USBFSBackend();
+            usbfs->SetTarget((uint16_t)vid, (uint16_t)pid);
+            backend = usbfs;
+        }
+
+        GatewayInstrument *instrument = new GatewayInstrument(backend, port + i);
+
+        if (!instrument->Open(address))
+            return 1;
+
+        instruments.push_back(instrument);
+    }
+
+    // One event loop per instrument
+    for (size_t i = 0; i < instruments.size(); i++)
+        threads.push_back(std::thread(&GatewayInstrument::Loop, instruments[i]));
+
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    return 0;
+}
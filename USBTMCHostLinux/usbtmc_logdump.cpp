@@ -0,0 +1,203 @@
+/*
+ * Log decoder for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// Prints a log of USBTMCLogger (usbtmc_logger.h) as text, one record a line:
+//   <microseconds> <channel> R <reading>
+//   <microseconds> <channel> S <count> <sample> <sample> ...
+// The time is the sum of the deltas from the beginning of the log.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#define __USBTMC_LOGGER_FORMAT_ONLY__
+#include "usbtmc_logger.h"
+#include "usbtmc_sample.h"
+
+class LogReader
+{
+    FILE *file;
+
+public:
+    bool isEnd;
+
+    LogReader(FILE *file) : file(file), isEnd(false) {};
+
+    uint8_t Byte()
+    {
+        int c = fgetc(file);
+
+        if (c == EOF)
+        {
+            isEnd = true;
+            return 0;
+        }
+
+        return (uint8_t)c;
+    }
+
+    uint32_t Varint()
+    {
+        uint32_t value = 0;
+
+        for (int shift = 0; shift < 35 && !isEnd; shift += 7)
+        {
+            uint8_t data = Byte();
+
+            value |= (uint32_t)(data & 0x7F) << shift;
+            if ((data & 0x80) == 0)
+                break;
+        }
+
+        return value;
+    }
+
+    int32_t Zigzag()
+    {
+        uint32_t value = Varint();
+
+        return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+    }
+};
+
+static int32_t RawSample(USBTMCSampleFormat format, uint8_t first, uint8_t second)
+{
+    switch (format)
+    {
+        case USBTMCSampleFormat::Int8:
+            return (int8_t)first;
+        case USBTMCSampleFormat::UInt8:
+            return first;
+        case USBTMCSampleFormat::Int16LE:
+            return (int16_t)(first | (second << 8));
+        case USBTMCSampleFormat::Int16BE:
+            return (int16_t)(second | (first << 8));
+        case USBTMCSampleFormat::UInt16LE:
+            return first | (second << 8);
+        default:
+            return second | (first << 8);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *file = stdin;
+    char magic[sizeof(USBTMC_LOGGER_MAGIC) - 1];
+    int64_t time = 0;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-' && argv[1][1] != '\0'))
+    {
+        fprintf(stderr, "usage: usbtmc_logdump [log file]\n");
+        return 2;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "-") != 0)
+    {
+        file = fopen(argv[1], "rb");
+        if (file == NULL)
+        {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    LogReader reader(file);
+
+    for (size_t i = 0; i < sizeof(magic); i++)
+        magic[i] = (char)reader.Byte();
+
+    if (reader.isEnd || memcmp(magic, USBTMC_LOGGER_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "not a log\n");
+        return 1;
+    }
+
+    if (reader.Byte() != USBTMC_LOGGER_VERSION)
+    {
+        fprintf(stderr, "unknown log version\n");
+        return 1;
+    }
+
+    while (true)
+    {
+        uint8_t tag = reader.Byte();
+
+        if (reader.isEnd)
+            break;
+
+        time += reader.Zigzag();
+
+        switch (tag >> 4)
+        {
+            case USBTMC_LOGGER_TYPE_READING:
+            {
+                uint32_t length = reader.Varint();
+                std::vector<char> text;
+
+                for (uint32_t i = 0; i < length && !reader.isEnd; i++)
+                    text.push_back((char)reader.Byte());
+
+                printf("%lld %u R %.*s\n", (long long)time, tag & 0x0F, (int)text.size(), text.data());
+                break;
+            }
+
+            case USBTMC_LOGGER_TYPE_SAMPLES:
+            {
+                USBTMCSampleFormat format = (USBTMCSampleFormat)reader.Byte();
+                uint8_t coding = reader.Byte();
+                uint32_t count = reader.Varint();
+                uint8_t size = USBTMCSampleSize(format);
+                int32_t value = 0;
+
+                printf("%lld %u S %u", (long long)time, tag & 0x0F, count);
+
+                for (uint32_t i = 0; i < count && !reader.isEnd; i++)
+                {
+                    if (coding == USBTMC_LOGGER_CODING_DELTA)
+                    {
+                        value += reader.Zigzag();
+                    }
+                    else
+                    {
+                        uint8_t first = reader.Byte();
+                        uint8_t second = (size == 2) ? reader.Byte() : 0;
+
+                        value = RawSample(format, first, second);
+                    }
+
+                    printf(" %d", value);
+                }
+
+                printf("\n");
+                break;
+            }
+
+            default:
+                fprintf(stderr, "unknown record %02X, the rest is not decoded\n", tag);
+                return 1;
+        }
+
+        if (reader.isEnd)
+        {
+            fprintf(stderr, "the last record is cut off\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,475 @@
+/*
+ * SCPI script compiler for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// Compiles a script to the bytecode of USBTMCScript and prints it as a PROGMEM array.
+//
+//   # comment
+//   send :CHAN1:SCAL {r0}        {rN} is replaced by register N
+//   query r0 :CHAN1:SCAL?        response to register 0
+//   wait 0x20 5000               status byte mask, timeout in ms
+//   delay 100                    ms
+//   loop:                        label
+//   jump loop
+//   ifeq r0 "STOP" loop          jump when register 0 is the text
+//   ifne r0 "STOP" loop
+//   end
+//
+// With -j, back to back sends are joined with ';' into one message as long as it fits.
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#define __USBTMC_SCRIPT_OPCODES_ONLY__
+#include "usbtmc_script.h"
+
+#define DEFAULT_MESSAGE_SIZE    64
+#define DEFAULT_REGISTER_SIZE   16
+
+struct Fixup {
+    size_t position;
+    std::string label;
+    int line;
+};
+
+class Compiler
+{
+    std::vector<uint8_t> code;
+    std::map<std::string, size_t> labels;
+    std::vector<Fixup> fixups;
+
+    // Message being joined
+    std::vector<uint8_t> message;
+    size_t messageLength;       // worst case, registers count as full
+    bool hasMessage;
+
+    int lineNumber;
+    bool isFailed;
+
+    void Error(const char *text)
+    {
+        fprintf(stderr, "line %d: %s\n", lineNumber, text);
+        isFailed = true;
+    }
+
+    void Word(uint16_t value)
+    {
+        code.push_back(value & 0xFF);
+        code.push_back(value >> 8);
+    }
+
+    bool ParseRegister(const std::string &token, uint8_t &index)
+    {
+        char *end;
+        long value;
+
+        if (token.size() < 2 || token[0] != 'r')
+            return false;
+
+        value = strtol(token.c_str() + 1, &end, 10);
+        if (*end != '\0' || value < 0 || value >= registerCount)
+            return false;
+
+        index = (uint8_t)value;
+        return true;
+    }
+
+    bool ParseNumber(const std::string &token, long maximum, long &value)
+    {
+        char *end;
+
+        errno = 0;
+        value = strtol(token.c_str(), &end, 0);
+        return !token.empty() && *end == '\0' && errno == 0 && value >= 0 && value <= maximum;
+    }
+
+    // TEXT and REGISTER parts of a command text
+    bool Parts(const std::string &text, std::vector<uint8_t> &parts, size_t &length)
+    {
+        std::string literal;
+        size_t i = 0;
+
+        length = 0;
+
+        while (i <= text.size())
+        {
+            bool isRegister = (i < text.size() && text[i] == '{');
+
+            if (i == text.size() || isRegister)
+            {
+                for (size_t n = 0; n < literal.size(); n += 255)
+                {
+                    std::string chunk = literal.substr(n, 255);
+
+                    parts.push_back(USBTMC_SCRIPT_TEXT);
+                    parts.push_back((uint8_t)chunk.size());
+                    parts.insert(parts.end(), chunk.begin(), chunk.end());
+                }
+                length += literal.size();
+                literal.clear();
+            }
+
+            if (i == text.size())
+                break;
+
+            if (isRegister)
+            {
+                size_t close = text.find('}', i);
+                uint8_t index;
+
+                if (close == std::string::npos || !ParseRegister(text.substr(i + 1, close - i - 1), index))
+                {
+                    Error("bad register in text");
+                    return false;
+                }
+
+                parts.push_back(USBTMC_SCRIPT_REGISTER);
+                parts.push_back(index);
+                length += registerSize - 1;
+                i = close + 1;
+                continue;
+            }
+
+            literal += text[i++];
+        }
+
+        return true;
+    }
+
+    void FlushMessage()
+    {
+        if (!hasMessage)
+            return;
+
+        code.insert(code.end(), message.begin(), message.end());
+        code.push_back(USBTMC_SCRIPT_SEND);
+        message.clear();
+        messageLength = 0;
+        hasMessage = false;
+    }
+
+    void Send(const std::string &text)
+    {
+        std::vector<uint8_t> parts;
+        size_t length;
+
+        if (!Parts(text, parts, length))
+            return;
+
+        // The terminator and a separator
+        if (hasMessage && (!isJoining || messageLength + 1 + length + 1 > messageSize))
+            FlushMessage();
+
+        if (length + 1 > messageSize)
+        {
+            Error("command longer than the message size");
+            return;
+        }
+
+        if (hasMessage)
+        {
+            message.push_back(USBTMC_SCRIPT_TEXT);
+            message.push_back(1);
+            message.push_back(';');
+            messageLength++;
+        }
+
+        message.insert(message.end(), parts.begin(), parts.end());
+        messageLength += length;
+        hasMessage = true;
+    }
+
+    void Target(const std::string &label)
+    {
+        fixups.push_back({code.size(), label, lineNumber});
+        Word(0);
+    }
+
+    static std::string Token(const std::string &line, size_t &position)
+    {
+        size_t begin = line.find_first_not_of(" \t", position);
+
+        if (begin == std::string::npos)
+        {
+            position = line.size();
+            return "";
+        }
+
+        size_t end = line.find_first_of(" \t", begin);
+        if (end == std::string::npos)
+            end = line.size();
+
+        position = end;
+        return line.substr(begin, end - begin);
+    }
+
+    static std::string Rest(const std::string &line, size_t position)
+    {
+        size_t begin = line.find_first_not_of(" \t", position);
+        size_t end = line.find_last_not_of(" \t\r");
+
+        return (begin == std::string::npos) ? "" : line.substr(begin, end - begin + 1);
+    }
+
+public:
+    size_t messageSize;
+    int registerCount;
+    size_t registerSize;
+    bool isJoining;
+
+    Compiler() : messageLength(0), hasMessage(false), lineNumber(0), isFailed(false),
+                 messageSize(DEFAULT_MESSAGE_SIZE), registerCount(16), registerSize(DEFAULT_REGISTER_SIZE), isJoining(false) {};
+
+    void Line(const std::string &text)
+    {
+        std::string line = text;
+        size_t position = 0;
+        std::string op;
+
+        lineNumber++;
+
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+
+        op = Token(line, position);
+        if (op.empty() || op[0] == '#')
+            return;
+
+        if (op == "send")
+        {
+            Send(Rest(line, position));
+            return;
+        }
+
+        // Anything else ends a joined message
+        FlushMessage();
+
+        if (op[op.size() - 1] == ':' && Rest(line, position).empty())
+        {
+            std::string label = op.substr(0, op.size() - 1);
+
+            if (labels.count(label))
+                Error("label defined twice");
+            labels[label] = code.size();
+        }
+        else if (op == "query")
+        {
+            uint8_t index;
+            std::vector<uint8_t> parts;
+            size_t length;
+
+            if (!ParseRegister(Token(line, position), index))
+            {
+                Error("query needs a register");
+                return;
+            }
+
+            if (!Parts(Rest(line, position), parts, length))
+                return;
+            if (length + 1 > messageSize)
+                Error("command longer than the message size");
+
+            code.insert(code.end(), parts.begin(), parts.end());
+            code.push_back(USBTMC_SCRIPT_QUERY);
+            code.push_back(index);
+        }
+        else if (op == "wait")
+        {
+            long mask, timeout;
+
+            if (!ParseNumber(Token(line, position), 0xFF, mask) || !ParseNumber(Token(line, position), 0xFFFF, timeout))
+            {
+                Error("wait needs a mask and a timeout");
+                return;
+            }
+
+            code.push_back(USBTMC_SCRIPT_WAIT_STATUS);
+            code.push_back((uint8_t)mask);
+            Word((uint16_t)timeout);
+        }
+        else if (op == "delay")
+        {
+            long milliseconds;
+
+            if (!ParseNumber(Token(line, position), 0xFFFF, milliseconds))
+            {
+                Error("delay needs milliseconds");
+                return;
+            }
+
+            code.push_back(USBTMC_SCRIPT_DELAY);
+            Word((uint16_t)milliseconds);
+        }
+        else if (op == "jump")
+        {
+            code.push_back(USBTMC_SCRIPT_JUMP);
+            Target(Token(line, position));
+        }
+        else if (op == "ifeq" || op == "ifne")
+        {
+            uint8_t index;
+            std::string rest;
+            size_t close;
+
+            if (!ParseRegister(Token(line, position), index))
+            {
+                Error("branch needs a register");
+                return;
+            }
+
+            rest = Rest(line, position);
+            close = rest.find('"', 1);
+            if (rest.empty() || rest[0] != '"' || close == std::string::npos || close - 1 > 255)
+            {
+                Error("branch needs a quoted text");
+                return;
+            }
+
+            std::string value = rest.substr(1, close - 1);
+            size_t labelPosition = close + 1;
+
+            code.push_back(op == "ifeq" ? USBTMC_SCRIPT_JUMP_IF_EQUAL : USBTMC_SCRIPT_JUMP_IF_NOT_EQUAL);
+            code.push_back(index);
+            code.push_back((uint8_t)value.size());
+            code.insert(code.end(), value.begin(), value.end());
+            Target(Token(rest, labelPosition));
+        }
+        else if (op == "end")
+        {
+            code.push_back(USBTMC_SCRIPT_END);
+        }
+        else
+        {
+            Error("unknown operation");
+        }
+    }
+
+    bool Finish()
+    {
+        FlushMessage();
+        code.push_back(USBTMC_SCRIPT_END);
+
+        for (size_t i = 0; i < fixups.size(); i++)
+        {
+            std::map<std::string, size_t>::iterator label = labels.find(fixups[i].label);
+
+            if (label == labels.end())
+            {
+                fprintf(stderr, "line %d: no label '%s'\n", fixups[i].line, fixups[i].label.c_str());
+                isFailed = true;
+                continue;
+            }
+
+            code[fixups[i].position] = label->second & 0xFF;
+            code[fixups[i].position + 1] = label->second >> 8;
+        }
+
+        if (code.size() > 0xFFFF)
+        {
+            fprintf(stderr, "script too long\n");
+            isFailed = true;
+        }
+
+        return !isFailed;
+    }
+
+    const std::vector<uint8_t> &Code()
+    {
+        return code;
+    }
+};
+
+static void Usage()
+{
+    fprintf(stderr, "usage: usbtmc_scriptc [-j] [-n name] [-m message size] [-r register size] script.txt > script.h\n");
+}
+
+int main(int argc, char **argv)
+{
+    Compiler compiler;
+    std::string name = "Script";
+    std::vector<std::string> source;
+    const char *path = NULL;
+    char buffer[1024];
+    FILE *file;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0)
+            compiler.isJoining = true;
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            name = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            compiler.messageSize = (size_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            compiler.registerSize = (size_t)atoi(argv[++i]);
+        else if (path == NULL && argv[i][0] != '-')
+            path = argv[i];
+        else
+        {
+            Usage();
+            return 2;
+        }
+    }
+
+    if (path == NULL || compiler.registerSize < 1)
+    {
+        Usage();
+        return 2;
+    }
+
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    while (fgets(buffer, sizeof(buffer), file) != NULL)
+    {
+        std::string line(buffer);
+
+        if (!line.empty() && line[line.size() - 1] == '\n')
+            line.erase(line.size() - 1);
+
+        source.push_back(line);
+        compiler.Line(line);
+    }
+
+    fclose(file);
+
+    if (!compiler.Finish())
+        return 1;
+
+    const std::vector<uint8_t> &code = compiler.Code();
+
+    printf("// Compiled by usbtmc_scriptc from %s\n//\n", path);
+    for (size_t i = 0; i < source.size(); i++)
+        printf("//   %s\n", source[i].c_str());
+    printf("\nconst uint8_t %s[] PROGMEM = {", name.c_str());
+
+    for (size_t i = 0; i < code.size(); i++)
+        printf("%s0x%02X", (i == 0) ? "\n    " : (i % 12 == 0) ? ",\n    " : ", ", code[i]);
+
+    printf("\n};\n");
+    return 0;
+}
@@ -0,0 +1,631 @@
+/*
+ * Waveform sample converter for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_waveform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define USBTMC_WAVEFORM_X86
+#include <immintrin.h>
+#endif
+
+#define KERNEL_SCALAR   0
+#define KERNEL_SSE2     1
+#define KERNEL_AVX2     2
+
+#define BLOCK_STATE_HASH        0   // waiting for '#'
+#define BLOCK_STATE_DIGITS      1   // number of length digits
+#define BLOCK_STATE_LENGTH      2   // length digits
+#define BLOCK_STATE_DATA        3
+#define BLOCK_STATE_DONE        4
+
+// Samples converted per step of ConvertInPlace()
+#define IN_PLACE_BLOCK          256
+
+typedef void (*FloatKernel)(const uint8_t *raw, size_t samples, float *out, float scale, float offset);
+typedef void (*DoubleKernel)(const uint8_t *raw, size_t samples, double *out, double scale, double offset);
+
+static bool isScalarForced = false;
+
+/* Scalar kernels */
+
+template <USBTMCSampleFormat F>
+static inline int32_t LoadSample(const uint8_t *p)
+{
+    switch (F)
+    {
+        case USBTMCSampleFormat::Int8:      return (int8_t)p[0];
+        case USBTMCSampleFormat::UInt8:     return p[0];
+        case USBTMCSampleFormat::Int16LE:   return (int16_t)(p[0] | (p[1] << 8));
+        case USBTMCSampleFormat::Int16BE:   return (int16_t)((p[0] << 8) | p[1]);
+        case USBTMCSampleFormat::UInt16LE:  return (uint16_t)(p[0] | (p[1] << 8));
+        case USBTMCSampleFormat::UInt16BE:  return (uint16_t)((p[0] << 8) | p[1]);
+    }
+    return 0;
+}
+
+template <USBTMCSampleFormat F>
+static inline size_t SampleSize()
+{
+    return (F == USBTMCSampleFormat::Int8 || F == USBTMCSampleFormat::UInt8) ? 1 : 2;
+}
+
+template <USBTMCSampleFormat F, typename T>
+static void ConvertScalar(const uint8_t *raw, size_t samples, T *out, T scale, T offset)
+{
+    const size_t size = SampleSize<F>();
+
+    for (size_t i = 0; i < samples; i++)
+        out[i] = (T)LoadSample<F>(raw + i * size) * scale + offset;
+}
+
+#if defined(USBTMC_WAVEFORM_X86)
+
+/* SSE2 kernels, 4 samples per step */
+
+template <USBTMCSampleFormat F>
+__attribute__((target("sse2"))) static inline __m128i Load4Sse2(const uint8_t *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x;
+
+    if (SampleSize<F>() == 1)
+    {
+        int32_t word;
+        memcpy(&word, p, sizeof(word));
+        x = _mm_cvtsi32_si128(word);
+
+        if (F == USBTMCSampleFormat::Int8)
+        {
+            x = _mm_unpacklo_epi8(x, x);
+            x = _mm_unpacklo_epi16(x, x);
+            return _mm_srai_epi32(x, 24);
+        }
+
+        x = _mm_unpacklo_epi8(x, zero);
+        return _mm_unpacklo_epi16(x, zero);
+    }
+
+    x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+
+    if (F == USBTMCSampleFormat::Int16BE || F == USBTMCSampleFormat::UInt16BE)
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+
+    if (F == USBTMCSampleFormat::Int16LE || F == USBTMCSampleFormat::Int16BE)
+    {
+        x = _mm_unpacklo_epi16(x, x);
+        return _mm_srai_epi32(x, 16);
+    }
+
+    return _mm_unpacklo_epi16(x, zero);
+}
+
+template <USBTMCSampleFormat F>
+__attribute__((target("sse2"))) static void ConvertFloatSse2(const uint8_t *raw, size_t samples, float *out, float scale, float offset)
+{
+    const size_t size = SampleSize<F>();
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 voffset = _mm_set1_ps(offset);
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4)
+    {
+        __m128 v = _mm_cvtepi32_ps(Load4Sse2<F>(raw + i * size));
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(v, vscale), voffset));
+    }
+
+    ConvertScalar<F, float>(raw + i * size, samples - i, out + i, scale, offset);
+}
+
+template <USBTMCSampleFormat F>
+__attribute__((target("sse2"))) static void ConvertDoubleSse2(const uint8_t *raw, size_t samples, double *out, double scale, double offset)
+{
+    const size_t size = SampleSize<F>();
+    const __m128d vscale = _mm_set1_pd(scale);
+    const __m128d voffset = _mm_set1_pd(offset);
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4)
+    {
+        __m128i v = Load4Sse2<F>(raw + i * size);
+        __m128d lo = _mm_cvtepi32_pd(v);
+        __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0xEE));
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_mul_pd(lo, vscale), voffset));
+        _mm_storeu_pd(out + i + 2, _mm_add_pd(_mm_mul_pd(hi, vscale), voffset));
+    }
+
+    ConvertScalar<F, double>(raw + i * size, samples - i, out + i, scale, offset);
+}
+
+/* AVX2 kernels, 8 samples per step */
+
+template <USBTMCSampleFormat F>
+__attribute__((target("avx2"))) static inline __m256i Load8Avx2(const uint8_t *p)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    __m128i x;
+
+    if (SampleSize<F>() == 1)
+    {
+        x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+        return (F == USBTMCSampleFormat::Int8) ? _mm256_cvtepi8_epi32(x) : _mm256_cvtepu8_epi32(x);
+    }
+
+    x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+
+    if (F == USBTMCSampleFormat::Int16BE || F == USBTMCSampleFormat::UInt16BE)
+        x = _mm_shuffle_epi8(x, swap);
+
+    if (F == USBTMCSampleFormat::Int16LE || F == USBTMCSampleFormat::Int16BE)
+        return _mm256_cvtepi16_epi32(x);
+
+    return _mm256_cvtepu16_epi32(x);
+}
+
+template <USBTMCSampleFormat F>
+__attribute__((target("avx2"))) static void ConvertFloatAvx2(const uint8_t *raw, size_t samples, float *out, float scale, float offset)
+{
+    const size_t size = SampleSize<F>();
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 voffset = _mm256_set1_ps(offset);
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m256 v = _mm256_cvtepi32_ps(Load8Avx2<F>(raw + i * size));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(v, vscale), voffset));
+    }
+
+    ConvertScalar<F, float>(raw + i * size, samples - i, out + i, scale, offset);
+}
+
+template <USBTMCSampleFormat F>
+__attribute__((target("avx2"))) static void ConvertDoubleAvx2(const uint8_t *raw, size_t samples, double *out, double scale, double offset)
+{
+    const size_t size = SampleSize<F>();
+    const __m256d vscale = _mm256_set1_pd(scale);
+    const __m256d voffset = _mm256_set1_pd(offset);
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m256i v = Load8Avx2<F>(raw + i * size);
+        __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+        __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1));
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(lo, vscale), voffset));
+        _mm256_storeu_pd(out + i + 4, _mm256_add_pd(_mm256_mul_pd(hi, vscale), voffset));
+    }
+
+    ConvertScalar<F, double>(raw + i * size, samples - i, out + i, scale, offset);
+}
+
+#endif // USBTMC_WAVEFORM_X86
+
+/* Kernel tables in USBTMCSampleFormat order */
+
+#define KERNEL_TABLE(kernel, T) { \
+    kernel<USBTMCSampleFormat::Int8>, \
+    kernel<USBTMCSampleFormat::UInt8>, \
+    kernel<USBTMCSampleFormat::Int16LE>, \
+    kernel<USBTMCSampleFormat::Int16BE>, \
+    kernel<USBTMCSampleFormat::UInt16LE>, \
+    kernel<USBTMCSampleFormat::UInt16BE> }
+
+template <USBTMCSampleFormat F>
+static void ConvertFloatScalar(const uint8_t *raw, size_t samples, float *out, float scale, float offset)
+{
+    ConvertScalar<F, float>(raw, samples, out, scale, offset);
+}
+
+template <USBTMCSampleFormat F>
+static void ConvertDoubleScalar(const uint8_t *raw, size_t samples, double *out, double scale, double offset)
+{
+    ConvertScalar<F, double>(raw, samples, out, scale, offset);
+}
+
+static const FloatKernel floatScalarKernels[] = KERNEL_TABLE(ConvertFloatScalar, float);
+static const DoubleKernel doubleScalarKernels[] = KERNEL_TABLE(ConvertDoubleScalar, double);
+#if defined(USBTMC_WAVEFORM_X86)
+static const FloatKernel floatSse2Kernels[] = KERNEL_TABLE(ConvertFloatSse2, float);
+static const DoubleKernel doubleSse2Kernels[] = KERNEL_TABLE(ConvertDoubleSse2, double);
+static const FloatKernel floatAvx2Kernels[] = KERNEL_TABLE(ConvertFloatAvx2, float);
+static const DoubleKernel doubleAvx2Kernels[] = KERNEL_TABLE(ConvertDoubleAvx2, double);
+#endif
+
+static uint8_t GetKernelLevel()
+{
+    static int level = -1;
+
+    if (isScalarForced)
+        return KERNEL_SCALAR;
+
+    if (level < 0)
+    {
+        level = KERNEL_SCALAR;
+#if defined(USBTMC_WAVEFORM_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            level = KERNEL_AVX2;
+        else if (__builtin_cpu_supports("sse2"))
+            level = KERNEL_SSE2;
+#endif
+    }
+
+    return (uint8_t)level;
+}
+
+static FloatKernel GetFloatKernel(USBTMCSampleFormat format)
+{
+    uint8_t index = (uint8_t)format;
+
+    switch (GetKernelLevel())
+    {
+#if defined(USBTMC_WAVEFORM_X86)
+        case KERNEL_AVX2:   return floatAvx2Kernels[index];
+        case KERNEL_SSE2:   return floatSse2Kernels[index];
+#endif
+        default:            return floatScalarKernels[index];
+    }
+}
+
+static DoubleKernel GetDoubleKernel(USBTMCSampleFormat format)
+{
+    uint8_t index = (uint8_t)format;
+
+    switch (GetKernelLevel())
+    {
+#if defined(USBTMC_WAVEFORM_X86)
+        case KERNEL_AVX2:   return doubleAvx2Kernels[index];
+        case KERNEL_SSE2:   return doubleSse2Kernels[index];
+#endif
+        default:            return doubleScalarKernels[index];
+    }
+}
+
+USBTMCWaveformConverter::USBTMCWaveformConverter()
+{
+    memset(&preamble, 0, sizeof(preamble));
+    preamble.yIncrement = 1.0;
+    preambleText[0] = '\0';
+    isPreambleValid = false;
+    format = USBTMCSampleFormat::UInt8;
+    UpdateScale();
+
+    BeginBlock((float *)NULL, 0);
+}
+
+const char *USBTMCWaveformConverter::GetKernelName()
+{
+    switch (GetKernelLevel())
+    {
+        case KERNEL_AVX2:   return "avx2";
+        case KERNEL_SSE2:   return "sse2";
+        default:            return "scalar";
+    }
+}
+
+void USBTMCWaveformConverter::UseScalarKernels(bool enable)
+{
+    isScalarForced = enable;
+}
+
+void USBTMCWaveformConverter::UpdateScale()
+{
+    // (raw - yReference) * yIncrement + yOrigin folded into raw * scale + offset
+    scale = preamble.yIncrement;
+    offset = preamble.yOrigin - preamble.yReference * preamble.yIncrement;
+    scaleFloat = (float)scale;
+    offsetFloat = (float)offset;
+}
+
+bool USBTMCWaveformConverter::SetPreamble(const char *text)
+{
+    USBTMCWaveformPreamble parsed;
+    double fields[10];
+    const char *p = text;
+    char *end;
+
+    if (IsPreambleCached(text))
+        return true;
+
+    for (int i = 0; i < 10; i++)
+    {
+        fields[i] = strtod(p, &end);
+        if (end == p)
+            return false;
+
+        p = end;
+        while (*p == ' ')
+            p++;
+
+        if (i < 9)
+        {
+            if (*p != ',')
+                return false;
+            p++;
+        }
+    }
+
+    parsed.format = (int32_t)fields[0];
+    parsed.type = (int32_t)fields[1];
+    parsed.points = (uint32_t)fields[2];
+    parsed.count = (uint32_t)fields[3];
+    parsed.xIncrement = fields[4];
+    parsed.xOrigin = fields[5];
+    parsed.xReference = fields[6];
+    parsed.yIncrement = fields[7];
+    parsed.yOrigin = fields[8];
+    parsed.yReference = fields[9];
+
+    SetPreamble(parsed);
+
+    // Only a text which fits is remembered
+    if (strlen(text) < sizeof(preambleText))
+        strcpy(preambleText, text);
+
+    return true;
+}
+
+void USBTMCWaveformConverter::SetPreamble(const USBTMCWaveformPreamble &value)
+{
+    preamble = value;
+    preambleText[0] = '\0';
+    isPreambleValid = true;
+    UpdateScale();
+}
+
+const USBTMCWaveformPreamble &USBTMCWaveformConverter::GetPreamble()
+{
+    return preamble;
+}
+
+bool USBTMCWaveformConverter::IsPreambleCached(const char *text)
+{
+    return isPreambleValid && preambleText[0] != '\0' && strcmp(text, preambleText) == 0;
+}
+
+void USBTMCWaveformConverter::ClearPreambleCache()
+{
+    preambleText[0] = '\0';
+}
+
+void USBTMCWaveformConverter::SetFormat(USBTMCSampleFormat value)
+{
+    format = value;
+    hasCarry = false;
+}
+
+USBTMCSampleFormat USBTMCWaveformConverter::GetFormat()
+{
+    return format;
+}
+
+uint8_t USBTMCWaveformConverter::BytesPerSample()
+{
+    return USBTMCSampleSize(format);
+}
+
+double USBTMCWaveformConverter::Scale(int32_t raw)
+{
+    return raw * scale + offset;
+}
+
+size_t USBTMCWaveformConverter::Convert(const uint8_t *raw, size_t bytes, float *out)
+{
+    size_t samples = bytes / BytesPerSample();
+
+    GetFloatKernel(format)(raw, samples, out, scaleFloat, offsetFloat);
+    return samples;
+}
+
+size_t USBTMCWaveformConverter::Convert(const uint8_t *raw, size_t bytes, double *out)
+{
+    size_t samples = bytes / BytesPerSample();
+
+    GetDoubleKernel(format)(raw, samples, out, scale, offset);
+    return samples;
+}
+
+float *USBTMCWaveformConverter::ConvertInPlace(void *buffer, size_t bytes)
+{
+    const uint8_t size = BytesPerSample();
+    const FloatKernel kernel = GetFloatKernel(format);
+    uint8_t *raw = static_cast<uint8_t *>(buffer);
+    float *out = static_cast<float *>(buffer);
+    uint8_t block[IN_PLACE_BLOCK * 2];
+    size_t end = bytes / size;
+
+    // From the tail, a value never lands on a sample which is not converted yet
+    while (end > 0)
+    {
+        size_t start = (end > IN_PLACE_BLOCK) ? end - IN_PLACE_BLOCK : 0;
+
+        memcpy(block, raw + start * size, (end - start) * size);
+        kernel(block, end - start, out + start, scaleFloat, offsetFloat);
+        end = start;
+    }
+
+    return out;
+}
+
+double *USBTMCWaveformConverter::ConvertInPlaceDouble(void *buffer, size_t bytes)
+{
+    const uint8_t size = BytesPerSample();
+    const DoubleKernel kernel = GetDoubleKernel(format);
+    uint8_t *raw = static_cast<uint8_t *>(buffer);
+    double *out = static_cast<double *>(buffer);
+    uint8_t block[IN_PLACE_BLOCK * 2];
+    size_t end = bytes / size;
+
+    while (end > 0)
+    {
+        size_t start = (end > IN_PLACE_BLOCK) ? end - IN_PLACE_BLOCK : 0;
+
+        memcpy(block, raw + start * size, (end - start) * size);
+        kernel(block, end - start, out + start, scale, offset);
+        end = start;
+    }
+
+    return out;
+}
+
+void USBTMCWaveformConverter::BeginBlock(float *out, size_t capacity)
+{
+    outFloat = out;
+    outDouble = NULL;
+    outCapacity = (out != NULL) ? capacity : 0;
+    outCount = 0;
+    isOverflowed = false;
+    blockState = BLOCK_STATE_HASH;
+    lengthDigits = 0;
+    blockRemaining = 0;
+    hasCarry = false;
+}
+
+void USBTMCWaveformConverter::BeginBlock(double *out, size_t capacity)
+{
+    BeginBlock((float *)NULL, 0);
+    outDouble = out;
+    outCapacity = (out != NULL) ? capacity : 0;
+}
+
+size_t USBTMCWaveformConverter::ConvertSamples(const uint8_t *raw, size_t samples)
+{
+    if (samples > outCapacity - outCount)
+    {
+        isOverflowed = true;
+        samples = outCapacity - outCount;
+    }
+
+    if (samples == 0)
+        return 0;
+
+    if (outFloat != NULL)
+        GetFloatKernel(format)(raw, samples, outFloat + outCount, scaleFloat, offsetFloat);
+    else
+        GetDoubleKernel(format)(raw, samples, outDouble + outCount, scale, offset);
+
+    outCount += samples;
+    return samples;
+}
+
+size_t USBTMCWaveformConverter::Feed(const uint8_t *dataptr, size_t length)
+{
+    const uint8_t size = BytesPerSample();
+    size_t produced = 0;
+
+    while (length > 0 && blockState != BLOCK_STATE_DATA)
+    {
+        uint8_t c = *dataptr++;
+        length--;
+
+        switch (blockState)
+        {
+            case BLOCK_STATE_HASH:
+                // A response header such as "CURVE " may come first
+                if (c == '#')
+                    blockState = BLOCK_STATE_DIGITS;
+                break;
+
+            case BLOCK_STATE_DIGITS:
+                if (c < '0' || c > '9')
+                {
+                    blockState = BLOCK_STATE_HASH;
+                    break;
+                }
+
+                lengthDigits = c - '0';
+                blockRemaining = 0;
+
+                // "#0" is the indefinite length block, it runs to the end of the message
+                if (lengthDigits == 0)
+                {
+                    blockRemaining = UINT64_MAX;
+                    blockState = BLOCK_STATE_DATA;
+                }
+                else
+                    blockState = BLOCK_STATE_LENGTH;
+                break;
+
+            case BLOCK_STATE_LENGTH:
+                if (c < '0' || c > '9')
+                {
+                    blockState = BLOCK_STATE_HASH;
+                    break;
+                }
+
+                blockRemaining = blockRemaining * 10 + (c - '0');
+                if (--lengthDigits == 0)
+                    blockState = (blockRemaining > 0) ? BLOCK_STATE_DATA : BLOCK_STATE_DONE;
+                break;
+
+            default:
+                // The terminator after the block is ignored
+                return produced;
+        }
+    }
+
+    if (blockState != BLOCK_STATE_DATA || length == 0)
+        return produced;
+
+    if (length > blockRemaining)
+        length = (size_t)blockRemaining;
+
+    blockRemaining -= length;
+
+    if (hasCarry && length > 0)
+    {
+        // The first byte of the sample came with the previous chunk
+        uint8_t sample[2] = { carry, dataptr[0] };
+
+        produced += ConvertSamples(sample, 1);
+        hasCarry = false;
+        dataptr++;
+        length--;
+    }
+
+    size_t samples = length / size;
+    produced += ConvertSamples(dataptr, samples);
+
+    if (length % size)
+    {
+        carry = dataptr[samples * size];
+        hasCarry = true;
+    }
+
+    if (blockRemaining == 0)
+        blockState = BLOCK_STATE_DONE;
+
+    return produced;
+}
+
+bool USBTMCWaveformConverter::IsBlockComplete()
+{
+    return (blockState == BLOCK_STATE_DONE);
+}
+
+size_t USBTMCWaveformConverter::SampleCount()
+{
+    return outCount;
+}
+
+bool USBTMCWaveformConverter::IsOverflowed()
+{
+    return isOverflowed;
+}
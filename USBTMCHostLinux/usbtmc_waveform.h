@@ -0,0 +1,117 @@
+/*
+ * Waveform sample converter for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_WAVEFORM_H__)
+#define __USBTMC_WAVEFORM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbtmc_sample.h"
+
+// The ten fields of :WAV:PRE?
+typedef struct tagUSBTMC_WAVEFORM_PREAMBLE {
+    int32_t format;
+    int32_t type;
+    uint32_t points;
+    uint32_t count;
+    double xIncrement;
+    double xOrigin;
+    double xReference;
+    double yIncrement;
+    double yOrigin;
+    double yReference;
+} USBTMCWaveformPreamble;
+
+#define USBTMC_PREAMBLE_TEXT_SIZE 256
+
+// Converts raw samples to volts as (raw - yReference) * yIncrement + yOrigin.
+// The kernels use AVX2 or SSE2 when the CPU has them and fall back to scalar code.
+//
+// Feed() takes the payload chunks of the receive path (OnReceivedData()) including the
+// IEEE 488.2 definite length block header, samples split between chunks are carried over.
+class USBTMCWaveformConverter
+{
+public:
+    USBTMCWaveformConverter();
+
+    // Parses the :WAV:PRE? response, the same text as last time is not parsed again.
+    // Returns false when the text is not a preamble, the previous scale is kept then.
+    bool SetPreamble(const char *text);
+    void SetPreamble(const USBTMCWaveformPreamble &preamble);
+    const USBTMCWaveformPreamble &GetPreamble();
+    // True when text is the preamble in use, the caller may skip querying the scale then
+    bool IsPreambleCached(const char *text);
+    void ClearPreambleCache();
+
+    void SetFormat(USBTMCSampleFormat format);
+    USBTMCSampleFormat GetFormat();
+    uint8_t BytesPerSample();
+
+    // One raw value, for values which are not samples such as an envelope
+    double Scale(int32_t raw);
+
+    // Whole buffers, returns the number of samples written to out
+    size_t Convert(const uint8_t *raw, size_t bytes, float *out);
+    size_t Convert(const uint8_t *raw, size_t bytes, double *out);
+
+    // The samples are replaced by their values in the same buffer.
+    // The buffer must hold (bytes / BytesPerSample()) values of the output type.
+    float *ConvertInPlace(void *buffer, size_t bytes);
+    double *ConvertInPlaceDouble(void *buffer, size_t bytes);
+
+    // Streaming from the receive path into a caller buffer
+    void BeginBlock(float *out, size_t capacity);
+    void BeginBlock(double *out, size_t capacity);
+    // Returns the number of samples produced by this chunk
+    size_t Feed(const uint8_t *dataptr, size_t length);
+    bool IsBlockComplete();
+    size_t SampleCount();
+    bool IsOverflowed();
+
+    // "avx2", "sse2" or "scalar"
+    static const char *GetKernelName();
+    // Forces the scalar kernels, for comparison
+    static void UseScalarKernels(bool enable);
+
+private:
+    USBTMCWaveformPreamble preamble;
+    char preambleText[USBTMC_PREAMBLE_TEXT_SIZE];
+    bool isPreambleValid;
+    USBTMCSampleFormat format;
+    float scaleFloat;
+    float offsetFloat;
+    double scale;
+    double offset;
+
+    // Block state
+    float *outFloat;
+    double *outDouble;
+    size_t outCapacity;
+    size_t outCount;
+    bool isOverflowed;
+    uint8_t blockState;
+    uint8_t lengthDigits;
+    uint64_t blockRemaining;
+    uint8_t carry;
+    bool hasCarry;
+
+    void UpdateScale();
+    size_t ConvertSamples(const uint8_t *raw, size_t samples);
+};
+
+#endif // __USBTMC_WAVEFORM_H__
@@ -4,6 +4,9 @@
 #include <usbhub.h>
 
 #include "usbtmc.h"
+#include "usbtmc_eeprom.h"
+#include "usbtmc_fifo.h"
+#include "usbtmc_frame.h"
 
 // Satisfy the IDE, which needs to see the include statement in the ino too.
 #ifdef dobogusinclude
@@ -17,17 +20,60 @@ const char SerialTerminator = '\n';
 
 static bool isTransmitOnBin = false;
 
+// Received packets and frames are staged here and go to the UART as far as it has room,
+// so USB reception goes on while the UART drains.
+#define SERIAL_STAGING_SIZE 128
+USBTMCFifo<SERIAL_STAGING_SIZE> SerialStaging;
+
+// Frame mode ("#FM;") carries raw payloads in COBS frames, see usbtmc_frame.h.
+// Every command frame is acknowledged with its sequence number once it is accepted,
+// so the PC may send the next one without waiting for the response.
+#define FRAME_WRITE         'W' // PC: message with EOM
+#define FRAME_BEGIN_WRITE   'B' // PC: total size (uint32 LE), the message follows in FRAME_DATA
+#define FRAME_DATA          'D' // PC: bytes of FRAME_BEGIN_WRITE, device: received payload
+#define FRAME_READ          'R' // PC: request size (uint32 LE), 1024 when empty
+#define FRAME_STATUS_BYTE   'S' // PC: read status byte, device: status byte
+#define FRAME_CLEAR         'C' // PC: clear
+#define FRAME_EXIT          'X' // PC: back to the text commands
+#define FRAME_ACK           'A' // device: sequence number of the accepted frame
+#define FRAME_NAK           'N' // device: a corrupted frame, sequence number of the last accepted one
+#define FRAME_END           'E' // device: end of FRAME_READ, EOM flag
+#define FRAME_FAILED        'F' // device: USBTMCInformation (int16 LE), code
+#define FRAME_ATTACHED      'U' // device: VID, PID (uint16 LE)
+
+USBTMCFrameLink FrameLink(&Serial);
+static_assert(SERIAL_STAGING_SIZE >= USBTMC_FRAME_ENCODED_SIZE, "SerialStaging must hold a whole frame");
+static bool isFrameMode = false;
+static bool isFrameRequestPending = false;
+static bool isFrameEndOfMessage = false;
+static bool hasFrameSequence = false;
+static uint8_t frameSequence;
+static uint8_t frameDataOffset;
+
 class USBTMCAsync : public USBTMCAsyncOper
 {
 public:
     void OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr, uint8_t serialNumLen);
     void OnReceived(uint8_t data);
+    void OnReceivedData(const uint8_t *dataptr, uint16_t length);
     void OnReadStatusByte(uint8_t status);
     void OnFailed(USBTMCInformation info, uint8_t code);
+    void OnSessionRestored();
+    void OnTransferHeader(uint32_t transferSize, bool isEndOfMessage);
 };
 
 void USBTMCAsync::OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr, uint8_t serialNumLen)
 {
+    if (isFrameMode)
+    {
+        uint8_t ids[4] = {(uint8_t)pdescr->idVendor, (uint8_t)(pdescr->idVendor >> 8),
+                          (uint8_t)pdescr->idProduct, (uint8_t)(pdescr->idProduct >> 8)};
+        stageFrame(FRAME_ATTACHED, ids, sizeof(ids));
+        return;
+    }
+
+    flushSerial();
+
     Serial.print(F("ProductID:"));
     Serial.println(pdescr->idProduct, HEX);
 
@@ -45,11 +91,43 @@ void USBTMCAsync::OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumP
 
 void USBTMCAsync::OnReceived(uint8_t data)
 {
-    Serial.write(data);
+    stageSerial(&data, 1);
+}
+
+void USBTMCAsync::OnReceivedData(const uint8_t *dataptr, uint16_t length)
+{
+    if (!isFrameMode)
+    {
+        stageSerial(dataptr, length);
+        drainSerial();
+        return;
+    }
+
+    while (length > 0)
+    {
+        uint8_t n = (length > USBTMC_FRAME_PAYLOAD_SIZE) ? USBTMC_FRAME_PAYLOAD_SIZE : length;
+
+        stageFrame(FRAME_DATA, dataptr, n);
+        dataptr += n;
+        length -= n;
+    }
+}
+
+void USBTMCAsync::OnTransferHeader(uint32_t transferSize, bool isEndOfMessage)
+{
+    isFrameEndOfMessage = isEndOfMessage;
 }
 
 void USBTMCAsync::OnReadStatusByte(uint8_t status)
 {
+    if (isFrameMode)
+    {
+        stageFrame(FRAME_STATUS_BYTE, &status, 1);
+        return;
+    }
+
+    flushSerial();
+
     char high;
     char low;
     uint8_t tmp;
@@ -74,6 +152,15 @@ void USBTMCAsync::OnReadStatusByte(uint8_t status)
 
 void USBTMCAsync::OnFailed(USBTMCInformation info, uint8_t code)
 {
+    if (isFrameMode)
+    {
+        uint8_t failure[3] = {(uint8_t)static_cast<int16_t>(info), (uint8_t)(static_cast<int16_t>(info) >> 8), code};
+        stageFrame(FRAME_FAILED, failure, sizeof(failure));
+        return;
+    }
+
+    flushSerial();
+
     if (info == USBTMCInformation::ReceiveheaderNakAndTimeouted)
     {
         Serial.println(F("Receive timeout occured"));
@@ -110,10 +197,36 @@ void USBTMCAsync::OnFailed(USBTMCInformation info, uint8_t code)
     }
 }
 
+void USBTMCAsync::OnSessionRestored()
+{
+    if (isFrameMode)
+        return;
+
+    flushSerial();
+    Serial.println(F("Session Restored"));
+}
+
 USB Usb;
 // USBHub Hub1(&Usb);
 USBTMCAsync UsbtmcAsync;
 USBTMC Usbtmc(&Usb, &UsbtmcAsync);
+#if defined(USBTMC_HAS_EEPROM)
+// Capabilities and endpoints of known devices are kept on EEPROM
+USBTMCEEPROMStore DeviceStore;
+#endif
+
+// Device rules bind instruments to this instance and apply their own settings.
+// {VID, PID, serial number, {timestep, timeout, packet budget, max request size, TermChar}}
+// VID or PID 0x0000 and serial number NULL match any device.
+const char DMMSerialNumber[] PROGMEM = "MY00001234";
+const USBTMCDeviceRule DeviceRules[] PROGMEM = {
+    {0x0957, 0x0618, DMMSerialNumber, {0, 5000, 1, 0, '\n'}},   // Agilent Technologies,34405A
+    {0x1AB1, 0x0000, NULL, {10, 5000, 4, 0, 0}},                // Rigol Technologies
+};
+
+// Session preamble is replayed every time the instrument is (re)connected, one command per line.
+const char SessionPreamble[] PROGMEM = "*CLS\n"
+                                       "*ESE 1\n";
 
 void setup()
 {
@@ -131,6 +244,21 @@ void setup()
 
     Usbtmc.TimeStep(0); // Try to change timestep when you can not receive all of the data.
                         // Some test and measurement instruments can not respond quickly.
+
+#if 0
+    // Accept only the devices listed in DeviceRules
+    Usbtmc.SetDeviceRules(DeviceRules, sizeof(DeviceRules) / sizeof(DeviceRules[0]));
+#endif
+
+#if 0 && defined(USBTMC_HAS_EEPROM)
+    // Skip the discovery round trips when the device is connected again
+    Usbtmc.SetDeviceStore(&DeviceStore);
+#endif
+
+#if 0
+    // Restore the instrument setup after a power cycle
+    Usbtmc.SetSessionPreamble(SessionPreamble);
+#endif
 }
 
 void loop()
@@ -138,6 +266,19 @@ void loop()
     Usb.Task();
     Usbtmc.Run();
 
+    drainSerial();
+    if (Usbtmc.IsIdle())
+    {
+        // Some cores report no room at all in availableForWrite()
+        flushSerial();
+    }
+
+    if (isFrameMode)
+    {
+        frameTask();
+        return;
+    }
+
     if (Usb.getUsbTaskState() != USB_STATE_RUNNING)
     {
         return;
@@ -146,17 +287,26 @@ void loop()
     if (isTransmitOnBin)
     {
         // #48196XXXX,,,
-        while (Serial.available() > 0)
+        // Whatever is waiting on Serial goes to the driver in one block.
+        // Bytes the device can not take yet stay on Serial instead of aborting the transfer.
+        uint8_t block[USBTMC_MESSAGE_SIZE];
+        uint16_t length = Serial.available();
+        uint16_t space = Usbtmc.TransmitSpaceAvailable();
+
+        if (length > space)
+            length = space;
+        if (length > sizeof(block))
+            length = sizeof(block);
+
+        if (length > 0)
         {
-            Usbtmc.TransmitData(Serial.read());
-
-            if (Usbtmc.TransmitDone())
-            {
-                isTransmitOnBin = false;
-                break;
-            }
+            Serial.readBytes(block, length);
+            Usbtmc.TransmitData(block, length);
         }
 
+        if (Usbtmc.TransmitDone())
+            isTransmitOnBin = false;
+
         return;
     }
 
@@ -206,12 +356,183 @@ void loop()
     {
         Usbtmc.Clear();
     }
+    else if (command == "#FM;")
+    {
+        flushSerial();
+        Serial.println(F("Frame mode"));
+        isFrameMode = true;
+        hasFrameSequence = false;
+        FrameLink.Release();
+    }
     else
     {
         // ignore
     }
 }
 
+// Bulk writes as much as the UART takes without blocking
+void drainSerial()
+{
+    int room = Serial.availableForWrite();
+
+    while (room > 0 && SerialStaging.available() > 0)
+    {
+        uint16_t length;
+        const uint8_t *dataptr = SerialStaging.peekContiguous(length);
+
+        if (length > (uint16_t)room)
+            length = room;
+
+        Serial.write(dataptr, length);
+        SerialStaging.skip(length);
+        room -= length;
+    }
+}
+
+void flushSerial()
+{
+    while (SerialStaging.available() > 0)
+    {
+        uint16_t length;
+        const uint8_t *dataptr = SerialStaging.peekContiguous(length);
+
+        Serial.write(dataptr, length);
+        SerialStaging.skip(length);
+    }
+}
+
+// Blocks only when the staging area is full
+void stageSerial(const uint8_t *dataptr, uint16_t length)
+{
+    while (length > 0)
+    {
+        uint16_t n = SerialStaging.write(dataptr, length);
+
+        dataptr += n;
+        length -= n;
+
+        if (length > 0)
+            flushSerial();
+    }
+}
+
+// A frame goes into the staging area whole, so flushSerial() and drainSerial() only ever see complete frames behind it
+void stageFrame(uint8_t type, const uint8_t *payload, uint8_t length)
+{
+    uint8_t encoded[USBTMC_FRAME_ENCODED_SIZE];
+    uint8_t n = FrameLink.Encode(type, payload, length, encoded);
+
+    if (SerialStaging.space() < n)
+        drainSerial();
+
+    // Blocks only when the UART is behind by more than the staging area
+    if (SerialStaging.space() < n)
+        flushSerial();
+
+    SerialStaging.write(encoded, n);
+    drainSerial();
+}
+
+uint32_t frameSize(uint32_t defaultSize)
+{
+    const uint8_t *payload = FrameLink.Payload();
+
+    if (FrameLink.PayloadLength() < 4)
+        return defaultSize;
+
+    return (uint32_t)payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+}
+
+// Carries out the frame, false when it has to wait for the driver
+bool frameExecute()
+{
+    uint8_t type = FrameLink.FrameType();
+
+    if (type == FRAME_EXIT)
+    {
+        isFrameMode = false;
+        return true;
+    }
+
+    if (type == FRAME_DATA)
+    {
+        // Leave the rest of the frame while the device is busy instead of aborting the transfer
+        frameDataOffset += Usbtmc.TransmitData(FrameLink.Payload() + frameDataOffset, FrameLink.PayloadLength() - frameDataOffset);
+
+        return (frameDataOffset >= FrameLink.PayloadLength() || Usbtmc.TransmitDone());
+    }
+
+    if (Usb.getUsbTaskState() != USB_STATE_RUNNING || !Usbtmc.IsIdle() || isTransmitOnBin)
+        return false;
+
+    switch (type)
+    {
+    case FRAME_WRITE:
+        Usbtmc.Transmit(FrameLink.PayloadLength(), (uint8_t *)FrameLink.Payload());
+        break;
+    case FRAME_BEGIN_WRITE:
+        Usbtmc.BeginTransmit(frameSize(0));
+        isTransmitOnBin = true;
+        break;
+    case FRAME_READ:
+        isFrameEndOfMessage = false;
+        isFrameRequestPending = true;
+        Usbtmc.Request(frameSize(1024));
+        break;
+    case FRAME_STATUS_BYTE:
+        Usbtmc.ReadStatusByte();
+        break;
+    case FRAME_CLEAR:
+        Usbtmc.Clear();
+        break;
+    default:
+        // ignore
+        break;
+    }
+
+    return true;
+}
+
+void frameTask()
+{
+    uint8_t result = FrameLink.Poll();
+
+    if (isFrameRequestPending && Usbtmc.IsIdle())
+    {
+        stageFrame(FRAME_END, (const uint8_t *)&isFrameEndOfMessage, 1);
+        isFrameRequestPending = false;
+    }
+
+    if (isTransmitOnBin && Usbtmc.TransmitDone())
+        isTransmitOnBin = false;
+
+    if (result == USBTMC_FRAME_CORRUPTED)
+    {
+        stageFrame(FRAME_NAK, &frameSequence, hasFrameSequence ? 1 : 0);
+        return;
+    }
+
+    if (result != USBTMC_FRAME_READY)
+        return;
+
+    if (hasFrameSequence && FrameLink.FrameSequence() == frameSequence)
+    {
+        // The PC sent it again as the acknowledge was lost
+        stageFrame(FRAME_ACK, &frameSequence, 1);
+        FrameLink.Release();
+        return;
+    }
+
+    if (!frameExecute())
+        return;
+
+    frameSequence = FrameLink.FrameSequence();
+    hasFrameSequence = true;
+    frameDataOffset = 0;
+    stageFrame(FRAME_ACK, &frameSequence, 1);
+    FrameLink.Release();
+}
+
 String serialReceive()
 {
     static String tmpText = "";
@@ -17,17 +17,86 @@
  */
 #include "usbtmc.h"
 
-#define USBTMC_MESSAGE_SIZE 64
 #define USBTMC_RCV_HEADER_SIZE 12
+#define USBTMC_DEFAULT_TIMEOUT 5000
+#define USBTMC_STRING_DESCRIPTOR_SIZE USBTMC_MESSAGE_SIZE
+
+#if USBTMC_USE_SERIAL_NUMBER
+// bLength tells more than the buffer took, e.g. a serial number of more than 31 characters.
+// Such a string is only a prefix and never identifies the device.
+static bool IsStringTruncated(const uint8_t *dataptr, uint8_t length)
+{
+    return (length > 0 && dataptr[0] > length);
+}
+#endif
+
+#if USBTMC_USE_PROFILES
+// Known instruments, only used when the sketch passes them to SetProfiles().
+// {VID, PID, timestep, max request size, quirks}
+// PID 0x0000 matches any product of the vendor, the first match wins.
+const USBTMCProfile USBTMCDefaultProfiles[] PROGMEM = {
+    {0x1AB1, 0x04CE, 10, 1024, USBTMC_QUIRK_TERMCHAR_IGNORED},                               // Rigol DS1000Z series
+    {0x1AB1, 0x0000, 10, 0, USBTMC_QUIRK_TERMCHAR_IGNORED},                                  // Rigol Technologies
+};
+const uint8_t USBTMCDefaultProfilesCount = sizeof(USBTMCDefaultProfiles) / sizeof(USBTMCDefaultProfiles[0]);
+#endif
+
+#if USBTMC_SHARED_PACKET_BUFFER
+// One packet buffer shared by every instance, Run() and Init() never overlap
+uint8_t USBTMC::packetBuffer[USBTMC_MESSAGE_SIZE];
+bool USBTMC::isPacketBufferBusy = false;
+#endif
 
 const uint8_t USBTMC::epDataInIndex = 1;
 const uint8_t USBTMC::epDataOutIndex = 2;
 const uint8_t USBTMC::epInterruptInIndex = 3;
 
 USBTMC::USBTMC(USB* p, USBTMCAsyncOper * pasync, uint16_t vid, uint16_t pid) : 
-    pAsync(pasync), pUsb(p), targetVID(vid), targetPID(pid), serialNumberDataPtr(NULL), bAddress(0), bNumEP(1), bTag(1), rtb_bTag(2), commandState(USBTMCState::Idle), bin_current_size(0), previousMillis(0), timestepMillis(0), isConnected(false)
+    pAsync(pasync), pUsb(p), bAddress(0), bNumEP(1), isConnected(false), targetVID(vid), targetPID(pid), isRemoteEnabled(true), quirkFlags(0), isClearPending(false), bTag(1), rtb_bTag(2), commandState(USBTMCState::Idle), previousMillis(0), bin_current_size(0)
 {
-    fifo_flush();
+    baseConfig.timestepMillis = 0;
+    baseConfig.timeoutMillis = USBTMC_DEFAULT_TIMEOUT;
+    baseConfig.packetBudget = 1;
+    baseConfig.maxRequestSize = 0;
+    baseConfig.termChar = 0;
+    config = baseConfig;
+
+#if !USBTMC_SHARED_PACKET_BUFFER
+    isPacketBufferBusy = false;
+#endif
+#if USBTMC_USE_SERIAL_NUMBER
+    serialNumberDataPtr = NULL;
+    langID = 0;
+    langIDVID = 0;
+    langIDPID = 0;
+#endif
+#if USBTMC_USE_DEVICE_RULES
+    deviceRulesPtr = NULL;
+    deviceRulesCount = 0;
+    deviceRuleIndex = -1;
+#endif
+#if USBTMC_USE_SESSION
+    sessionPreamblePtr = NULL;
+    sessionOffset = 0;
+    sessionLineRemaining = 0;
+    isSessionPending = false;
+#endif
+#if USBTMC_USE_DEVICE_STORE
+    pStore = NULL;
+    isCachedConnection = false;
+    isDeviceKeyUnique = false;
+#endif
+#if USBTMC_USE_PROFILES
+    profilesPtr = NULL;
+    profilesCount = 0;
+#endif
+#if USBTMC_USE_LINE_MODE
+    lineTerminator = 0;
+    lineBuffer = NULL;
+    lineBufferSize = 0;
+    lineLength = 0;
+    isEndOfMessage = false;
+#endif
 
     for (uint8_t i = 0; i < USBTMC_MAX_ENDPOINTS; i++)
     {
@@ -53,6 +122,9 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
     EpInfo* oldep_ptr = NULL;
 
     uint8_t num_of_conf; // number of configurations
+    uint8_t* serialNumData;
+    uint8_t serialNumLength;
+    bool isCached;
 
     AddressPool & addrPool = pUsb->GetAddressPool();
 
@@ -94,13 +166,35 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
         }
     }
 
-    uint8_t serialNumData[255];
-    uint8_t serialNumLength;
+    ApplyProfile(udd);
+
+    // Reject the device by VID/PID before spending any control transfer on the serial number
+    if (!IsDeviceRuleCandidate(udd))
+    {
+        rcode = USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+        goto FailOnInit;
+    }
+
+    serialNumData = NULL;
+    serialNumLength = 0;
+
+#if USBTMC_USE_SERIAL_NUMBER
+    // The descriptor is only needed until OnRcvdDescr() returns
+    serialNumData = packetBuffer;
+
+    // The language table is read again only for another kind of device
+    if (udd->idVendor != langIDVID || udd->idProduct != langIDPID)
+    {
+        langID = 0;
+        langIDVID = udd->idVendor;
+        langIDPID = udd->idProduct;
+    }
+
     GetStringDescriptor(0, udd->iSerialNumber, serialNumData, &serialNumLength);
 
     if (serialNumberDataPtr != NULL)
     {
-        bool isValid = true;
+        bool isValid = !IsStringTruncated(serialNumData, serialNumLength);
         for (int i=0; i < serialNumLength; i++)
         {
             if (serialNumData[i] != pgm_read_byte(serialNumberDataPtr + i))
@@ -116,6 +210,24 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
             goto FailOnInit;
         }
     }
+#endif
+
+    rcode = MatchDeviceRule(udd, serialNumData, serialNumLength);
+
+    if (rcode)
+        goto FailOnInit;
+
+#if USBTMC_USE_DEVICE_STORE
+    deviceKey.vid = udd->idVendor;
+    deviceKey.pid = udd->idProduct;
+    deviceKey.serialHash = GetSerialNumberHash(serialNumData, serialNumLength);
+#if USBTMC_USE_SERIAL_NUMBER
+    // Devices which share the prefix of a long serial number would share the slot
+    isDeviceKeyUnique = !IsStringTruncated(serialNumData, serialNumLength);
+#else
+    isDeviceKeyUnique = true;
+#endif
+#endif
 
     pAsync->OnRcvdDescr(udd, serialNumData, serialNumLength);
 
@@ -157,7 +269,14 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
     if (rcode)
         goto FailSetDevTblEntry;
 
-    for (uint8_t i = 0; i < num_of_conf; i++)
+    // A known device skips the configuration descriptor and GET_CAPABILITIES round trips
+    isCached = LoadDeviceRecord();
+#if USBTMC_USE_DEVICE_STORE
+    isCachedConnection = isCached;
+#endif
+
+ReadConfiguration:
+    for (uint8_t i = 0; i < num_of_conf && !isCached; i++)
     {
         //USB Test and Measurement Device conforming to the USBTMC USB488 Subclass Specification found on www.usb.org.
         ConfigDescParser < USB_CLASS_APP_SPECIFIC, 0x03, 0x01, CP_MASK_COMPARE_ALL > confDescrParser(this);
@@ -180,34 +299,54 @@ uint8_t USBTMC::Init(uint8_t parent, uint8_t port, bool lowspeed)
     // Set Configuration Value
     rcode = pUsb->setConf(bAddress, 0, bConfNum);
 
-    if (rcode)
-        goto FailSetConfDescr;
-
-    rcode = GetCapabilities(&Capabilities);
+    if (rcode && isCached)
+    {
+        // The device has changed since it was stored, e.g. by a firmware update
+        DropDeviceRecord();
+        isCached = false;
+        bNumEP = 1;
+        goto ReadConfiguration;
+    }
 
     if (rcode)
-        goto FailOnInit;
+        goto FailSetConfDescr;
 
-    // Does the interface accept REN_CONTROL request?
-    if(Capabilities.USB488Interface & 0x02)
+    if (!isCached)
     {
-        // USB488 REN_CONTROL
-        // bRequest = 0xA0(160) REN_CONTROL
-        // wValLo = 0x01 Assert REN.
-        // wValHi = 0x00 Reserved. Must be 0x00.
-        // total, nbytes = 0x0001
-        uint8_t usbtmc_status;
-        rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0xA0, 0x01, 0x00, 0x0000, 0x0001, 0x0001, &usbtmc_status, NULL);
+        rcode = GetCapabilities(&Capabilities);
 
         if (rcode)
             goto FailOnInit;
 
-        if (usbtmc_status != 0x01)
+        SaveDeviceRecord();
+    }
+
+    if (isRemoteEnabled)
+    {
+        rcode = RenControl(true);
+
+        if (rcode && isCached)
+        {
+            DropDeviceRecord();
+            isCached = false;
+            bNumEP = 1;
+            goto ReadConfiguration;
+        }
+
+        if (rcode)
             goto FailOnInit;
     }
 
     isConnected = true;
 
+    // The quirky device is cleared and the session preamble is replayed from Run() once the device becomes idle
+    isClearPending = (quirkFlags & USBTMC_QUIRK_CLEAR_ON_INIT) ? true : false;
+#if USBTMC_USE_SESSION
+    isSessionPending = (sessionPreamblePtr != NULL);
+    sessionOffset = 0;
+    sessionLineRemaining = 0;
+#endif
+
     return 0;
 
 FailGetDevDescr:
@@ -244,44 +383,286 @@ Fail:
     return rcode;
 }
 
+#if USBTMC_USE_SERIAL_NUMBER
 uint8_t USBTMC::GetStringDescriptor(uint8_t addr, uint8_t idx, uint8_t* dataptr, uint8_t* datalen)
 {
     uint8_t rcode;
-    uint8_t length;
-    uint16_t langid;
 
-    // get language table length
-    rcode = pUsb->getStrDescr(addr, 0, 1, 0, 0, dataptr);  
-    if (rcode)
+    *datalen = 0;
+
+    if (idx == 0)
+        return 0;   // the device has no such string
+
+    if (langID == 0)
     {
-        return rcode;
+        // bLength, bDescriptorType and the first LANGID of the language table are enough
+        rcode = pUsb->getStrDescr(addr, 0, 4, 0, 0, dataptr);
+        if (rcode)
+        {
+            return rcode;
+        }
+
+        if (dataptr[0] < 4)
+        {
+            return USBTMC_ERR_UNEXPECTEDSIZE;
+        }
+
+        langID = (dataptr[3] << 8) | dataptr[2];
     }
 
-    length = dataptr[ 0 ];      //length is the first byte
-    // get language table
-    rcode = pUsb->getStrDescr(addr, 0, length, 0, 0, dataptr);
+    // The device returns bLength bytes at most, so a single max-length read is enough
+    rcode = pUsb->getStrDescr(addr, 0, USBTMC_STRING_DESCRIPTOR_SIZE, idx, langID, dataptr);
     if (rcode)
     {
+        // The cached LANGID may not suit this device, read the table next time
+        langID = 0;
         return rcode;
     }
 
-    langid = (dataptr[3] << 8) | dataptr[2];
-    rcode = pUsb->getStrDescr(addr, 0, 1, idx, langid, dataptr);
-    if (rcode)
+    *datalen = dataptr[ 0 ];
+    if (*datalen > USBTMC_STRING_DESCRIPTOR_SIZE)
+        *datalen = USBTMC_STRING_DESCRIPTOR_SIZE;
+
+    return rcode;
+}
+#endif
+
+void USBTMC::ApplyProfile(USB_DEVICE_DESCRIPTOR* pdescr)
+{
+    // Every connection starts from the configuration of the sketch
+    config = baseConfig;
+    quirkFlags = 0;
+
+#if USBTMC_USE_PROFILES
+    const USBTMCProfile* profiles = profilesPtr;
+    uint8_t count = profilesCount;
+
+    for (uint8_t i = 0; i < count; i++)
     {
-        return rcode;
+        USBTMCProfile profile;
+        memcpy_P(&profile, &profiles[i], sizeof(USBTMCProfile));
+
+        if (profile.vid != pdescr->idVendor)
+            continue;
+
+        if (profile.pid != 0 && profile.pid != pdescr->idProduct)
+            continue;
+
+        if (profile.timestepMillis > config.timestepMillis)
+            config.timestepMillis = profile.timestepMillis;
+
+        if (profile.maxRequestSize != 0 && (config.maxRequestSize == 0 || profile.maxRequestSize < config.maxRequestSize))
+            config.maxRequestSize = profile.maxRequestSize;
+
+        quirkFlags = profile.quirks;
+        return;
     }
+#else
+    (void)pdescr;
+#endif
+}
 
-    *datalen = dataptr[ 0 ];
-    rcode = pUsb->getStrDescr(addr, 0, *datalen, idx, langid, dataptr);
-    if (rcode)
+bool USBTMC::IsDeviceRuleCandidate(USB_DEVICE_DESCRIPTOR* pdescr)
+{
+#if USBTMC_USE_DEVICE_RULES
+    if (deviceRulesPtr == NULL)
+        return true;
+
+    for (uint8_t i = 0; i < deviceRulesCount; i++)
     {
-        return rcode;
+        uint16_t vid = pgm_read_word(&deviceRulesPtr[i].vid);
+        uint16_t pid = pgm_read_word(&deviceRulesPtr[i].pid);
+
+        if ((vid == 0 || vid == pdescr->idVendor) && (pid == 0 || pid == pdescr->idProduct))
+            return true;
     }
 
-    return rcode;
+    return false;
+#else
+    (void)pdescr;
+    return true;
+#endif
 }
 
+#if USBTMC_USE_SERIAL_NUMBER
+bool USBTMC::IsSerialNumberMatched(const char* serialNumber, uint8_t* serialNumPtr, uint8_t serialNumLen)
+{
+    // string is UTF-16LE encoded, the first two bytes are bLength and bDescriptorType
+    uint8_t i = 2;
+
+    while (true)
+    {
+        char c = (char)pgm_read_byte(serialNumber++);
+
+        if (c == 0)
+            return (i >= serialNumLen && !IsStringTruncated(serialNumPtr, serialNumLen));
+
+        if ((i + 1) >= serialNumLen)
+            return false;
+
+        if (serialNumPtr[i] != (uint8_t)c || serialNumPtr[i + 1] != 0x00)
+            return false;
+
+        i += 2;
+    }
+}
+#endif
+
+uint8_t USBTMC::MatchDeviceRule(USB_DEVICE_DESCRIPTOR* pdescr, uint8_t* serialNumPtr, uint8_t serialNumLen)
+{
+#if USBTMC_USE_DEVICE_RULES
+    deviceRuleIndex = -1;
+
+    if (deviceRulesPtr == NULL)
+        return 0;
+
+    for (uint8_t i = 0; i < deviceRulesCount; i++)
+    {
+        USBTMCDeviceRule rule;
+        memcpy_P(&rule, &deviceRulesPtr[i], sizeof(USBTMCDeviceRule));
+
+        if (rule.vid != 0 && rule.vid != pdescr->idVendor)
+            continue;
+
+        if (rule.pid != 0 && rule.pid != pdescr->idProduct)
+            continue;
+
+#if USBTMC_USE_SERIAL_NUMBER
+        if (rule.serialNumber != NULL && !IsSerialNumberMatched(rule.serialNumber, serialNumPtr, serialNumLen))
+            continue;
+#else
+        // The serial number is not read, such a rule never matches
+        if (rule.serialNumber != NULL)
+            continue;
+#endif
+
+        deviceRuleIndex = i;
+        UseConfig(rule.config);
+        return 0;
+    }
+
+    return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+#else
+    (void)pdescr;
+    (void)serialNumPtr;
+    (void)serialNumLen;
+    return 0;
+#endif
+}
+
+#if USBTMC_USE_DEVICE_STORE
+uint16_t USBTMC::GetSerialNumberHash(uint8_t* serialNumPtr, uint8_t serialNumLen)
+{
+    // CRC-16/CCITT-FALSE
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t i = 0; i < serialNumLen; i++)
+    {
+        crc ^= (uint16_t)serialNumPtr[i] << 8;
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+
+    return crc;
+}
+#endif
+
+bool USBTMC::LoadDeviceRecord()
+{
+#if USBTMC_USE_DEVICE_STORE
+    USBTMCDeviceRecord record;
+
+    if (pStore == NULL || !isDeviceKeyUnique)
+        return false;
+
+    if (!pStore->Load(deviceKey, &record))
+        return false;
+
+    if (record.bNumEP < 2 || record.bNumEP > USBTMC_MAX_ENDPOINTS)
+        return false;
+
+    Capabilities = record.capabilities;
+    bConfNum = record.bConfNum;
+    bNumEP = record.bNumEP;
+
+    for (uint8_t i = 1; i < USBTMC_MAX_ENDPOINTS; i++)
+    {
+        epInfo[i].epAddr = record.epAddr[i];
+        epInfo[i].maxPktSize = record.maxPktSize[i];
+        epInfo[i].bmSndToggle = 0;
+        epInfo[i].bmRcvToggle = 0;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void USBTMC::SaveDeviceRecord()
+{
+#if USBTMC_USE_DEVICE_STORE
+    USBTMCDeviceRecord record;
+
+    if (pStore == NULL || !isDeviceKeyUnique)
+        return;
+
+    record.capabilities = Capabilities;
+    record.bConfNum = bConfNum;
+    record.bNumEP = bNumEP;
+
+    for (uint8_t i = 0; i < USBTMC_MAX_ENDPOINTS; i++)
+    {
+        record.epAddr[i] = epInfo[i].epAddr;
+        record.maxPktSize[i] = (uint8_t)epInfo[i].maxPktSize;
+    }
+
+    pStore->Save(deviceKey, &record);
+#endif
+}
+
+// A stored record which does not work any more is removed, the device is read again instead
+void USBTMC::DropDeviceRecord()
+{
+#if USBTMC_USE_DEVICE_STORE
+    if (pStore != NULL && isCachedConnection)
+        pStore->Remove(deviceKey);
+
+    isCachedConnection = false;
+#endif
+}
+
+#if USBTMC_USE_DEVICE_STORE
+void USBTMC::SetDeviceStore(USBTMCDeviceStore* store)
+{
+    pStore = store;
+}
+
+bool USBTMC::IsCachedConnection()
+{
+    return isCachedConnection;
+}
+
+uint8_t USBTMC::ReadIdentity(char* dataptr, uint8_t size)
+{
+    if (pStore == NULL || !isConnected || !isDeviceKeyUnique)
+        return 0;
+
+    return pStore->LoadIdentity(deviceKey, dataptr, size);
+}
+
+void USBTMC::SaveIdentity(const char* identity)
+{
+    if (pStore == NULL || !isConnected || !isDeviceKeyUnique)
+        return;
+
+    // The slot may have been evicted since the device connected
+    SaveDeviceRecord();
+    pStore->SaveIdentity(deviceKey, identity);
+}
+#endif
+
 bool USBTMC::IsConnected()
 {
     return isConnected;
@@ -292,10 +673,65 @@ void USBTMC::Clear()
     commandState = USBTMCState::InitiateClear;
 }
 
+#if USBTMC_USE_SERIAL_NUMBER
 void USBTMC::SetTargetSerialNumber(const uint8_t* serialNumPtr)
 {
     serialNumberDataPtr = serialNumPtr;
 }
+#endif
+
+#if USBTMC_USE_SESSION
+void USBTMC::SetSessionPreamble(const char* script)
+{
+    sessionPreamblePtr = script;
+}
+#endif
+
+#if USBTMC_USE_LINE_MODE
+void USBTMC::SetLineMode(char terminator, char* buffer, uint16_t size)
+{
+    lineTerminator = terminator;
+    lineBuffer = (size > 0) ? buffer : NULL;
+    lineBufferSize = (lineBuffer != NULL) ? size : 0;
+    lineLength = 0;
+}
+#endif
+
+void USBTMC::SetRemoteEnable(bool enable)
+{
+    uint8_t rcode = 0;
+
+    isRemoteEnabled = enable;
+
+    if (!isConnected)
+        return;
+
+    rcode = RenControl(enable);
+
+    if (rcode)
+        pAsync->OnFailed(USBTMCInformation::RencontrolError, rcode);
+}
+
+#if USBTMC_USE_PROFILES
+void USBTMC::SetProfiles(const USBTMCProfile* profiles, uint8_t count)
+{
+    profilesPtr = profiles;
+    profilesCount = count;
+}
+#endif
+
+#if USBTMC_USE_DEVICE_RULES
+void USBTMC::SetDeviceRules(const USBTMCDeviceRule* rules, uint8_t count)
+{
+    deviceRulesPtr = rules;
+    deviceRulesCount = count;
+}
+
+int8_t USBTMC::GetDeviceRuleIndex()
+{
+    return deviceRuleIndex;
+}
+#endif
 
 void USBTMC::Request(int length)
 {
@@ -307,6 +743,9 @@ void USBTMC::Request(int length)
         return;
     }
 
+    if (config.maxRequestSize != 0 && (uint32_t)length > config.maxRequestSize)
+        length = (int)config.maxRequestSize;
+
     rcode = BulkOutRequest((uint32_t)length);
 
     if (rcode)
@@ -351,6 +790,7 @@ void USBTMC::ReadStatusByte()
     if (rtb_bTag > 127)
         rtb_bTag = 2;
 
+#if USBTMC_USE_INTERRUPT_EP
     if(Capabilities.USB488Interface & 0x02)
     {
         uint8_t status;
@@ -368,6 +808,7 @@ void USBTMC::ReadStatusByte()
 
     }
     else
+#endif
     {
         pAsync->OnReadStatusByte(response[2]);
     }
@@ -403,79 +844,175 @@ void USBTMC::BeginTransmit(uint32_t total_size)
 
 void USBTMC::TransmitData(uint8_t data)
 {
-#define BUFFER_LENGTH 64
-
-    uint8_t rcode = 0;
+    USBTMCState state = commandState;
 
-    if(fifo_available() >= (USBTMC_FIFO_SIZE-1))
+    // A failed send has already been reported and aborted
+    if(!TryTransmitData(data) && commandState == state)
     {
-        fifo_flush();
+        bin_fifo.flush();
         bin_current_size = 0;
         if(isSentHeader)
             commandState = USBTMCState::InitiateAbortBulkOut;
         isSentHeader = false;
         pAsync->OnFailed(USBTMCInformation::TransmitError, USBTMC_ERR_OVERFLOWED);
-        return;
     }
+}
 
-    fifo_write(data);
+bool USBTMC::TryTransmitData(uint8_t data)
+{
+    USBTMCState state = commandState;
+    uint8_t rcode;
 
-    if(bin_current_size > 0)
-        bin_current_size--;
+    // Nothing beyond the size announced by BeginTransmit(), e.g. after an aborted transfer
+    if(bin_current_size <= 0)
+        return false;
 
-    uint32_t max_packet_size;
-    uint32_t remain;
-    uint8_t buf[BUFFER_LENGTH];
+    if(bin_fifo.space() == 0)
+    {
+        // Make room by sending the pending packets
+        rcode = SendTransmitPackets();
+        if(rcode && rcode != hrNAK)
+            return false; // the transfer has been aborted
 
-    if(isSentHeader)
-        max_packet_size = epInfo[epDataOutIndex].maxPktSize;
-    else
-        max_packet_size = epInfo[epDataOutIndex].maxPktSize - USBTMC_RCV_HEADER_SIZE;
+        if(bin_fifo.space() == 0)
+            return false;
+    }
 
-    remain = (uint32_t)fifo_available();
-    if(remain < max_packet_size)
-        if(bin_current_size <= 0)
-            max_packet_size = remain;
-        else
-            return;
+    // The byte must not start a new message while an abort is pending
+    if(commandState != state)
+        return false;
 
-    for(int i = 0; i < max_packet_size; i++)
-        buf[i] = fifo_read();
+    bin_fifo.write(data);
+    bin_current_size--;
 
-    if(isSentHeader)
-    {
-        rcode = BulkOutData(max_packet_size, buf);
-    }
-    else
+    rcode = SendTransmitPackets();
+
+    return (rcode == 0 || rcode == hrNAK);
+}
+
+uint16_t USBTMC::TransmitData(const uint8_t *dataptr, uint16_t length)
+{
+    uint8_t rcode;
+    uint16_t accepted = 0;
+    uint16_t n;
+
+    // Nothing beyond the size announced by BeginTransmit()
+    if(bin_current_size < length)
+        length = (uint16_t)bin_current_size;
+
+    while(accepted < length)
     {
-        rcode = BulkOutData(max_packet_size, &buf[0], bin_total_size);
-        if (!rcode)
-            isSentHeader = true;
+        n = bin_fifo.write(dataptr + accepted, length - accepted);
+
+        accepted += n;
+        bin_current_size -= n;
+
+        // Packets only go out when they are full or the message is complete
+        rcode = SendTransmitPackets();
+        if(rcode && rcode != hrNAK)
+            break; // the transfer has been aborted
+
+        // The device is busy and the FIFO is still full
+        if(n == 0)
+            break;
     }
 
-    if (rcode)
+    return accepted;
+}
+
+uint16_t USBTMC::TransmitSpaceAvailable()
+{
+    uint16_t space = bin_fifo.space();
+
+    if(bin_current_size < space)
+        space = (uint16_t)bin_current_size;
+
+    return space;
+}
+
+uint8_t USBTMC::SendTransmitPackets()
+{
+    // Sending from an OnReceived() handler, the packet buffer still holds the received data
+    if(isPacketBufferBusy)
+        return SendTransmitPacketsOnStack();
+
+    return SendTransmitPackets(packetBuffer);
+}
+
+// Kept out of line so that only the sends from a handler pay for the stack buffer
+__attribute__((noinline)) uint8_t USBTMC::SendTransmitPacketsOnStack()
+{
+    uint8_t buffer[USBTMC_MESSAGE_SIZE];
+
+    return SendTransmitPackets(buffer);
+}
+
+uint8_t USBTMC::SendTransmitPackets(uint8_t *buffer)
+{
+    uint8_t rcode = 0;
+    uint16_t max_packet_size;
+    uint16_t remain;
+
+    while(bin_fifo.available() > 0)
     {
-        fifo_flush();
-        bin_current_size = 0;
-        commandState = USBTMCState::InitiateAbortBulkOut;
-        isSentHeader = false;
+        max_packet_size = epInfo[epDataOutIndex].maxPktSize;
+        if(max_packet_size > USBTMC_MESSAGE_SIZE)
+            max_packet_size = USBTMC_MESSAGE_SIZE;
+
+        if(!isSentHeader)
+            max_packet_size -= USBTMC_RCV_HEADER_SIZE;
+
+        remain = bin_fifo.available();
+        if(remain < max_packet_size)
+        {
+            if(bin_current_size <= 0)
+                max_packet_size = remain;
+            else
+                return rcode;
+        }
+
+        // The data stays in the FIFO until the device accepts the packet
         if(isSentHeader)
+        {
+            bin_fifo.peek(buffer, max_packet_size);
+            rcode = BulkOutData(buffer, max_packet_size);
+        }
+        else
+        {
+            bin_fifo.peek(&buffer[USBTMC_RCV_HEADER_SIZE], max_packet_size);
+            rcode = BulkOutData(buffer, max_packet_size, bin_total_size);
+            if (!rcode)
+                isSentHeader = true;
+        }
+
+        if (rcode == hrNAK)
+        {
+            // The device is busy, try again on the next call
+            return rcode;
+        }
+        else if (rcode)
+        {
+            bin_fifo.flush();
+            bin_current_size = 0;
             commandState = USBTMCState::InitiateAbortBulkOut;
-        return;
+            isSentHeader = false;
+            DropDeviceRecord();
+            pAsync->OnFailed(USBTMCInformation::TransmitError, rcode);
+            return rcode;
+        }
+
+        bin_fifo.skip(max_packet_size);
     }
 
     if(bin_current_size <= 0)
-    {
-        fifo_flush();
         isSentHeader = false;
-    }
 
-#undef BUFFER_LENGTH
+    return rcode;
 }
 
 bool USBTMC::TransmitDone()
 {
-    if(bin_current_size <= 0)
+    if(bin_current_size <= 0 && bin_fifo.available() == 0)
         return true;
     else
         return false;
@@ -488,18 +1025,23 @@ void USBTMC::AbortReceive()
 
 void USBTMC::AbortTransmit()
 {
+    bin_fifo.flush();
+    bin_current_size = 0;
+    isSentHeader = false;
     commandState = USBTMCState::InitiateAbortBulkOut;
 }
 
 void USBTMC::Run()
 {
-#define BUFFER_LENGTH 64
+#define BUFFER_LENGTH USBTMC_MESSAGE_SIZE
     uint8_t rcode = 0;
     uint8_t status = 0;;
+#if USBTMC_USE_ABORT_CLEAR
     uint8_t bmAbortBulkIn = 0;
     bool isFull = false;
+#endif
     uint16_t rcvd = BUFFER_LENGTH;
-    uint8_t buf[BUFFER_LENGTH];
+    uint8_t* buf = packetBuffer;
     uint32_t currentMillis;
 
     USBTMCState state;
@@ -510,7 +1052,7 @@ void USBTMC::Run()
     }
 
     currentMillis = millis();
-    if ((currentMillis - previousMillis) < timestepMillis)
+    if ((currentMillis - previousMillis) < config.timestepMillis)
         return;
 
     previousMillis = currentMillis;
@@ -525,15 +1067,16 @@ void USBTMC::Run()
 
         case USBTMCState::ReceiveHeader:
             uint32_t totalLength;
+            bool isEndOfMessage;
             totalLength = requestLength;
 
-            rcode = BulkIn(&rcvd, buf, totalLength);
+            rcode = BulkIn(&rcvd, buf, totalLength, isEndOfMessage);
 
             if (rcode == hrNAK)
             {
                 //Try again
                 currentMillis = millis();
-                if ((currentMillis - waitBeginMillis) >= 5000)
+                if ((currentMillis - waitBeginMillis) >= config.timeoutMillis)
                 {
                     pAsync->OnFailed(USBTMCInformation::ReceiveheaderNakAndTimeouted, 0);
                     commandState = USBTMCState::InitiateAbortBulkIn;
@@ -542,6 +1085,7 @@ void USBTMC::Run()
             }
             else if (rcode)
             {
+                DropDeviceRecord();
                 pAsync->OnFailed(USBTMCInformation::ReceiveheaderError, rcode);
                 commandState = USBTMCState::Idle;
             }
@@ -549,21 +1093,28 @@ void USBTMC::Run()
             {
                 waitBeginMillis = millis();
 
+                pAsync->OnTransferHeader(totalLength, isEndOfMessage);
+#if USBTMC_USE_LINE_MODE
+                this->isEndOfMessage = isEndOfMessage;
+#endif
+
                 if(requestLength > totalLength)
                     requestLength = totalLength;
 
                 if(rcvd > requestLength)
                     rcvd = requestLength;
 
-                for (uint16_t i = USBTMC_RCV_HEADER_SIZE; i < (rcvd + USBTMC_RCV_HEADER_SIZE); i++)
-                    pAsync->OnReceived(buf[i]);
+                DeliverPayload(&buf[USBTMC_RCV_HEADER_SIZE], rcvd);
 
                 requestLength -= rcvd;
 
                 if(requestLength > 0)
                     commandState = USBTMCState::ReceivePayload;
                 else
+                {
                     commandState = USBTMCState::Idle;
+                    EndTransfer();
+                }
 
             }
 
@@ -571,45 +1122,56 @@ void USBTMC::Run()
 
         case USBTMCState::ReceivePayload:
 
-            rcode = BulkIn(&rcvd, buf);
-
-            if (rcode == hrNAK)
+            for (uint8_t packet = 0; packet < config.packetBudget; packet++)
             {
-                //Try again
-                currentMillis = millis();
-                if ((currentMillis - waitBeginMillis) >= 5000)
+                rcvd = BUFFER_LENGTH;
+                rcode = BulkIn(&rcvd, buf);
+
+                if (rcode == hrNAK)
                 {
-                    pAsync->OnFailed(USBTMCInformation::ReceivepayloadNakAndTimeouted, 0);
-                    commandState = USBTMCState::InitiateAbortBulkIn;
+                    //Try again
+                    currentMillis = millis();
+                    if ((currentMillis - waitBeginMillis) >= config.timeoutMillis)
+                    {
+                        pAsync->OnFailed(USBTMCInformation::ReceivepayloadNakAndTimeouted, 0);
+                        commandState = USBTMCState::InitiateAbortBulkIn;
+                    }
+
+                }
+                else if (rcode)
+                {
+                    DropDeviceRecord();
+                    pAsync->OnFailed(USBTMCInformation::ReceivepayloadError, rcode);
+                    commandState = USBTMCState::Idle;
                 }
+                else
+                {
+                    waitBeginMillis = millis();
 
-            }
-            else if (rcode)
-            {
-                pAsync->OnFailed(USBTMCInformation::ReceivepayloadError, rcode);
-                commandState = USBTMCState::Idle;
-            }
-            else
-            {
-                waitBeginMillis = millis();
+                    if(rcvd > requestLength)
+                        rcvd = requestLength;
 
-                if(rcvd > requestLength)
-                    rcvd = requestLength;
+                    DeliverPayload(buf, rcvd);
 
-                for (uint16_t i = 0; i < rcvd; i++)
-                    pAsync->OnReceived(buf[i]);
+                    requestLength -= rcvd;
 
-                requestLength -= rcvd;
+                    if(requestLength > 0)
+                        commandState = USBTMCState::ReceivePayload;
+                    else
+                    {
+                        commandState = USBTMCState::Idle;
+                        EndTransfer();
+                    }
 
-                if(requestLength > 0)
-                    commandState = USBTMCState::ReceivePayload;
-                else
-                    commandState = USBTMCState::Idle;
+                }
 
+                if (rcode || commandState != USBTMCState::ReceivePayload)
+                    break;
             }
 
             break;
 
+#if USBTMC_USE_ABORT_CLEAR
         case USBTMCState::InitiateAbortBulkOut:
             rcode = InitiateAbortBulkOut(status);
 
@@ -788,6 +1350,56 @@ void USBTMC::Run()
             commandState = USBTMCState::Idle;
 
             break;
+#else
+        case USBTMCState::InitiateAbortBulkOut:
+        case USBTMCState::CheckAbortBulkOutStatus:
+        case USBTMCState::InitiateAbortBulkIn:
+        case USBTMCState::ReadingByAbortBulkIn:
+        case USBTMCState::CheckAbortBulkInStatus:
+        case USBTMCState::InitiateClear:
+        case USBTMCState::CheckClearStatus:
+        case USBTMCState::ReadingByInitiateClear:
+        case USBTMCState::ClearFeature:
+            // Without the abort and clear sequences the host just gives up the transfer
+            commandState = USBTMCState::Idle;
+
+            break;
+#endif
+
+        case USBTMCState::Idle:
+            if (bin_fifo.available() > 0)
+            {
+                // Retry the packets which the device refused
+                SendTransmitPackets();
+            }
+            else if (isClearPending)
+            {
+                isClearPending = false;
+                commandState = USBTMCState::InitiateClear;
+            }
+#if USBTMC_USE_SESSION
+            else if (isSessionPending)
+                commandState = USBTMCState::RestoreSession;
+#endif
+
+            break;
+
+#if USBTMC_USE_SESSION
+        case USBTMCState::RestoreSession:
+            if (!RestoreSessionLine())
+            {
+                isSessionPending = false;
+                commandState = USBTMCState::Idle;
+                pAsync->OnSessionRestored();
+            }
+            else if (commandState != USBTMCState::RestoreSession)
+            {
+                // The transmit failed and the abort sequence took over
+                isSessionPending = false;
+            }
+
+            break;
+#endif
 
         default:
             break;
@@ -811,7 +1423,8 @@ void USBTMC::Run()
 
 bool USBTMC::IsIdle()
 {
-    if (commandState == USBTMCState::Idle)
+    // Packets refused by the device are still waiting in the FIFO
+    if (commandState == USBTMCState::Idle && bin_fifo.available() == 0)
         return true;
     else
         return false;
@@ -837,7 +1450,31 @@ void USBTMC::Unpause()
 
 void USBTMC::TimeStep(uint32_t value)
 {
-    timestepMillis = value;
+    baseConfig.timestepMillis = value;
+    config.timestepMillis = value;
+}
+
+void USBTMC::SetConfig(const USBTMCConfig &value)
+{
+    UseConfig(value);
+    baseConfig = config;
+}
+
+// Configuration of the current connection only
+void USBTMC::UseConfig(const USBTMCConfig &value)
+{
+    config = value;
+
+    if (config.packetBudget == 0)
+        config.packetBudget = 1;
+
+    if (config.timeoutMillis == 0)
+        config.timeoutMillis = USBTMC_DEFAULT_TIMEOUT;
+}
+
+const USBTMCConfig &USBTMC::GetConfig()
+{
+    return config;
 }
 
 void USBTMC::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto __attribute__((unused)), const USB_ENDPOINT_DESCRIPTOR* pep) {
@@ -845,9 +1482,12 @@ void USBTMC::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t pr
 
     uint8_t index;
 
+#if USBTMC_USE_INTERRUPT_EP
     if ((pep->bmAttributes & bmUSB_TRANSFER_TYPE) == USB_TRANSFER_TYPE_INTERRUPT && (pep->bEndpointAddress & 0x80) == 0x80)
             index = epInterruptInIndex;
-    else if ((pep->bmAttributes & bmUSB_TRANSFER_TYPE) == USB_TRANSFER_TYPE_BULK)
+    else
+#endif
+    if ((pep->bmAttributes & bmUSB_TRANSFER_TYPE) == USB_TRANSFER_TYPE_BULK)
             index = ((pep->bEndpointAddress & 0x80) == 0x80) ? epDataInIndex : epDataOutIndex;
     else
             return;
@@ -870,14 +1510,89 @@ uint8_t USBTMC::Release()
     isConnected = false;
     bAddress = 0;
     bNumEP = 1;
+    isClearPending = false;
+    quirkFlags = 0;
+    config = baseConfig;
+#if USBTMC_USE_DEVICE_RULES
+    deviceRuleIndex = -1;
+#endif
+#if USBTMC_USE_SESSION
+    isSessionPending = false;
+    sessionLineRemaining = 0;
+#endif
+#if USBTMC_USE_DEVICE_STORE
+    isCachedConnection = false;
+    isDeviceKeyUnique = false;
+#endif
     return rcode;
 }
 
-uint8_t USBTMC::BulkOutData(uint8_t nbytes, uint8_t* dataptr, uint32_t totalbytes)
+#if USBTMC_USE_SESSION
+bool USBTMC::RestoreSessionLine()
+{
+    char c;
+
+    commandState = USBTMCState::RestoreSession;
+
+    if (sessionLineRemaining == 0)
+    {
+        // A line starts only after the device has taken the whole previous one
+        if (bin_fifo.available() > 0)
+        {
+            SendTransmitPackets();
+            return true;
+        }
+
+        const char* line = sessionPreamblePtr + sessionOffset;
+
+        // Skip empty lines
+        while ((c = (char)pgm_read_byte(line)) == '\n' || c == '\r')
+        {
+            line++;
+            sessionOffset++;
+        }
+
+        if (c == 0)
+            return false;
+
+        uint16_t length = 0;
+        while ((c = (char)pgm_read_byte(line + length)) != 0 && c != '\n' && c != '\r')
+            length++;
+
+        sessionLineRemaining = length + 1;
+        BeginTransmit(sessionLineRemaining);
+    }
+
+    // What the busy device can not take yet goes on the next call
+    while (sessionLineRemaining > 0)
+    {
+        c = (sessionLineRemaining > 1) ? (char)pgm_read_byte(sessionPreamblePtr + sessionOffset) : '\n';
+
+        bool isWritten = TryTransmitData((uint8_t)c);
+
+        if (commandState != USBTMCState::RestoreSession)
+        {
+            // The transmit failed and the abort sequence took over
+            sessionLineRemaining = 0;
+            return true;
+        }
+
+        if (!isWritten)
+            return true;
+
+        if (sessionLineRemaining > 1)
+            sessionOffset++;
+        sessionLineRemaining--;
+    }
+
+    return true;
+}
+#endif
+
+uint8_t USBTMC::BulkOutData(uint8_t* message, uint8_t nbytes, uint32_t totalbytes)
 {
 #define RESERVED_SIZE USBTMC_RCV_HEADER_SIZE
-#define DEV_MESSAGE_BEGIN RESERVED_SIZE
-    uint8_t message[USBTMC_MESSAGE_SIZE];
+    // The caller has put nbytes of data behind the header in message
     uint16_t messageSize = RESERVED_SIZE;
     uint8_t rcode = 0;
 
@@ -915,15 +1630,9 @@ uint8_t USBTMC::BulkOutData(uint8_t nbytes, uint8_t* dataptr, uint32_t totalbyte
     message[10] = 0x00;
     message[11] = 0x00;
 
-    for (uint16_t i = DEV_MESSAGE_BEGIN; i < messageSize; i++)
-        message[i] = *dataptr++;
-
-    uint16_t quotient = messageSize / 4;
+    messageSize = PadMessage(message, messageSize);
 
-    if (messageSize > (quotient * 4))
-        quotient++;
-
-    rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, (quotient * 4), &message[0]);
+    rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, messageSize, &message[0]);
     if (rcode)
         return rcode;
 
@@ -937,13 +1646,12 @@ uint8_t USBTMC::BulkOutData(uint8_t nbytes, uint8_t* dataptr, uint32_t totalbyte
 
     return rcode;
 
-#undef DEV_MESSAGE_BEGIN
 #undef RESERVED_SIZE
 }
 
-uint8_t USBTMC::BulkOutData(uint8_t nbytes, uint8_t* dataptr)
+uint8_t USBTMC::BulkOutData(uint8_t* message, uint8_t nbytes)
 {
-    uint8_t message[USBTMC_MESSAGE_SIZE];
+    // The caller has put nbytes of data at the head of message
     uint16_t messageSize = 0;
     uint8_t rcode = 0;
 
@@ -961,18 +1669,32 @@ uint8_t USBTMC::BulkOutData(uint8_t nbytes, uint8_t* dataptr)
         return rcode;
     }
 
-    for (uint16_t i = 0; i < messageSize; i++)
-        message[i] = *dataptr++;
+    messageSize = PadMessage(message, messageSize);
+
+    rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, messageSize, &message[0]);
+
+    return rcode;
+
+}
 
-    uint16_t quotient = messageSize / 4;
+uint16_t USBTMC::PadMessage(uint8_t* message, uint16_t messageSize)
+{
+    if (quirkFlags & USBTMC_QUIRK_NO_PADDING)
+        return messageSize;
 
-    if (messageSize > (quotient * 4))
-        quotient++;
+    // The total number of bytes in a Bulk-OUT transfer must be a multiple of 4
+    while ((messageSize & 0x03) != 0 && messageSize < USBTMC_MESSAGE_SIZE)
+        message[messageSize++] = 0x00;
 
-    rcode = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, (quotient * 4), &message[0]);
+    return messageSize;
+}
 
-    return rcode;
+bool USBTMC::IsTermCharSupported()
+{
+    if (quirkFlags & USBTMC_QUIRK_TERMCHAR_IGNORED)
+        return false;
 
+    return (Capabilities.USBTMCDevice & 0x01);
 }
 
 uint8_t USBTMC::BulkOutRequest(uint32_t nbytes)
@@ -995,10 +1717,20 @@ uint8_t USBTMC::BulkOutRequest(uint32_t nbytes)
     message[5] = ( nbytes >>  8 )& 0xFF;
     message[6] = ( nbytes >> 16 )& 0xFF;
     message[7] = ( nbytes >> 24 )& 0xFF;
-    //8:bmTransfer Attributes
-    message[8] = 0x00; //D1 = 0 The device must ignore TermChar.
-    //9:TermChar
-    message[9] = 0x00; //If bmTransferAttributes.D1 = 0, the device must ignore this field.
+    if (config.termChar != 0 && IsTermCharSupported())
+    {
+        //8:bmTransfer Attributes
+        message[8] = 0x02; //D1 = 1 The device must end the transfer when TermChar is sent.
+        //9:TermChar
+        message[9] = (uint8_t)config.termChar;
+    }
+    else
+    {
+        //8:bmTransfer Attributes
+        message[8] = 0x00; //D1 = 0 The device must ignore TermChar.
+        //9:TermChar
+        message[9] = 0x00; //If bmTransferAttributes.D1 = 0, the device must ignore this field.
+    }
     //10,11:Reserved(0x00)
     message[10] = 0x00;
     message[11] = 0x00;
@@ -1021,11 +1753,102 @@ uint8_t USBTMC::BulkOutRequest(uint32_t nbytes)
 }
 
 
-uint8_t USBTMC::BulkIn(uint16_t* bytes_rcvd, uint8_t* dataptr, uint32_t &length)
+void USBTMC::DeliverPayload(uint8_t* dataptr, uint16_t length)
+{
+    // Keep the transmit path off the packet buffer while the handlers read it
+    isPacketBufferBusy = true;
+
+#if USBTMC_USE_LINE_MODE
+    if (lineTerminator != 0)
+        DeliverLines(dataptr, length);
+    else
+#endif
+        pAsync->OnReceivedData(dataptr, length);
+
+    isPacketBufferBusy = false;
+}
+
+#if USBTMC_USE_LINE_MODE
+void USBTMC::DeliverLines(uint8_t* dataptr, uint16_t length)
+{
+    while (length > 0)
+    {
+        uint8_t* end = (uint8_t*)memchr(dataptr, lineTerminator, length);
+
+        if (end == NULL)
+        {
+            // The line continues in the next packet
+            AppendLine(dataptr, length);
+            return;
+        }
+
+        uint16_t chunk = (uint16_t)(end - dataptr);
+
+        if (lineLength == 0)
+        {
+            // The whole line is in this packet, hand it over in place
+            *end = '\0';
+            pAsync->OnLine((const char*)dataptr, chunk);
+        }
+        else if (lineBuffer == NULL)
+        {
+            // Without a line buffer a line spanning packets is dropped
+            lineLength = 0;
+        }
+        else
+        {
+            AppendLine(dataptr, chunk);
+            uint16_t lineSize = lineLength;
+            lineLength = 0;
+            pAsync->OnLine(lineBuffer, lineSize);
+        }
+
+        dataptr += chunk + 1;
+        length -= chunk + 1;
+    }
+}
+
+void USBTMC::AppendLine(const uint8_t* dataptr, uint16_t length)
+{
+    if (lineBuffer == NULL)
+    {
+        // Only remember that a line is in progress
+        lineLength = 1;
+        return;
+    }
+
+    // The line is truncated to fit the buffer
+    if (length > (lineBufferSize - 1) - lineLength)
+        length = (lineBufferSize - 1) - lineLength;
+
+    memcpy(&lineBuffer[lineLength], dataptr, length);
+    lineLength += length;
+    lineBuffer[lineLength] = '\0';
+}
+#endif
+
+void USBTMC::EndTransfer()
+{
+#if USBTMC_USE_LINE_MODE
+    // The last line of a message may come without the terminator
+    if (lineTerminator != 0 && isEndOfMessage && lineLength > 0)
+    {
+        uint16_t lineSize = lineLength;
+        lineLength = 0;
+
+        if (lineBuffer != NULL)
+            pAsync->OnLine(lineBuffer, lineSize);
+    }
+#endif
+}
+
+uint8_t USBTMC::BulkIn(uint16_t* bytes_rcvd, uint8_t* dataptr, uint32_t &length, bool &isEndOfMessage)
 {
     uint16_t rcvd = *bytes_rcvd;
     uint8_t rcode = 0;
 
+    isEndOfMessage = false;
+
     rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &rcvd, dataptr);
     if (rcode)
     {
@@ -1053,6 +1876,9 @@ uint8_t USBTMC::BulkIn(uint16_t* bytes_rcvd, uint8_t* dataptr, uint32_t &length)
 
     length = data_size;
 
+    //8:bmTransferAttributes D0:EOM
+    isEndOfMessage = (dataptr[8] & 0x01) ? true : false;
+
     *bytes_rcvd = rcvd - USBTMC_RCV_HEADER_SIZE;
 
     return rcode;
@@ -1068,14 +1894,20 @@ uint8_t USBTMC::BulkIn(uint16_t* bytes_rcvd, uint8_t* dataptr)
 
 }
 
+#if USBTMC_USE_ABORT_CLEAR
 uint8_t USBTMC::PurgeBulkIn(bool &isFull)
 {
     uint8_t packet_size = epInfo[epDataInIndex].maxPktSize;
-    uint8_t message[packet_size];
-    uint16_t rcvd = packet_size;
+    uint16_t rcvd;
     uint8_t rcode = 0;
 
-    rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &rcvd, message);
+    if (packet_size > USBTMC_MESSAGE_SIZE)
+        packet_size = USBTMC_MESSAGE_SIZE;
+
+    rcvd = packet_size;
+
+    // The purged data is thrown away, so it can go to the packet buffer
+    rcode = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &rcvd, packetBuffer);
     if (rcode)
         return rcode;
 
@@ -1087,7 +1919,9 @@ uint8_t USBTMC::PurgeBulkIn(bool &isFull)
     return rcode;
 
 }
+#endif
 
+#if USBTMC_USE_INTERRUPT_EP
 uint8_t USBTMC::ReadStatusByteFromInterruptEP(uint8_t &status, uint8_t previous_btag)
 {
     uint8_t rcode = 0;
@@ -1122,7 +1956,9 @@ uint8_t USBTMC::ReadStatusByteFromInterruptEP(uint8_t &status, uint8_t previous_
 
     return rcode;
 }
+#endif
 
+#if USBTMC_USE_ABORT_CLEAR
 uint8_t USBTMC::InitiateAbortBulkOut(uint8_t &status)
 {
     uint8_t rcode = 0;
@@ -1244,6 +2080,31 @@ uint8_t USBTMC::CheckClearStatus(uint8_t &status, uint8_t &bmAbortBulkIn)
 
     return rcode;
 }
+#endif
+
+uint8_t USBTMC::RenControl(bool enable)
+{
+    uint8_t rcode = 0;
+
+    // Does the interface accept REN_CONTROL request?
+    if ((Capabilities.USB488Interface & 0x02) == 0)
+        return rcode;
+
+    // USB488 REN_CONTROL
+    // bRequest = 0xA0(160) REN_CONTROL
+    // wValLo = 0x01 Assert REN, 0x00 Deassert REN.
+    // wValHi = 0x00 Reserved. Must be 0x00.
+    // total, nbytes = 0x0001
+    uint8_t usbtmc_status;
+    rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0xA0, (enable ? 0x01 : 0x00), 0x00, 0x0000, 0x0001, 0x0001, &usbtmc_status, NULL);
+    if (rcode)
+        return rcode;
+
+    if (usbtmc_status != 0x01)
+        return USBTMC_ERR_FAILED;
+
+    return rcode;
+}
 
 uint8_t USBTMC::GetCapabilities(USBTMCCapabilities* pCapabilities)
 {
@@ -1258,6 +2119,7 @@ uint8_t USBTMC::GetCapabilities(USBTMCCapabilities* pCapabilities)
     return pUsb->ctrlReq(bAddress, 0, bmREQ_CL_GET_INTF, 0x07, 0x00, 0x00, wInd, 0x0018, 0x0018, (uint8_t*)pCapabilities, NULL);
 }
 
+#if USBTMC_USE_ABORT_CLEAR
 uint8_t USBTMC::ClearFeature(uint8_t index)
 {
     uint8_t rcode = 0;
@@ -1279,53 +2141,4 @@ uint8_t USBTMC::ClearFeature(uint8_t index)
 
     return 0;
 }
-
-// long message fifo for transmit
-uint16_t USBTMC::fifo_available()
-{
-    return ((uint16_t)(USBTMC_FIFO_SIZE + bin_fifo_buffer_head - bin_fifo_buffer_tail)) % USBTMC_FIFO_SIZE;
-}
-
-uint8_t USBTMC::fifo_peek()
-{
-    if (bin_fifo_buffer_head == bin_fifo_buffer_tail)
-    {
-        return -1;
-    }
-    else
-    {
-        return bin_fifo_buffer[bin_fifo_buffer_tail];
-    }
-
-}
-
-uint8_t USBTMC::fifo_read()
-{
-    if (bin_fifo_buffer_head == bin_fifo_buffer_tail)
-    {
-        return -1;
-    }
-    else
-    {
-        uint8_t c = bin_fifo_buffer[bin_fifo_buffer_tail];
-        bin_fifo_buffer_tail = (uint8_t)(bin_fifo_buffer_tail + 1) % USBTMC_FIFO_SIZE;
-        return c;
-    }
-
-}
-
-void USBTMC::fifo_write(uint8_t c)
-{
-    uint8_t i = (uint8_t)(bin_fifo_buffer_head + 1) % USBTMC_FIFO_SIZE;
-
-    if (i != bin_fifo_buffer_tail) {
-        bin_fifo_buffer[bin_fifo_buffer_head] = c;
-        bin_fifo_buffer_head = i;
-    }
-}
-
-void USBTMC::fifo_flush()
-{
-    bin_fifo_buffer_head = 0;
-    bin_fifo_buffer_tail = 0;
-}
+#endif
@@ -19,8 +19,8 @@
 #define __USBTMC_H__
 
 #include <Usb.h>
-
-#define USBTMC_FIFO_SIZE 128
+#include "usbtmc_config.h"
+#include "usbtmc_fifo.h"
 
 #define USBTMC_ERR_FAILED           0xF1
 #define USBTMC_ERR_OVERFLOWED       0xF2
@@ -40,7 +40,8 @@ enum class USBTMCState {
     InitiateClear,
     CheckClearStatus,
     ReadingByInitiateClear,
-    ClearFeature
+    ClearFeature,
+    RestoreSession
 };
 
 enum class USBTMCInformation : int16_t {
@@ -64,7 +65,8 @@ enum class USBTMCInformation : int16_t {
     InitiateclearFailed             = -16,
     CheckclearstatusError           = -17,
     ReadingbyinitiateclearError     = -18,
-    ClearfeatureError               = -19
+    ClearfeatureError               = -19,
+    RencontrolError                 = -20
 };
 
 typedef struct tagUSBTMC_CAPABILITIES {
@@ -168,23 +170,143 @@ typedef struct tagUSBTMC_CAPABILITIES {
     
 } __attribute__((packed)) USBTMCCapabilities;
 
+typedef struct tagUSBTMC_CONFIG {
+    uint32_t timestepMillis;
+    // Minimum interval between two Run() steps.
+
+    uint16_t timeoutMillis;
+    // NAK timeout while waiting for Bulk-IN data.
+
+    uint8_t packetBudget;
+    // Number of Bulk-IN packets handled in a single Run() step.
+
+    uint32_t maxRequestSize;
+    // Upper limit of TransferSize in REQUEST_DEV_DEP_MSG_IN.
+    // 0 means no limit.
+
+    char termChar;
+    // TermChar sent with REQUEST_DEV_DEP_MSG_IN when the device
+    // supports it. 0 means the device must ignore TermChar.
+
+} USBTMCConfig;
+
+#define USBTMC_QUIRK_TERMCHAR_IGNORED   0x02   // Never use TermChar
+#define USBTMC_QUIRK_NO_PADDING         0x04   // Do not pad Bulk-OUT transfers to a multiple of 4 bytes
+#define USBTMC_QUIRK_CLEAR_ON_INIT      0x08   // Send INITIATE_CLEAR after the device is connected
+
+typedef struct tagUSBTMC_PROFILE {
+    uint16_t vid;
+
+    uint16_t pid;
+    // 0x0000 matches any product of the vendor.
+
+    uint32_t timestepMillis;
+    // Shortest polling cadence of Run() for the instrument.
+    // A longer TimeStep() of the sketch is kept.
+
+    uint32_t maxRequestSize;
+    // Upper limit of TransferSize in REQUEST_DEV_DEP_MSG_IN.
+    // 0 means no limit. A smaller limit of the sketch is kept.
+
+    uint8_t quirks;
+    // USBTMC_QUIRK_XXX flags.
+
+} USBTMCProfile;
+
+#if USBTMC_USE_PROFILES
+// Profiles of known instruments, e.g. Usbtmc.SetProfiles(USBTMCDefaultProfiles, USBTMCDefaultProfilesCount);
+extern const USBTMCProfile USBTMCDefaultProfiles[];
+extern const uint8_t USBTMCDefaultProfilesCount;
+#endif
+
+typedef struct tagUSBTMC_DEVICE_RULE {
+    uint16_t vid;
+    // 0x0000 matches any vendor.
+
+    uint16_t pid;
+    // 0x0000 matches any product.
+
+    const char *serialNumber;
+    // ASCII serial number stored in PROGMEM.
+    // NULL matches any serial number. A serial number longer than (USBTMC_MESSAGE_SIZE - 2) / 2
+    // characters, 31 by default, is read only in part and never matches.
+
+    USBTMCConfig config;
+    // Applied when the device is bound to this rule.
+
+} USBTMCDeviceRule;
+
 class USBTMC;
 
+// Only single port chips are currently supported by the library,
+//              so only three endpoints are allocated.
+#if USBTMC_USE_INTERRUPT_EP
+#define USBTMC_MAX_ENDPOINTS    4
+#else
+#define USBTMC_MAX_ENDPOINTS    3
+#endif
+
+typedef struct tagUSBTMC_DEVICE_KEY {
+    uint16_t vid;
+    uint16_t pid;
+    uint16_t serialHash;
+    // CRC-16 of the serial number string descriptor.
+
+} USBTMCDeviceKey;
+
+typedef struct tagUSBTMC_DEVICE_RECORD {
+    USBTMCCapabilities capabilities;
+
+    uint8_t bConfNum;
+    uint8_t bNumEP;
+    uint8_t epAddr[USBTMC_MAX_ENDPOINTS];
+    uint8_t maxPktSize[USBTMC_MAX_ENDPOINTS];
+    // Endpoints negotiated on the first connection.
+    // Only what is read from the device is kept. Timing parameters are not cached,
+    // they come from the sketch, profiles and rules on every connection.
+
+} USBTMCDeviceRecord;
+
+class USBTMCDeviceStore
+{
+public:
+    virtual bool Load(const USBTMCDeviceKey &key, USBTMCDeviceRecord *record) = 0;
+
+    virtual void Save(const USBTMCDeviceKey &key, const USBTMCDeviceRecord *record) = 0;
+
+    virtual void Remove(const USBTMCDeviceKey &key) = 0;
+
+    virtual uint8_t LoadIdentity(const USBTMCDeviceKey &key, char *dataptr, uint8_t size) = 0;
+
+    virtual void SaveIdentity(const USBTMCDeviceKey &key, const char *identity) = 0;
+};
+
 class USBTMCAsyncOper
 {
 public:
     virtual void OnRcvdDescr(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr __attribute__((unused)), uint8_t serialNumLen __attribute__((unused)));
 
     virtual void OnReceived(uint8_t data);
+
+    // The payload of one packet, override it to take the data in bulk
+    virtual void OnReceivedData(const uint8_t *dataptr, uint16_t length) {
+        for (uint16_t i = 0; i < length; i++)
+            OnReceived(dataptr[i]);
+    };
+
+    // A received line in line mode without the terminator, the text is null terminated.
+    // It points into the packet buffer or the line buffer and is valid until the callback returns.
+    virtual void OnLine(const char *line __attribute__((unused)), uint16_t length __attribute__((unused))) {};
     
     virtual void OnReadStatusByte(uint8_t status);
 
     virtual void OnFailed(USBTMCInformation info, uint8_t code);
-};
 
-// Only single port chips are currently supported by the library,
-//              so only three endpoints are allocated.
-#define USBTMC_MAX_ENDPOINTS    4
+    virtual void OnSessionRestored() {};
+
+    // TransferSize and EOM of the Bulk-IN header, called before the payload of the transfer
+    virtual void OnTransferHeader(uint32_t transferSize __attribute__((unused)), bool isEndOfMessage __attribute__((unused))) {};
+};
 
 class USBTMC : public USBDeviceConfig, public UsbConfigXtracter {
     static const uint8_t epDataInIndex; // DataIn endpoint index
@@ -200,7 +322,47 @@ class USBTMC : public USBDeviceConfig, public UsbConfigXtracter {
     bool isConnected;
     uint16_t targetVID;
     uint16_t targetPID;
+#if USBTMC_USE_SERIAL_NUMBER
     const uint8_t *serialNumberDataPtr;
+    uint16_t langID;
+    uint16_t langIDVID;
+    uint16_t langIDPID;
+    // First LANGID of the last device, kept over reconnects of the same VID/PID.
+#endif
+#if USBTMC_USE_DEVICE_RULES
+    const USBTMCDeviceRule *deviceRulesPtr;
+    uint8_t deviceRulesCount;
+    int8_t deviceRuleIndex;
+#endif
+#if USBTMC_USE_SESSION
+    const char *sessionPreamblePtr;
+    uint16_t sessionOffset;
+    uint16_t sessionLineRemaining;
+    bool isSessionPending;
+#endif
+#if USBTMC_USE_DEVICE_STORE
+    USBTMCDeviceStore *pStore;
+    USBTMCDeviceKey deviceKey;
+    bool isCachedConnection;
+    bool isDeviceKeyUnique;     // false for a truncated serial number, the store is not used
+#endif
+#if USBTMC_USE_PROFILES
+    const USBTMCProfile *profilesPtr;
+    uint8_t profilesCount;
+#endif
+#if USBTMC_USE_LINE_MODE
+    char lineTerminator;
+    char *lineBuffer;
+    uint16_t lineBufferSize;
+    uint16_t lineLength;
+    bool isEndOfMessage;
+#endif
+    bool isRemoteEnabled;
+    uint8_t quirkFlags;
+    bool isClearPending;
+    USBTMCConfig baseConfig;
+    // Set by the sketch, profiles and device rules apply on top of it for each connection.
+    USBTMCConfig config;
     
     uint8_t last_bTag;
     uint8_t bTag;
@@ -210,14 +372,13 @@ class USBTMC : public USBDeviceConfig, public UsbConfigXtracter {
     USBTMCState resumedCommandState;
     uint32_t waitBeginMillis;
     uint32_t previousMillis;
-    uint32_t timestepMillis;
     int requestLength;
     
     EpInfo epInfo[USBTMC_MAX_ENDPOINTS];
     
-    volatile uint8_t bin_fifo_buffer_head;
-    volatile uint8_t bin_fifo_buffer_tail;
-    uint8_t bin_fifo_buffer[USBTMC_FIFO_SIZE];
+    // A short packet ends the transfer, so the FIFO must hold a full one
+    static_assert(USBTMC_FIFO_SIZE > USBTMC_MESSAGE_SIZE, "USBTMC_FIFO_SIZE must be larger than USBTMC_MESSAGE_SIZE");
+    USBTMCFifo<USBTMC_FIFO_SIZE> bin_fifo;
 
     uint32_t bin_total_size;
     uint32_t bin_current_size;
@@ -225,7 +386,26 @@ class USBTMC : public USBDeviceConfig, public UsbConfigXtracter {
     bool isSentHeader;
     bool isResume;
 
+    // Packet scratch buffer, shared by all instances unless USBTMC_SHARED_PACKET_BUFFER is 0.
+    // While a received packet is delivered from it, packets are sent from a stack buffer instead.
+#if USBTMC_SHARED_PACKET_BUFFER
+    static uint8_t packetBuffer[USBTMC_MESSAGE_SIZE];
+    static bool isPacketBufferBusy;
+#else
+    uint8_t packetBuffer[USBTMC_MESSAGE_SIZE];
+    bool isPacketBufferBusy;
+#endif
+
     uint8_t GetStringDescriptor(uint8_t addr, uint8_t idx, uint8_t *dataptr, uint8_t *length);
+    void    ApplyProfile(USB_DEVICE_DESCRIPTOR *pdescr);
+    void    UseConfig(const USBTMCConfig &value);
+    bool    IsDeviceRuleCandidate(USB_DEVICE_DESCRIPTOR *pdescr);
+    bool    IsSerialNumberMatched(const char *serialNumber, uint8_t *serialNumPtr, uint8_t serialNumLen);
+    uint8_t MatchDeviceRule(USB_DEVICE_DESCRIPTOR *pdescr, uint8_t *serialNumPtr, uint8_t serialNumLen);
+    void    DeliverPayload(uint8_t *dataptr, uint16_t length);
+    void    DeliverLines(uint8_t *dataptr, uint16_t length);
+    void    AppendLine(const uint8_t *dataptr, uint16_t length);
+    void    EndTransfer();
 
     uint8_t InitiateAbortBulkOut(uint8_t &status);
     uint8_t CheckAbortBulkOutStatus(uint8_t &status);
@@ -234,31 +414,60 @@ class USBTMC : public USBDeviceConfig, public UsbConfigXtracter {
     uint8_t InitiateClear(uint8_t &status);
     uint8_t CheckClearStatus(uint8_t &status, uint8_t &bmAbortBulkIn);
     uint8_t GetCapabilities(USBTMCCapabilities *pCapabilities);
+    uint8_t RenControl(bool enable);
+    uint16_t GetSerialNumberHash(uint8_t *serialNumPtr, uint8_t serialNumLen);
+    bool    LoadDeviceRecord();
+    void    SaveDeviceRecord();
+    void    DropDeviceRecord();
+    bool    RestoreSessionLine();
 
     uint8_t PurgeBulkIn(bool &isFull);
 
     uint8_t ClearFeature(uint8_t index);
 
-    uint8_t BulkOutData(uint8_t nbytes, uint8_t *dataptr, uint32_t totalbytes);
-    uint8_t BulkOutData(uint8_t nbytes, uint8_t *dataptr);
+    uint8_t BulkOutData(uint8_t *message, uint8_t nbytes, uint32_t totalbytes);
+    uint8_t BulkOutData(uint8_t *message, uint8_t nbytes);
     uint8_t BulkOutRequest(uint32_t nbytes);
-    uint8_t BulkIn(uint16_t *bytes_rcvd, uint8_t *dataptr, uint32_t &length);
+    uint16_t PadMessage(uint8_t *message, uint16_t messageSize);
+    bool    IsTermCharSupported();
+    uint8_t BulkIn(uint16_t *bytes_rcvd, uint8_t *dataptr, uint32_t &length, bool &isEndOfMessage);
     uint8_t BulkIn(uint16_t *bytes_rcvd, uint8_t *dataptr);
 
-    uint8_t ReadStatusByteFromInterruptEP(uint8_t &status, uint8_t previous_btag);
+    uint8_t SendTransmitPackets();
+    uint8_t SendTransmitPacketsOnStack();
+    uint8_t SendTransmitPackets(uint8_t *buffer);
 
-    uint16_t fifo_available();
-    uint8_t fifo_peek();
-    uint8_t fifo_read();
-    void fifo_write(uint8_t c);
-    void fifo_flush();
+    uint8_t ReadStatusByteFromInterruptEP(uint8_t &status, uint8_t previous_btag);
     
 public:
     USBTMC(USB *pusb, USBTMCAsyncOper *pasync, uint16_t vid = 0, uint16_t pid = 0);
 
     USBTMCCapabilities Capabilities;
     bool    IsConnected();
+    void    SetRemoteEnable(bool enable);
+#if USBTMC_USE_LINE_MODE
+    void    SetLineMode(char terminator, char *buffer, uint16_t size);
+#endif
+#if USBTMC_USE_SERIAL_NUMBER
+    // A serial number read only in part never matches, see USBTMCDeviceRule
     void SetTargetSerialNumber(const uint8_t *serialNumPtr);
+#endif
+#if USBTMC_USE_SESSION
+    void SetSessionPreamble(const char *script);
+#endif
+#if USBTMC_USE_PROFILES
+    void SetProfiles(const USBTMCProfile *profiles, uint8_t count);
+#endif
+#if USBTMC_USE_DEVICE_RULES
+    void SetDeviceRules(const USBTMCDeviceRule *rules, uint8_t count);
+    int8_t  GetDeviceRuleIndex();
+#endif
+#if USBTMC_USE_DEVICE_STORE
+    void SetDeviceStore(USBTMCDeviceStore *store);
+    bool    IsCachedConnection();
+    uint8_t ReadIdentity(char *dataptr, uint8_t size);
+    void    SaveIdentity(const char *identity);
+#endif
     
     void    Clear();
     void    Request(int length);
@@ -267,6 +476,11 @@ public:
     void Transmit(uint8_t nbytes, uint8_t *dataptr);
     void    BeginTransmit(uint32_t total_size);
     void    TransmitData(uint8_t data);
+    bool    TryTransmitData(uint8_t data);
+    // Takes as many bytes as the FIFO has room for and sends the full packets,
+    // returns the number of bytes accepted. The rest is for the next call.
+    uint16_t TransmitData(const uint8_t *dataptr, uint16_t length);
+    uint16_t TransmitSpaceAvailable();
     bool    TransmitDone();
 
     void    AbortReceive();
@@ -280,6 +494,8 @@ public:
     void    Unpause();
 
     void    TimeStep(uint32_t value);
+    void    SetConfig(const USBTMCConfig &value);
+    const USBTMCConfig &GetConfig();
 
     // USBDeviceConfig implementation
     uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
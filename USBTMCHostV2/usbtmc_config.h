@@ -0,0 +1,82 @@
+/*
+ * USBTMC class driver configuration
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_CONFIG_H__)
+#define __USBTMC_CONFIG_H__
+
+// Set a feature to 0 to strip its code and RAM from the driver.
+
+// Serial number fetch and matching.
+// SetTargetSerialNumber(), serial numbers in device rules and the serial number part of the device store key.
+#if !defined(USBTMC_USE_SERIAL_NUMBER)
+#define USBTMC_USE_SERIAL_NUMBER    1
+#endif
+
+// READ_STATUS_BYTE response through the Interrupt-IN endpoint.
+#if !defined(USBTMC_USE_INTERRUPT_EP)
+#define USBTMC_USE_INTERRUPT_EP     1
+#endif
+
+// Abort Bulk-OUT, Abort Bulk-IN and Clear sequences.
+// Without them a timeout or a transfer error just returns to idle.
+#if !defined(USBTMC_USE_ABORT_CLEAR)
+#define USBTMC_USE_ABORT_CLEAR      1
+#endif
+
+// SetDeviceRules()
+#if !defined(USBTMC_USE_DEVICE_RULES)
+#define USBTMC_USE_DEVICE_RULES     1
+#endif
+
+// Instrument profile table applied on Init().
+#if !defined(USBTMC_USE_PROFILES)
+#define USBTMC_USE_PROFILES         1
+#endif
+
+// SetSessionPreamble()
+#if !defined(USBTMC_USE_SESSION)
+#define USBTMC_USE_SESSION          1
+#endif
+
+// SetDeviceStore()
+#if !defined(USBTMC_USE_DEVICE_STORE)
+#define USBTMC_USE_DEVICE_STORE     1
+#endif
+
+// SetLineMode()
+#if !defined(USBTMC_USE_LINE_MODE)
+#define USBTMC_USE_LINE_MODE        1
+#endif
+
+// Capacity of the transmit FIFO, must be a power of two larger than USBTMC_MESSAGE_SIZE.
+#if !defined(USBTMC_FIFO_SIZE)
+#define USBTMC_FIFO_SIZE            128
+#endif
+
+// One packet buffer for all USBTMC instances, which saves RAM on a single loop.
+// Set 0 for a buffer in each instance when instances run on separate threads.
+#if !defined(USBTMC_SHARED_PACKET_BUFFER)
+#define USBTMC_SHARED_PACKET_BUFFER 1
+#endif
+
+// Size of the packet buffer.
+// It must hold the largest Bulk endpoint packet of the instruments.
+#if !defined(USBTMC_MESSAGE_SIZE)
+#define USBTMC_MESSAGE_SIZE         64
+#endif
+
+#endif // __USBTMC_CONFIG_H__
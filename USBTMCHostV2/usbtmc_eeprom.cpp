@@ -0,0 +1,237 @@
+/*
+ * USBTMC device store on EEPROM
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_eeprom.h"
+
+#if defined(USBTMC_HAS_EEPROM)
+
+#include <EEPROM.h>
+
+#define SLOT_MAGIC              0xA6    // changes with the slot layout, older slots are ignored
+#define SLOT_MAGIC_OFFSET       0
+#define SLOT_KEY_OFFSET         (SLOT_MAGIC_OFFSET + 1)
+#define SLOT_RECORD_OFFSET      (SLOT_KEY_OFFSET + sizeof(USBTMCDeviceKey))
+#define SLOT_IDENTITY_OFFSET    (SLOT_RECORD_OFFSET + sizeof(USBTMCDeviceRecord))
+#define SLOT_CHECKSUM_OFFSET    (SLOT_IDENTITY_OFFSET + USBTMC_IDENTITY_SIZE)
+
+const uint16_t USBTMCEEPROMStore::SlotSize = SLOT_CHECKSUM_OFFSET + 1;
+
+USBTMCEEPROMStore::USBTMCEEPROMStore(uint16_t address, uint8_t slots) : baseAddress(address), slotCount(slots), isBegun(false)
+{
+}
+
+bool USBTMCEEPROMStore::Load(const USBTMCDeviceKey &key, USBTMCDeviceRecord *record)
+{
+    Begin();
+
+    int16_t slot = FindSlot(key);
+
+    if (slot < 0)
+        return false;
+
+    ReadBlock(SlotAddress(slot) + SLOT_RECORD_OFFSET, (uint8_t *)record, sizeof(USBTMCDeviceRecord));
+
+    return true;
+}
+
+void USBTMCEEPROMStore::Save(const USBTMCDeviceKey &key, const USBTMCDeviceRecord *record)
+{
+    Begin();
+
+    uint8_t slot = AllocSlot(key);
+    uint16_t address = SlotAddress(slot);
+
+    WriteBlock(address + SLOT_RECORD_OFFSET, (const uint8_t *)record, sizeof(USBTMCDeviceRecord));
+    UpdateByte(address + SLOT_CHECKSUM_OFFSET, CalcChecksum(slot));
+    Commit();
+}
+
+void USBTMCEEPROMStore::Remove(const USBTMCDeviceKey &key)
+{
+    Begin();
+
+    int16_t slot = FindSlot(key);
+
+    if (slot < 0)
+        return;
+
+    UpdateByte(SlotAddress(slot) + SLOT_MAGIC_OFFSET, 0xFF);
+    Commit();
+}
+
+uint8_t USBTMCEEPROMStore::LoadIdentity(const USBTMCDeviceKey &key, char *dataptr, uint8_t size)
+{
+    Begin();
+
+    int16_t slot = FindSlot(key);
+    uint8_t length = 0;
+
+    if (slot < 0 || size == 0)
+        return 0;
+
+    uint16_t address = SlotAddress(slot) + SLOT_IDENTITY_OFFSET;
+
+    while (length < (size - 1) && length < USBTMC_IDENTITY_SIZE)
+    {
+        char c = (char)EEPROM.read(address + length);
+
+        if (c == 0)
+            break;
+
+        dataptr[length++] = c;
+    }
+
+    dataptr[length] = 0;
+
+    return length;
+}
+
+void USBTMCEEPROMStore::SaveIdentity(const USBTMCDeviceKey &key, const char *identity)
+{
+    Begin();
+
+    uint8_t slot = AllocSlot(key);
+    uint16_t address = SlotAddress(slot) + SLOT_IDENTITY_OFFSET;
+    uint8_t i = 0;
+
+    for (; i < (USBTMC_IDENTITY_SIZE - 1) && identity[i] != 0; i++)
+        UpdateByte(address + i, (uint8_t)identity[i]);
+
+    for (; i < USBTMC_IDENTITY_SIZE; i++)
+        UpdateByte(address + i, 0x00);
+
+    UpdateByte(SlotAddress(slot) + SLOT_CHECKSUM_OFFSET, CalcChecksum(slot));
+    Commit();
+}
+
+void USBTMCEEPROMStore::Erase()
+{
+    Begin();
+
+    for (uint8_t slot = 0; slot < slotCount; slot++)
+        UpdateByte(SlotAddress(slot) + SLOT_MAGIC_OFFSET, 0xFF);
+
+    Commit();
+}
+
+uint16_t USBTMCEEPROMStore::SlotAddress(uint8_t slot)
+{
+    return baseAddress + (uint16_t)slot * SlotSize;
+}
+
+int16_t USBTMCEEPROMStore::FindSlot(const USBTMCDeviceKey &key)
+{
+    for (uint8_t slot = 0; slot < slotCount; slot++)
+    {
+        uint16_t address = SlotAddress(slot);
+        USBTMCDeviceKey stored;
+
+        if (EEPROM.read(address + SLOT_MAGIC_OFFSET) != SLOT_MAGIC)
+            continue;
+
+        ReadBlock(address + SLOT_KEY_OFFSET, (uint8_t *)&stored, sizeof(USBTMCDeviceKey));
+
+        if (stored.vid != key.vid || stored.pid != key.pid || stored.serialHash != key.serialHash)
+            continue;
+
+        if (EEPROM.read(address + SLOT_CHECKSUM_OFFSET) != CalcChecksum(slot))
+            continue;
+
+        return slot;
+    }
+
+    return -1;
+}
+
+uint8_t USBTMCEEPROMStore::AllocSlot(const USBTMCDeviceKey &key)
+{
+    int16_t found = FindSlot(key);
+
+    if (found >= 0)
+        return (uint8_t)found;
+
+    uint8_t slot;
+
+    for (slot = 0; slot < slotCount; slot++)
+    {
+        if (EEPROM.read(SlotAddress(slot) + SLOT_MAGIC_OFFSET) != SLOT_MAGIC)
+            break;
+    }
+
+    if (slot >= slotCount)
+        slot = (uint8_t)((key.vid ^ key.pid ^ key.serialHash) % slotCount);  // Evict
+
+    uint16_t address = SlotAddress(slot);
+
+    UpdateByte(address + SLOT_MAGIC_OFFSET, SLOT_MAGIC);
+    WriteBlock(address + SLOT_KEY_OFFSET, (const uint8_t *)&key, sizeof(USBTMCDeviceKey));
+
+    for (uint16_t i = SLOT_RECORD_OFFSET; i < SLOT_CHECKSUM_OFFSET; i++)
+        UpdateByte(address + i, 0x00);
+
+    return slot;
+}
+
+uint8_t USBTMCEEPROMStore::CalcChecksum(uint8_t slot)
+{
+    uint16_t address = SlotAddress(slot);
+    uint8_t sum = 0;
+
+    for (uint16_t i = SLOT_KEY_OFFSET; i < SLOT_CHECKSUM_OFFSET; i++)
+        sum += EEPROM.read(address + i);
+
+    return (uint8_t)~sum;
+}
+
+void USBTMCEEPROMStore::ReadBlock(uint16_t address, uint8_t *dataptr, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+        dataptr[i] = EEPROM.read(address + i);
+}
+
+void USBTMCEEPROMStore::WriteBlock(uint16_t address, const uint8_t *dataptr, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+        UpdateByte(address + i, dataptr[i]);
+}
+
+// Not every core has EEPROM.update(), an unchanged byte is not written
+void USBTMCEEPROMStore::UpdateByte(uint16_t address, uint8_t value)
+{
+    if (EEPROM.read(address) != value)
+        EEPROM.write(address, value);
+}
+
+void USBTMCEEPROMStore::Begin()
+{
+    if (isBegun)
+        return;
+
+#if defined(USBTMC_EEPROM_EMULATED)
+    EEPROM.begin(baseAddress + (uint16_t)slotCount * SlotSize);
+#endif
+    isBegun = true;
+}
+
+void USBTMCEEPROMStore::Commit()
+{
+#if defined(USBTMC_EEPROM_EMULATED)
+    EEPROM.commit();
+#endif
+}
+
+#endif // USBTMC_HAS_EEPROM
@@ -0,0 +1,72 @@
+/*
+ * USBTMC device store on EEPROM
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_EEPROM_H__)
+#define __USBTMC_EEPROM_H__
+
+#include "usbtmc.h"
+
+#if defined(__has_include)
+#if __has_include(<EEPROM.h>)
+#define USBTMC_HAS_EEPROM
+#endif
+#endif
+
+#if defined(USBTMC_HAS_EEPROM)
+
+// These cores keep EEPROM in flash, it is mapped by begin() and written back by commit()
+#if defined(ESP8266) || defined(ESP32) || defined(ARDUINO_ARCH_RP2040)
+#define USBTMC_EEPROM_EMULATED
+#endif
+
+#define USBTMC_IDENTITY_SIZE 48
+
+// Each slot holds one device:
+// [magic][USBTMCDeviceKey][USBTMCDeviceRecord][identity][checksum]
+class USBTMCEEPROMStore : public USBTMCDeviceStore
+{
+    uint16_t baseAddress;
+    uint8_t slotCount;
+    bool isBegun;
+
+    uint16_t SlotAddress(uint8_t slot);
+    int16_t FindSlot(const USBTMCDeviceKey &key);
+    uint8_t AllocSlot(const USBTMCDeviceKey &key);
+    uint8_t CalcChecksum(uint8_t slot);
+    void    ReadBlock(uint16_t address, uint8_t *dataptr, uint16_t length);
+    void    WriteBlock(uint16_t address, const uint8_t *dataptr, uint16_t length);
+    void    UpdateByte(uint16_t address, uint8_t value);
+    void    Begin();
+    void    Commit();
+
+public:
+    USBTMCEEPROMStore(uint16_t address = 0, uint8_t slots = 4);
+
+    static const uint16_t SlotSize;
+
+    bool Load(const USBTMCDeviceKey &key, USBTMCDeviceRecord *record);
+    void Save(const USBTMCDeviceKey &key, const USBTMCDeviceRecord *record);
+    void Remove(const USBTMCDeviceKey &key);
+    uint8_t LoadIdentity(const USBTMCDeviceKey &key, char *dataptr, uint8_t size);
+    void SaveIdentity(const USBTMCDeviceKey &key, const char *identity);
+
+    void Erase();
+};
+
+#endif // USBTMC_HAS_EEPROM
+
+#endif // __USBTMC_EEPROM_H__
@@ -0,0 +1,332 @@
+/*
+ * Min/max envelope decimation for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_envelope.h"
+
+#define BLOCK_STATE_HASH        0   // waiting for '#'
+#define BLOCK_STATE_DIGITS      1   // number of length digits
+#define BLOCK_STATE_LENGTH      2   // length digits
+#define BLOCK_STATE_DATA        3
+#define BLOCK_STATE_DONE        4
+
+#define INDEFINITE_LENGTH       0xFFFFFFFF
+
+// INT16_MIN and INT16_MAX need __STDC_LIMIT_MACROS in C++ on avr-libc
+#define SAMPLE_MINIMUM          (-32767 - 1)
+#define SAMPLE_MAXIMUM          32767
+
+template <USBTMCSampleFormat F>
+static inline int16_t LoadSample(const uint8_t *p)
+{
+    switch (F)
+    {
+        case USBTMCSampleFormat::Int8:      return (int8_t)p[0];
+        case USBTMCSampleFormat::UInt8:     return p[0];
+        case USBTMCSampleFormat::Int16LE:   return (int16_t)(p[0] | (p[1] << 8));
+        case USBTMCSampleFormat::Int16BE:   return (int16_t)((p[0] << 8) | p[1]);
+        case USBTMCSampleFormat::UInt16LE:  return (int16_t)((p[0] | (p[1] << 8)) ^ 0x8000);
+        case USBTMCSampleFormat::UInt16BE:  return (int16_t)(((p[0] << 8) | p[1]) ^ 0x8000);
+    }
+    return 0;
+}
+
+// One format per loop, the format switch stays out of the per sample path
+template <USBTMCSampleFormat F>
+static void ScanSamples(const uint8_t *dataptr, uint32_t samples, int16_t &minimum, int16_t &maximum, int64_t *sum)
+{
+    const uint8_t size = USBTMCSampleSize(F);
+    int16_t lo = minimum;
+    int16_t hi = maximum;
+    int32_t total = 0;
+
+    for (uint32_t i = 0; i < samples; i++)
+    {
+        int16_t value = LoadSample<F>(dataptr);
+        dataptr += size;
+
+        if (value < lo)
+            lo = value;
+        if (value > hi)
+            hi = value;
+
+        if (sum != 0)
+        {
+            total += value;
+
+            // Keep the 32 bit sum in range on AVR
+            if ((i & 0x7FFF) == 0x7FFF)
+            {
+                *sum += total;
+                total = 0;
+            }
+        }
+    }
+
+    if (sum != 0)
+        *sum += total;
+
+    minimum = lo;
+    maximum = hi;
+}
+
+USBTMCEnvelope::USBTMCEnvelope(int16_t *minimums, int16_t *maximums, uint16_t size, int16_t *means) :
+    minimums(minimums), maximums(maximums), means(means), capacity(size)
+{
+    SetFormat(USBTMCSampleFormat::UInt8);
+    Begin();
+}
+
+void USBTMCEnvelope::SetFormat(USBTMCSampleFormat value)
+{
+    format = value;
+    isBiased = (value == USBTMCSampleFormat::UInt16LE || value == USBTMCSampleFormat::UInt16BE);
+    hasCarry = false;
+}
+
+void USBTMCEnvelope::Begin(uint32_t totalSamples)
+{
+    count = 0;
+    sampleCount = 0;
+    isOverflowed = false;
+    bucketRemaining = 0;
+    bucketSamples = 0;
+    blockState = BLOCK_STATE_HASH;
+    lengthDigits = 0;
+    blockRemaining = 0;
+    hasCarry = false;
+
+    Layout(totalSamples);
+}
+
+void USBTMCEnvelope::Layout(uint32_t totalSamples)
+{
+    bucketCount = (totalSamples < capacity) ? (uint16_t)totalSamples : capacity;
+    samplesPerBucket = (bucketCount > 0) ? totalSamples / bucketCount : 0;
+    remainder = (bucketCount > 0) ? (uint16_t)(totalSamples % bucketCount) : 0;
+    error = 0;
+}
+
+void USBTMCEnvelope::CloseBucket()
+{
+    minimums[count] = bucketMinimum;
+    maximums[count] = bucketMaximum;
+
+    if (means != 0)
+        means[count] = (int16_t)(bucketSum / (int64_t)bucketSamples);
+
+    count++;
+    bucketRemaining = 0;
+    bucketSamples = 0;
+}
+
+void USBTMCEnvelope::AddSamples(const uint8_t *dataptr, uint32_t samples)
+{
+    const uint8_t size = USBTMCSampleSize(format);
+    int64_t *sum = (means != 0) ? &bucketSum : 0;
+
+    sampleCount += samples;
+
+    while (samples > 0)
+    {
+        if (bucketSamples == 0)
+        {
+            if (count >= bucketCount)
+            {
+                isOverflowed = true;
+                return;
+            }
+
+            // The remainder is handed out one sample at a time (Bresenham)
+            bucketRemaining = samplesPerBucket;
+            error += remainder;
+            if (error >= bucketCount)
+            {
+                error -= bucketCount;
+                bucketRemaining++;
+            }
+
+            bucketMinimum = SAMPLE_MAXIMUM;
+            bucketMaximum = SAMPLE_MINIMUM;
+            bucketSum = 0;
+        }
+
+        uint32_t n = (samples < bucketRemaining) ? samples : bucketRemaining;
+
+        switch (format)
+        {
+            case USBTMCSampleFormat::Int8:      ScanSamples<USBTMCSampleFormat::Int8>(dataptr, n, bucketMinimum, bucketMaximum, sum); break;
+            case USBTMCSampleFormat::UInt8:     ScanSamples<USBTMCSampleFormat::UInt8>(dataptr, n, bucketMinimum, bucketMaximum, sum); break;
+            case USBTMCSampleFormat::Int16LE:   ScanSamples<USBTMCSampleFormat::Int16LE>(dataptr, n, bucketMinimum, bucketMaximum, sum); break;
+            case USBTMCSampleFormat::Int16BE:   ScanSamples<USBTMCSampleFormat::Int16BE>(dataptr, n, bucketMinimum, bucketMaximum, sum); break;
+            case USBTMCSampleFormat::UInt16LE:  ScanSamples<USBTMCSampleFormat::UInt16LE>(dataptr, n, bucketMinimum, bucketMaximum, sum); break;
+            case USBTMCSampleFormat::UInt16BE:  ScanSamples<USBTMCSampleFormat::UInt16BE>(dataptr, n, bucketMinimum, bucketMaximum, sum); break;
+        }
+
+        dataptr += n * size;
+        samples -= n;
+        bucketSamples += n;
+        bucketRemaining -= n;
+
+        if (bucketRemaining == 0)
+            CloseBucket();
+    }
+}
+
+uint16_t USBTMCEnvelope::Feed(const uint8_t *dataptr, uint16_t length)
+{
+    const uint8_t size = USBTMCSampleSize(format);
+    uint16_t previous = count;
+
+    while (length > 0 && blockState != BLOCK_STATE_DATA)
+    {
+        uint8_t c = *dataptr++;
+        length--;
+
+        switch (blockState)
+        {
+            case BLOCK_STATE_HASH:
+                // A response header such as "CURVE " may come first
+                if (c == '#')
+                    blockState = BLOCK_STATE_DIGITS;
+                break;
+
+            case BLOCK_STATE_DIGITS:
+                if (c < '0' || c > '9')
+                {
+                    blockState = BLOCK_STATE_HASH;
+                    break;
+                }
+
+                lengthDigits = c - '0';
+                blockRemaining = 0;
+
+                if (lengthDigits == 0)
+                {
+                    blockRemaining = INDEFINITE_LENGTH;
+                    blockState = BLOCK_STATE_DATA;
+                }
+                else
+                    blockState = BLOCK_STATE_LENGTH;
+                break;
+
+            case BLOCK_STATE_LENGTH:
+                if (c < '0' || c > '9')
+                {
+                    blockState = BLOCK_STATE_HASH;
+                    break;
+                }
+
+                blockRemaining = blockRemaining * 10 + (c - '0');
+                if (--lengthDigits > 0)
+                    break;
+
+                if (bucketCount == 0)
+                    Layout(blockRemaining / size);
+
+                blockState = (blockRemaining > 0) ? BLOCK_STATE_DATA : BLOCK_STATE_DONE;
+                break;
+
+            default:
+                // The terminator after the block is ignored
+                return 0;
+        }
+    }
+
+    if (blockState != BLOCK_STATE_DATA || length == 0)
+        return count - previous;
+
+    if (blockRemaining != INDEFINITE_LENGTH)
+    {
+        if (length > blockRemaining)
+            length = (uint16_t)blockRemaining;
+
+        blockRemaining -= length;
+    }
+
+    if (hasCarry && length > 0)
+    {
+        // The first byte of the sample came with the previous chunk
+        uint8_t sample[2] = { carry, dataptr[0] };
+
+        AddSamples(sample, 1);
+        hasCarry = false;
+        dataptr++;
+        length--;
+    }
+
+    uint16_t samples = length / size;
+    AddSamples(dataptr, samples);
+
+    if (length % size)
+    {
+        carry = dataptr[samples * size];
+        hasCarry = true;
+    }
+
+    if (blockRemaining == 0)
+        blockState = BLOCK_STATE_DONE;
+
+    return count - previous;
+}
+
+uint16_t USBTMCEnvelope::Finish()
+{
+    if (bucketSamples > 0)
+        CloseBucket();
+
+    return count;
+}
+
+bool USBTMCEnvelope::IsComplete()
+{
+    return (bucketCount > 0 && count >= bucketCount);
+}
+
+uint16_t USBTMCEnvelope::Count()
+{
+    return count;
+}
+
+uint32_t USBTMCEnvelope::SampleCount()
+{
+    return sampleCount;
+}
+
+bool USBTMCEnvelope::IsOverflowed()
+{
+    return isOverflowed;
+}
+
+int32_t USBTMCEnvelope::Unbias(int16_t value)
+{
+    return isBiased ? (int32_t)(uint16_t)(value ^ 0x8000) : value;
+}
+
+int32_t USBTMCEnvelope::Minimum(uint16_t index)
+{
+    return (index < count) ? Unbias(minimums[index]) : 0;
+}
+
+int32_t USBTMCEnvelope::Maximum(uint16_t index)
+{
+    return (index < count) ? Unbias(maximums[index]) : 0;
+}
+
+int32_t USBTMCEnvelope::Mean(uint16_t index)
+{
+    return (index < count && means != 0) ? Unbias(means[index]) : 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Min/max envelope decimation for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_ENVELOPE_H__)
+#define __USBTMC_ENVELOPE_H__
+
+#include <stdint.h>
+
+#include "usbtmc_sample.h"
+
+// Reduces a :WAV:DATA? block to min/max (and mean) per bucket while it streams in,
+// the memory used is the bucket arrays only however long the capture is.
+// Feed it the payload chunks from OnReceivedData() including the IEEE 488.2 block header.
+//
+//   int16_t minimums[100], maximums[100];
+//   USBTMCEnvelope envelope(minimums, maximums, 100);
+//   envelope.SetFormat(USBTMCSampleFormat::UInt8);
+//   envelope.Begin();
+//   void OnReceivedData(const uint8_t *dataptr, uint16_t length) { envelope.Feed(dataptr, length); }
+//   ... after the message has ended: envelope.Finish(); envelope.Minimum(i), envelope.Maximum(i)
+//
+// The values are raw samples, scale them with the preamble for volts.
+class USBTMCEnvelope
+{
+    int16_t *minimums;
+    int16_t *maximums;
+    int16_t *means;
+    uint16_t capacity;
+    USBTMCSampleFormat format;
+    bool isBiased;              // UInt16 samples are stored with the sign bit flipped
+
+    // Samples are spread over the buckets as evenly as integers allow
+    uint16_t bucketCount;
+    uint32_t samplesPerBucket;
+    uint16_t remainder;
+    uint16_t error;
+    uint16_t count;             // completed buckets
+    uint32_t sampleCount;
+    bool isOverflowed;
+
+    // Bucket in progress
+    uint32_t bucketRemaining;
+    uint32_t bucketSamples;
+    int16_t bucketMinimum;
+    int16_t bucketMaximum;
+    int64_t bucketSum;
+
+    // Block header
+    uint8_t blockState;
+    uint8_t lengthDigits;
+    uint32_t blockRemaining;
+    uint8_t carry;
+    bool hasCarry;
+
+    void Layout(uint32_t totalSamples);
+    void CloseBucket();
+    void AddSamples(const uint8_t *dataptr, uint32_t samples);
+    int32_t Unbias(int16_t value);
+
+public:
+    // means may be 0 when the mean is not needed
+    USBTMCEnvelope(int16_t *minimums, int16_t *maximums, uint16_t size, int16_t *means = 0);
+
+    void SetFormat(USBTMCSampleFormat format);
+    // The total comes from the block header when it is 0, an indefinite length block ("#0") needs it
+    void Begin(uint32_t totalSamples = 0);
+    // Returns the number of buckets completed by this chunk
+    uint16_t Feed(const uint8_t *dataptr, uint16_t length);
+    // Completes the last bucket when the block was shorter than expected
+    uint16_t Finish();
+
+    bool IsComplete();
+    uint16_t Count();
+    uint32_t SampleCount();
+    // More samples than the total, they are not in the envelope
+    bool IsOverflowed();
+
+    int32_t Minimum(uint16_t index);
+    int32_t Maximum(uint16_t index);
+    int32_t Mean(uint16_t index);
+};
+
+#endif // __USBTMC_ENVELOPE_H__
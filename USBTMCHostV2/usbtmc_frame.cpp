@@ -0,0 +1,185 @@
+/*
+ * COBS framing with CRC for the USBTMC serial bridge
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_frame.h"
+
+#define CRC16_INITIAL       0xFFFF
+#define CRC16_POLYNOMIAL    0x1021
+
+USBTMCFrameLink::USBTMCFrameLink(Stream *stream) : pStream(stream), txSequence(0)
+{
+    ResetReceive();
+}
+
+void USBTMCFrameLink::ResetReceive()
+{
+    rxLength = 0;
+    rxCode = 0;
+    rxRemaining = 0;
+    isRxOverflowed = false;
+    isFrameReady = false;
+}
+
+uint16_t USBTMCFrameLink::Crc16(uint16_t crc, const uint8_t *dataptr, uint8_t length)
+{
+    while (length--)
+    {
+        crc ^= (uint16_t)(*dataptr++) << 8;
+
+        for (uint8_t i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLYNOMIAL : (crc << 1);
+    }
+
+    return crc;
+}
+
+uint8_t USBTMCFrameLink::Poll()
+{
+    while (!isFrameReady && pStream->available() > 0)
+    {
+        uint8_t c = (uint8_t)pStream->read();
+
+        if (c == 0x00)
+        {
+            // End of frame, a block which is cut short means bytes were lost
+            bool isValid = !isRxOverflowed && rxRemaining == 0 && rxLength >= USBTMC_FRAME_HEADER_SIZE + USBTMC_FRAME_CRC_SIZE;
+
+            if (isValid)
+            {
+                uint8_t length = rxLength - USBTMC_FRAME_CRC_SIZE;
+                uint16_t crc = rxBuffer[length] | (rxBuffer[length + 1] << 8);
+
+                isValid = (Crc16(CRC16_INITIAL, rxBuffer, length) == crc);
+            }
+
+            if (!isValid)
+            {
+                bool isEmpty = (rxLength == 0 && rxCode == 0);
+
+                ResetReceive();
+
+                // Back to back delimiters are not an error
+                if (isEmpty)
+                    continue;
+
+                return USBTMC_FRAME_CORRUPTED;
+            }
+
+            rxLength -= USBTMC_FRAME_CRC_SIZE;
+            isFrameReady = true;
+            return USBTMC_FRAME_READY;
+        }
+
+        if (rxRemaining == 0)
+        {
+            // Start of a block, the previous block ended with an implicit zero unless it was full
+            if (rxCode != 0 && rxCode != 0xFF)
+            {
+                if (rxLength < sizeof(rxBuffer))
+                    rxBuffer[rxLength++] = 0x00;
+                else
+                    isRxOverflowed = true;
+            }
+
+            rxCode = c;
+            rxRemaining = c - 1;
+            continue;
+        }
+
+        if (rxLength < sizeof(rxBuffer))
+            rxBuffer[rxLength++] = c;
+        else
+            isRxOverflowed = true;
+
+        rxRemaining--;
+    }
+
+    return isFrameReady ? USBTMC_FRAME_READY : USBTMC_FRAME_NONE;
+}
+
+void USBTMCFrameLink::Release()
+{
+    ResetReceive();
+}
+
+uint8_t USBTMCFrameLink::FrameType()
+{
+    return rxBuffer[0];
+}
+
+uint8_t USBTMCFrameLink::FrameSequence()
+{
+    return rxBuffer[1];
+}
+
+const uint8_t *USBTMCFrameLink::Payload()
+{
+    return &rxBuffer[USBTMC_FRAME_HEADER_SIZE];
+}
+
+uint8_t USBTMCFrameLink::PayloadLength()
+{
+    return rxLength - USBTMC_FRAME_HEADER_SIZE;
+}
+
+void USBTMCFrameLink::Send(uint8_t type, const uint8_t *payload, uint8_t length)
+{
+    uint8_t encoded[USBTMC_FRAME_ENCODED_SIZE];
+    uint8_t n = Encode(type, payload, length, encoded);
+
+    pStream->write(encoded, n);
+}
+
+uint8_t USBTMCFrameLink::Encode(uint8_t type, const uint8_t *payload, uint8_t length, uint8_t *encoded)
+{
+    uint8_t frame[USBTMC_FRAME_SIZE];
+    uint8_t codeIndex = 0;
+    uint8_t code = 1;
+    uint8_t n = 1;
+    uint16_t crc;
+
+    if (length > USBTMC_FRAME_PAYLOAD_SIZE)
+        length = USBTMC_FRAME_PAYLOAD_SIZE;
+
+    frame[0] = type;
+    frame[1] = txSequence++;
+    memcpy(&frame[USBTMC_FRAME_HEADER_SIZE], payload, length);
+    length += USBTMC_FRAME_HEADER_SIZE;
+
+    crc = Crc16(CRC16_INITIAL, frame, length);
+    frame[length++] = crc & 0xFF;
+    frame[length++] = crc >> 8;
+
+    for (uint8_t i = 0; i < length; i++)
+    {
+        if (frame[i] == 0x00)
+        {
+            encoded[codeIndex] = code;
+            codeIndex = n++;
+            code = 1;
+            continue;
+        }
+
+        encoded[n++] = frame[i];
+        code++;
+    }
+
+    encoded[codeIndex] = code;
+    encoded[n++] = 0x00;
+
+    return n;
+}
@@ -0,0 +1,85 @@
+/*
+ * COBS framing with CRC for the USBTMC serial bridge
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_FRAME_H__)
+#define __USBTMC_FRAME_H__
+
+#include <Arduino.h>
+
+// Largest payload of one frame, a packet of the instrument fits in one frame
+#if !defined(USBTMC_FRAME_PAYLOAD_SIZE)
+#define USBTMC_FRAME_PAYLOAD_SIZE   64
+#endif
+
+// type, sequence number, payload, CRC16
+#define USBTMC_FRAME_HEADER_SIZE    2
+#define USBTMC_FRAME_CRC_SIZE       2
+#define USBTMC_FRAME_SIZE           (USBTMC_FRAME_HEADER_SIZE + USBTMC_FRAME_PAYLOAD_SIZE + USBTMC_FRAME_CRC_SIZE)
+// COBS code byte and delimiter on top
+#define USBTMC_FRAME_ENCODED_SIZE   (USBTMC_FRAME_SIZE + 2)
+
+// A frame is one COBS block at most
+#if USBTMC_FRAME_SIZE > 253
+#error USBTMC_FRAME_PAYLOAD_SIZE is too large
+#endif
+
+#define USBTMC_FRAME_NONE           0   // nothing complete yet
+#define USBTMC_FRAME_READY          1
+#define USBTMC_FRAME_CORRUPTED      2   // bad CRC, too long or too short
+
+// Frames on a byte stream:
+//   COBS(type, sequence number, payload, CRC16-CCITT little endian) 0x00
+// COBS keeps 0x00 out of the frame, so a receiver finds the next frame after any garbage.
+// The CRC covers type, sequence number and payload.
+class USBTMCFrameLink
+{
+    Stream *pStream;
+
+    // Receive, decoded in place while the bytes come in
+    uint8_t rxBuffer[USBTMC_FRAME_SIZE];
+    uint8_t rxLength;
+    uint8_t rxCode;             // COBS code of the block in progress
+    uint8_t rxRemaining;        // bytes left in the block
+    bool isRxOverflowed;
+    bool isFrameReady;
+
+    uint8_t txSequence;
+
+    void ResetReceive();
+
+public:
+    USBTMCFrameLink(Stream *stream);
+
+    // Reads the bytes waiting on the stream up to the end of a frame
+    uint8_t Poll();
+    // The frame stays until Release(), Poll() does not read further until then
+    void Release();
+
+    uint8_t FrameType();
+    uint8_t FrameSequence();
+    const uint8_t *Payload();
+    uint8_t PayloadLength();
+
+    // The sequence number counts up per frame sent
+    void Send(uint8_t type, const uint8_t *payload, uint8_t length);
+    // The frame for the caller to send, e.g. through a staging buffer. Returns its length.
+    uint8_t Encode(uint8_t type, const uint8_t *payload, uint8_t length, uint8_t *encoded);
+
+    static uint16_t Crc16(uint16_t crc, const uint8_t *dataptr, uint8_t length);
+};
+
+#endif // __USBTMC_FRAME_H__
@@ -0,0 +1,281 @@
+/*
+ * Binary data logger for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_logger.h"
+
+USBTMCLogger::USBTMCLogger(Print *output, uint8_t *buffer, uint16_t size, bool isBlindWrite) :
+    pOutput(output), buffer(buffer), halfSize(size / 2), isBlindWrite(isBlindWrite)
+{
+    active = buffer;
+    draining = buffer + halfSize;
+    activeLength = 0;
+    drainOffset = 0;
+    drainLength = 0;
+    lastTimestamp = 0;
+    dropped = 0;
+    hasPendingByte = false;
+}
+
+void USBTMCLogger::Begin()
+{
+    static const char magic[] = USBTMC_LOGGER_MAGIC;
+
+    activeLength = 0;
+    drainOffset = 0;
+    drainLength = 0;
+    lastTimestamp = 0;
+    dropped = 0;
+    hasPendingByte = false;
+
+    recordBegin = 0;
+    isRecordOverflowed = false;
+    for (uint8_t i = 0; i < sizeof(magic) - 1; i++)
+        Put(magic[i]);
+    Put(USBTMC_LOGGER_VERSION);
+}
+
+uint16_t USBTMCLogger::GetDropped()
+{
+    return dropped;
+}
+
+void USBTMCLogger::Put(uint8_t data)
+{
+    if (activeLength >= halfSize)
+    {
+        isRecordOverflowed = true;
+        return;
+    }
+
+    active[activeLength++] = data;
+}
+
+void USBTMCLogger::PutVarint(uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        Put((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+
+    Put((uint8_t)value);
+}
+
+void USBTMCLogger::PutZigzag(int32_t value)
+{
+    PutVarint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+void USBTMCLogger::BeginRecord(uint8_t type, uint8_t channel, uint32_t timestamp)
+{
+    recordBegin = activeLength;
+    isRecordOverflowed = false;
+
+    Put((type << 4) | (channel & 0x0F));
+    PutZigzag((int32_t)(timestamp - lastTimestamp));
+}
+
+// Keeps the record when it fits, otherwise it is taken back
+bool USBTMCLogger::EndRecord()
+{
+    if (!isRecordOverflowed)
+        return true;
+
+    activeLength = recordBegin;
+    return false;
+}
+
+// Makes room for a record which did not fit, false when it must be dropped
+bool USBTMCLogger::SwapForRetry()
+{
+    if (drainOffset < drainLength || activeLength == 0)
+    {
+        dropped++;
+        return false;
+    }
+
+    Swap();
+    return true;
+}
+
+void USBTMCLogger::Swap()
+{
+    uint8_t *half = draining;
+
+    draining = active;
+    drainLength = activeLength;
+    drainOffset = 0;
+
+    active = half;
+    activeLength = 0;
+}
+
+bool USBTMCLogger::WriteReading(uint8_t channel, uint32_t timestamp, const char *text, uint16_t length)
+{
+    while (true)
+    {
+        BeginRecord(USBTMC_LOGGER_TYPE_READING, channel, timestamp);
+        PutVarint(length);
+
+        for (uint16_t i = 0; i < length; i++)
+            Put((uint8_t)text[i]);
+
+        if (EndRecord())
+            break;
+
+        if (!SwapForRetry())
+            return false;
+    }
+
+    lastTimestamp = timestamp;
+    return true;
+}
+
+bool USBTMCLogger::WriteSamples(uint8_t channel, uint32_t timestamp, USBTMCSampleFormat format, const uint8_t *dataptr, uint16_t length, bool isDeltaCoded)
+{
+    uint8_t size = USBTMCSampleSize(format);
+    bool isPending = (size == 2 && hasPendingByte);
+    uint16_t total = length + (isPending ? 1 : 0);
+    uint16_t count = total / size;
+    bool isWritten = true;
+
+    if (length == 0)
+        return true;
+
+    while (true)
+    {
+        int32_t previous = 0;
+
+        BeginRecord(USBTMC_LOGGER_TYPE_SAMPLES, channel, timestamp);
+        Put((uint8_t)format);
+        Put(isDeltaCoded ? USBTMC_LOGGER_CODING_DELTA : USBTMC_LOGGER_CODING_RAW);
+        PutVarint(count);
+
+        for (uint16_t i = 0; i < count * size; i += size)
+        {
+            // The pending byte is the first byte of the stream
+            uint8_t first = (isPending && i == 0) ? pendingByte : dataptr[i - (isPending ? 1 : 0)];
+            uint8_t second = (size == 2) ? dataptr[i + 1 - (isPending ? 1 : 0)] : 0;
+            int32_t value;
+
+            if (!isDeltaCoded)
+            {
+                Put(first);
+                if (size == 2)
+                    Put(second);
+                continue;
+            }
+
+            switch (format)
+            {
+                case USBTMCSampleFormat::Int8:
+                    value = (int8_t)first;
+                    break;
+                case USBTMCSampleFormat::UInt8:
+                    value = first;
+                    break;
+                case USBTMCSampleFormat::Int16LE:
+                    value = (int16_t)(first | ((uint16_t)second << 8));
+                    break;
+                case USBTMCSampleFormat::Int16BE:
+                    value = (int16_t)(second | ((uint16_t)first << 8));
+                    break;
+                case USBTMCSampleFormat::UInt16LE:
+                    value = first | ((uint16_t)second << 8);
+                    break;
+                default:
+                    value = second | ((uint16_t)first << 8);
+                    break;
+            }
+
+            PutZigzag(value - previous);
+            previous = value;
+        }
+
+        if (EndRecord())
+            break;
+
+        if (!SwapForRetry())
+        {
+            isWritten = false;
+            break;
+        }
+    }
+
+    if (isWritten)
+        lastTimestamp = timestamp;
+
+    // A dropped chunk still moves the stream on, the next chunk continues on the same sample boundary
+    if (size == 2 && (total & 1))
+    {
+        pendingByte = dataptr[length - 1];
+        hasPendingByte = true;
+    }
+    else
+    {
+        hasPendingByte = false;
+    }
+
+    return isWritten;
+}
+
+void USBTMCLogger::Task()
+{
+    // The records go out as soon as the output has room, the halves only swap when one is drained
+    if (drainOffset >= drainLength && activeLength > 0)
+        Swap();
+
+    if (drainOffset >= drainLength)
+        return;
+
+    int room = pOutput->availableForWrite();
+    uint16_t length = drainLength - drainOffset;
+
+    // A full output is left alone, only one without availableForWrite() gets a short write which may block
+    if (room <= 0)
+    {
+        if (!isBlindWrite)
+            return;
+
+        room = USBTMC_LOGGER_BLIND_WRITE;
+    }
+
+    if ((uint16_t)room < length)
+        length = (uint16_t)room;
+
+    drainOffset += pOutput->write(draining + drainOffset, length);
+}
+
+void USBTMCLogger::Flush()
+{
+    uint32_t progressMillis = millis();
+
+    while (drainOffset < drainLength || activeLength > 0)
+    {
+        uint16_t offset = drainOffset;
+        uint16_t pending = activeLength;
+
+        Task();
+
+        if (drainOffset != offset || activeLength != pending)
+            progressMillis = millis();
+        else if (millis() - progressMillis >= USBTMC_LOGGER_FLUSH_TIMEOUT)
+            break;  // The output takes nothing more, e.g. the SD card is gone
+    }
+
+    pOutput->flush();
+}
@@ -0,0 +1,114 @@
+/*
+ * Binary data logger for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_LOGGER_H__)
+#define __USBTMC_LOGGER_H__
+
+// Log format, shared with the decoder on the PC (USBTMCHostLinux/usbtmc_logdump).
+//
+// The log begins with "UTLG" and the version. Each record is
+//   tag: type << 4 | channel (0 to 15)
+//   time: zigzag varint, microseconds from the previous record (from 0 for the first)
+// and by type
+//   READING: varint length, text
+//   SAMPLES: format (USBTMCSampleFormat), coding, varint count, then the samples,
+//            raw as received or delta coded zigzag varints from 0 in each record
+// Varints are 7 bits a byte, least significant first, bit 7 set when more follow.
+#define USBTMC_LOGGER_MAGIC             "UTLG"
+#define USBTMC_LOGGER_VERSION           1
+
+#define USBTMC_LOGGER_TYPE_READING      1
+#define USBTMC_LOGGER_TYPE_SAMPLES      2
+
+#define USBTMC_LOGGER_CODING_RAW        0
+#define USBTMC_LOGGER_CODING_DELTA      1
+
+#if !defined(__USBTMC_LOGGER_FORMAT_ONLY__)
+
+#include <Arduino.h>
+#include "usbtmc_sample.h"
+
+// Bytes handed at a time to an output constructed with isBlindWrite
+#define USBTMC_LOGGER_BLIND_WRITE       32
+// Flush() gives up when the output takes nothing for this long
+#define USBTMC_LOGGER_FLUSH_TIMEOUT     1000
+
+// Writes the records to one half of the buffer while the other half goes out.
+// Task() hands the output only as much as availableForWrite() tells, so a slow SD card or UART
+// never holds up USB reception. A record which finds both halves busy is dropped and counted.
+// Print reports no room at all unless the output implements availableForWrite(). Such an output needs isBlindWrite,
+// then it gets USBTMC_LOGGER_BLIND_WRITE bytes a call, which may block.
+// A half must hold the largest record, e.g. a 64 byte packet of delta coded WORD samples takes up to 106 bytes.
+//
+//   uint8_t logBuffer[512];
+//   USBTMCLogger logger(&logFile, logBuffer, sizeof(logBuffer));
+//   logger.Begin();
+//   void OnSample(const USBTMCSample &sample) { logger.WriteReading(sample.channel, sample.timestamp, sample.reading, sample.length); }
+//   loop: Usb.Task(); Usbtmc.Run(); logger.Task();
+class USBTMCLogger
+{
+    Print *pOutput;
+    uint8_t *buffer;
+    uint16_t halfSize;
+    bool isBlindWrite;
+
+    uint8_t *active;            // records are written here
+    uint16_t activeLength;
+    uint8_t *draining;          // this goes out
+    uint16_t drainOffset;
+    uint16_t drainLength;
+
+    uint16_t recordBegin;
+    bool isRecordOverflowed;
+    uint32_t lastTimestamp;
+    uint16_t dropped;
+
+    // Odd byte of a 16 bit sample split between two calls
+    uint8_t pendingByte;
+    bool hasPendingByte;
+
+    void Put(uint8_t data);
+    void PutVarint(uint32_t value);
+    void PutZigzag(int32_t value);
+    void BeginRecord(uint8_t type, uint8_t channel, uint32_t timestamp);
+    bool EndRecord();
+    bool SwapForRetry();
+    void Swap();
+
+public:
+    USBTMCLogger(Print *output, uint8_t *buffer, uint16_t size, bool isBlindWrite = false);
+
+    // Writes the log header
+    void Begin();
+
+    // Text of a reading, e.g. from USBTMCSampler, without the terminator
+    bool WriteReading(uint8_t channel, uint32_t timestamp, const char *text, uint16_t length);
+    // Raw samples of :WAV:DATA? without the block header. A chunk may end in the middle of a WORD sample,
+    // the byte is kept for the next chunk of the same waveform.
+    bool WriteSamples(uint8_t channel, uint32_t timestamp, USBTMCSampleFormat format, const uint8_t *dataptr, uint16_t length, bool isDeltaCoded);
+
+    void Task();
+    // Waits until every record is out, e.g. before the SD card file is closed
+    void Flush();
+
+    // Records lost since Begin()
+    uint16_t GetDropped();
+};
+
+#endif // __USBTMC_LOGGER_FORMAT_ONLY__
+
+#endif // __USBTMC_LOGGER_H__
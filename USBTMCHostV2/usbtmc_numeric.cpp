@@ -0,0 +1,226 @@
+/*
+ * Numeric response parser for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_numeric.h"
+
+#define NUMERIC_STATE_SEPARATOR     0   // between tokens
+#define NUMERIC_STATE_INTEGER       1
+#define NUMERIC_STATE_FRACTION      2
+#define NUMERIC_STATE_EXPONENT      3
+#define NUMERIC_STATE_SKIP          4   // not a number, skip up to the separator
+#define NUMERIC_STATE_QUOTED        5   // in a string, skip up to the closing quote
+
+// uint32_t holds 9 decimal digits without overflow
+#define NUMERIC_MAX_DIGITS          9
+
+USBTMCNumericParser::USBTMCNumericParser(float *values, uint16_t size) : floatValues(values), intValues(0), capacity(size)
+{
+    Reset();
+}
+
+USBTMCNumericParser::USBTMCNumericParser(int32_t *values, uint16_t size) : floatValues(0), intValues(values), capacity(size)
+{
+    Reset();
+}
+
+void USBTMCNumericParser::Reset()
+{
+    count = 0;
+    isOverflowed = false;
+    state = NUMERIC_STATE_SEPARATOR;
+}
+
+void USBTMCNumericParser::BeginToken()
+{
+    isNegative = false;
+    isExponentNegative = false;
+    hasDigits = false;
+    digits = 0;
+    mantissa = 0;
+    exponent = 0;
+    exponentValue = 0;
+}
+
+void USBTMCNumericParser::EndToken()
+{
+    if (state != NUMERIC_STATE_SKIP && state != NUMERIC_STATE_SEPARATOR && hasDigits)
+        Store(exponent + (isExponentNegative ? -exponentValue : exponentValue));
+
+    state = NUMERIC_STATE_SEPARATOR;
+}
+
+void USBTMCNumericParser::Store(int16_t power)
+{
+    if (count >= capacity)
+    {
+        isOverflowed = true;
+        return;
+    }
+
+    if (floatValues != 0)
+    {
+        float value = (float)mantissa;
+
+        for (; power > 0; power--)
+            value *= 10.0f;
+        for (; power < 0; power++)
+            value /= 10.0f;
+
+        floatValues[count++] = isNegative ? -value : value;
+    }
+    else
+    {
+        uint32_t magnitude = mantissa;
+        int32_t value;
+
+        for (; power < 0 && magnitude != 0; power++)
+            magnitude /= 10;
+
+        // Saturate instead of wrapping around
+        for (; power > 0 && magnitude != 0; power--)
+        {
+            if (magnitude > 0x7FFFFFFFUL / 10)
+            {
+                magnitude = 0x7FFFFFFFUL;
+                break;
+            }
+            magnitude *= 10;
+        }
+
+        if (magnitude > 0x7FFFFFFFUL)
+            magnitude = 0x7FFFFFFFUL;
+
+        value = (int32_t)magnitude;
+        intValues[count++] = isNegative ? -value : value;
+    }
+}
+
+uint16_t USBTMCNumericParser::Feed(const uint8_t *dataptr, uint16_t length)
+{
+    uint16_t previousCount = count;
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        char c = (char)dataptr[i];
+
+        if (state == NUMERIC_STATE_QUOTED)
+        {
+            // A doubled quote opens the string again right after
+            if (c == quote)
+                state = NUMERIC_STATE_SKIP;
+            continue;
+        }
+
+        if (c == '"' || c == '\'')
+        {
+            quote = c;
+            state = NUMERIC_STATE_QUOTED;
+            continue;
+        }
+
+        if (c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == 0)
+        {
+            EndToken();
+            continue;
+        }
+
+        switch (state)
+        {
+            case NUMERIC_STATE_SEPARATOR:
+                BeginToken();
+                state = NUMERIC_STATE_INTEGER;
+
+                if (c == '+' || c == '-')
+                {
+                    isNegative = (c == '-');
+                    break;
+                }
+                // fall through
+
+            case NUMERIC_STATE_INTEGER:
+            case NUMERIC_STATE_FRACTION:
+                if (c >= '0' && c <= '9')
+                {
+                    hasDigits = true;
+
+                    if (mantissa == 0 && c == '0')
+                    {
+                        // Leading zeros carry no precision
+                        if (state == NUMERIC_STATE_FRACTION)
+                            exponent--;
+                    }
+                    else if (digits < NUMERIC_MAX_DIGITS)
+                    {
+                        mantissa = mantissa * 10 + (uint8_t)(c - '0');
+                        digits++;
+                        if (state == NUMERIC_STATE_FRACTION)
+                            exponent--;
+                    }
+                    else if (state == NUMERIC_STATE_INTEGER)
+                    {
+                        // Out of precision, keep the magnitude
+                        exponent++;
+                    }
+                }
+                else if (c == '.' && state == NUMERIC_STATE_INTEGER)
+                    state = NUMERIC_STATE_FRACTION;
+                else if ((c == 'E' || c == 'e') && hasDigits)
+                    state = NUMERIC_STATE_EXPONENT;
+                else
+                    state = NUMERIC_STATE_SKIP;
+
+                break;
+
+            case NUMERIC_STATE_EXPONENT:
+                if (c >= '0' && c <= '9')
+                {
+                    if (exponentValue < 1000)
+                        exponentValue = exponentValue * 10 + (c - '0');
+                }
+                else if ((c == '+' || c == '-') && exponentValue == 0)
+                    isExponentNegative = (c == '-');
+                else
+                    state = NUMERIC_STATE_SKIP;
+
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return count - previousCount;
+}
+
+uint16_t USBTMCNumericParser::Finish()
+{
+    uint16_t previousCount = count;
+
+    EndToken();
+
+    return count - previousCount;
+}
+
+uint16_t USBTMCNumericParser::Count()
+{
+    return count;
+}
+
+bool USBTMCNumericParser::IsOverflowed()
+{
+    return isOverflowed;
+}
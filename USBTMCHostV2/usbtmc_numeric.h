@@ -0,0 +1,71 @@
+/*
+ * Numeric response parser for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_NUMERIC_H__)
+#define __USBTMC_NUMERIC_H__
+
+#include <stdint.h>
+
+// Incremental parser for comma separated NR1/NR2/NR3 responses such as
+// ":MEAS:ITEM?", "CURVE?" in ASCII encoding or "READ?".
+// Feed it the payload chunks from OnReceivedData(), a value split between
+// two packets is carried over in the parser state.
+//
+//   USBTMCNumericParser parser(values, 100);
+//   void OnReceivedData(const uint8_t *dataptr, uint16_t length) { parser.Feed(dataptr, length); }
+//   ... after the message has ended: parser.Finish(); parser.Count();
+//
+// Tokens which are not numbers (headers, units, strings) are skipped.
+// A quoted string is skipped whole, the commas in it do not split it.
+class USBTMCNumericParser
+{
+    float *floatValues;
+    int32_t *intValues;
+    uint16_t capacity;
+    uint16_t count;
+    bool isOverflowed;
+
+    // Token in progress
+    uint8_t state;
+    char quote;                 // of the string being skipped
+    bool isNegative;
+    bool isExponentNegative;
+    bool hasDigits;
+    uint8_t digits;             // significant digits in mantissa
+    uint32_t mantissa;
+    int16_t exponent;           // decimal exponent of the mantissa
+    int16_t exponentValue;      // digits after 'E'
+
+    void BeginToken();
+    void EndToken();
+    void Store(int16_t power);
+
+public:
+    USBTMCNumericParser(float *values, uint16_t size);
+    USBTMCNumericParser(int32_t *values, uint16_t size);
+
+    void Reset();
+    // Returns the number of values completed by this chunk
+    uint16_t Feed(const uint8_t *dataptr, uint16_t length);
+    // Completes the last value which has no separator after it
+    uint16_t Finish();
+
+    uint16_t Count();
+    bool IsOverflowed();
+};
+
+#endif // __USBTMC_NUMERIC_H__
@@ -0,0 +1,38 @@
+/*
+ * Sample formats for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_SAMPLE_H__)
+#define __USBTMC_SAMPLE_H__
+
+#include <stdint.h>
+
+// Raw sample encodings of :WAV:DATA? (BYTE and WORD in either byte order)
+enum class USBTMCSampleFormat : uint8_t {
+    Int8,
+    UInt8,
+    Int16LE,
+    Int16BE,
+    UInt16LE,
+    UInt16BE
+};
+
+inline uint8_t USBTMCSampleSize(USBTMCSampleFormat format)
+{
+    return (format == USBTMCSampleFormat::Int8 || format == USBTMCSampleFormat::UInt8) ? 1 : 2;
+}
+
+#endif // __USBTMC_SAMPLE_H__
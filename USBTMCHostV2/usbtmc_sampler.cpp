@@ -0,0 +1,332 @@
+/*
+ * Periodic measurement sampler for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "usbtmc_sampler.h"
+
+#define SAMPLER_STATE_WAIT      0
+#define SAMPLER_STATE_TRANSMIT  1
+#define SAMPLER_STATE_REQUEST   2   // the query is out, the reading is not requested yet
+#define SAMPLER_STATE_RECEIVE   3
+
+#define SAMPLER_DEFAULT_TIMEOUT 1000
+
+// Wraps with millis()
+#define IS_DUE(now, time)       ((int32_t)((now) - (time)) >= 0)
+
+USBTMCSampler::USBTMCSampler(USBTMCSamplerChannel *channels, uint8_t count, USBTMCSampleHandler handler) :
+    channels(channels), channelCount(count), handler(handler)
+{
+    timeout = SAMPLER_DEFAULT_TIMEOUT;
+    isRunning = false;
+
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        channels[i].pUsbtmc = NULL;
+        channels[i].period = 0;
+        channels[i].state = SAMPLER_STATE_WAIT;
+    }
+}
+
+void USBTMCSampler::SetChannel(uint8_t index, USBTMC *pusbtmc, const __FlashStringHelper *query, uint32_t period)
+{
+    if (index >= channelCount)
+        return;
+
+    channels[index].pUsbtmc = pusbtmc;
+    channels[index].query = (const char *)query;
+    channels[index].period = period;
+    channels[index].state = SAMPLER_STATE_WAIT;
+}
+
+void USBTMCSampler::SetTimeout(uint16_t value)
+{
+    timeout = value;
+}
+
+void USBTMCSampler::Start()
+{
+    uint32_t now = millis();
+
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        USBTMCSamplerChannel &channel = channels[i];
+
+        channel.release = now;
+        channel.deadline = now + channel.period;
+        channel.overruns = 0;
+        channel.missed = 0;
+        channel.state = SAMPLER_STATE_WAIT;
+    }
+
+    isRunning = true;
+}
+
+void USBTMCSampler::Stop()
+{
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        if (channels[i].state != SAMPLER_STATE_WAIT)
+            Release(i);
+
+        channels[i].state = SAMPLER_STATE_WAIT;
+    }
+
+    isRunning = false;
+}
+
+bool USBTMCSampler::IsRunning()
+{
+    return isRunning;
+}
+
+uint16_t USBTMCSampler::GetOverruns(uint8_t index)
+{
+    return (index < channelCount) ? channels[index].overruns : 0;
+}
+
+// The channel which has a query out on the instrument
+USBTMCSamplerChannel *USBTMCSampler::Active(USBTMC *pusbtmc)
+{
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        if (channels[i].pUsbtmc == pusbtmc && channels[i].state != SAMPLER_STATE_WAIT)
+            return &channels[i];
+    }
+
+    return NULL;
+}
+
+bool USBTMCSampler::IsInstrumentBusy(USBTMC *pusbtmc)
+{
+    return (Active(pusbtmc) != NULL || !pusbtmc->IsIdle());
+}
+
+// Sends the due query with the earliest deadline on each free instrument
+void USBTMCSampler::Dispatch(uint32_t now)
+{
+    while (true)
+    {
+        int16_t selected = -1;
+
+        for (uint8_t i = 0; i < channelCount; i++)
+        {
+            USBTMCSamplerChannel &channel = channels[i];
+
+            if (channel.pUsbtmc == NULL || channel.period == 0 || channel.state != SAMPLER_STATE_WAIT || !IS_DUE(now, channel.release))
+                continue;
+
+            // Whole periods went by, the sample is for the current one
+            if (IS_DUE(now, channel.deadline))
+            {
+                uint32_t periods = (now - channel.release) / channel.period;
+
+                channel.release += periods * channel.period;
+                channel.deadline = channel.release + channel.period;
+                channel.missed += periods;
+                channel.overruns += periods;
+            }
+
+            if (IsInstrumentBusy(channel.pUsbtmc))
+                continue;
+
+            if (selected < 0 || (int32_t)(channel.deadline - channels[selected].deadline) < 0)
+                selected = i;
+        }
+
+        if (selected < 0)
+            return;
+
+        USBTMCSamplerChannel &channel = channels[selected];
+
+        channel.transmitOffset = 0;
+        channel.length = 0;
+        channel.hasTimestamp = false;
+        channel.isEndOfMessage = false;
+        channel.beginMillis = now;
+        channel.state = SAMPLER_STATE_TRANSMIT;
+        channel.pUsbtmc->BeginTransmit(strlen_P(channel.query) + 1);
+
+        Advance(selected);
+    }
+}
+
+void USBTMCSampler::Advance(uint8_t index)
+{
+    USBTMCSamplerChannel &channel = channels[index];
+    USBTMC *pusbtmc = channel.pUsbtmc;
+
+    if (millis() - channel.beginMillis >= timeout)
+    {
+        Release(index);
+        Finish(index, true);
+        return;
+    }
+
+    switch (channel.state)
+    {
+        case SAMPLER_STATE_TRANSMIT:
+            while (true)
+            {
+                char c = pgm_read_byte(channel.query + channel.transmitOffset);
+
+                if (!pusbtmc->TryTransmitData((c != '\0') ? (uint8_t)c : '\n') || channel.state != SAMPLER_STATE_TRANSMIT)
+                    return;
+
+                if (c == '\0')
+                    break;
+
+                channel.transmitOffset++;
+            }
+
+            channel.state = SAMPLER_STATE_REQUEST;
+            // fall through
+
+        case SAMPLER_STATE_REQUEST:
+            if (!pusbtmc->IsIdle() || !pusbtmc->TransmitDone())
+                return;
+
+            channel.state = SAMPLER_STATE_RECEIVE;
+            pusbtmc->Request(USBTMC_SAMPLER_TEXT_SIZE);
+            return;
+
+        case SAMPLER_STATE_RECEIVE:
+            if (!pusbtmc->IsIdle())
+                return;
+
+            if (!channel.isEndOfMessage)
+            {
+                // The rest of a long reading is drained
+                pusbtmc->Request(USBTMC_SAMPLER_TEXT_SIZE);
+                return;
+            }
+
+            Finish(index, false);
+            return;
+
+        default:
+            return;
+    }
+}
+
+// Leaves the instrument ready for the next query when a sample is given up
+void USBTMCSampler::Release(uint8_t index)
+{
+    USBTMCSamplerChannel &channel = channels[index];
+    USBTMC *pusbtmc = channel.pUsbtmc;
+
+    if (channel.state == SAMPLER_STATE_RECEIVE)
+    {
+        if (!pusbtmc->IsIdle())
+            pusbtmc->AbortReceive();
+        else if (!channel.isEndOfMessage)
+            pusbtmc->Clear();   // the rest of the reading would answer the next query
+    }
+    else if (!pusbtmc->TransmitDone())
+    {
+        // A query left partly in the FIFO would keep the instrument busy for good
+        pusbtmc->AbortTransmit();
+    }
+    else if (channel.state == SAMPLER_STATE_REQUEST)
+    {
+        pusbtmc->Clear();   // the reading of the query is not requested yet
+    }
+}
+
+void USBTMCSampler::Finish(uint8_t index, bool isFailed)
+{
+    USBTMCSamplerChannel &channel = channels[index];
+    USBTMCSample sample;
+
+    while (channel.length > 0 && (channel.text[channel.length - 1] == '\n' || channel.text[channel.length - 1] == '\r'))
+        channel.length--;
+    channel.text[channel.length] = '\0';
+
+    sample.channel = index;
+    sample.reading = channel.text;
+    sample.length = isFailed ? 0 : channel.length;
+    sample.timestamp = channel.hasTimestamp ? channel.timestamp : micros();
+    sample.missed = channel.missed;
+    sample.isLate = IS_DUE(millis(), channel.deadline + 1);
+    sample.isFailed = isFailed;
+
+    if (sample.isLate)
+        channel.overruns++;
+
+    channel.missed = 0;
+    channel.release += channel.period;
+    channel.deadline += channel.period;
+    channel.state = SAMPLER_STATE_WAIT;
+
+    if (handler != NULL)
+        handler(sample);
+}
+
+void USBTMCSampler::Task()
+{
+    if (!isRunning)
+        return;
+
+    for (uint8_t i = 0; i < channelCount; i++)
+    {
+        if (channels[i].state != SAMPLER_STATE_WAIT)
+            Advance(i);
+    }
+
+    Dispatch(millis());
+}
+
+void USBTMCSampler::OnReceivedData(USBTMC *pusbtmc, const uint8_t *dataptr, uint16_t length)
+{
+    USBTMCSamplerChannel *channel = Active(pusbtmc);
+
+    if (channel == NULL || channel->state != SAMPLER_STATE_RECEIVE)
+        return;
+
+    while (length > 0 && channel->length + 1 < USBTMC_SAMPLER_TEXT_SIZE)
+    {
+        channel->text[channel->length++] = (char)*dataptr++;
+        length--;
+    }
+}
+
+void USBTMCSampler::OnTransferHeader(USBTMC *pusbtmc, uint32_t transferSize __attribute__((unused)), bool isEndOfMessage)
+{
+    USBTMCSamplerChannel *channel = Active(pusbtmc);
+
+    if (channel == NULL)
+        return;
+
+    // The instrument answered here, the loop may pick the payload up later
+    if (!channel->hasTimestamp)
+    {
+        channel->timestamp = micros();
+        channel->hasTimestamp = true;
+    }
+
+    channel->isEndOfMessage = isEndOfMessage;
+}
+
+void USBTMCSampler::OnFailed(USBTMC *pusbtmc, USBTMCInformation info, uint8_t code __attribute__((unused)))
+{
+    USBTMCSamplerChannel *channel = Active(pusbtmc);
+
+    // The notices of a finished abort or clear are not failures
+    if (channel == NULL || static_cast<int16_t>(info) >= 0)
+        return;
+
+    Finish(channel - channels, true);
+}
@@ -0,0 +1,109 @@
+/*
+ * Periodic measurement sampler for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_SAMPLER_H__)
+#define __USBTMC_SAMPLER_H__
+
+#include "usbtmc.h"
+
+// Longest reading with the terminator
+#if !defined(USBTMC_SAMPLER_TEXT_SIZE)
+#define USBTMC_SAMPLER_TEXT_SIZE    24
+#endif
+
+struct USBTMCSample
+{
+    uint8_t channel;
+    const char *reading;        // without the terminator, null terminated
+    uint8_t length;
+    uint32_t timestamp;         // micros() when the Bulk-IN header arrived
+    uint16_t missed;            // periods skipped before this sample
+    bool isLate;                // finished after its deadline
+    bool isFailed;              // no reading, the transfer failed or timed out
+};
+
+typedef void (*USBTMCSampleHandler)(const USBTMCSample &sample);
+
+// One query at a fixed period. The members are managed by USBTMCSampler.
+struct USBTMCSamplerChannel
+{
+    USBTMC *pUsbtmc;
+    const char *query;          // PROGMEM
+    uint32_t period;            // milliseconds, 0 is disabled
+    uint32_t release;           // millis() when the next sample is due
+    uint32_t deadline;          // millis() when it must have finished
+    uint32_t beginMillis;
+    uint32_t timestamp;
+    uint16_t overruns;
+    uint16_t missed;
+    uint8_t state;
+    uint8_t transmitOffset;
+    uint8_t length;
+    bool isEndOfMessage;
+    bool hasTimestamp;
+    char text[USBTMC_SAMPLER_TEXT_SIZE];
+};
+
+// Queries the channels at their periods, earliest deadline first.
+// Each instrument (USBTMC instance) carries one query at a time and the instruments run side by side.
+// A channel which cannot go out within its period skips the missed periods and reports them as overruns,
+// so the sample times do not drift.
+//
+//   USBTMCSamplerChannel channels[2];
+//   USBTMCSampler sampler(channels, 2, OnSample);
+//   sampler.SetChannel(0, &Dmm1, F("READ?"), 100);
+//   sampler.SetChannel(1, &Dmm2, F("READ?"), 250);
+//   sampler.Start();
+//   loop: Usb.Task(); Dmm1.Run(); Dmm2.Run(); sampler.Task();
+class USBTMCSampler
+{
+    USBTMCSamplerChannel *channels;
+    uint8_t channelCount;
+    USBTMCSampleHandler handler;
+    uint16_t timeout;
+    bool isRunning;
+
+    bool IsInstrumentBusy(USBTMC *pusbtmc);
+    USBTMCSamplerChannel *Active(USBTMC *pusbtmc);
+    void Dispatch(uint32_t now);
+    void Advance(uint8_t index);
+    void Release(uint8_t index);
+    void Finish(uint8_t index, bool isFailed);
+
+public:
+    USBTMCSampler(USBTMCSamplerChannel *channels, uint8_t count, USBTMCSampleHandler handler);
+
+    // The query is in PROGMEM, a period of 0 disables the channel
+    void SetChannel(uint8_t index, USBTMC *pusbtmc, const __FlashStringHelper *query, uint32_t period);
+    // For each query, milliseconds
+    void SetTimeout(uint16_t value);
+
+    void Start();
+    void Stop();
+    void Task();
+    bool IsRunning();
+
+    // Periods missed or finished late since Start()
+    uint16_t GetOverruns(uint8_t index);
+
+    // Forward these from the USBTMCAsyncOper of each instrument
+    void OnReceivedData(USBTMC *pusbtmc, const uint8_t *dataptr, uint16_t length);
+    void OnTransferHeader(USBTMC *pusbtmc, uint32_t transferSize, bool isEndOfMessage);
+    void OnFailed(USBTMC *pusbtmc, USBTMCInformation info, uint8_t code);
+};
+
+#endif // __USBTMC_SAMPLER_H__
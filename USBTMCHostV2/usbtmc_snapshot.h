@@ -0,0 +1,102 @@
+/*
+ * Instrument state snapshot for USBTMC class driver
+ * Copyright (c) 2022 Naoya Imai
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if !defined(__USBTMC_SNAPSHOT_H__)
+#define __USBTMC_SNAPSHOT_H__
+
+#include "usbtmc.h"
+
+// Size of each Bulk-IN request while capturing
+#if !defined(USBTMC_SNAPSHOT_REQUEST_SIZE)
+#define USBTMC_SNAPSHOT_REQUEST_SIZE    256
+#endif
+
+// Captures the instrument settings and puts them back, one message each way.
+//
+// Without a query set, "*LRN?" is captured and replayed as it is.
+// A query set is one PROGMEM text of plain queries joined with ';', e.g. ":CHAN1:SCAL?;:TRIG:EDG:LEV?".
+// It goes out as one message and only the answers are kept, so the store is small.
+// The restore message is built while it is sent: ":CHAN1:SCAL <answer>;:TRIG:EDG:LEV <answer>".
+// The answers are kept as raw bytes, quoted strings and definite length blocks (#9...) may have ';' in them.
+//
+//   uint8_t setting[64];
+//   USBTMCSnapshot snapshot(&Usbtmc, setting, sizeof(setting));
+//   snapshot.SetQuerySet(F(":CHAN1:SCAL?;:CHAN2:SCAL?"));
+//   snapshot.Capture(); ... snapshot.Restore();
+//   loop: Usb.Task(); Usbtmc.Run(); snapshot.Task();
+class USBTMCSnapshot
+{
+    USBTMC *pUsbtmc;
+    uint8_t *buffer;
+    uint16_t bufferSize;
+    uint16_t length;
+    const char *querySet;       // PROGMEM, NULL for *LRN?
+
+    uint8_t state;
+    bool isValid;
+    bool isOverflowed;
+    bool isEndOfMessage;
+    bool isFailureReported;
+    uint16_t timeout;
+    uint32_t waitBeginMillis;
+
+    // Segment in progress of the message going out
+    const uint8_t *segmentPtr;
+    uint16_t segmentLength;
+    bool isSegmentProgmem;
+    uint16_t queryOffset;
+    uint16_t answerOffset;
+    uint8_t part;
+
+    void Rewind();
+    bool NextSegment();
+    uint16_t AnswerLength(uint16_t offset);
+    uint32_t MessageLength();
+    bool Transmit();
+    void Fail();
+
+public:
+    USBTMCSnapshot(USBTMC *pusbtmc, uint8_t *buffer, uint16_t size);
+
+    // PROGMEM, NULL for *LRN?. The snapshot is no longer valid.
+    void SetQuerySet(const __FlashStringHelper *queries);
+    // For each transfer, milliseconds
+    void SetTimeout(uint16_t value);
+
+    // Returns false when the driver or the snapshot is busy, or nothing is captured for Restore()
+    bool Capture();
+    bool Restore();
+    void Task();
+
+    bool IsBusy();
+    bool IsFailed();
+    // A capture has finished, the answers match the query set
+    bool IsValid();
+
+    // The stored answers, e.g. to keep them in EEPROM.
+    // Load() takes them back for the same query set.
+    const uint8_t *GetData();
+    uint16_t GetLength();
+    bool Load(const uint8_t *dataptr, uint16_t length);
+
+    // Forward these from the USBTMCAsyncOper while it is busy
+    void OnReceivedData(const uint8_t *dataptr, uint16_t length);
+    void OnTransferHeader(uint32_t transferSize, bool isEndOfMessage);
+    void OnFailed(USBTMCInformation info, uint8_t code);
+};
+
+#endif // __USBTMC_SNAPSHOT_H__